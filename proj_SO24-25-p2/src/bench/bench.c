@@ -0,0 +1,82 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Micro-benchmarks of the server internals. Each benchmark is selected by
+// name and prints one line per measured configuration.
+
+struct Benchmark {
+  const char *name;
+  const char *usage;
+  int (*run)(int argc, char **argv);
+};
+
+static const struct Benchmark benchmarks[] = {
+    {"hash", "[max_keys]", bench_hash},
+    {"reads", "[num_keys] [num_reads]", bench_reads},
+    {"writes", "[num_keys]", bench_writes},
+    {"output", "[num_keys] [num_commands]", bench_output},
+    {"parser", "[megabytes]", bench_parser},
+    {"show", "[num_commands]", bench_show},
+    {"threads", "[max_threads] [commands_per_job]", bench_threads},
+    {"split", "[max_threads] [megabytes]", bench_split},
+    {"backup", "[num_keys] [changed_keys]", bench_backup},
+    {"restore", "[num_keys]", bench_restore},
+    {"shards", "[num_keys] [max_shards]", bench_shards},
+    {"compress", "[num_keys]", bench_compress},
+    {"snapshot", "[num_keys] [max_writes]", bench_snapshot},
+    {"wal", "[num_writes] [max_threads]", bench_wal},
+    {"sessions", "[rounds] [loop_threads]", bench_sessions},
+    {"connect", "[max_clients] [num_connects] [loop_threads]", bench_connect},
+    {"fanout", "[num_subscribers] [num_publishes]", bench_fanout},
+    {"changes", "[num_subscribers] [num_writes]", bench_changes},
+    {"batching", "[num_subscribers] [num_publishes] [rate]", bench_batching},
+    {"protocol", "[num_frames]", bench_protocol},
+    {"subscriptions", "[num_subscriptions] [num_keys]", bench_subscriptions},
+    {"patterns", "[num_patterns] [num_keys]", bench_patterns},
+};
+
+uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t next_random(uint64_t *state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+size_t arg_or(int argc, char **argv, int index, size_t fallback) {
+  if (index >= argc) {
+    return fallback;
+  }
+  char *endptr;
+  unsigned long value = strtoul(argv[index], &endptr, 10);
+  if (*endptr != '\0' || value == 0) {
+    return fallback;
+  }
+  return (size_t)value;
+}
+
+int main(int argc, char **argv) {
+  size_t count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+  if (argc >= 2) {
+    for (size_t i = 0; i < count; i++) {
+      if (strcmp(argv[1], benchmarks[i].name) == 0) {
+        return benchmarks[i].run(argc - 2, argv + 2);
+      }
+    }
+  }
+
+  fprintf(stderr, "Usage: %s <benchmark> [args]\n", argv[0]);
+  for (size_t i = 0; i < count; i++) {
+    fprintf(stderr, "  %s %s\n", benchmarks[i].name, benchmarks[i].usage);
+  }
+  return 1;
+}
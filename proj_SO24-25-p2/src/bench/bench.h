@@ -0,0 +1,113 @@
+#ifndef KVS_BENCH_H
+#define KVS_BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/// Reads the monotonic clock.
+/// @return Current time in nanoseconds.
+uint64_t now_ns(void);
+
+/// Small xorshift generator, so runs are reproducible and cheap.
+/// @param state Generator state, must not be 0.
+/// @return Next pseudo-random number.
+uint64_t next_random(uint64_t *state);
+
+/// Parses an optional numeric argument.
+/// @param argc Number of arguments of the benchmark.
+/// @param argv Arguments of the benchmark.
+/// @param index Index of the argument.
+/// @param fallback Value used when the argument is missing or invalid.
+/// @return The parsed value.
+size_t arg_or(int argc, char **argv, int index, size_t fallback);
+
+// Lookup cost of the KVS hash table from 1k keys up to [max_keys].
+int bench_hash(int argc, char **argv);
+
+// Heap allocations and latency of single key READs.
+int bench_reads(int argc, char **argv);
+
+// Write syscalls per READ, DELETE and SHOW command.
+int bench_output(int argc, char **argv);
+
+// Heap allocations and latency of write_pair inserts and overwrites.
+int bench_writes(int argc, char **argv);
+
+// Throughput of a SHOW-heavy job of [num_commands] commands.
+int bench_show(int argc, char **argv);
+
+// Throughput of the job file parser on a generated [megabytes] MB file.
+int bench_parser(int argc, char **argv);
+
+// Throughput of the jobs directory processed with 1 to [max_threads] threads.
+int bench_threads(int argc, char **argv);
+
+// Throughput and worker utilization of a single [megabytes] MB job split
+// across 1 to [max_threads] threads.
+int bench_split(int argc, char **argv);
+
+// Bytes written and time taken by full and delta backups of [num_keys]
+// pairs, [changed_keys] of them changed between backups.
+int bench_backup(int argc, char **argv);
+
+// Size and restore time of a text checkpoint and a binary snapshot of
+// [num_keys] pairs.
+int bench_restore(int argc, char **argv);
+
+// Time taken to write and to restore a text checkpoint of [num_keys] pairs
+// split into 1 to [max_shards] shards.
+int bench_shards(int argc, char **argv);
+
+// Size, backup and restore time of text checkpoints and binary snapshots
+// of [num_keys] pairs with and without compression, and the speed of the
+// block codec on them.
+int bench_compress(int argc, char **argv);
+
+// Latency of the writes made while a backup of [num_keys] pairs is written
+// by a forked child and by a thread from an in-process snapshot.
+int bench_snapshot(int argc, char **argv);
+
+// Throughput and commit latency of the write-ahead log with each sync
+// policy, [num_writes] records from 1 to [max_threads] threads.
+int bench_wal(int argc, char **argv);
+
+// Throughput, memory and threads of 10, 1k and 10k client sessions served
+// by a thread each and by [loop_threads] threads with epoll.
+int bench_sessions(int argc, char **argv);
+
+// Latency of 1 to [max_clients] concurrent clients connecting
+// [num_connects] times each through the register FIFO, with sessions served
+// by a thread each and by [loop_threads] threads with epoll.
+int bench_connect(int argc, char **argv);
+
+// Publish rate and latency, and notifications queued, sent and dropped,
+// with [num_publishes] messages to [num_subscribers] subscribers, one of
+// them stuck, under each overflow policy.
+int bench_fanout(int argc, char **argv);
+
+// Cost of a write, notifications per subscriber and latency from a write to
+// its notification, with [num_subscribers] subscribers of a key written
+// [num_writes] times, under change windows from 0 to 20 ms.
+int bench_changes(int argc, char **argv);
+
+// Notification rate, writes and CPU time per notification and latency of
+// [num_publishes] messages published at [rate] messages/s to
+// [num_subscribers] subscribers, with notifications written one at a time
+// and in batches with and without a deadline.
+int bench_batching(int argc, char **argv);
+
+// Size and encode/decode speed of [num_frames] SUBSCRIBE, PUBLISH and WRITE
+// requests as binary frames and as the text lines they replaced.
+int bench_protocol(int argc, char **argv);
+
+// Cost of subscribing, publishing and ending sessions with [num_subscriptions]
+// subscriptions over [num_keys] keys, in the subscription table and in the
+// single list it replaced.
+int bench_subscriptions(int argc, char **argv);
+
+// Cost of publishing to exact keys with and without patterns subscribed,
+// and to keys under 10 to [num_patterns] prefix and glob patterns, in the
+// pattern trie and by matching every pattern, over [num_keys] keys.
+int bench_patterns(int argc, char **argv);
+
+#endif  // KVS_BENCH_H
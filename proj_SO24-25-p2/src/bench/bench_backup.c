@@ -0,0 +1,460 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "src/server/backup.h"
+#include "src/server/constants.h"
+#include "src/server/lz.h"
+#include "src/server/operations.h"
+
+#define BACKUP_ROUNDS 8    // Backups measured per mode
+#define PAIRS_PER_BATCH 64 // Pairs of each kvs_write while loading
+
+// Removes a directory of backups and every file in it.
+static void remove_backups(const char *dir) {
+  DIR *handle = opendir(dir);
+  if (handle != NULL) {
+    struct dirent *entry;
+    while ((entry = readdir(handle)) != NULL) {
+      if (entry->d_name[0] != '.') {
+        unlinkat(dirfd(handle), entry->d_name, 0);
+      }
+    }
+    closedir(handle);
+  }
+  rmdir(dir);
+}
+
+// Writes a batch of pairs with keys from first to first + count - 1.
+static void write_keys(size_t first, size_t count, size_t version) {
+  char keys[PAIRS_PER_BATCH][MAX_STRING_SIZE];
+  char values[PAIRS_PER_BATCH][MAX_STRING_SIZE];
+  Slice key_slices[PAIRS_PER_BATCH], value_slices[PAIRS_PER_BATCH];
+  for (size_t i = 0; i < count; i++) {
+    key_slices[i].data = keys[i];
+    key_slices[i].len = (size_t)snprintf(keys[i], MAX_STRING_SIZE, "key_%zu", first + i);
+    value_slices[i].data = values[i];
+    value_slices[i].len = (size_t)snprintf(values[i], MAX_STRING_SIZE, "value_%zu_%zu", first + i,
+                                           version);
+  }
+  kvs_write(count, key_slices, value_slices);
+}
+
+// Takes a backup and waits for the child writing it.
+// @return Size of the backup file in bytes.
+static size_t take_backup(const char *dir, size_t num_backup) {
+  kvs_backup(num_backup, "bench.job", dir, NULL);
+  wait(NULL);
+  char path[MAX_JOB_FILE_NAME_SIZE];
+  snprintf(path, sizeof(path), "%s/bench-%zu.bck", dir, num_backup);
+  struct stat st;
+  return stat(path, &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+// Loads [num_keys] pairs, then repeatedly changes [changed_keys] of them and
+// takes a backup, once with full backups and once with delta backups, and
+// reports the bytes written and the time each backup took.
+int bench_backup(int argc, char **argv) {
+  size_t num_keys = arg_or(argc, argv, 0, 1000000);
+  size_t changed_keys = arg_or(argc, argv, 1, 1000);
+  if (changed_keys > num_keys) {
+    changed_keys = num_keys;
+  }
+
+  printf("%8s %10s %14s %12s\n", "mode", "changed", "bytes/backup", "ms/backup");
+  for (int delta = 0; delta <= 1; delta++) {
+    char dir[] = "/tmp/kvs_bench_XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+      perror("Failed to create backup directory");
+      return 1;
+    }
+    // Only the first backup of the delta run is a checkpoint
+    kvs_delta_backups(delta ? BACKUP_ROUNDS + 1 : 0);
+    if (kvs_init()) {
+      fprintf(stderr, "Failed to initialize KVS\n");
+      remove_backups(dir);
+      return 1;
+    }
+    for (size_t i = 0; i < num_keys; i += PAIRS_PER_BATCH) {
+      write_keys(i, num_keys - i < PAIRS_PER_BATCH ? num_keys - i : PAIRS_PER_BATCH, 0);
+    }
+    fflush(stdout);
+    take_backup(dir, 1);
+
+    uint64_t state = 88172645463325252ULL;
+    size_t bytes = 0;
+    uint64_t elapsed = 0;
+    for (size_t round = 1; round <= BACKUP_ROUNDS; round++) {
+      for (size_t i = 0; i < changed_keys; i++) {
+        write_keys(next_random(&state) % num_keys, 1, round);
+      }
+      uint64_t start = now_ns();
+      bytes += take_backup(dir, round + 1);
+      elapsed += now_ns() - start;
+    }
+    kvs_terminate();
+    kvs_delta_backups(0);
+    remove_backups(dir);
+
+    printf("%8s %10zu %14zu %12.2f\n", delta ? "delta" : "full", changed_keys,
+           bytes / BACKUP_ROUNDS, (double)elapsed / BACKUP_ROUNDS / 1e6);
+  }
+  return 0;
+}
+
+// Takes a text checkpoint and a binary snapshot of [num_keys] pairs and
+// reports their size and how long restoring each one takes.
+int bench_restore(int argc, char **argv) {
+  size_t num_keys = arg_or(argc, argv, 0, 1000000);
+
+  printf("%8s %10s %14s %12s %14s\n", "format", "keys", "bytes", "ms/restore", "keys/s");
+  for (int binary = 0; binary <= 1; binary++) {
+    char dir[] = "/tmp/kvs_bench_XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+      perror("Failed to create backup directory");
+      return 1;
+    }
+    // A checkpoint interval of 1 makes every backup a full one with header
+    kvs_delta_backups(1);
+    kvs_binary_snapshots(binary);
+    if (kvs_init()) {
+      fprintf(stderr, "Failed to initialize KVS\n");
+      remove_backups(dir);
+      return 1;
+    }
+    for (size_t i = 0; i < num_keys; i += PAIRS_PER_BATCH) {
+      write_keys(i, num_keys - i < PAIRS_PER_BATCH ? num_keys - i : PAIRS_PER_BATCH, 0);
+    }
+    fflush(stdout);
+    size_t bytes = take_backup(dir, 1);
+    kvs_terminate();
+
+    kvs_init();
+    uint64_t start = now_ns();
+    int result = kvs_restore(dir);
+    uint64_t elapsed = now_ns() - start;
+    kvs_terminate();
+    kvs_delta_backups(0);
+    kvs_binary_snapshots(false);
+    remove_backups(dir);
+    if (result != 0) {
+      fprintf(stderr, "Failed to restore backup\n");
+      return 1;
+    }
+
+    printf("%8s %10zu %14zu %12.1f %14.0f\n", binary ? "snapshot" : "text", num_keys, bytes,
+           (double)elapsed / 1e6, (double)num_keys / ((double)elapsed / 1e9));
+  }
+  return 0;
+}
+
+// Total size of the files of a directory of backups.
+static size_t directory_bytes(const char *dir) {
+  size_t bytes = 0;
+  DIR *handle = opendir(dir);
+  if (handle != NULL) {
+    struct dirent *entry;
+    struct stat st;
+    while ((entry = readdir(handle)) != NULL) {
+      if (entry->d_name[0] != '.' && fstatat(dirfd(handle), entry->d_name, &st, 0) == 0) {
+        bytes += (size_t)st.st_size;
+      }
+    }
+    closedir(handle);
+  }
+  return bytes;
+}
+
+// Takes a text checkpoint of [num_keys] pairs split into 1 to [max_shards]
+// shards, and reports how long writing it and restoring it take.
+int bench_shards(int argc, char **argv) {
+  size_t num_keys = arg_or(argc, argv, 0, 1000000);
+  size_t max_shards = arg_or(argc, argv, 1, 16);
+
+  printf("%8s %10s %14s %12s %12s\n", "shards", "keys", "bytes", "ms/backup", "ms/restore");
+  for (size_t shards = 1; shards <= max_shards; shards *= 2) {
+    char dir[] = "/tmp/kvs_bench_XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+      perror("Failed to create backup directory");
+      return 1;
+    }
+    kvs_delta_backups(1);
+    kvs_backup_shards(shards);
+    if (kvs_init()) {
+      fprintf(stderr, "Failed to initialize KVS\n");
+      remove_backups(dir);
+      return 1;
+    }
+    for (size_t i = 0; i < num_keys; i += PAIRS_PER_BATCH) {
+      write_keys(i, num_keys - i < PAIRS_PER_BATCH ? num_keys - i : PAIRS_PER_BATCH, 0);
+    }
+    fflush(stdout);
+    uint64_t start = now_ns();
+    take_backup(dir, 1);
+    uint64_t backup_elapsed = now_ns() - start;
+    size_t bytes = directory_bytes(dir);
+    kvs_terminate();
+
+    kvs_init();
+    start = now_ns();
+    int result = kvs_restore(dir);
+    uint64_t restore_elapsed = now_ns() - start;
+    kvs_terminate();
+    kvs_delta_backups(0);
+    kvs_backup_shards(1);
+    remove_backups(dir);
+    if (result != 0) {
+      fprintf(stderr, "Failed to restore backup\n");
+      return 1;
+    }
+
+    printf("%8zu %10zu %14zu %12.1f %12.1f\n", shards, num_keys, bytes,
+           (double)backup_elapsed / 1e6, (double)restore_elapsed / 1e6);
+  }
+  return 0;
+}
+
+// Compresses a file with the block codec alone, a COMPRESSED_BLOCK_SIZE
+// block at a time like compressed backups, then decompresses it.
+// @param compress_mbs Set to the MB/s of the file compressed.
+// @param decompress_mbs Set to the MB/s of the file decompressed.
+// @return 0 if successful, 1 otherwise.
+static int codec_speed(const char *path, double *compress_mbs, double *decompress_mbs) {
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0) {
+    if (fd != -1) {
+      close(fd);
+    }
+    return 1;
+  }
+  size_t size = (size_t)st.st_size;
+  size_t num_blocks = (size + COMPRESSED_BLOCK_SIZE - 1) / COMPRESSED_BLOCK_SIZE;
+  // Incompressible blocks grow by a little over 1/255
+  size_t bound = COMPRESSED_BLOCK_SIZE + COMPRESSED_BLOCK_SIZE / 255 + 16;
+  char *data = malloc(size + 1);
+  char *packed = malloc(num_blocks * bound + 1);
+  size_t *packed_sizes = malloc((num_blocks + 1) * sizeof(size_t));
+  uint32_t *table = malloc(LZ_HASH_SIZE * sizeof(uint32_t));
+  size_t done = 0;
+  ssize_t n = 1;
+  while (data != NULL && done < size && (n = read(fd, data + done, size - done)) > 0) {
+    done += (size_t)n;
+  }
+  close(fd);
+  int failed = data == NULL || packed == NULL || packed_sizes == NULL || table == NULL ||
+               done != size;
+
+  uint64_t start = now_ns();
+  for (size_t i = 0; !failed && i < num_blocks; i++) {
+    size_t offset = i * COMPRESSED_BLOCK_SIZE;
+    size_t len = size - offset < COMPRESSED_BLOCK_SIZE ? size - offset : COMPRESSED_BLOCK_SIZE;
+    packed_sizes[i] = lz_compress(data + offset, len, packed + i * bound, bound, table);
+    failed = packed_sizes[i] == 0;
+  }
+  uint64_t compress_elapsed = now_ns() - start;
+
+  start = now_ns();
+  for (size_t i = 0; !failed && i < num_blocks; i++) {
+    size_t offset = i * COMPRESSED_BLOCK_SIZE;
+    size_t len = size - offset < COMPRESSED_BLOCK_SIZE ? size - offset : COMPRESSED_BLOCK_SIZE;
+    failed = lz_decompress(packed + i * bound, packed_sizes[i], data + offset, len) != 0;
+  }
+  uint64_t decompress_elapsed = now_ns() - start;
+
+  *compress_mbs = (double)size / 1e6 / ((double)compress_elapsed / 1e9);
+  *decompress_mbs = (double)size / 1e6 / ((double)decompress_elapsed / 1e9);
+  free(data);
+  free(packed);
+  free(packed_sizes);
+  free(table);
+  return failed;
+}
+
+// Takes a text checkpoint and a binary snapshot of [num_keys] pairs written
+// like the jobs write them, uncompressed and compressed, and reports their
+// size, how long writing and restoring each one takes, and the speed of the
+// codec alone on the uncompressed file.
+int bench_compress(int argc, char **argv) {
+  size_t num_keys = arg_or(argc, argv, 0, 1000000);
+
+  printf("%8s %6s %14s %8s %12s %12s %12s %12s\n", "format", "lz", "bytes", "ratio",
+         "ms/backup", "ms/restore", "lz MB/s", "unlz MB/s");
+  for (int binary = 0; binary <= 1; binary++) {
+    size_t raw_bytes = 0;
+    double compress_mbs = 0, decompress_mbs = 0;
+    for (int compressed = 0; compressed <= 1; compressed++) {
+      char dir[] = "/tmp/kvs_bench_XXXXXX";
+      if (mkdtemp(dir) == NULL) {
+        perror("Failed to create backup directory");
+        return 1;
+      }
+      kvs_delta_backups(1);
+      kvs_binary_snapshots(binary);
+      kvs_compressed_backups(compressed);
+      if (kvs_init()) {
+        fprintf(stderr, "Failed to initialize KVS\n");
+        remove_backups(dir);
+        return 1;
+      }
+      for (size_t i = 0; i < num_keys; i += PAIRS_PER_BATCH) {
+        write_keys(i, num_keys - i < PAIRS_PER_BATCH ? num_keys - i : PAIRS_PER_BATCH, 0);
+      }
+      fflush(stdout);
+      uint64_t start = now_ns();
+      size_t bytes = take_backup(dir, 1);
+      uint64_t backup_elapsed = now_ns() - start;
+      kvs_terminate();
+
+      int failed = 0;
+      if (!compressed) {
+        char path[MAX_JOB_FILE_NAME_SIZE];
+        snprintf(path, sizeof(path), "%s/bench-1.bck", dir);
+        raw_bytes = bytes;
+        failed = codec_speed(path, &compress_mbs, &decompress_mbs);
+      }
+
+      kvs_init();
+      start = now_ns();
+      failed = kvs_restore(dir) != 0 || failed;
+      uint64_t restore_elapsed = now_ns() - start;
+      kvs_terminate();
+      kvs_delta_backups(0);
+      kvs_binary_snapshots(false);
+      kvs_compressed_backups(false);
+      remove_backups(dir);
+      if (failed) {
+        fprintf(stderr, "Failed to restore backup\n");
+        return 1;
+      }
+
+      printf("%8s %6s %14zu %8.2f %12.1f %12.1f ", binary ? "snapshot" : "text",
+             compressed ? "on" : "off", bytes, bytes > 0 ? (double)raw_bytes / (double)bytes : 0.0,
+             (double)backup_elapsed / 1e6, (double)restore_elapsed / 1e6);
+      if (compressed) {
+        printf("%12.1f %12.1f\n", compress_mbs, decompress_mbs);
+      } else {
+        printf("%12s %12s\n", "-", "-");
+      }
+    }
+  }
+  return 0;
+}
+
+// A thread overwriting random keys and timing each kvs_write, until stopped
+// or [max_writes] are done.
+typedef struct SnapshotWriter {
+  pthread_t thread;
+  size_t num_keys;
+  size_t max_writes;
+  size_t done;
+  uint64_t *latencies;
+  atomic_bool stop;
+} SnapshotWriter;
+
+static void *snapshot_writer(void *arg) {
+  SnapshotWriter *writer = arg;
+  uint64_t state = 2463534242ULL;
+  while (!atomic_load(&writer->stop) && writer->done < writer->max_writes) {
+    size_t key = next_random(&state) % writer->num_keys;
+    uint64_t start = now_ns();
+    write_keys(key, 1, writer->done + 1);
+    writer->latencies[writer->done++] = now_ns() - start;
+  }
+  return NULL;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Loads [num_keys] pairs and overwrites random keys while a backup is
+// written, by a forked child and by a thread from an in-process snapshot,
+// and reports the latency of those writes and how long the backup took.
+// The writes of a run without backup are the baseline. At most
+// [max_writes] are timed per run.
+int bench_snapshot(int argc, char **argv) {
+  size_t num_keys = arg_or(argc, argv, 0, 1000000);
+  size_t max_writes = arg_or(argc, argv, 1, 1000000);
+  if (num_keys == 0 || max_writes == 0) {
+    return 1;
+  }
+  uint64_t *latencies = malloc(max_writes * sizeof(uint64_t));
+  if (latencies == NULL) {
+    return 1;
+  }
+
+  printf("%8s %12s %10s %10s %10s %10s\n", "backup", "ms/backup", "writes", "p50 us",
+         "p99 us", "max us");
+  // Without a backup the writer runs for as long as the fork backup took
+  const char *const modes[] = {"fork", "thread", "none"};
+  uint64_t fork_elapsed = 0;
+  for (int mode = 0; mode < 3; mode++) {
+    char dir[] = "/tmp/kvs_bench_XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+      perror("Failed to create backup directory");
+      free(latencies);
+      return 1;
+    }
+    kvs_fork_free_backups(mode == 1);
+    if (kvs_init()) {
+      fprintf(stderr, "Failed to initialize KVS\n");
+      kvs_fork_free_backups(false);
+      remove_backups(dir);
+      free(latencies);
+      return 1;
+    }
+    for (size_t i = 0; i < num_keys; i += PAIRS_PER_BATCH) {
+      write_keys(i, num_keys - i < PAIRS_PER_BATCH ? num_keys - i : PAIRS_PER_BATCH, 0);
+    }
+    fflush(stdout);
+
+    SnapshotWriter writer = {0, num_keys, max_writes, 0, latencies, false};
+    uint64_t start = now_ns();
+    pthread_create(&writer.thread, NULL, snapshot_writer, &writer);
+    if (mode == 2) {
+      while (writer.done < max_writes && now_ns() - start < fork_elapsed) {
+        sched_yield();
+      }
+    } else {
+      pid_t pid = kvs_backup(1, "bench.job", dir, NULL);
+      if (pid > 0) {
+        waitpid(pid, NULL, 0);
+      } else {
+        kvs_wait_backup();
+      }
+    }
+    uint64_t elapsed = now_ns() - start;
+    atomic_store(&writer.stop, true);
+    pthread_join(writer.thread, NULL);
+    kvs_terminate();
+    kvs_fork_free_backups(false);
+    remove_backups(dir);
+
+    if (mode == 0) {
+      fork_elapsed = elapsed;
+    }
+    size_t done = writer.done;
+    qsort(latencies, done, sizeof(uint64_t), compare_latencies);
+    printf("%8s %12.1f %10zu ", modes[mode], mode == 2 ? 0.0 : (double)elapsed / 1e6, done);
+    if (done > 0) {
+      printf("%10.1f %10.1f %10.1f\n", (double)latencies[done / 2] / 1e3,
+             (double)latencies[done * 99 / 100] / 1e3, (double)latencies[done - 1] / 1e3);
+    } else {
+      printf("%10s %10s %10s\n", "-", "-", "-");
+    }
+  }
+  free(latencies);
+  return 0;
+}
@@ -0,0 +1,315 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "src/server/constants.h"
+#include "src/server/jobs.h"
+#include "src/server/operations.h"
+#include "src/server/parser.h"
+
+#define NUM_JOBS 8
+#define NUM_KEYS 4096
+#define PAIRS_PER_WRITE 4
+#define BYTES_PER_COMMAND 50 // Rough size of a generated command
+
+// Writes a job file with a mix of batched WRITEs, READs and DELETEs over a
+// shared key space.
+// @return 0 if the file was written, 1 otherwise.
+static int generate_job(const char *path, size_t num_commands, uint64_t seed) {
+  FILE *job = fopen(path, "w");
+  if (job == NULL) {
+    perror("Failed to create job file");
+    return 1;
+  }
+
+  uint64_t state = seed;
+  for (size_t i = 0; i < num_commands; i++) {
+    uint64_t kind = next_random(&state) % 10;
+    if (kind < 5) {
+      fputs("WRITE [", job);
+      for (int j = 0; j < PAIRS_PER_WRITE; j++) {
+        uint64_t key = next_random(&state) % NUM_KEYS;
+        fprintf(job, "(key_%llu,value_%zu)", (unsigned long long)key, i);
+      }
+      fputs("]\n", job);
+    } else if (kind < 9) {
+      fputs("READ [", job);
+      for (int j = 0; j < PAIRS_PER_WRITE; j++) {
+        uint64_t key = next_random(&state) % NUM_KEYS;
+        fprintf(job, "%skey_%llu", j == 0 ? "" : ",", (unsigned long long)key);
+      }
+      fputs("]\n", job);
+    } else {
+      fprintf(job, "DELETE [key_%llu]\n", (unsigned long long)(next_random(&state) % NUM_KEYS));
+    }
+  }
+
+  fclose(job);
+  return 0;
+}
+
+// Removes the generated jobs directory and every file in it.
+static void remove_jobs(const char *dir) {
+  char path[MAX_JOB_FILE_NAME_SIZE];
+  for (int i = 0; i < NUM_JOBS; i++) {
+    snprintf(path, sizeof(path), "%s/bench%d.job", dir, i);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/bench%d.out", dir, i);
+    unlink(path);
+  }
+  rmdir(dir);
+}
+
+// Processes a generated jobs directory with an increasing number of threads
+// and reports the command throughput of each run.
+int bench_threads(int argc, char **argv) {
+  size_t max_threads = arg_or(argc, argv, 0, 8);
+  size_t commands_per_job = arg_or(argc, argv, 1, 20000);
+
+  char dir[] = "/tmp/kvs_bench_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("Failed to create jobs directory");
+    return 1;
+  }
+
+  char path[MAX_JOB_FILE_NAME_SIZE];
+  for (int i = 0; i < NUM_JOBS; i++) {
+    snprintf(path, sizeof(path), "%s/bench%d.job", dir, i);
+    if (generate_job(path, commands_per_job, 88172645463325252ULL + (unsigned)i)) {
+      remove_jobs(dir);
+      return 1;
+    }
+  }
+
+  // The jobs print progress to stdout, which would get mixed with the results
+  int saved_stdout = dup(STDOUT_FILENO);
+  int devnull = open("/dev/null", O_WRONLY);
+
+  printf("%8s %14s %12s\n", "threads", "commands/s", "speedup");
+  double baseline = 0;
+  for (size_t threads = 1; threads <= max_threads; threads++) {
+    if (kvs_init()) {
+      fprintf(stderr, "Failed to initialize KVS\n");
+      break;
+    }
+
+    fflush(stdout);
+    dup2(devnull, STDOUT_FILENO);
+    uint64_t start = now_ns();
+    process_jobs(dir, threads, 1);
+    uint64_t elapsed = now_ns() - start;
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+
+    kvs_terminate();
+
+    double throughput = (double)commands_per_job * NUM_JOBS / ((double)elapsed / 1e9);
+    if (threads == 1) {
+      baseline = throughput;
+    }
+    printf("%8zu %14.0f %11.2fx\n", threads, throughput, throughput / baseline);
+  }
+
+  close(devnull);
+  close(saved_stdout);
+  remove_jobs(dir);
+  return 0;
+}
+
+// Processes a single large job of WRITEs and READs of distinct keys, which
+// the scheduler splits in segments, with an increasing number of threads.
+// Reports the command throughput of each run, followed by the utilization
+// of each worker printed by the scheduler.
+int bench_split(int argc, char **argv) {
+  size_t max_threads = arg_or(argc, argv, 0, 4);
+  size_t megabytes = arg_or(argc, argv, 1, 16);
+
+  char dir[] = "/tmp/kvs_bench_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("Failed to create jobs directory");
+    return 1;
+  }
+  char path[MAX_JOB_FILE_NAME_SIZE];
+  snprintf(path, sizeof(path), "%s/bench0.job", dir);
+  FILE *job = fopen(path, "w");
+  if (job == NULL) {
+    perror("Failed to create job file");
+    remove_jobs(dir);
+    return 1;
+  }
+  size_t num_commands = 0;
+  for (long size = 0; (size_t)size < megabytes << 20; size = ftell(job), num_commands++) {
+    size_t key = num_commands / 2;
+    if (num_commands % 2 == 0) {
+      fprintf(job, "WRITE [(bulk_%zu,value_%zu)(bulk_%zu_b,value_%zu)]\n", key, key, key, key);
+    } else {
+      fprintf(job, "READ [bulk_%zu,bulk_%zu_b]\n", key, key);
+    }
+  }
+  fclose(job);
+
+  for (size_t threads = 1; threads <= max_threads; threads++) {
+    if (kvs_init()) {
+      fprintf(stderr, "Failed to initialize KVS\n");
+      break;
+    }
+    printf("threads = %zu\n", threads);
+    fflush(stdout);
+    uint64_t start = now_ns();
+    process_jobs(dir, threads, 1);
+    uint64_t elapsed = now_ns() - start;
+    kvs_terminate();
+    printf("%14.0f commands/s\n", (double)num_commands / ((double)elapsed / 1e9));
+  }
+
+  remove_jobs(dir);
+  return 0;
+}
+
+// Processes a job made mostly of SHOWs of a small table, blank lines and
+// comments, where the cost of each command is dominated by the per-command
+// overhead of run_job rather than by the KVS, and reports its throughput.
+int bench_show(int argc, char **argv) {
+  size_t num_commands = arg_or(argc, argv, 0, 200000);
+
+  char dir[] = "/tmp/kvs_bench_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("Failed to create jobs directory");
+    return 1;
+  }
+  char path[MAX_JOB_FILE_NAME_SIZE];
+  snprintf(path, sizeof(path), "%s/bench0.job", dir);
+  FILE *job = fopen(path, "w");
+  if (job == NULL) {
+    perror("Failed to create job file");
+    remove_jobs(dir);
+    return 1;
+  }
+  fputs("WRITE [(a,1)(b,2)(c,3)(d,4)]\n", job);
+  uint64_t state = 88172645463325252ULL;
+  for (size_t i = 0; i < num_commands; i++) {
+    uint64_t kind = next_random(&state) % 10;
+    if (kind < 6) {
+      fputs("SHOW\n", job);
+    } else if (kind < 8) {
+      fputs("\n", job);
+    } else if (kind < 9) {
+      fputs("# comment\n", job);
+    } else {
+      fputs("READ [a,b]\n", job);
+    }
+  }
+  fclose(job);
+
+  if (kvs_init()) {
+    fprintf(stderr, "Failed to initialize KVS\n");
+    remove_jobs(dir);
+    return 1;
+  }
+  int saved_stdout = dup(STDOUT_FILENO);
+  int devnull = open("/dev/null", O_WRONLY);
+  fflush(stdout);
+  dup2(devnull, STDOUT_FILENO);
+  uint64_t start = now_ns();
+  process_jobs(dir, 1, 1);
+  uint64_t elapsed = now_ns() - start;
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(devnull);
+  close(saved_stdout);
+  kvs_terminate();
+
+  printf("%10s %14s %14s\n", "commands", "commands/s", "ns/command");
+  printf("%10zu %14.0f %14.1f\n", num_commands,
+         (double)num_commands / ((double)elapsed / 1e9), (double)elapsed / (double)num_commands);
+  remove_jobs(dir);
+  return 0;
+}
+
+// Parses a whole job file without executing it.
+// @param in Input buffer of the file, mapped or not.
+// @return Number of commands parsed.
+static size_t parse_job(InputBuffer *in) {
+  CommandArgs args;
+  command_args_init(&args);
+  size_t commands = 0;
+  size_t invalid = 0;
+  while (1) {
+    enum Command command = get_next(in);
+    if (command == EOC) {
+      break;
+    }
+    commands++;
+    if (command == CMD_WRITE) {
+      invalid += parse_write(in, &args, MAX_STRING_SIZE) == 0;
+    } else if (command == CMD_READ || command == CMD_DELETE) {
+      invalid += parse_read_delete(in, &args, MAX_STRING_SIZE) == 0;
+    } else {
+      invalid++;
+    }
+  }
+  command_args_destroy(&args);
+  if (invalid > 0) {
+    fprintf(stderr, "%zu commands failed to parse\n", invalid);
+  }
+  return commands;
+}
+
+// Parses a generated job file of [megabytes] MB without executing it, both
+// streamed and mapped, and reports the parser throughput and the read
+// syscalls it needed.
+int bench_parser(int argc, char **argv) {
+  size_t megabytes = arg_or(argc, argv, 0, 100);
+
+  char path[] = "/tmp/kvs_bench_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    perror("Failed to create job file");
+    return 1;
+  }
+  close(fd);
+  if (generate_job(path, megabytes * 1024 * 1024 / BYTES_PER_COMMAND, 88172645463325252ULL)) {
+    unlink(path);
+    return 1;
+  }
+
+  struct stat st;
+  if (stat(path, &st) == -1) {
+    perror("Failed to stat job file");
+    unlink(path);
+    return 1;
+  }
+  double size_mb = (double)st.st_size / (1024.0 * 1024.0);
+
+  static InputBuffer in;
+  printf("%10s %10s %10s %10s %12s\n", "mode", "MB", "commands", "MB/s", "reads");
+  for (int mapped = 0; mapped < 2; mapped++) {
+    fd = open(path, O_RDONLY);
+    if (fd == -1) {
+      perror("Failed to open job file");
+      break;
+    }
+    input_init(&in, fd);
+    if (mapped && input_map(&in) != 0) {
+      fprintf(stderr, "Failed to map job file\n");
+      close(fd);
+      break;
+    }
+
+    uint64_t start = now_ns();
+    size_t commands = parse_job(&in);
+    uint64_t elapsed = now_ns() - start;
+    printf("%10s %10.1f %10zu %10.1f %12zu\n", mapped ? "mmap" : "stream", size_mb, commands,
+           size_mb / ((double)elapsed / 1e9), in.syscalls);
+
+    input_release(&in);
+    close(fd);
+  }
+
+  unlink(path);
+  return 0;
+}
@@ -0,0 +1,282 @@
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "src/server/constants.h"
+#include "src/server/epoch.h"
+#include "src/server/kvs.h"
+#include "src/server/operations.h"
+
+#define LOOKUPS 1000000
+
+#ifdef __GLIBC__
+// Counts every heap allocation of the process, including the ones made
+// inside libc (strdup, for instance), by interposing the glibc allocator.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static atomic_size_t allocations = 0;
+
+void *malloc(size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+#define ALLOCATION_COUNTING 1
+#else
+#define ALLOCATION_COUNTING 0
+#endif
+
+// Fills a table with keys sharing a common prefix, like the production key
+// space, and measures the average cost of looking up existing keys.
+int bench_hash(int argc, char **argv) {
+  size_t max_keys = arg_or(argc, argv, 0, 1000000);
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+
+  printf("%10s %10s %14s\n", "keys", "buckets", "ns/lookup");
+  for (size_t num_keys = 1000; num_keys <= max_keys; num_keys *= 10) {
+    HashTable *ht = create_hash_table();
+    if (ht == NULL) {
+      fprintf(stderr, "Failed to create hash table\n");
+      return 1;
+    }
+
+    for (size_t i = 0; i < num_keys; i++) {
+      snprintf(key, sizeof(key), "user_%zu", i);
+      snprintf(value, sizeof(value), "value_%zu", i);
+      if (write_pair(ht, key, strlen(key), value, strlen(value)) != 0) {
+        fprintf(stderr, "Failed to write key %s\n", key);
+        free_table(ht);
+        return 1;
+      }
+      resize_step(ht);
+    }
+
+    uint64_t state = 88172645463325252ULL;
+    size_t total_len = 0;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < LOOKUPS; i++) {
+      snprintf(key, sizeof(key), "user_%zu", (size_t)(next_random(&state) % num_keys));
+      size_t len = 0;
+      epoch_enter();
+      read_pair(ht, key, strlen(key), &len);
+      epoch_exit();
+      total_len += len;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    if (total_len == 0) {
+      fprintf(stderr, "No key was found\n");
+    }
+    printf("%10zu %10zu %14.1f\n", num_keys, atomic_load(&ht->capacity), (double)elapsed / LOOKUPS);
+    free_table(ht);
+  }
+  return 0;
+}
+
+// Slice of a whole string.
+static Slice slice_of(const char *str) {
+  return (Slice){str, strlen(str)};
+}
+
+// Issues single key READs through kvs_read, half of them for missing keys,
+// and reports the heap allocations and time per READ.
+int bench_reads(int argc, char **argv) {
+  size_t num_keys = arg_or(argc, argv, 0, 100000);
+  size_t num_reads = arg_or(argc, argv, 1, 1000000);
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+  Slice key_slice;
+  Slice value_slice;
+
+  if (kvs_init()) {
+    fprintf(stderr, "Failed to initialize KVS\n");
+    return 1;
+  }
+  for (size_t i = 0; i < num_keys; i++) {
+    snprintf(key, MAX_STRING_SIZE, "user_%zu", i);
+    snprintf(value, MAX_STRING_SIZE, "value_%zu", i);
+    key_slice = slice_of(key);
+    value_slice = slice_of(value);
+    kvs_write(1, &key_slice, &value_slice);
+  }
+
+  int out_fd = open("/dev/null", O_WRONLY);
+  if (out_fd == -1) {
+    perror("Failed to open /dev/null");
+    kvs_terminate();
+    return 1;
+  }
+
+  OutputBuffer out;
+  output_init(&out, out_fd);
+
+  // The first READ of a thread registers it for epoch based reclamation
+  kvs_read(1, &key_slice, &out);
+  output_flush(&out);
+
+  uint64_t state = 88172645463325252ULL;
+  size_t allocations_before = 0;
+#if ALLOCATION_COUNTING
+  allocations_before = atomic_load(&allocations);
+#endif
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < num_reads; i++) {
+    snprintf(key, MAX_STRING_SIZE, "user_%zu", (size_t)(next_random(&state) % (2 * num_keys)));
+    key_slice = slice_of(key);
+    kvs_read(1, &key_slice, &out);
+    output_flush(&out);
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  printf("%10s %14s %14s\n", "reads", "ns/READ", "allocs/READ");
+#if ALLOCATION_COUNTING
+  printf("%10zu %14.1f %14.3f\n", num_reads, (double)elapsed / (double)num_reads,
+         (double)(atomic_load(&allocations) - allocations_before) / (double)num_reads);
+#else
+  (void)allocations_before;
+  printf("%10zu %14.1f %14s\n", num_reads, (double)elapsed / (double)num_reads, "n/a");
+#endif
+
+  close(out_fd);
+  kvs_terminate();
+  return 0;
+}
+
+// Writes num_keys new keys into a table, then overwrites all of them, and
+// reports the heap allocations and time per write_pair of each phase.
+int bench_writes(int argc, char **argv) {
+  size_t num_keys = arg_or(argc, argv, 0, 1000000);
+  char key[MAX_STRING_SIZE];
+  char value[MAX_STRING_SIZE];
+
+  HashTable *ht = create_hash_table();
+  if (ht == NULL) {
+    fprintf(stderr, "Failed to create hash table\n");
+    return 1;
+  }
+
+  printf("%10s %10s %14s %14s\n", "phase", "writes", "ns/write", "allocs/write");
+  const char *phases[] = {"insert", "overwrite"};
+  for (size_t phase = 0; phase < 2; phase++) {
+    size_t allocations_before = 0;
+#if ALLOCATION_COUNTING
+    allocations_before = atomic_load(&allocations);
+#endif
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < num_keys; i++) {
+      snprintf(key, sizeof(key), "user_%zu", i);
+      snprintf(value, sizeof(value), "value_%zu_%zu", phase, i);
+      if (write_pair(ht, key, strlen(key), value, strlen(value)) != 0) {
+        fprintf(stderr, "Failed to write key %s\n", key);
+        free_table(ht);
+        return 1;
+      }
+      resize_step(ht);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+#if ALLOCATION_COUNTING
+    printf("%10s %10zu %14.1f %14.3f\n", phases[phase], num_keys,
+           (double)elapsed / (double)num_keys,
+           (double)(atomic_load(&allocations) - allocations_before) / (double)num_keys);
+#else
+    (void)allocations_before;
+    printf("%10s %10zu %14.1f %14s\n", phases[phase], num_keys,
+           (double)elapsed / (double)num_keys, "n/a");
+#endif
+  }
+
+  free_table(ht);
+  return 0;
+}
+
+// Runs READ and DELETE commands of MAX_WRITE_SIZE keys and a SHOW of the
+// whole table through an OutputBuffer, and reports the write syscalls per
+// command next to the number of writes made when every pair was written
+// on its own.
+int bench_output(int argc, char **argv) {
+  size_t num_keys = arg_or(argc, argv, 0, 100000);
+  size_t num_commands = arg_or(argc, argv, 1, 1000);
+  static char keys[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  static char values[MAX_WRITE_SIZE][MAX_STRING_SIZE];
+  static Slice key_slices[MAX_WRITE_SIZE];
+  static Slice value_slices[MAX_WRITE_SIZE];
+
+  if (kvs_init()) {
+    fprintf(stderr, "Failed to initialize KVS\n");
+    return 1;
+  }
+  for (size_t i = 0; i < num_keys; i++) {
+    snprintf(keys[0], MAX_STRING_SIZE, "user_%zu", i);
+    snprintf(values[0], MAX_STRING_SIZE, "value_%zu", i);
+    key_slices[0] = slice_of(keys[0]);
+    value_slices[0] = slice_of(values[0]);
+    kvs_write(1, key_slices, value_slices);
+  }
+
+  int out_fd = open("/dev/null", O_WRONLY);
+  if (out_fd == -1) {
+    perror("Failed to open /dev/null");
+    kvs_terminate();
+    return 1;
+  }
+  OutputBuffer out;
+
+  printf("%10s %10s %14s %14s %14s\n", "command", "pairs", "ns/command", "writes/command",
+         "unbuffered");
+  uint64_t state = 88172645463325252ULL;
+  for (int command = 0; command < 3; command++) {
+    size_t runs = command == 2 ? 10 : num_commands;
+    output_init(&out, out_fd);
+    uint64_t start = now_ns();
+    for (size_t run = 0; run < runs; run++) {
+      if (command < 2) {
+        for (size_t i = 0; i < MAX_WRITE_SIZE; i++) {
+          // DELETE uses keys that are never stored, so the table is unchanged
+          snprintf(keys[i], MAX_STRING_SIZE, command == 0 ? "user_%zu" : "missing_%zu",
+                   (size_t)(next_random(&state) % num_keys));
+          key_slices[i] = slice_of(keys[i]);
+        }
+      }
+      if (command == 0) {
+        kvs_read(MAX_WRITE_SIZE, key_slices, &out);
+      } else if (command == 1) {
+        kvs_delete(MAX_WRITE_SIZE, key_slices, &out);
+      } else {
+        kvs_show(&out);
+      }
+      output_flush(&out);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    // Previously: one write per pair, plus the brackets for READ and DELETE
+    size_t pairs = command == 2 ? num_keys : MAX_WRITE_SIZE;
+    size_t unbuffered = command == 2 ? num_keys : MAX_WRITE_SIZE + 2;
+    const char *names[] = {"READ", "DELETE", "SHOW"};
+    printf("%10s %10zu %14.1f %14.2f %14zu\n", names[command], pairs,
+           (double)elapsed / (double)runs, (double)out.syscalls / (double)runs, unbuffered);
+  }
+
+  close(out_fd);
+  kvs_terminate();
+  return 0;
+}
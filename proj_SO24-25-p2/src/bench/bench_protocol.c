@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "src/common/constants.h"
+#include "src/common/protocol.h"
+
+#define WRITE_PAIRS 4      // Pairs of the WRITE requests
+#define REQUEST_SIZE 512   // Room for any request, in either format
+
+enum { KIND_SUBSCRIBE, KIND_PUBLISH, KIND_WRITE, NUM_KINDS };
+
+static const char *const kind_names[NUM_KINDS] = {"SUBSCRIBE", "PUBLISH", "WRITE"};
+static const uint8_t kind_op_codes[NUM_KINDS] = {OP_CODE_SUBSCRIBE, OP_CODE_PUBLISH,
+                                                 OP_CODE_WRITE};
+
+typedef char Strings[2 * WRITE_PAIRS][MAX_STRING_SIZE];
+
+// Fills the fields of the [i]th request of a kind, backed by strings.
+// @return Number of fields.
+static size_t request_fields(int kind, size_t i, Strings strings, Field *fields) {
+  size_t count = kind == KIND_SUBSCRIBE ? 1 : kind == KIND_PUBLISH ? 2 : 2 * WRITE_PAIRS;
+  for (size_t f = 0; f < count; f++) {
+    if (f % 2 == 0) {
+      snprintf(strings[f], MAX_STRING_SIZE, "key%06zu", (i * 7 + f) % 100000);
+    } else if (kind == KIND_PUBLISH) {
+      snprintf(strings[f], MAX_STRING_SIZE, "message number %zu", i);
+    } else {
+      snprintf(strings[f], MAX_STRING_SIZE, "value%zu", i + f);
+    }
+    fields[f] = (Field){strings[f], strlen(strings[f])};
+  }
+  return count;
+}
+
+// Encodes a request in the line format the server used to read.
+// @return Size of the line.
+static size_t text_encode(char *buffer, size_t size, int kind, size_t count,
+                          Strings strings) {
+  int len;
+  if (kind == KIND_SUBSCRIBE) {
+    len = snprintf(buffer, size, "SUBSCRIBE %s\n", strings[0]);
+  } else if (kind == KIND_PUBLISH) {
+    len = snprintf(buffer, size, "PUBLISH %s %s\n", strings[0], strings[1]);
+  } else {
+    len = snprintf(buffer, size, "WRITE [");
+    for (size_t f = 0; f < count; f += 2) {
+      len += snprintf(buffer + len, size - (size_t)len, "(%s,%s)", strings[f], strings[f + 1]);
+    }
+    len += snprintf(buffer + len, size - (size_t)len, "]\n");
+  }
+  return (size_t)len;
+}
+
+// Parses a request line the way the server used to.
+// @return Number of strings read, 0 if the line is malformed.
+static size_t text_decode(const char *line, char strings[][MAX_STRING_SIZE]) {
+  if (strncmp(line, "SUBSCRIBE", 9) == 0) {
+    return sscanf(line + 10, "%39s", strings[0]) == 1 ? 1 : 0;
+  } else if (strncmp(line, "PUBLISH", 7) == 0) {
+    return sscanf(line + 8, "%39s %39[^\n]", strings[0], strings[1]) == 2 ? 2 : 0;
+  } else if (strncmp(line, "WRITE [", 7) == 0) {
+    size_t count = 0;
+    int consumed;
+    const char *cursor = line + 7;
+    while (count + 1 < MAX_FRAME_FIELDS &&
+           sscanf(cursor, "(%39[^,],%39[^)])%n", strings[count], strings[count + 1],
+                  &consumed) == 2) {
+      cursor += consumed;
+      count += 2;
+    }
+    return *cursor == ']' ? count : 0;
+  }
+  return 0;
+}
+
+// Copies the fields of a frame into strings, as the server does.
+// @return Number of fields, 0 if the frame is malformed.
+static size_t frame_strings(const char *frame, char strings[][MAX_STRING_SIZE]) {
+  FrameHeader header;
+  Field fields[MAX_FRAME_FIELDS];
+  memcpy(&header, frame, sizeof(header));
+  if (frame_decode(&header, frame + sizeof(header), fields, MAX_FRAME_FIELDS) != 0) {
+    return 0;
+  }
+  for (size_t f = 0; f < header.count; f++) {
+    if (fields[f].data == NULL || fields[f].len >= MAX_STRING_SIZE) {
+      return 0;
+    }
+    memcpy(strings[f], fields[f].data, fields[f].len);
+    strings[f][fields[f].len] = '\0';
+  }
+  return header.count;
+}
+
+// Encodes [num_frames] requests of a kind into one stream, as frames or as
+// lines, then decodes the stream back, and prints the speed of both.
+// @return 0 if every request decoded to what was encoded, 1 otherwise.
+static int run_protocol(int kind, int binary, size_t num_frames) {
+  char *stream = malloc(num_frames * REQUEST_SIZE);
+  // The strings of every request are made outside the timed loops
+  Strings *strings = malloc(num_frames * sizeof(Strings));
+  Field(*fields)[2 * WRITE_PAIRS] = malloc(num_frames * sizeof(*fields));
+  if (stream == NULL || strings == NULL || fields == NULL) {
+    fprintf(stderr, "Failed to allocate the requests\n");
+    free(stream);
+    free(strings);
+    free(fields);
+    return 1;
+  }
+  size_t count = 0;
+  for (size_t i = 0; i < num_frames; i++) {
+    count = request_fields(kind, i, strings[i], fields[i]);
+  }
+  // Faults the stream in, so neither format pays for it
+  memset(stream, 0, num_frames * REQUEST_SIZE);
+
+  size_t len = 0;
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < num_frames; i++) {
+    if (binary) {
+      len += frame_encode(stream + len, REQUEST_SIZE, kind_op_codes[kind], 0, count, fields[i]);
+    } else {
+      len += text_encode(stream + len, REQUEST_SIZE, kind, count, strings[i]);
+    }
+  }
+  uint64_t encode_elapsed = now_ns() - start;
+
+  int failed = 0;
+  size_t offset = 0;
+  char decoded[MAX_FRAME_FIELDS][MAX_STRING_SIZE], line[REQUEST_SIZE];
+  start = now_ns();
+  for (size_t i = 0; i < num_frames && !failed; i++) {
+    if (binary) {
+      FrameHeader header;
+      memcpy(&header, stream + offset, sizeof(header));
+      failed = frame_strings(stream + offset, decoded) != count;
+      offset += sizeof(header) + header.len;
+    } else {
+      // The server ended each line with '\0' in its read buffer before sscanf
+      const char *end = memchr(stream + offset, '\n', len - offset);
+      size_t line_len = end != NULL ? (size_t)(end - stream) + 1 - offset : 0;
+      memcpy(line, stream + offset, line_len);
+      line[line_len] = '\0';
+      failed = end == NULL || text_decode(line, decoded) != count;
+      offset += line_len;
+    }
+  }
+  uint64_t decode_elapsed = now_ns() - start;
+
+  // Checks the last request, so the decoding can't be skipped
+  for (size_t f = 0; f < count && !failed; f++) {
+    failed = strcmp(strings[num_frames - 1][f], decoded[f]) != 0;
+  }
+  free(stream);
+  free(strings);
+  free(fields);
+  if (failed) {
+    fprintf(stderr, "%s requests didn't decode to what was encoded\n", kind_names[kind]);
+    return 1;
+  }
+
+  printf("%10s %8s %10.1f %14.0f %12.1f %14.0f %12.1f\n", kind_names[kind],
+         binary ? "frames" : "text", (double)len / (double)num_frames,
+         (double)num_frames * 1e9 / (double)encode_elapsed,
+         (double)len * 1e3 / (double)encode_elapsed,
+         (double)num_frames * 1e9 / (double)decode_elapsed,
+         (double)len * 1e3 / (double)decode_elapsed);
+  return 0;
+}
+
+int bench_protocol(int argc, char **argv) {
+  size_t num_frames = arg_or(argc, argv, 0, 1000000);
+  if (num_frames == 0) {
+    num_frames = 1;
+  }
+
+  printf("%10s %8s %10s %14s %12s %14s %12s\n", "request", "format", "bytes", "encode/s",
+         "encode MB/s", "decode/s", "decode MB/s");
+  for (int kind = 0; kind < NUM_KINDS; kind++) {
+    for (int binary = 1; binary >= 0; binary--) {
+      if (run_protocol(kind, binary, num_frames) != 0) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,996 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "src/common/io.h"
+#include "src/common/protocol.h"
+#include "src/server/notifications.h"
+#include "src/server/operations.h"
+#include "src/server/sessions.h"
+
+#define SESSION_COUNTS 3 // Runs of 10, 1k and 10k sessions
+#define FANOUT_TIMEOUT_MS 1 // How long OVERFLOW_BLOCK waits in bench fanout
+#define FANOUT_BURST 32     // Messages published before waiting for readers
+
+static char request[64], disconnect[sizeof(FrameHeader)];
+static size_t request_len, disconnect_len;
+
+// Encodes the frames clients send: a request, answered without touching the
+// KVS, and the DISCONNECT that ends a session.
+static void encode_requests(void) {
+  Field key = {"bench", strlen("bench")};
+  request_len = frame_encode(request, sizeof(request), OP_CODE_UNSUBSCRIBE, 0, 1, &key);
+  disconnect_len = frame_encode(disconnect, sizeof(disconnect), OP_CODE_DISCONNECT, 0, 0, NULL);
+}
+
+// Reads a whole response frame.
+// @return 0 if successful, 1 otherwise.
+static int read_response(int fd) {
+  FrameHeader header;
+  char payload[MAX_FRAME_PAYLOAD];
+  if (read_all(fd, &header, sizeof(header), NULL) != 1 || header.len > MAX_FRAME_PAYLOAD) {
+    return 1;
+  }
+  return header.len > 0 && read_all(fd, payload, header.len, NULL) != 1;
+}
+
+// Reads a "<field>: <value>" line of /proc/self/status.
+// @return The value, 0 if it is missing.
+static size_t proc_status(const char *field) {
+  FILE *file = fopen("/proc/self/status", "r");
+  if (file == NULL) {
+    return 0;
+  }
+  char line[256];
+  size_t len = strlen(field), value = 0;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (strncmp(line, field, len) == 0 && line[len] == ':') {
+      value = strtoul(line + len + 1, NULL, 10);
+      break;
+    }
+  }
+  fclose(file);
+  return value;
+}
+
+// Client side of a run, in a process of its own like real clients: sends a
+// request to every session and reads every response, [rounds] times, then
+// reports the elapsed nanoseconds and disconnects once told to.
+static void drive_sessions(const char *dir, size_t num_sessions, size_t rounds, int result,
+                           int go) {
+  int *requests = malloc(num_sessions * sizeof(int));
+  int *responses = malloc(num_sessions * sizeof(int));
+  if (requests == NULL || responses == NULL) {
+    _exit(1);
+  }
+  char path[64];
+  for (size_t i = 0; i < num_sessions; i++) {
+    // O_RDWR, so that opening doesn't wait for the server
+    snprintf(path, sizeof(path), "%s/req%zu", dir, i);
+    requests[i] = open(path, O_RDWR);
+    snprintf(path, sizeof(path), "%s/resp%zu", dir, i);
+    responses[i] = open(path, O_RDWR);
+    if (requests[i] == -1 || responses[i] == -1) {
+      _exit(1);
+    }
+  }
+
+  char byte;
+  if (read(go, &byte, 1) != 1) {
+    _exit(1);
+  }
+  // Every session starts with the response to its CONNECT
+  for (size_t i = 0; i < num_sessions; i++) {
+    if (read_response(responses[i]) != 0) {
+      _exit(1);
+    }
+  }
+  uint64_t start = now_ns();
+  for (size_t round = 0; round < rounds; round++) {
+    for (size_t i = 0; i < num_sessions; i++) {
+      if (write(requests[i], request, request_len) != (ssize_t)request_len) {
+        _exit(1);
+      }
+    }
+    for (size_t i = 0; i < num_sessions; i++) {
+      if (read_response(responses[i]) != 0) {
+        _exit(1);
+      }
+    }
+  }
+  uint64_t elapsed = now_ns() - start;
+  if (write(result, &elapsed, sizeof(elapsed)) != sizeof(elapsed) || read(go, &byte, 1) != 1) {
+    _exit(1);
+  }
+
+  for (size_t i = 0; i < num_sessions; i++) {
+    if (write(requests[i], disconnect, disconnect_len) < 0) {
+      _exit(1);
+    }
+  }
+  _exit(0);
+}
+
+// Opens [num_sessions] sessions, each one served by a thread or by the
+// [loop_threads] threads of the event loop, has a client process send
+// [rounds] requests through each one, and prints the throughput and what
+// the sessions cost the server in memory and threads.
+static int run_sessions(size_t num_sessions, size_t rounds, size_t loop_threads, FILE *report) {
+  char dir[] = "/tmp/kvs_bench_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("Failed to create FIFO directory");
+    return 1;
+  }
+  char path[64];
+  for (size_t i = 0; i < num_sessions; i++) {
+    snprintf(path, sizeof(path), "%s/req%zu", dir, i);
+    mkfifo(path, 0666);
+    snprintf(path, sizeof(path), "%s/resp%zu", dir, i);
+    mkfifo(path, 0666);
+    snprintf(path, sizeof(path), "%s/notif%zu", dir, i);
+    mkfifo(path, 0666);
+  }
+
+  size_t base_rss = proc_status("VmRSS");
+  size_t base_threads = proc_status("Threads");
+  if (loop_threads > 0 && sessions_multiplex(loop_threads)) {
+    fprintf(report, "Failed to start session threads\n");
+    return 1;
+  }
+  int result[2], go[2];
+  if (pipe(result) != 0 || pipe(go) != 0) {
+    perror("Failed to create pipes");
+    return 1;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(result[0]);
+    close(go[1]);
+    drive_sessions(dir, num_sessions, rounds, result[1], go[0]);
+  }
+  close(result[1]);
+  close(go[0]);
+
+  size_t failed = 0;
+  for (size_t i = 0; i < num_sessions; i++) {
+    char requests[64], responses[64], notifications[64];
+    snprintf(requests, sizeof(requests), "%s/req%zu", dir, i);
+    snprintf(responses, sizeof(responses), "%s/resp%zu", dir, i);
+    snprintf(notifications, sizeof(notifications), "%s/notif%zu", dir, i);
+    failed += session_open(requests, responses, notifications) != 0;
+  }
+
+  // Memory and threads are measured once every session handled requests
+  uint64_t elapsed = 0;
+  int ok = failed == 0 && write(go[1], "", 1) == 1 &&
+           read(result[0], &elapsed, sizeof(elapsed)) == sizeof(elapsed);
+  size_t rss = proc_status("VmRSS");
+  size_t threads = proc_status("Threads");
+  if (write(go[1], "", 1) != 1) {
+    ok = 0;
+  }
+
+  // Sessions end on DISCONNECT, and remove their FIFOs
+  SessionStats stats;
+  uint64_t deadline = now_ns() + 10000000000ULL;
+  for (sessions_stats(&stats); stats.active > 0 && now_ns() < deadline; sessions_stats(&stats)) {
+    struct timespec delay = {0, 1000000};
+    nanosleep(&delay, NULL);
+  }
+  if (stats.active > 0) {
+    kill(pid, SIGKILL);
+  }
+  waitpid(pid, NULL, 0);
+  sessions_stop();
+  close(result[0]);
+  close(go[1]);
+  for (size_t i = 0; i < num_sessions; i++) {
+    snprintf(path, sizeof(path), "%s/req%zu", dir, i);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/resp%zu", dir, i);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/notif%zu", dir, i);
+    unlink(path);
+  }
+  rmdir(dir);
+
+  fprintf(report, "%8s %10zu ", loop_threads > 0 ? "epoll" : "thread", num_sessions);
+  if (!ok || stats.active > 0) {
+    fprintf(report, "failed (%zu sessions not opened)\n", failed);
+    return 1;
+  }
+  double rss_kb = (double)(rss > base_rss ? rss - base_rss : 0);
+  fprintf(report, "%10zu %12.1f %12.2f %14.0f\n", threads - base_threads, rss_kb / 1024,
+          rss_kb / (double)num_sessions, (double)(num_sessions * rounds) * 1e9 / (double)elapsed);
+  return 0;
+}
+
+// Serves 10, 1k and 10k sessions with a thread each and with [loop_threads]
+// threads multiplexing them with epoll, each session handling [rounds]
+// requests, and reports the throughput and the memory and threads used.
+// The number of sessions is capped by the limit of open files, since each
+// one takes up to five file descriptors in the server (its FIFOs, the
+// eventfd that evicts it and, multiplexed, an epoll of its own) and two in
+// the client.
+int bench_sessions(int argc, char **argv) {
+  size_t rounds = arg_or(argc, argv, 0, 20);
+  size_t loop_threads = arg_or(argc, argv, 1, 4);
+  const size_t counts[SESSION_COUNTS] = {10, 1000, 10000};
+  encode_requests();
+
+  struct rlimit limit;
+  size_t max_sessions = 10000;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    getrlimit(RLIMIT_NOFILE, &limit);
+    max_sessions = ((size_t)limit.rlim_cur - 64) / 5;
+  }
+
+  // The sessions log every request, so the runs report to a copy of stdout
+  // and stdout is silenced
+  FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+  int null_fd = open("/dev/null", O_WRONLY);
+  if (report == NULL || null_fd == -1) {
+    return 1;
+  }
+  fprintf(report, "%8s %10s %10s %12s %12s %14s\n", "mode", "sessions", "threads", "RSS MB",
+          "KB/session", "requests/s");
+  fflush(report);
+  int result = 0;
+  for (size_t c = 0; c < SESSION_COUNTS && result == 0; c++) {
+    size_t num_sessions = counts[c] < max_sessions ? counts[c] : max_sessions;
+    for (int loop = 0; loop <= 1 && result == 0; loop++) {
+      // Each run is a process of its own, so memory freed by the previous
+      // one doesn't hide what the next one takes
+      fflush(stdout);
+      pid_t pid = fork();
+      if (pid == 0) {
+        dup2(null_fd, STDOUT_FILENO);
+        int failed = run_sessions(num_sessions, rounds, loop ? loop_threads : 0, report);
+        fflush(report);
+        _exit(failed);
+      }
+      int status;
+      result = pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+               WEXITSTATUS(status) != 0;
+    }
+  }
+  close(null_fd);
+  fclose(report);
+  return result;
+}
+
+// A client connecting [num_connects] times in a row, each time with a new
+// pair of FIFOs: registers, sends a request and waits for the responses to
+// its CONNECT and to the request, then disconnects.
+typedef struct ConnectClient {
+  pthread_t thread;
+  const char *dir;
+  size_t id;
+  size_t num_connects;
+  int register_fd;
+  uint64_t *latencies; // Nanoseconds from registering to the first response
+  int failed;
+} ConnectClient;
+
+static void *connect_client(void *arg) {
+  ConnectClient *client = arg;
+  char requests[64], responses[64], frame[160];
+  for (size_t i = 0; i < client->num_connects && !client->failed; i++) {
+    snprintf(requests, sizeof(requests), "%s/req%zu_%zu", client->dir, client->id, i);
+    snprintf(responses, sizeof(responses), "%s/resp%zu_%zu", client->dir, client->id, i);
+    Field paths[] = {{requests, strlen(requests)}, {responses, strlen(responses)}};
+    size_t len = frame_encode(frame, sizeof(frame), OP_CODE_CONNECT, 0, 2, paths);
+    int request_fd = -1, response_fd = -1;
+    if (mkfifo(requests, 0666) != 0 || mkfifo(responses, 0666) != 0 ||
+        (request_fd = open(requests, O_RDWR)) == -1 ||
+        (response_fd = open(responses, O_RDWR)) == -1) {
+      client->failed = 1;
+    } else {
+      uint64_t start = now_ns();
+      client->failed = write(client->register_fd, frame, len) != (ssize_t)len ||
+                       write(request_fd, request, request_len) < 0 ||
+                       read_response(response_fd) != 0 || read_response(response_fd) != 0;
+      client->latencies[i] = now_ns() - start;
+      if (write(request_fd, disconnect, disconnect_len) < 0) {
+        client->failed = 1;
+      }
+    }
+    if (request_fd != -1) {
+      close(request_fd);
+    }
+    if (response_fd != -1) {
+      close(response_fd);
+    }
+  }
+  return NULL;
+}
+
+static int compare_latencies(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void *accept_sessions(void *arg) {
+  int *fds = arg;
+  sessions_accept(fds[0], fds[1]);
+  return NULL;
+}
+
+// Has [num_clients] concurrent clients connect [num_connects] times each
+// through the register FIFO of sessions_accept, with sessions served by a
+// thread each or by [loop_threads] threads, and prints the latency from
+// registering to the response of the first request.
+static int run_connects(size_t num_clients, size_t num_connects, size_t loop_threads) {
+  size_t total = num_clients * num_connects;
+  char dir[] = "/tmp/kvs_bench_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("Failed to create FIFO directory");
+    return 1;
+  }
+  char register_path[64];
+  snprintf(register_path, sizeof(register_path), "%s/register", dir);
+  int stop[2];
+  int fds[2] = {-1, -1};
+  uint64_t *latencies = malloc(total * sizeof(uint64_t));
+  ConnectClient *clients = malloc(num_clients * sizeof(ConnectClient));
+  if (latencies == NULL || clients == NULL || mkfifo(register_path, 0666) != 0 ||
+      (fds[0] = open(register_path, O_RDWR | O_NONBLOCK)) == -1 || pipe(stop) != 0 ||
+      (loop_threads > 0 && sessions_multiplex(loop_threads))) {
+    perror("Failed to create register FIFO");
+    free(latencies);
+    free(clients);
+    unlink(register_path);
+    rmdir(dir);
+    return 1;
+  }
+  fds[1] = stop[0];
+
+  // The sessions log every request, so stdout is silenced while they run
+  fflush(stdout);
+  int saved_stdout = dup(STDOUT_FILENO);
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, STDOUT_FILENO);
+  close(null_fd);
+
+  pthread_t acceptor;
+  pthread_create(&acceptor, NULL, accept_sessions, fds);
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < num_clients; i++) {
+    clients[i] = (ConnectClient){0,  dir, i, num_connects, open(register_path, O_WRONLY),
+                                 latencies + i * num_connects, 0};
+    pthread_create(&clients[i].thread, NULL, connect_client, &clients[i]);
+  }
+  int failed = 0;
+  for (size_t i = 0; i < num_clients; i++) {
+    pthread_join(clients[i].thread, NULL);
+    close(clients[i].register_fd);
+    failed |= clients[i].failed;
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  SessionStats stats;
+  uint64_t deadline = now_ns() + 10000000000ULL;
+  for (sessions_stats(&stats); stats.active > 0 && now_ns() < deadline; sessions_stats(&stats)) {
+    struct timespec delay = {0, 1000000};
+    nanosleep(&delay, NULL);
+  }
+  if (write(stop[1], "", 1) != 1) {
+    failed = 1;
+  }
+  pthread_join(acceptor, NULL);
+  sessions_stop();
+  fflush(stdout);
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+  close(stop[0]);
+  close(stop[1]);
+  close(fds[0]);
+  unlink(register_path);
+  rmdir(dir);
+
+  printf("%8s %8zu ", loop_threads > 0 ? "epoll" : "thread", num_clients);
+  if (failed || stats.active > 0) {
+    printf("failed\n");
+    free(latencies);
+    free(clients);
+    return 1;
+  }
+  qsort(latencies, total, sizeof(uint64_t), compare_latencies);
+  printf("%10zu %12.0f %10.1f %10.1f %10.1f\n", total, (double)total * 1e9 / (double)elapsed,
+         (double)latencies[total / 2] / 1e3, (double)latencies[total * 99 / 100] / 1e3,
+         (double)latencies[total - 1] / 1e3);
+  free(latencies);
+  free(clients);
+  return 0;
+}
+
+// Has 1 to [max_clients] concurrent clients connect [num_connects] times
+// each through the register FIFO, with sessions served by a thread each and
+// by [loop_threads] threads, and reports the connect latency.
+int bench_connect(int argc, char **argv) {
+  size_t max_clients = arg_or(argc, argv, 0, 64);
+  size_t num_connects = arg_or(argc, argv, 1, 100);
+  size_t loop_threads = arg_or(argc, argv, 2, 4);
+  encode_requests();
+
+  printf("%8s %8s %10s %12s %10s %10s %10s\n", "mode", "clients", "connects", "connects/s",
+         "p50 us", "p99 us", "max us");
+  for (size_t clients = 1; clients <= max_clients; clients *= 4) {
+    for (int loop = 0; loop <= 1; loop++) {
+      if (run_connects(clients, num_connects, loop ? loop_threads : 0) != 0) {
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Opens the [i]th session of a run, with its FIFOs in [dir], and
+// subscribes it to [key].
+// @return The notification FIFO of the session, opened without blocking, -1
+// if it could not be opened.
+static int open_subscriber(const char *dir, size_t i, const char *key) {
+  char subscribe[MAX_FRAME_SIZE];
+  Field field = {key, strlen(key)};
+  size_t subscribe_len = frame_encode(subscribe, sizeof(subscribe), OP_CODE_SUBSCRIBE, 0, 1, &field);
+  char requests[64], responses[64], notifications[64];
+  snprintf(requests, sizeof(requests), "%s/req%zu", dir, i);
+  snprintf(responses, sizeof(responses), "%s/resp%zu", dir, i);
+  snprintf(notifications, sizeof(notifications), "%s/notif%zu", dir, i);
+  // O_RDWR, so that opening doesn't wait for the server
+  int request_fd = -1, response_fd = -1, notification_fd = -1;
+  int failed = mkfifo(requests, 0666) != 0 || mkfifo(responses, 0666) != 0 ||
+               mkfifo(notifications, 0666) != 0 || (request_fd = open(requests, O_RDWR)) == -1 ||
+               (response_fd = open(responses, O_RDWR)) == -1 ||
+               (notification_fd = open(notifications, O_RDWR | O_NONBLOCK)) == -1 ||
+               session_open(requests, responses, notifications) != 0 ||
+               read_response(response_fd) != 0 ||
+               write(request_fd, subscribe, subscribe_len) != (ssize_t)subscribe_len ||
+               read_response(response_fd) != 0;
+  return failed ? -1 : notification_fd;
+}
+
+// Removes the FIFOs of the first [num_subscribers] sessions of a run, and
+// their directory.
+static void remove_subscribers(const char *dir, size_t num_subscribers) {
+  char path[64];
+  const char *names[] = {"req", "resp", "notif"};
+  for (size_t i = 0; i < num_subscribers; i++) {
+    for (size_t n = 0; n < 3; n++) {
+      snprintf(path, sizeof(path), "%s/%s%zu", dir, names[n], i);
+      unlink(path);
+    }
+  }
+  rmdir(dir);
+}
+
+// Subscribers of a fanout run that read their notifications, all but the
+// first, which never does.
+typedef struct FanoutReader {
+  pthread_t thread;
+  struct pollfd *fds;
+  size_t num_fds;
+  atomic_size_t received; // Bytes read
+  atomic_bool stop;
+} FanoutReader;
+
+static void *fanout_reader(void *arg) {
+  FanoutReader *reader = arg;
+  char buffer[4096];
+  while (!atomic_load(&reader->stop)) {
+    if (poll(reader->fds, reader->num_fds, 10) <= 0) {
+      continue;
+    }
+    for (size_t i = 0; i < reader->num_fds; i++) {
+      ssize_t count;
+      while ((reader->fds[i].revents & POLLIN) &&
+             (count = read(reader->fds[i].fd, buffer, sizeof(buffer))) > 0) {
+        atomic_fetch_add(&reader->received, (size_t)count);
+      }
+    }
+  }
+  return NULL;
+}
+
+// Opens [num_subscribers] sessions subscribed to one key, the first of
+// which never reads its notifications, publishes [num_publishes] messages
+// to the key and prints how long publishing took and what became of the
+// notifications with an overflow policy.
+static int run_fanout(enum OverflowPolicy policy, size_t num_subscribers, size_t num_publishes,
+                      FILE *report) {
+  char dir[] = "/tmp/kvs_bench_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("Failed to create FIFO directory");
+    return 1;
+  }
+  notifications_configure(OUTBOX_CAPACITY, policy, FANOUT_TIMEOUT_MS);
+  if (sessions_multiplex(2)) {
+    fprintf(report, "Failed to start session threads\n");
+    return 1;
+  }
+
+  Field key = {"bench", strlen("bench")};
+  FanoutReader reader = {.num_fds = num_subscribers - 1};
+  reader.fds = calloc(num_subscribers, sizeof(struct pollfd));
+  uint64_t *latencies = malloc(num_publishes * sizeof(uint64_t));
+  int failed = reader.fds == NULL || latencies == NULL;
+  for (size_t i = 0; i < num_subscribers && !failed; i++) {
+    int notification_fd = open_subscriber(dir, i, "bench");
+    failed = notification_fd == -1;
+    if (i > 0) {
+      reader.fds[i - 1] = (struct pollfd){notification_fd, POLLIN, 0};
+    }
+  }
+  atomic_init(&reader.received, 0);
+  atomic_init(&reader.stop, false);
+  if (!failed && pthread_create(&reader.thread, NULL, fanout_reader, &reader) != 0) {
+    failed = 1;
+  }
+
+  // Publishes in bursts, each delivered to the subscribers that read before
+  // the next one, so only the stuck subscriber overflows its outbox
+  NotificationStats stats;
+  char frame[64];
+  Field fields[2] = {key, {"message", strlen("message")}};
+  size_t frame_len = frame_encode(frame, sizeof(frame), OP_CODE_NOTIFICATION, STATUS_OK, 2, fields);
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < num_publishes && !failed; i++) {
+    uint64_t publish_start = now_ns();
+    publish_message("bench", "message", -1);
+    latencies[i] = now_ns() - publish_start;
+    if ((i + 1) % FANOUT_BURST == 0 || i + 1 == num_publishes) {
+      uint64_t deadline = now_ns() + 1000000000ULL;
+      while (atomic_load(&reader.received) < (num_subscribers - 1) * (i + 1) * frame_len &&
+             now_ns() < deadline) {
+        sched_yield();
+      }
+    }
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  // Waits for the notifier to be done with what it can still send
+  notifications_stats(&stats);
+  uint64_t deadline = now_ns() + 5000000000ULL;
+  size_t last_sent;
+  do {
+    last_sent = stats.sent;
+    struct timespec pause = {0, 50000000};
+    nanosleep(&pause, NULL);
+    notifications_stats(&stats);
+  } while (!failed && stats.sent != last_sent && now_ns() < deadline);
+  if (!failed) {
+    atomic_store(&reader.stop, true);
+    pthread_join(reader.thread, NULL);
+  }
+
+  const char *names[] = {"drop", "disconnect", "block"};
+  fprintf(report, "%10s ", names[policy]);
+  if (failed) {
+    fprintf(report, "failed\n");
+  } else {
+    qsort(latencies, num_publishes, sizeof(uint64_t), compare_latencies);
+    fprintf(report, "%12.0f %10.1f %10.1f %10.1f %10zu %10zu %10zu %8zu\n",
+            (double)num_publishes * 1e9 / (double)elapsed,
+            (double)latencies[num_publishes / 2] / 1e3,
+            (double)latencies[num_publishes * 99 / 100] / 1e3,
+            (double)latencies[num_publishes - 1] / 1e3, stats.queued, stats.sent, stats.dropped,
+            stats.evicted);
+  }
+  remove_subscribers(dir, num_subscribers);
+  free(reader.fds);
+  free(latencies);
+  return failed;
+}
+
+// Publishes [num_publishes] messages to [num_subscribers] subscribers of
+// a key, one of which is stuck and never reads, with each overflow policy.
+// Each run is a process of its own, so the counters start from zero.
+int bench_fanout(int argc, char **argv) {
+  size_t num_subscribers = arg_or(argc, argv, 0, 64);
+  size_t num_publishes = arg_or(argc, argv, 1, 5000);
+  if (num_subscribers < 2 || num_publishes == 0) {
+    fprintf(stderr, "Needs at least 2 subscribers and 1 publish\n");
+    return 1;
+  }
+
+  FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+  int null_fd = open("/dev/null", O_WRONLY);
+  if (report == NULL || null_fd == -1) {
+    return 1;
+  }
+  fprintf(report, "%zu subscribers, 1 stuck, %zu notifications queued each, block waits %d ms\n",
+          num_subscribers, (size_t)OUTBOX_CAPACITY, FANOUT_TIMEOUT_MS);
+  fprintf(report, "%10s %12s %10s %10s %10s %10s %10s %10s %8s\n", "policy", "messages/s",
+          "p50 us", "p99 us", "max us", "queued", "sent", "dropped", "evicted");
+  fflush(report);
+  int result = 0;
+  enum OverflowPolicy policies[] = {OVERFLOW_DROP_OLDEST, OVERFLOW_DISCONNECT, OVERFLOW_BLOCK};
+  for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]) && result == 0; p++) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      dup2(null_fd, STDOUT_FILENO);
+      int failed = run_fanout(policies[p], num_subscribers, num_publishes, report);
+      fflush(report);
+      _exit(failed);
+    }
+    int status;
+    result = pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+             WEXITSTATUS(status) != 0;
+  }
+  close(null_fd);
+  fclose(report);
+  return result;
+}
+
+#define CHANGE_WINDOWS 4        // Runs of bench changes, with windows of 0, 1, 5 and 20 ms
+#define CHANGE_INTERVAL_NS 10000 // Time between writes of the hot key, 100k writes/s
+
+// Subscribers whose notifications carry the number of the write or of the
+// publish they come from.
+typedef struct StampReader {
+  pthread_t thread;
+  struct pollfd *fds;
+  size_t num_fds;
+  char (*pending)[MAX_FRAME_SIZE]; // Start of a frame split between reads, per FIFO
+  size_t *pending_len;
+  const _Atomic uint64_t *stamps; // When each write or publish was made
+  uint64_t *latencies;            // From the write or publish to its notification
+  atomic_size_t num_latencies;
+  atomic_size_t deletes; // Notifications of the delete of the key
+  atomic_bool stop;
+} StampReader;
+
+// Takes the notifications in the data read from the [i]th FIFO.
+static void take_stamps(StampReader *reader, size_t i, uint64_t now) {
+  char *data = reader->pending[i];
+  size_t offset = 0, len = reader->pending_len[i];
+  FrameHeader header;
+  Field fields[2];
+  while (len - offset >= sizeof(header)) {
+    memcpy(&header, data + offset, sizeof(header));
+    if (len - offset < sizeof(header) + header.len) {
+      break;
+    }
+    if (frame_decode(&header, data + offset + sizeof(header), fields, 2) == 0 &&
+        header.count == 2) {
+      if (fields[1].data == NULL) {
+        atomic_fetch_add(&reader->deletes, 1);
+      } else {
+        // The value isn't '\0' terminated
+        size_t stamp = 0;
+        for (size_t c = 0; c < fields[1].len; c++) {
+          stamp = stamp * 10 + (size_t)(fields[1].data[c] - '0');
+        }
+        size_t n = atomic_load(&reader->num_latencies);
+        reader->latencies[n] = now - atomic_load(&reader->stamps[stamp]);
+        atomic_store(&reader->num_latencies, n + 1);
+      }
+    }
+    offset += sizeof(header) + header.len;
+  }
+  memmove(data, data + offset, len - offset);
+  reader->pending_len[i] = len - offset;
+}
+
+static void *stamp_reader(void *arg) {
+  StampReader *reader = arg;
+  while (!atomic_load(&reader->stop)) {
+    if (poll(reader->fds, reader->num_fds, 10) <= 0) {
+      continue;
+    }
+    uint64_t now = now_ns();
+    for (size_t i = 0; i < reader->num_fds; i++) {
+      ssize_t count;
+      while ((reader->fds[i].revents & POLLIN) &&
+             (count = read(reader->fds[i].fd, reader->pending[i] + reader->pending_len[i],
+                           MAX_FRAME_SIZE - reader->pending_len[i])) > 0) {
+        reader->pending_len[i] += (size_t)count;
+        take_stamps(reader, i, now);
+      }
+    }
+  }
+  return NULL;
+}
+
+// Writes a hot key [num_writes] times at 100k writes/s, with
+// [num_subscribers] sessions subscribed to it and changes gathered for
+// [window_ms], then deletes it, and prints how many notifications each
+// subscriber got and how long after the write they carry. With no
+// subscribers it only times the writes.
+static int run_changes(unsigned int window_ms, size_t num_subscribers, size_t num_writes,
+                       FILE *report) {
+  char dir[] = "/tmp/kvs_bench_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("Failed to create FIFO directory");
+    return 1;
+  }
+  kvs_change_window(window_ms);
+  if (kvs_init() || sessions_multiplex(2)) {
+    fprintf(report, "Failed to start the KVS\n");
+    return 1;
+  }
+
+  StampReader reader = {.num_fds = num_subscribers};
+  reader.fds = calloc(num_subscribers + 1, sizeof(struct pollfd));
+  reader.pending = calloc(num_subscribers + 1, MAX_FRAME_SIZE);
+  reader.pending_len = calloc(num_subscribers + 1, sizeof(size_t));
+  reader.latencies = malloc((num_subscribers * num_writes + 1) * sizeof(uint64_t));
+  _Atomic uint64_t *written = calloc(num_writes, sizeof(uint64_t));
+  reader.stamps = written;
+  int failed = reader.fds == NULL || reader.pending == NULL || reader.pending_len == NULL ||
+               reader.latencies == NULL || written == NULL;
+  for (size_t i = 0; i < num_subscribers && !failed; i++) {
+    int notification_fd = open_subscriber(dir, i, "hot");
+    failed = notification_fd == -1;
+    reader.fds[i] = (struct pollfd){notification_fd, POLLIN, 0};
+  }
+  atomic_init(&reader.num_latencies, 0);
+  atomic_init(&reader.deletes, 0);
+  atomic_init(&reader.stop, false);
+  if (!failed && pthread_create(&reader.thread, NULL, stamp_reader, &reader) != 0) {
+    failed = 1;
+  }
+
+  // Yields while waiting for the next write, so the notifications are sent
+  // and read between writes even on a single CPU
+  Slice key = {"hot", strlen("hot")};
+  char value[MAX_STRING_SIZE];
+  uint64_t writing = 0;
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < num_writes && !failed; i++) {
+    while (now_ns() < start + i * CHANGE_INTERVAL_NS) {
+      sched_yield();
+    }
+    Slice slice = {value, (size_t)snprintf(value, sizeof(value), "%zu", i)};
+    uint64_t write_start = now_ns();
+    atomic_store(&written[i], write_start);
+    failed = kvs_write(1, &key, &slice) != 0;
+    writing += now_ns() - write_start;
+  }
+  OutputBuffer out;
+  output_init(&out, STDOUT_FILENO);
+  failed = failed || kvs_delete(1, &key, &out) != 0;
+  output_flush(&out);
+
+  // The delete is the last notification of every subscriber
+  uint64_t deadline = now_ns() + 2000000000ULL + (uint64_t)window_ms * 1000000;
+  while (!failed && atomic_load(&reader.deletes) < num_subscribers && now_ns() < deadline) {
+    struct timespec pause = {0, 1000000};
+    nanosleep(&pause, NULL);
+  }
+  if (!failed) {
+    atomic_store(&reader.stop, true);
+    pthread_join(reader.thread, NULL);
+  }
+  failed = failed || atomic_load(&reader.deletes) != num_subscribers;
+
+  NotificationStats stats;
+  notifications_stats(&stats);
+  if (num_subscribers == 0) {
+    fprintf(report, "%10s ", "none");
+  } else {
+    fprintf(report, "%10u ", window_ms);
+  }
+  if (failed) {
+    fprintf(report, "failed\n");
+  } else if (num_subscribers == 0) {
+    fprintf(report, "%10.1f\n", (double)writing / (double)num_writes);
+  } else {
+    size_t count = atomic_load(&reader.num_latencies);
+    qsort(reader.latencies, count, sizeof(uint64_t), compare_latencies);
+    fprintf(report, "%10.1f %14.1f %12.1f %10.1f %10.1f %10.1f %10zu\n",
+            (double)writing / (double)num_writes, (double)count / (double)num_subscribers,
+            (double)(num_writes * num_subscribers) / (double)(count > 0 ? count : 1),
+            count > 0 ? (double)reader.latencies[count / 2] / 1e3 : 0.0,
+            count > 0 ? (double)reader.latencies[count * 99 / 100] / 1e3 : 0.0,
+            count > 0 ? (double)reader.latencies[count - 1] / 1e3 : 0.0, stats.dropped);
+  }
+  remove_subscribers(dir, num_subscribers);
+  free(reader.fds);
+  free(reader.pending);
+  free(reader.pending_len);
+  free(reader.latencies);
+  free(written);
+  return failed;
+}
+
+// Writes a hot key [num_writes] times with [num_subscribers] subscribers,
+// with each change window, after timing the writes with no subscribers.
+// Each run is a process of its own, so the counters start from zero.
+int bench_changes(int argc, char **argv) {
+  size_t num_subscribers = arg_or(argc, argv, 0, 16);
+  size_t num_writes = arg_or(argc, argv, 1, 20000);
+
+  FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+  int null_fd = open("/dev/null", O_WRONLY);
+  if (report == NULL || null_fd == -1) {
+    return 1;
+  }
+  fprintf(report, "%zu subscribers of a key written %zu times at %d writes/s, then deleted\n",
+          num_subscribers, num_writes, 1000000000 / CHANGE_INTERVAL_NS);
+  fprintf(report, "%10s %10s %14s %12s %10s %10s %10s %10s\n", "window ms", "write ns",
+          "notifications", "writes/notif", "p50 us", "p99 us", "max us", "dropped");
+  fflush(report);
+  int result = 0;
+  unsigned int windows[CHANGE_WINDOWS] = {0, 1, CHANGE_WINDOW_MS, 20};
+  for (size_t w = 0; w <= CHANGE_WINDOWS && result == 0; w++) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      dup2(null_fd, STDOUT_FILENO);
+      // The first run has no subscribers
+      int failed = w == 0 ? run_changes(0, 0, num_writes, report)
+                          : run_changes(windows[w - 1], num_subscribers, num_writes, report);
+      fflush(report);
+      _exit(failed);
+    }
+    int status;
+    result = pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+             WEXITSTATUS(status) != 0;
+  }
+  close(null_fd);
+  fclose(report);
+  return result;
+}
+
+#define BATCH_RUNS 5         // Runs of bench batching, with a batch size and deadline each
+#define BATCH_CAPACITY 1024  // Notifications queued per subscriber in bench batching
+#define BATCH_BURST 16       // Messages published between sleeps in bench batching
+
+// Publishes [num_publishes] messages at [rate] messages/s to
+// [num_subscribers] subscribers of a key, with notifications written in
+// batches of [batch_size] waiting up to [deadline_us], and prints the
+// writes and CPU time each notification took and how long after the
+// publish it was read.
+static int run_batching(size_t batch_size, unsigned int deadline_us, size_t num_subscribers,
+                        size_t num_publishes, size_t rate, FILE *report) {
+  char dir[] = "/tmp/kvs_bench_XXXXXX";
+  if (mkdtemp(dir) == NULL) {
+    perror("Failed to create FIFO directory");
+    return 1;
+  }
+  notifications_configure(BATCH_CAPACITY, OVERFLOW_DROP_OLDEST, 0);
+  notifications_batching(batch_size, deadline_us);
+  if (sessions_multiplex(2)) {
+    fprintf(report, "Failed to start session threads\n");
+    return 1;
+  }
+
+  StampReader reader = {.num_fds = num_subscribers};
+  reader.fds = calloc(num_subscribers, sizeof(struct pollfd));
+  reader.pending = calloc(num_subscribers, MAX_FRAME_SIZE);
+  reader.pending_len = calloc(num_subscribers, sizeof(size_t));
+  reader.latencies = malloc(num_subscribers * num_publishes * sizeof(uint64_t));
+  _Atomic uint64_t *published = calloc(num_publishes, sizeof(uint64_t));
+  reader.stamps = published;
+  int failed = reader.fds == NULL || reader.pending == NULL || reader.pending_len == NULL ||
+               reader.latencies == NULL || published == NULL;
+  for (size_t i = 0; i < num_subscribers && !failed; i++) {
+    int notification_fd = open_subscriber(dir, i, "bench");
+    failed = notification_fd == -1;
+    reader.fds[i] = (struct pollfd){notification_fd, POLLIN, 0};
+  }
+  atomic_init(&reader.num_latencies, 0);
+  atomic_init(&reader.deletes, 0);
+  atomic_init(&reader.stop, false);
+  if (!failed && pthread_create(&reader.thread, NULL, stamp_reader, &reader) != 0) {
+    failed = 1;
+  }
+
+  struct rusage usage_start, usage_end;
+  getrusage(RUSAGE_SELF, &usage_start);
+  uint64_t interval = 1000000000ULL / rate;
+  char message[MAX_STRING_SIZE];
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < num_publishes && !failed; i++) {
+    // Sleeps between bursts instead of spinning, so the CPU time is only
+    // that of publishing and delivering
+    if (i % BATCH_BURST == 0) {
+      uint64_t next = start + i * interval;
+      struct timespec until = {(time_t)(next / 1000000000), (long)(next % 1000000000)};
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR) {
+      }
+    }
+    snprintf(message, sizeof(message), "%zu", i);
+    atomic_store(&published[i], now_ns());
+    publish_message("bench", message, -1);
+  }
+
+  // Every notification not dropped is read
+  NotificationStats stats;
+  uint64_t deadline = now_ns() + 5000000000ULL;
+  do {
+    struct timespec pause = {0, 1000000};
+    nanosleep(&pause, NULL);
+    notifications_stats(&stats);
+  } while (!failed && atomic_load(&reader.num_latencies) + stats.dropped <
+                          num_subscribers * num_publishes &&
+           now_ns() < deadline);
+  uint64_t elapsed = now_ns() - start;
+  getrusage(RUSAGE_SELF, &usage_end);
+  if (!failed) {
+    atomic_store(&reader.stop, true);
+    pthread_join(reader.thread, NULL);
+  }
+
+  fprintf(report, "%8zu %10u ", batch_size, deadline_us);
+  size_t count = atomic_load(&reader.num_latencies);
+  if (failed || count == 0) {
+    fprintf(report, "failed\n");
+  } else {
+    uint64_t cpu =
+        (uint64_t)(usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec +
+                   usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) * 1000000000ULL +
+        (uint64_t)(usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec +
+                   usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec) * 1000ULL;
+    qsort(reader.latencies, count, sizeof(uint64_t), compare_latencies);
+    fprintf(report, "%12.0f %12.3f %12.0f %10.1f %10.1f %10zu\n",
+            (double)count * 1e9 / (double)elapsed,
+            (double)stats.batches / (double)(stats.sent > 0 ? stats.sent : 1),
+            (double)cpu / (double)count, (double)reader.latencies[count / 2] / 1e3,
+            (double)reader.latencies[count * 99 / 100] / 1e3, stats.dropped);
+  }
+  remove_subscribers(dir, num_subscribers);
+  free(reader.fds);
+  free(reader.pending);
+  free(reader.pending_len);
+  free(reader.latencies);
+  free(published);
+  return failed;
+}
+
+// Publishes to [num_subscribers] subscribers of a key with each batch size
+// and deadline, from one write per notification to the largest batches.
+// Each run is a process of its own, so the counters start from zero.
+int bench_batching(int argc, char **argv) {
+  size_t num_subscribers = arg_or(argc, argv, 0, 16);
+  size_t num_publishes = arg_or(argc, argv, 1, 50000);
+  size_t rate = arg_or(argc, argv, 2, 50000);
+
+  FILE *report = fdopen(dup(STDOUT_FILENO), "w");
+  int null_fd = open("/dev/null", O_WRONLY);
+  if (report == NULL || null_fd == -1) {
+    return 1;
+  }
+  fprintf(report, "%zu subscribers, %zu messages at %zu messages/s, %d notifications queued each\n",
+          num_subscribers, num_publishes, rate, BATCH_CAPACITY);
+  fprintf(report, "%8s %10s %12s %12s %12s %10s %10s %10s\n", "batch", "deadline us",
+          "notif/s", "writes/notif", "cpu ns/notif", "p50 us", "p99 us", "dropped");
+  fflush(report);
+  size_t batches[BATCH_RUNS] = {1, NOTIFY_BATCH, NOTIFY_BATCH, NOTIFY_BATCH, NOTIFY_BATCH_MAX};
+  unsigned int deadlines[BATCH_RUNS] = {0, 0, 200, 1000, 1000};
+  int result = 0;
+  for (size_t r = 0; r < BATCH_RUNS && result == 0; r++) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+      dup2(null_fd, STDOUT_FILENO);
+      int failed =
+          run_batching(batches[r], deadlines[r], num_subscribers, num_publishes, rate, report);
+      fflush(report);
+      _exit(failed);
+    }
+    int status;
+    result = pid == -1 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+             WEXITSTATUS(status) != 0;
+  }
+  close(null_fd);
+  fclose(report);
+  return result;
+}
@@ -0,0 +1,324 @@
+#include <fnmatch.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "src/server/operations.h"
+#include "src/server/subscriptions.h"
+
+#define KEYS_PER_SESSION 100 // Subscriptions of each session
+#define LIST_SAMPLE 1000     // Operations timed on the list, which are slow
+#define PATTERN_COUNTS 3     // Runs of bench patterns, with 10, 1k and [num_patterns] patterns
+
+// The registry this replaced: one list of every subscription, searched with
+// strcmp by every operation.
+typedef struct ListSubscription {
+  char key[MAX_KEY_LENGTH];
+  int fd;
+  struct ListSubscription *next;
+} ListSubscription;
+
+static int list_subscribe(ListSubscription **list, int fd, const char *key) {
+  for (ListSubscription *current = *list; current != NULL; current = current->next) {
+    if (strcmp(current->key, key) == 0 && current->fd == fd) {
+      return 1;
+    }
+  }
+  ListSubscription *subscription = malloc(sizeof(ListSubscription));
+  if (subscription == NULL) {
+    return -1;
+  }
+  strncpy(subscription->key, key, MAX_KEY_LENGTH);
+  subscription->fd = fd;
+  subscription->next = *list;
+  *list = subscription;
+  return 0;
+}
+
+static size_t list_publish(ListSubscription *list, const char *key) {
+  size_t visited = 0;
+  for (ListSubscription *current = list; current != NULL; current = current->next) {
+    visited += strcmp(current->key, key) == 0;
+  }
+  return visited;
+}
+
+static void list_unsubscribe_all(ListSubscription **list, int fd) {
+  ListSubscription **current = list;
+  while (*current != NULL) {
+    if ((*current)->fd == fd) {
+      ListSubscription *to_remove = *current;
+      *current = to_remove->next;
+      free(to_remove);
+    } else {
+      current = &(*current)->next;
+    }
+  }
+}
+
+// Key of the [j]th subscription of session [i]: every session subscribes
+// to KEYS_PER_SESSION consecutive keys, so every key ends up with the same
+// number of subscribers.
+static void subscription_key(char *key, size_t i, size_t j, size_t num_keys) {
+  snprintf(key, MAX_KEY_LENGTH, "key%06zu", (i * KEYS_PER_SESSION + j) % num_keys);
+}
+
+static void print_row(const char *registry, const char *operation, size_t count,
+                      uint64_t elapsed) {
+  printf("%10s %16s %10zu %12.1f\n", registry, operation, count,
+         (double)elapsed / (double)count);
+}
+
+// Subscribes [num_sessions] sessions to KEYS_PER_SESSION keys each, then
+// publishes to every key and ends every session, through the table.
+static int run_table(size_t num_sessions, size_t num_keys) {
+  SubscriptionTable *table = create_subscription_table();
+  Session *sessions = calloc(num_sessions, sizeof(Session));
+  if (table == NULL || sessions == NULL) {
+    fprintf(stderr, "Failed to allocate the sessions\n");
+    free(sessions);
+    if (table != NULL) {
+      free_subscription_table(table);
+    }
+    return 1;
+  }
+  char key[MAX_KEY_LENGTH];
+  int failed = 0;
+
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < num_sessions && !failed; i++) {
+    for (size_t j = 0; j < KEYS_PER_SESSION && !failed; j++) {
+      subscription_key(key, i, j, num_keys);
+      failed = table_subscribe(table, &sessions[i].subscriptions, &sessions[i], key) != 0;
+    }
+  }
+  print_row("table", "subscribe", num_sessions * KEYS_PER_SESSION, now_ns() - start);
+
+  size_t visited = 0;
+  start = now_ns();
+  for (size_t k = 0; k < num_keys; k++) {
+    snprintf(key, sizeof(key), "key%06zu", k);
+    for (Subscription *s = table_subscribers(table, key); s != NULL; s = s->next_subscriber) {
+      visited++;
+    }
+  }
+  print_row("table", "publish", num_keys, now_ns() - start);
+  failed = failed || visited != table->num_subscriptions;
+
+  start = now_ns();
+  for (size_t i = 0; i < num_sessions; i++) {
+    table_unsubscribe_all(table, &sessions[i].subscriptions);
+  }
+  print_row("table", "unsubscribe_all", num_sessions, now_ns() - start);
+  failed = failed || table->num_topics != 0 || table->num_subscriptions != 0;
+
+  free_subscription_table(table);
+  free(sessions);
+  if (failed) {
+    fprintf(stderr, "Subscription table lost track of a subscription\n");
+  }
+  return failed;
+}
+
+// Same as run_table through the list, timing only LIST_SAMPLE operations of
+// each kind: subscribing every session through it takes quadratic time.
+static int run_list(size_t num_sessions, size_t num_keys) {
+  ListSubscription *list = NULL;
+  char key[MAX_KEY_LENGTH];
+  size_t total = num_sessions * KEYS_PER_SESSION;
+  size_t sample = total < LIST_SAMPLE ? total : LIST_SAMPLE;
+
+  // The first subscriptions are pushed without checking for duplicates
+  for (size_t n = 0; n < total - sample; n++) {
+    ListSubscription *subscription = malloc(sizeof(ListSubscription));
+    if (subscription == NULL) {
+      fprintf(stderr, "Failed to allocate the subscriptions\n");
+      return 1;
+    }
+    subscription_key(subscription->key, n / KEYS_PER_SESSION, n % KEYS_PER_SESSION, num_keys);
+    subscription->fd = (int)(n / KEYS_PER_SESSION);
+    subscription->next = list;
+    list = subscription;
+  }
+  int failed = 0;
+  uint64_t start = now_ns();
+  for (size_t n = total - sample; n < total && !failed; n++) {
+    subscription_key(key, n / KEYS_PER_SESSION, n % KEYS_PER_SESSION, num_keys);
+    failed = list_subscribe(&list, (int)(n / KEYS_PER_SESSION), key) != 0;
+  }
+  print_row("list", "subscribe", sample, now_ns() - start);
+
+  size_t publishes = num_keys < LIST_SAMPLE ? num_keys : LIST_SAMPLE;
+  size_t visited = 0;
+  start = now_ns();
+  for (size_t k = 0; k < publishes; k++) {
+    snprintf(key, sizeof(key), "key%06zu", k);
+    visited += list_publish(list, key);
+  }
+  print_row("list", "publish", publishes, now_ns() - start);
+  failed = failed || visited != publishes * total / num_keys;
+
+  size_t ends = num_sessions < LIST_SAMPLE / 10 ? num_sessions : LIST_SAMPLE / 10;
+  start = now_ns();
+  for (size_t i = 0; i < ends; i++) {
+    list_unsubscribe_all(&list, (int)i);
+  }
+  print_row("list", "unsubscribe_all", ends, now_ns() - start);
+
+  while (list != NULL) {
+    ListSubscription *next = list->next;
+    free(list);
+    list = next;
+  }
+  if (failed) {
+    fprintf(stderr, "Subscription list lost track of a subscription\n");
+  }
+  return failed;
+}
+
+int bench_subscriptions(int argc, char **argv) {
+  size_t num_subscriptions = arg_or(argc, argv, 0, 100000);
+  size_t num_keys = arg_or(argc, argv, 1, 10000);
+  size_t num_sessions = num_subscriptions / KEYS_PER_SESSION;
+  if (num_sessions == 0 || num_keys < KEYS_PER_SESSION ||
+      num_sessions * KEYS_PER_SESSION % num_keys != 0) {
+    fprintf(stderr, "Subscriptions must be a multiple of %d and of the keys, and keys at least %d\n",
+            KEYS_PER_SESSION, KEYS_PER_SESSION);
+    return 1;
+  }
+
+  printf("%zu sessions, %zu subscriptions over %zu keys\n", num_sessions,
+         num_sessions * KEYS_PER_SESSION, num_keys);
+  printf("%10s %16s %10s %12s\n", "registry", "operation", "count", "ns/op");
+  return run_table(num_sessions, num_keys) || run_list(num_sessions, num_keys);
+}
+
+static void count_subscription(Subscription *subscription, void *arg) {
+  (void)subscription;
+  (*(size_t *)arg)++;
+}
+
+// Pattern [i] of a run: every other one a prefix, the rest globs matching
+// the keys of the prefix that end in 9.
+static void pattern_of(char *pattern, size_t i) {
+  snprintf(pattern, MAX_KEY_LENGTH, i % 2 == 0 ? "order_%05zu*" : "order_%05zu_*9", i);
+}
+
+static void print_pattern_row(size_t num_patterns, const char *registry, const char *operation,
+                              size_t count, uint64_t elapsed, size_t matched) {
+  printf("%10zu %10s %16s %10zu %12.1f %10.2f\n", num_patterns, registry, operation, count,
+         (double)elapsed / (double)count, (double)matched / (double)count);
+}
+
+// Subscribes a session to [num_keys] exact keys and another to
+// [num_patterns] patterns, then publishes to the exact keys and to keys
+// under the patterns through the table, and to the same keys by matching
+// every pattern in turn, as a registry without an index would.
+static int run_patterns(size_t num_patterns, size_t num_keys) {
+  SubscriptionTable *table = create_subscription_table();
+  char(*patterns)[MAX_KEY_LENGTH] = malloc(num_patterns * MAX_KEY_LENGTH);
+  Session sessions[2] = {0};
+  if (table == NULL || patterns == NULL) {
+    fprintf(stderr, "Failed to allocate the patterns\n");
+    free(patterns);
+    if (table != NULL) {
+      free_subscription_table(table);
+    }
+    return 1;
+  }
+  char key[MAX_KEY_LENGTH];
+  int failed = 0;
+  for (size_t k = 0; k < num_keys && !failed; k++) {
+    snprintf(key, sizeof(key), "key%06zu", k);
+    failed = table_subscribe(table, &sessions[0].subscriptions, &sessions[0], key) != 0;
+  }
+
+  // Exact keys start like no pattern, so they only look at the root
+  size_t matched = 0;
+  uint64_t start = now_ns();
+  for (size_t k = 0; k < num_keys; k++) {
+    snprintf(key, sizeof(key), "key%06zu", k);
+    table_match(table, key, strlen(key), count_subscription, &matched);
+  }
+  print_pattern_row(0, "table", "exact publish", num_keys, now_ns() - start, matched);
+  failed = failed || matched != num_keys;
+
+  for (size_t i = 0; i < num_patterns && !failed; i++) {
+    pattern_of(patterns[i], i);
+    failed = table_subscribe(table, &sessions[1].subscriptions, &sessions[1], patterns[i]) != 0;
+  }
+  matched = 0;
+  start = now_ns();
+  for (size_t k = 0; k < num_keys; k++) {
+    snprintf(key, sizeof(key), "key%06zu", k);
+    table_match(table, key, strlen(key), count_subscription, &matched);
+  }
+  print_pattern_row(num_patterns, "table", "exact publish", num_keys, now_ns() - start, matched);
+  failed = failed || matched != num_keys;
+
+  // Keys under random patterns, a tenth of which end in 9
+  uint64_t state = 88172645463325252ULL;
+  matched = 0;
+  start = now_ns();
+  for (size_t k = 0; k < num_keys; k++) {
+    snprintf(key, sizeof(key), "order_%05zu_%04zu", (size_t)(next_random(&state) % num_patterns),
+             k % 10000);
+    table_match(table, key, strlen(key), count_subscription, &matched);
+  }
+  print_pattern_row(num_patterns, "trie", "pattern publish", num_keys, now_ns() - start, matched);
+  size_t trie_matched = matched;
+
+  size_t sample = num_keys < LIST_SAMPLE ? num_keys : LIST_SAMPLE;
+  state = 88172645463325252ULL;
+  matched = 0;
+  start = now_ns();
+  for (size_t k = 0; k < sample; k++) {
+    snprintf(key, sizeof(key), "order_%05zu_%04zu", (size_t)(next_random(&state) % num_patterns),
+             k % 10000);
+    for (size_t i = 0; i < num_patterns; i++) {
+      matched += fnmatch(patterns[i], key, 0) == 0;
+    }
+  }
+  print_pattern_row(num_patterns, "scan", "pattern publish", sample, now_ns() - start, matched);
+
+  // Both registries match the same patterns for the keys both published
+  state = 88172645463325252ULL;
+  size_t checked = 0;
+  for (size_t k = 0; k < sample; k++) {
+    snprintf(key, sizeof(key), "order_%05zu_%04zu", (size_t)(next_random(&state) % num_patterns),
+             k % 10000);
+    table_match(table, key, strlen(key), count_subscription, &checked);
+  }
+  failed = failed || checked != matched || trie_matched < checked;
+
+  table_unsubscribe_all(table, &sessions[0].subscriptions);
+  table_unsubscribe_all(table, &sessions[1].subscriptions);
+  failed = failed || table->num_topics != 0 || table->num_patterns != 0 ||
+           table->patterns->num_children != 0;
+  free_subscription_table(table);
+  free(patterns);
+  if (failed) {
+    fprintf(stderr, "Pattern index lost track of a subscription\n");
+  }
+  return failed;
+}
+
+int bench_patterns(int argc, char **argv) {
+  size_t num_patterns = arg_or(argc, argv, 0, 10000);
+  size_t num_keys = arg_or(argc, argv, 1, 100000);
+  if (num_patterns < 1000) {
+    fprintf(stderr, "Needs at least 1000 patterns\n");
+    return 1;
+  }
+  printf("%zu exact subscriptions, then prefix and glob patterns\n", num_keys);
+  printf("%10s %10s %16s %10s %12s %10s\n", "patterns", "registry", "operation", "count",
+         "ns/op", "matched/op");
+  size_t counts[PATTERN_COUNTS] = {10, 1000, num_patterns};
+  for (size_t c = 0; c < PATTERN_COUNTS; c++) {
+    if (run_patterns(counts[c], num_keys)) {
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,129 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "src/server/constants.h"
+#include "src/server/wal.h"
+
+#define WAL_INTERVAL_MS 5 // Sync interval of the periodic policy
+
+// A thread appending WRITE records of single pairs and committing each one,
+// like a job of single pair WRITEs.
+typedef struct WalWriter {
+  pthread_t thread;
+  WriteAheadLog *wal;
+  size_t id;
+  size_t num_writes;
+  uint64_t *latencies; // Nanoseconds of each append and commit
+} WalWriter;
+
+static void *wal_writer(void *arg) {
+  WalWriter *writer = arg;
+  char key[MAX_STRING_SIZE], value[MAX_STRING_SIZE];
+  for (size_t i = 0; i < writer->num_writes; i++) {
+    Slice key_slice = {key, (size_t)snprintf(key, sizeof(key), "key_%zu_%zu", writer->id, i)};
+    Slice value_slice = {value, (size_t)snprintf(value, sizeof(value), "value_%zu", i)};
+    uint64_t start = now_ns();
+    uint64_t lsn = wal_append(writer->wal, WAL_WRITE, 1, &key_slice, &value_slice);
+    wal_commit(writer->wal, lsn);
+    writer->latencies[i] = now_ns() - start;
+  }
+  return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void count_pair(const Slice *key, const Slice *value, void *arg) {
+  (void)key;
+  (void)value;
+  (*(size_t *)arg)++;
+}
+
+// Appends [num_writes] single pair WRITE records from 1 to [max_threads]
+// threads with each sync policy, and reports the throughput, the commit
+// latency and how many records each sync covered. Then replays the log.
+int bench_wal(int argc, char **argv) {
+  size_t num_writes = arg_or(argc, argv, 0, 20000);
+  size_t max_threads = arg_or(argc, argv, 1, 8);
+  const struct {
+    const char *name;
+    enum WalSync sync;
+  } policies[] = {
+      {"always", WAL_SYNC_ALWAYS}, {"periodic", WAL_SYNC_PERIODIC}, {"never", WAL_SYNC_NEVER}};
+
+  char path[] = "/tmp/kvs_bench_wal_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd == -1) {
+    perror("Failed to create log");
+    return 1;
+  }
+  close(fd);
+
+  uint64_t *latencies = malloc(num_writes * sizeof(uint64_t));
+  WalWriter *writers = malloc(max_threads * sizeof(WalWriter));
+  if (latencies == NULL || writers == NULL) {
+    free(latencies);
+    free(writers);
+    unlink(path);
+    return 1;
+  }
+
+  printf("%9s %8s %12s %10s %10s %14s\n", "policy", "threads", "writes/s", "p50 us", "p99 us",
+         "records/sync");
+  for (size_t p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+    for (size_t threads = 1; threads <= max_threads; threads *= 2) {
+      WriteAheadLog *wal = wal_open(path, policies[p].sync, WAL_INTERVAL_MS, true);
+      if (wal == NULL) {
+        fprintf(stderr, "Failed to open log\n");
+        free(latencies);
+        free(writers);
+        unlink(path);
+        return 1;
+      }
+
+      size_t per_thread = num_writes / threads;
+      uint64_t start = now_ns();
+      for (size_t i = 0; i < threads; i++) {
+        writers[i] = (WalWriter){0, wal, i, per_thread, latencies + i * per_thread};
+        pthread_create(&writers[i].thread, NULL, wal_writer, &writers[i]);
+      }
+      for (size_t i = 0; i < threads; i++) {
+        pthread_join(writers[i].thread, NULL);
+      }
+      uint64_t elapsed = now_ns() - start;
+      WalStats stats;
+      wal_stats(wal, &stats);
+      wal_close(wal);
+
+      size_t total = per_thread * threads;
+      qsort(latencies, total, sizeof(uint64_t), compare_u64);
+      printf("%9s %8zu %12.0f %10.1f %10.1f ", policies[p].name, threads,
+             (double)total * 1e9 / (double)elapsed, (double)latencies[total / 2] / 1e3,
+             (double)latencies[total * 99 / 100] / 1e3);
+      // Short periodic runs end before their first sync, "never" doesn't sync
+      if (stats.syncs > 0) {
+        printf("%14.1f\n", (double)stats.records / (double)stats.syncs);
+      } else {
+        printf("%14s\n", "-");
+      }
+    }
+  }
+
+  // The log of the last run is left in the file
+  size_t replayed = 0;
+  uint64_t start = now_ns();
+  wal_replay(path, NULL, count_pair, &replayed);
+  double ms = (double)(now_ns() - start) / 1e6;
+  printf("replayed %zu records in %.1f ms\n", replayed, ms);
+
+  free(latencies);
+  free(writers);
+  unlink(path);
+  return 0;
+}
@@ -1,67 +1,135 @@
 #include "api.h"
 #include "src/common/constants.h"
+#include "src/common/io.h"
 #include "src/common/protocol.h"
+#include <errno.h>       // Para errno
 #include <fcntl.h>       // Para open
 #include <unistd.h>      // Para close, unlink
 #include <sys/stat.h>    // Para mkfifo
-#include <stdio.h>       // Para perror, fprintf, snprintf
+#include <stdio.h>       // Para perror, fprintf
 #include <stdlib.h>      // Para exit, malloc
-#include <string.h>      // Para strlen, strncpy
+#include <string.h>      // Para strlen, strcpy
 
 static int request_fd = -1;
 static int response_fd = -1;
 static int notification_fd = -1;
 
-int kvs_connect(char const* req_pipe_path, char const* resp_pipe_path, char const* server_pipe_path,
-                char const* notif_pipe_path, int* notif_pipe) {
-    // Criar FIFOs locais para pedidos, respostas e notificações
-    if (mkfifo(req_pipe_path, 0666) == -1 || mkfifo(resp_pipe_path, 0666) == -1 || mkfifo(notif_pipe_path, 0666) == -1) {
-        perror("Failed to create FIFOs");
+// Caminhos dos FIFOs, para os remover ao desligar
+static char request_path[MAX_PIPE_PATH_LENGTH];
+static char response_path[MAX_PIPE_PATH_LENGTH];
+static char notification_path[MAX_PIPE_PATH_LENGTH];
+
+// Encodes a frame and writes it at once.
+// @return 0 if successful, 1 otherwise.
+static int frame_write(int fd, uint8_t op_code, size_t count, const Field* fields) {
+    char frame[MAX_FRAME_SIZE];
+    size_t len = frame_encode(frame, sizeof(frame), op_code, 0, count, fields);
+    return len == 0 || write_all(fd, frame, len) != 1;
+}
+
+// Reads a frame, its payload into payload.
+// @return 0 if successful, 1 otherwise.
+static int frame_read(int fd, FrameHeader* header, char* payload) {
+    if (read_all(fd, header, sizeof(*header), NULL) != 1 || header->len > MAX_FRAME_PAYLOAD) {
         return 1;
     }
+    return header->len > 0 && read_all(fd, payload, header->len, NULL) != 1;
+}
 
-    // Abrir FIFOs
-    request_fd = open(req_pipe_path, O_WRONLY);
-    response_fd = open(resp_pipe_path, O_RDONLY | O_NONBLOCK);
-    notification_fd = open(notif_pipe_path, O_RDONLY | O_NONBLOCK);
+// Sends a request and waits for its response.
+// @return The status of the response, or STATUS_ERROR if it could not be sent
+// or received.
+static int request(uint8_t op_code, size_t count, const Field* fields) {
+    if (request_fd == -1 || response_fd == -1) {
+        fprintf(stderr, "No active connection\n");
+        return STATUS_ERROR;
+    }
+    if (frame_write(request_fd, op_code, count, fields) != 0) {
+        perror("Failed to send request");
+        return STATUS_ERROR;
+    }
 
-    if (request_fd == -1 || response_fd == -1 || notification_fd == -1) {
-        perror("Failed to open FIFOs");
+    FrameHeader header;
+    char payload[MAX_FRAME_PAYLOAD];
+    if (frame_read(response_fd, &header, payload) != 0 || header.op_code != op_code) {
+        fprintf(stderr, "Failed to read response\n");
+        return STATUS_ERROR;
+    }
+    return header.status;
+}
+
+// Creates a FIFO, replacing one left by a previous client.
+static int create_fifo(char* path, char const* pipe_path) {
+    if (strlen(pipe_path) >= MAX_PIPE_PATH_LENGTH) {
+        fprintf(stderr, "FIFO path too long: %s\n", pipe_path);
+        return 1;
+    }
+    strcpy(path, pipe_path);
+    if (unlink(path) == -1 && errno != ENOENT) {
+        perror("Failed to remove old FIFO");
+        return 1;
+    }
+    if (mkfifo(path, 0666) == -1) {
+        perror("Failed to create FIFOs");
+        return 1;
+    }
+    return 0;
+}
+
+int kvs_connect(char const* req_pipe_path, char const* resp_pipe_path, char const* server_pipe_path,
+                char const* notif_pipe_path, int* notif_pipe) {
+    // Criar FIFOs locais para pedidos, respostas e notificações
+    if (create_fifo(request_path, req_pipe_path) != 0 ||
+        create_fifo(response_path, resp_pipe_path) != 0 ||
+        create_fifo(notification_path, notif_pipe_path) != 0) {
         return 1;
     }
 
-    // Enviar mensagem de conexão para o servidor
+    // Enviar mensagem de conexão para o servidor, antes de abrir os FIFOs,
+    // cuja abertura bloqueia até o servidor os abrir também
     int server_fd = open(server_pipe_path, O_WRONLY);
     if (server_fd == -1) {
         perror("Failed to open server FIFO");
         return 1;
     }
 
-    char message[128];
-    snprintf(message, sizeof(message), "CONNECT|%s|%s|%s", req_pipe_path, resp_pipe_path, notif_pipe_path);
-
-    if (write(server_fd, message, strlen(message)) == -1) {
+    Field fields[] = {{req_pipe_path, strlen(req_pipe_path)},
+                      {resp_pipe_path, strlen(resp_pipe_path)},
+                      {notif_pipe_path, strlen(notif_pipe_path)}};
+    if (frame_write(server_fd, OP_CODE_CONNECT, 3, fields) != 0) {
         perror("Failed to send connect message");
         close(server_fd);
         return 1;
     }
-
     close(server_fd);
+
+    // Abrir FIFOs
+    request_fd = open(req_pipe_path, O_WRONLY);
+    response_fd = open(resp_pipe_path, O_RDONLY);
+    notification_fd = open(notif_pipe_path, O_RDONLY | O_NONBLOCK);
+
+    if (request_fd == -1 || response_fd == -1 || notification_fd == -1) {
+        perror("Failed to open FIFOs");
+        return 1;
+    }
+
+    // O servidor responde ao CONNECT depois de abrir a sessão
+    FrameHeader header;
+    char payload[MAX_FRAME_PAYLOAD];
+    if (frame_read(response_fd, &header, payload) != 0 || header.op_code != OP_CODE_CONNECT ||
+        header.status != STATUS_OK) {
+        fprintf(stderr, "Server refused the connection\n");
+        return 1;
+    }
+
     *notif_pipe = notification_fd;
     return 0;
 }
 
 int kvs_disconnect(void) {
-    if (request_fd == -1 || response_fd == -1) {
-        fprintf(stderr, "No active connection\n");
-        return 1;
-    }
-
     // Enviar mensagem de desconexão
-    char message[128] = "DISCONNECT";
-
-    if (write(request_fd, message, strlen(message)) == -1) {
-        perror("Failed to send disconnect message");
+    if (request(OP_CODE_DISCONNECT, 0, NULL) != STATUS_OK) {
+        fprintf(stderr, "Failed to send disconnect message\n");
         return 1;
     }
 
@@ -72,43 +140,19 @@ int kvs_disconnect(void) {
 
     request_fd = response_fd = notification_fd = -1;
 
-    unlink("/tmp/req");
-    unlink("/tmp/resp");
-    unlink("/tmp/notif");
+    unlink(request_path);
+    unlink(response_path);
+    unlink(notification_path);
 
     return 0;
 }
 
 int kvs_subscribe(const char* key) {
-    if (request_fd == -1 || response_fd == -1) {
-        fprintf(stderr, "No active connection\n");
-        return 1;
-    }
-
-    char message[128];
-    snprintf(message, sizeof(message), "SUBSCRIBE|%s", key);
-
-    if (write(request_fd, message, strlen(message)) == -1) {
-        perror("Failed to send subscribe message");
-        return 1;
-    }
-
-    return 0;
+    Field field = {key, strlen(key)};
+    return request(OP_CODE_SUBSCRIBE, 1, &field) != STATUS_OK;
 }
 
 int kvs_unsubscribe(const char* key) {
-    if (request_fd == -1 || response_fd == -1) {
-        fprintf(stderr, "No active connection\n");
-        return 1;
-    }
-
-    char message[128];
-    snprintf(message, sizeof(message), "UNSUBSCRIBE|%s", key);
-
-    if (write(request_fd, message, strlen(message)) == -1) {
-        perror("Failed to send unsubscribe message");
-        return 1;
-    }
-
-    return 0;
+    Field field = {key, strlen(key)};
+    return request(OP_CODE_UNSUBSCRIBE, 1, &field) != STATUS_OK;
 }
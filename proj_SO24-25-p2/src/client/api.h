@@ -8,6 +8,8 @@
 /// @param req_pipe_path Path to the name pipe to be created for requests.
 /// @param resp_pipe_path Path to the name pipe to be created for responses.
 /// @param server_pipe_path Path to the name pipe where the server is listening.
+/// @param notif_pipe_path Path to the name pipe to be created for notifications.
+/// @param notif_pipe Set to the notification pipe, opened without blocking.
 /// @return 0 if the connection was established successfully, 1 otherwise.
 int kvs_connect(char const* req_pipe_path, char const* resp_pipe_path, char const* server_pipe_path,
                 char const* notif_pipe_path, int* notif_pipe);
@@ -17,7 +19,7 @@ int kvs_disconnect(void);
 
 /// Requests a subscription for a key
 /// @param key Key to be subscribed
-/// @return 1 if the key was subscribed successfully (key existing), 0 otherwise.
+/// @return 0 if the key was subscribed successfully, 1 otherwise.
 
 int kvs_subscribe(const char* key);
 
@@ -1,4 +1,6 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,7 +11,85 @@
 #include "src/client/api.h"
 #include "src/common/constants.h"
 #include "src/common/io.h"
+#include "src/common/protocol.h"
+
+// Written to stop the notifications thread
+static int stop_pipe[2];
+
+// Prints the notifications of a buffer, as (key,value) or (key,DELETED) for
+// a deleted key.
+// @return Bytes of the complete frames printed, -1 if a frame is malformed.
+static ssize_t print_notifications(const char *buffer, size_t len) {
+  size_t start = 0;
+  while (len - start >= sizeof(FrameHeader)) {
+    FrameHeader header;
+    memcpy(&header, buffer + start, sizeof(header));
+    if (header.len > MAX_FRAME_PAYLOAD) {
+      return -1;
+    }
+    if (len - start < sizeof(header) + header.len) {
+      break;
+    }
+    Field fields[2];
+    if (header.op_code != OP_CODE_NOTIFICATION || header.count != 2 ||
+        frame_decode(&header, buffer + start + sizeof(header), fields, 2) != 0 ||
+        fields[0].data == NULL) {
+      return -1;
+    }
+    if (fields[1].data != NULL) {
+      printf("(%.*s,%.*s)\n", (int)fields[0].len, fields[0].data, (int)fields[1].len,
+             fields[1].data);
+    } else {
+      printf("(%.*s,DELETED)\n", (int)fields[0].len, fields[0].data);
+    }
+    start += sizeof(header) + header.len;
+  }
+  return (ssize_t)start;
+}
+
+// Reads the notification pipe, without blocking, until the server closes it
+// or the stop pipe is written.
+static void *notifications_thread(void *arg) {
+  int notif_pipe = *(int *)arg;
+  char buffer[MAX_FRAME_SIZE];
+  size_t len = 0; // Bytes of a frame not yet complete
+  struct pollfd fds[2] = {{notif_pipe, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+
+  while (1) {
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Failed to wait for notifications");
+      return NULL;
+    }
+    if (fds[1].revents != 0) {
+      return NULL;
+    }
 
+    ssize_t count = read(notif_pipe, buffer + len, sizeof(buffer) - len);
+    if (count == 0) {
+      // The server ended the session
+      printf("Server closed the notifications\n");
+      return NULL;
+    } else if (count < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        continue;
+      }
+      perror("Failed to read notifications");
+      return NULL;
+    }
+    len += (size_t)count;
+
+    ssize_t printed = print_notifications(buffer, len);
+    if (printed < 0) {
+      fprintf(stderr, "Malformed notification\n");
+      return NULL;
+    }
+    len -= (size_t)printed;
+    memmove(buffer, buffer + printed, len);
+  }
+}
 
 int main(int argc, char* argv[]) {
   if (argc < 3) {
@@ -29,16 +109,32 @@ int main(int argc, char* argv[]) {
   strncat(resp_pipe_path, argv[1], strlen(argv[1]) * sizeof(char));
   strncat(notif_pipe_path, argv[1], strlen(argv[1]) * sizeof(char));
 
-  // TODO open pipes
+  int notif_pipe;
+  if (kvs_connect(req_pipe_path, resp_pipe_path, argv[2], notif_pipe_path, &notif_pipe) != 0) {
+    fprintf(stderr, "Failed to connect to the server\n");
+    return 1;
+  }
+
+  pthread_t notifications;
+  if (pipe(stop_pipe) != 0 ||
+      pthread_create(&notifications, NULL, notifications_thread, &notif_pipe) != 0) {
+    fprintf(stderr, "Failed to start reading notifications\n");
+    kvs_disconnect();
+    return 1;
+  }
 
   while (1) {
     switch (get_next(STDIN_FILENO)) {
       case CMD_DISCONNECT:
+        // The thread stops before kvs_disconnect closes the notification pipe
+        if (write(stop_pipe[1], "", 1) != 1) {
+          perror("Failed to stop reading notifications");
+        }
+        pthread_join(notifications, NULL);
         if (kvs_disconnect() != 0) {
           fprintf(stderr, "Failed to disconnect to the server\n");
           return 1;
         }
-        // TODO: end notifications thread
         printf("Disconnected from server\n");
         return 0;
 
@@ -0,0 +1,55 @@
+#include "protocol.h"
+
+#include <string.h>
+
+size_t frame_encode(char *buffer, size_t size, uint8_t op_code, uint8_t status, size_t count,
+                    const Field *fields) {
+  if (count > UINT16_MAX || size < sizeof(FrameHeader)) {
+    return 0;
+  }
+  size_t limit = size - sizeof(FrameHeader) < MAX_FRAME_PAYLOAD ? size - sizeof(FrameHeader)
+                                                                 : MAX_FRAME_PAYLOAD;
+  char *payload = buffer + sizeof(FrameHeader);
+  size_t len = 0;
+  for (size_t i = 0; i < count; i++) {
+    size_t field_len = fields[i].data != NULL ? fields[i].len : 0;
+    if (field_len >= FIELD_MISSING || limit - len < sizeof(uint16_t) + field_len) {
+      return 0;
+    }
+    uint16_t prefix = fields[i].data != NULL ? (uint16_t)field_len : FIELD_MISSING;
+    memcpy(payload + len, &prefix, sizeof(prefix));
+    memcpy(payload + len + sizeof(prefix), fields[i].data, field_len);
+    len += sizeof(prefix) + field_len;
+  }
+
+  FrameHeader header = {op_code, status, (uint16_t)count, (uint32_t)len};
+  memcpy(buffer, &header, sizeof(header));
+  return sizeof(header) + len;
+}
+
+int frame_decode(const FrameHeader *header, const char *payload, Field *fields,
+                 size_t max_fields) {
+  if (header->count > max_fields || header->len > MAX_FRAME_PAYLOAD) {
+    return 1;
+  }
+  size_t offset = 0;
+  for (size_t i = 0; i < header->count; i++) {
+    uint16_t prefix;
+    if (header->len - offset < sizeof(prefix)) {
+      return 1;
+    }
+    memcpy(&prefix, payload + offset, sizeof(prefix));
+    offset += sizeof(prefix);
+    if (prefix == FIELD_MISSING) {
+      fields[i] = (Field){NULL, 0};
+      continue;
+    }
+    if (header->len - offset < prefix) {
+      return 1;
+    }
+    fields[i] = (Field){payload + offset, prefix};
+    offset += prefix;
+  }
+  // Trailing bytes mean the count and the payload disagree
+  return offset != header->len;
+}
@@ -1,12 +1,93 @@
 #ifndef COMMON_PROTOCOL_H
 #define COMMON_PROTOCOL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+// Every message between client and server is a frame: a FrameHeader
+// followed by len bytes of payload. The payload is a sequence of count
+// fields, each a u16 length followed by that many bytes, without '\0'.
+// Integers are in host byte order, since both ends run on the same
+// machine. Frames are written with a single write, and no larger than
+// PIPE_BUF, so frames of different clients never interleave in a FIFO.
+//
+//   request                       fields              response fields
+//   CONNECT (register FIFO)       req, resp, notif    -
+//   DISCONNECT                    -                   -
+//   SUBSCRIBE / UNSUBSCRIBE       key                 -
+//   PUBLISH                       key, message        -
+//   READ                          key...              value... (FIELD_MISSING if absent)
+//   WRITE                         key, value...       -
+//
+// A response repeats the opcode of its request and carries a status. The
+// three FIFOs of a CONNECT must be distinct: the server writes responses
+// and notifications from different threads, so each goes to a FIFO of its
+// own. Subscribers get NOTIFICATION frames (key, message) on their
+// notification FIFO. The same frames
+// carry changes of the key: (key, value) when it is written and
+// (key, FIELD_MISSING) when it is deleted. A SUBSCRIBE key with '*' or '?'
+// is a pattern ('*' any characters, '?' any one), notified of the messages
+// and changes of every key it matches, with the key they come from.
+
 // Opcodes for client-server communication
 // estes opcodes sao usados num switch case para determinar o que fazer com a mensagem recebida no server
 // usam estes opcodes tambem nos clientes quando enviam mensagens para o server
 enum {
   OP_CODE_CONNECT = 1,
-  // TODO mais opcodes para cada operacao
+  OP_CODE_DISCONNECT = 2,
+  OP_CODE_SUBSCRIBE = 3,
+  OP_CODE_UNSUBSCRIBE = 4,
+  OP_CODE_PUBLISH = 5,
+  OP_CODE_READ = 6,
+  OP_CODE_WRITE = 7,
+  OP_CODE_NOTIFICATION = 8,
+};
+
+// Status of a response
+enum {
+  STATUS_OK = 0,
+  STATUS_ERROR = 1,      // The request was valid but failed
+  STATUS_MALFORMED = 2,  // Wrong fields for the opcode
+  STATUS_UNKNOWN_OP = 3,
+  STATUS_NOT_FOUND = 4,  // UNSUBSCRIBE of a key that wasn't subscribed
 };
 
+typedef struct FrameHeader {
+  uint8_t op_code;
+  uint8_t status;  // STATUS_* in responses, 0 in requests
+  uint16_t count;  // Fields in the payload
+  uint32_t len;    // Bytes of payload
+} FrameHeader;
+
+typedef struct Field {
+  const char *data;
+  size_t len;
+} Field;
+
+#define MAX_FRAME_PAYLOAD 2048                                // Larger frames are malformed
+#define MAX_FRAME_SIZE (sizeof(FrameHeader) + MAX_FRAME_PAYLOAD)
+#define MAX_FRAME_FIELDS 64
+#define FIELD_MISSING UINT16_MAX                              // Length of a field with no value
+
+/// Encodes a frame.
+/// @param buffer Where the frame is written.
+/// @param size Size of buffer.
+/// @param op_code Opcode of the frame.
+/// @param status Status of a response, 0 in requests.
+/// @param count Number of fields.
+/// @param fields The fields, with data NULL for FIELD_MISSING.
+/// @return Size of the frame, 0 if it doesn't fit in buffer or in
+/// MAX_FRAME_PAYLOAD.
+size_t frame_encode(char *buffer, size_t size, uint8_t op_code, uint8_t status, size_t count,
+                    const Field *fields);
+
+/// Splits the payload of a frame into its fields, which point into it.
+/// @param header Header of the frame.
+/// @param payload The header.len bytes of payload.
+/// @param fields Set to the header.count fields, data NULL if missing.
+/// @param max_fields Size of fields.
+/// @return 0 if successful, 1 if the payload is malformed.
+int frame_decode(const FrameHeader *header, const char *payload, Field *fields,
+                 size_t max_fields);
+
 #endif  // COMMON_PROTOCOL_H
@@ -0,0 +1,884 @@
+#include "backup.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "kvs.h"
+
+// Longest line of a backup: both strings as long as a node allows
+#define MAX_RECORD_SIZE (2 * UINT8_MAX + 6)
+
+static const char *const kind_names[] = {"plain", "full", "delta", "snapshot"};
+
+typedef struct SnapshotHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t generation;
+  uint64_t pairs;
+  uint32_t crc;       // Of the fields above
+  uint32_t reserved;
+} SnapshotHeader;
+
+typedef struct BlockHeader {
+  uint32_t len;  // Bytes of the payload, 0 for the last block
+  uint32_t crc;  // Of the payload
+} BlockHeader;
+
+// Snapshot being written by a backup: records are gathered in block
+// until it is full, then the block is written after its header.
+typedef struct SnapshotWriter {
+  OutputBuffer *out;
+  uint32_t crc_table[256];
+  size_t pairs; // Records written so far
+  size_t len;   // Bytes used in block
+  char block[SNAPSHOT_BLOCK_SIZE];
+} SnapshotWriter;
+
+typedef struct CompressedHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+} CompressedHeader;
+
+typedef struct CompressedBlock {
+  uint32_t len;     // Bytes of the block decompressed, 0 for the last block
+  uint32_t stored;  // Bytes stored, len if the block is not compressed
+  uint32_t crc;     // Of the block decompressed
+} CompressedBlock;
+
+// Manifest of a sharded backup, as read from its file.
+typedef struct Manifest {
+  BackupInfo info;
+  char *paths[MAX_BACKUP_SHARDS];         // Paths of the shards
+  BackupShard shards[MAX_BACKUP_SHARDS];  // What each shard should hold
+} Manifest;
+
+// Shard of a manifest being loaded, counting its records on their way to
+// apply.
+typedef struct ShardLoad {
+  pthread_t thread;
+  const char *path;
+  const BackupInfo *manifest;
+  BackupShard expected;
+  void (*apply)(const Slice *key, const Slice *value, void *arg);
+  void *arg;
+  size_t records;  // Records applied so far
+  bool compressed; // Whether the shard was compressed
+  int result;
+} ShardLoad;
+
+void crc32_init(uint32_t table[256]) {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320U & (0U - (crc & 1)));
+    }
+    table[i] = crc;
+  }
+}
+
+uint32_t crc32(const uint32_t table[256], const void *data, size_t len) {
+  const unsigned char *bytes = data;
+  uint32_t crc = 0xFFFFFFFFU;
+  for (size_t i = 0; i < len; i++) {
+    crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// Writes a whole buffer, retrying after short writes and interruptions.
+// @return 0 if successful, -1 otherwise.
+static int write_all(int fd, const void *data, size_t len) {
+  const char *bytes = data;
+  while (len > 0) {
+    ssize_t written = write(fd, bytes, len);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    bytes += written;
+    len -= (size_t)written;
+  }
+  return 0;
+}
+
+// Sink of a compressed backup: compresses its output into blocks of at
+// most COMPRESSED_BLOCK_SIZE bytes and writes them.
+static int compress_blocks(OutputBuffer *out, const char *data, size_t len) {
+  Compressor *compressor = out->sink_arg;
+  while (len > 0) {
+    size_t raw_len = len < COMPRESSED_BLOCK_SIZE ? len : COMPRESSED_BLOCK_SIZE;
+    // A block that doesn't shrink is stored as it is
+    size_t packed_len = lz_compress(data, raw_len, compressor->packed, raw_len - 1,
+                                    compressor->positions);
+    CompressedBlock block = {(uint32_t)raw_len, (uint32_t)(packed_len > 0 ? packed_len : raw_len),
+                             crc32(compressor->crc_table, data, raw_len)};
+    if (write_all(out->fd, &block, sizeof(block)) != 0 ||
+        write_all(out->fd, packed_len > 0 ? compressor->packed : data, block.stored) != 0) {
+      return -1;
+    }
+    data += raw_len;
+    len -= raw_len;
+  }
+  return 0;
+}
+
+int compressed_init(OutputBuffer *out, int fd, Compressor *compressor) {
+  output_init_block(out, fd, compressor->raw, COMPRESSED_BLOCK_SIZE);
+  out->sink = compress_blocks;
+  out->sink_arg = compressor;
+  crc32_init(compressor->crc_table);
+
+  CompressedHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, COMPRESSED_MAGIC, sizeof(header.magic));
+  header.version = COMPRESSED_VERSION;
+  return write_all(fd, &header, sizeof(header));
+}
+
+int compressed_finish(OutputBuffer *out) {
+  int result = output_flush(out);
+  CompressedBlock end = {0, 0, 0};
+  return write_all(out->fd, &end, sizeof(end)) != 0 ? -1 : result;
+}
+
+// Writes an unsigned integer in decimal, without snprintf, which is not
+// async signal safe.
+static void write_number(OutputBuffer *out, uint64_t value) {
+  char digits[20];
+  size_t i = sizeof(digits);
+  do {
+    digits[--i] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value > 0);
+  output_write(out, digits + i, sizeof(digits) - i);
+}
+
+void backup_header(OutputBuffer *out, enum BackupKind kind, uint32_t generation) {
+  output_str(out, BACKUP_HEADER " ");
+  output_str(out, kind_names[kind]);
+  output_write(out, " ", 1);
+  write_number(out, generation);
+  output_write(out, "\n", 1);
+}
+
+void backup_record(OutputBuffer *out, const char *key, size_t key_len, const char *value,
+                   size_t value_len) {
+  char line[MAX_RECORD_SIZE];
+  if (key_len > UINT8_MAX || value_len > UINT8_MAX) {
+    return;
+  }
+  size_t len = 0;
+  line[len++] = '(';
+  memcpy(line + len, key, key_len);
+  len += key_len;
+  if (value != NULL) {
+    memcpy(line + len, ", ", 2);
+    len += 2;
+    memcpy(line + len, value, value_len);
+    len += value_len;
+  }
+  memcpy(line + len, ")\n", 2);
+  len += 2;
+  output_write(out, line, len);
+}
+
+// Writes the block of a snapshot writer, if it holds any record.
+static void flush_block(SnapshotWriter *writer) {
+  if (writer->len == 0) {
+    return;
+  }
+  BlockHeader header = {(uint32_t)writer->len,
+                        crc32(writer->crc_table, writer->block, writer->len)};
+  output_write(writer->out, (const char *)&header, sizeof(header));
+  output_write(writer->out, writer->block, writer->len);
+  writer->len = 0;
+}
+
+// Adds a pair to the block of a snapshot writer.
+// @param keyNode Node to be written.
+// @param arg Pointer to the SnapshotWriter.
+static void snapshot_pair(const KeyNode *keyNode, void *arg) {
+  SnapshotWriter *writer = arg;
+  size_t size = 2 + (size_t)keyNode->key_len + keyNode->value_len;
+  if (writer->len + size > SNAPSHOT_BLOCK_SIZE) {
+    flush_block(writer);
+  }
+  char *record = writer->block + writer->len;
+  record[0] = (char)keyNode->key_len;
+  record[1] = (char)keyNode->value_len;
+  memcpy(record + 2, node_key(keyNode), keyNode->key_len);
+  memcpy(record + 2 + keyNode->key_len, node_value(keyNode), keyNode->value_len);
+  writer->len += size;
+  writer->pairs++;
+}
+
+size_t snapshot_write(OutputBuffer *out, HashTable *ht, uint64_t stripes, uint32_t generation,
+                      size_t pairs,
+                      void (*iterate)(HashTable *ht, uint64_t stripes,
+                                      void (*visit)(const KeyNode *node, void *arg), void *arg)) {
+  SnapshotWriter writer;
+  writer.out = out;
+  writer.pairs = 0;
+  writer.len = 0;
+  crc32_init(writer.crc_table);
+
+  SnapshotHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.generation = generation;
+  header.pairs = pairs;
+  header.crc = crc32(writer.crc_table, &header, offsetof(SnapshotHeader, crc));
+  output_write(out, (const char *)&header, sizeof(header));
+
+  iterate(ht, stripes, snapshot_pair, &writer);
+  flush_block(&writer);
+  BlockHeader end = {0, 0};
+  output_write(out, (const char *)&end, sizeof(end));
+  return writer.pairs;
+}
+
+int shard_path(char *path, size_t size, const char *backup, size_t index) {
+  char digits[20];
+  size_t i = sizeof(digits);
+  do {
+    digits[--i] = (char)('0' + index % 10);
+    index /= 10;
+  } while (index > 0);
+
+  size_t len = strlen(backup);
+  if (len + 1 + sizeof(digits) - i + 1 > size) {
+    return 1;
+  }
+  memcpy(path, backup, len);
+  path[len++] = '.';
+  memcpy(path + len, digits + i, sizeof(digits) - i);
+  path[len + sizeof(digits) - i] = '\0';
+  return 0;
+}
+
+int manifest_write(const char *path, enum BackupKind kind, uint32_t generation,
+                   size_t num_shards, const BackupShard *shards) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) {
+    return 1;
+  }
+  // Shards are named relative to the directory of the manifest
+  const char *name = strrchr(path, '/');
+  name = name != NULL ? name + 1 : path;
+  OutputBuffer out;
+  output_init(&out, fd);
+  output_str(&out, MANIFEST_HEADER " ");
+  output_str(&out, kind_names[kind]);
+  output_write(&out, " ", 1);
+  write_number(&out, generation);
+  output_write(&out, " ", 1);
+  write_number(&out, num_shards);
+  output_write(&out, "\n", 1);
+  for (size_t i = 0; i < num_shards; i++) {
+    output_str(&out, name);
+    output_write(&out, ".", 1);
+    write_number(&out, i);
+    output_write(&out, " ", 1);
+    write_number(&out, shards[i].records);
+    output_write(&out, " ", 1);
+    write_number(&out, shards[i].bytes);
+    output_write(&out, "\n", 1);
+  }
+  int failed = output_flush(&out) != 0;
+  return close(fd) != 0 || failed;
+}
+
+// Parses the header of a snapshot.
+// @return 0 if data starts with a valid snapshot header, 1 otherwise.
+static int parse_snapshot_header(const char *data, size_t size, const uint32_t crc_table[256],
+                                 BackupInfo *info) {
+  SnapshotHeader header;
+  if (size < sizeof(header)) {
+    return 1;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != SNAPSHOT_VERSION ||
+      header.crc != crc32(crc_table, &header, offsetof(SnapshotHeader, crc))) {
+    return 1;
+  }
+  info->kind = BACKUP_SNAPSHOT;
+  info->generation = header.generation;
+  info->pairs = (size_t)header.pairs;
+  return 0;
+}
+
+// Applies the pairs of a snapshot, a block at a time, each only after its
+// checksum was verified.
+// @return 0 if successful, 1 if the snapshot is truncated or corrupted.
+static int load_snapshot(const char *data, size_t size, BackupInfo *info,
+                         void (*apply)(const Slice *key, const Slice *value, void *arg),
+                         void *arg) {
+  uint32_t crc_table[256];
+  crc32_init(crc_table);
+  if (parse_snapshot_header(data, size, crc_table, info) != 0) {
+    return 1;
+  }
+
+  size_t pos = sizeof(SnapshotHeader);
+  while (1) {
+    BlockHeader header;
+    if (size - pos < sizeof(header)) {
+      return 1;
+    }
+    memcpy(&header, data + pos, sizeof(header));
+    pos += sizeof(header);
+    if (header.len == 0) {
+      return 0;
+    }
+    if (size - pos < header.len || crc32(crc_table, data + pos, header.len) != header.crc) {
+      return 1;
+    }
+
+    const unsigned char *block = (const unsigned char *)data + pos;
+    for (size_t i = 0; i < header.len;) {
+      if (header.len - i < 2 || header.len - i - 2 < (size_t)block[i] + block[i + 1]) {
+        return 1;
+      }
+      Slice key = {(const char *)block + i + 2, block[i]};
+      Slice value = {key.data + key.len, block[i + 1]};
+      apply(&key, &value, arg);
+      i += 2 + key.len + value.len;
+    }
+    pos += header.len;
+  }
+}
+
+// Parses the header line of a backup, if any.
+// @return Offset of the first line after the header.
+static size_t parse_header(const char *data, size_t size, BackupInfo *info) {
+  size_t header_len = strlen(BACKUP_HEADER);
+  info->kind = BACKUP_PLAIN;
+  info->generation = 0;
+  info->pairs = 0;
+  if (size < header_len || memcmp(data, BACKUP_HEADER, header_len) != 0) {
+    return 0;
+  }
+
+  const char *end = memchr(data, '\n', size);
+  size_t pos = header_len + 1;
+  size_t line_end = end != NULL ? (size_t)(end - data) : size;
+  info->kind = BACKUP_FULL;
+  for (int kind = BACKUP_FULL; kind < BACKUP_SNAPSHOT; kind++) {
+    size_t len = strlen(kind_names[kind]);
+    if (pos + len <= line_end && memcmp(data + pos, kind_names[kind], len) == 0) {
+      info->kind = (enum BackupKind)kind;
+      pos += len + 1;
+      break;
+    }
+  }
+  for (; pos < line_end && data[pos] >= '0' && data[pos] <= '9'; pos++) {
+    info->generation = info->generation * 10 + (uint32_t)(data[pos] - '0');
+  }
+  return end != NULL ? line_end + 1 : size;
+}
+
+// Parses an unsigned integer in decimal.
+// @param pos Position of the first digit, set to the first byte after the
+// last one.
+// @param end End of the data.
+// @param value Set to the integer.
+// @return 0 if successful, 1 if there is no digit at pos.
+static int parse_number(const char **pos, const char *end, uint64_t *value) {
+  const char *start = *pos;
+  *value = 0;
+  for (; *pos < end && **pos >= '0' && **pos <= '9'; (*pos)++) {
+    *value = *value * 10 + (uint64_t)(**pos - '0');
+  }
+  return *pos == start;
+}
+
+// Whether data starts with the header of a compressed backup.
+static bool is_compressed(const char *data, size_t size) {
+  size_t len = strlen(COMPRESSED_MAGIC);
+  return size >= len && memcmp(data, COMPRESSED_MAGIC, len) == 0;
+}
+
+// Decompresses a compressed backup, verifying the checksum of each block.
+// @param limit Bytes needed: blocks after the one reaching limit are left
+// alone, so the end of the file is only checked for with SIZE_MAX.
+// @param raw_size Set to the number of bytes decompressed.
+// @return The bytes decompressed, to be freed, NULL if the file is
+// malformed or memory could not be allocated.
+static char *decompress(const char *data, size_t size, size_t limit, size_t *raw_size) {
+  CompressedHeader header;
+  if (size < sizeof(header)) {
+    return NULL;
+  }
+  memcpy(&header, data, sizeof(header));
+  if (header.version != COMPRESSED_VERSION) {
+    return NULL;
+  }
+
+  // First pass: the size of the decompressed bytes
+  size_t total = 0;
+  size_t pos = sizeof(header);
+  while (total < limit) {
+    CompressedBlock block;
+    if (size - pos < sizeof(block)) {
+      return NULL;
+    }
+    memcpy(&block, data + pos, sizeof(block));
+    pos += sizeof(block);
+    if (block.len == 0) {
+      break;
+    }
+    if (block.len > COMPRESSED_BLOCK_SIZE || block.stored > block.len ||
+        size - pos < block.stored) {
+      return NULL;
+    }
+    total += block.len;
+    pos += block.stored;
+  }
+
+  char *raw = malloc(total > 0 ? total : 1);
+  if (raw == NULL) {
+    return NULL;
+  }
+  uint32_t crc_table[256];
+  crc32_init(crc_table);
+  pos = sizeof(header);
+  for (size_t done = 0; done < total;) {
+    CompressedBlock block;
+    memcpy(&block, data + pos, sizeof(block));
+    pos += sizeof(block);
+    int failed = 0;
+    if (block.stored == block.len) {
+      memcpy(raw + done, data + pos, block.len);
+    } else {
+      failed = lz_decompress(data + pos, block.stored, raw + done, block.len);
+    }
+    if (failed || crc32(crc_table, raw + done, block.len) != block.crc) {
+      free(raw);
+      return NULL;
+    }
+    done += block.len;
+    pos += block.stored;
+  }
+  *raw_size = total;
+  return raw;
+}
+
+// Whether data starts with the header of a manifest.
+static bool is_manifest(const char *data, size_t size) {
+  size_t len = strlen(MANIFEST_HEADER);
+  return size > len && memcmp(data, MANIFEST_HEADER, len) == 0 && data[len] == ' ';
+}
+
+// Frees the paths of a manifest.
+static void manifest_free(Manifest *manifest) {
+  for (size_t i = 0; i < manifest->info.shards; i++) {
+    free(manifest->paths[i]);
+  }
+}
+
+// Parses a manifest, a "<name> <records> <bytes>" line per shard after the
+// header line.
+// @param path Path of the manifest, whose directory holds the shards.
+// @return 0 if successful, 1 if the manifest is malformed, leaving nothing
+// to free.
+static int parse_manifest(const char *path, const char *data, size_t size, Manifest *manifest) {
+  const char *end = data + size;
+  const char *pos = data + strlen(MANIFEST_HEADER) + 1;
+  BackupInfo *info = &manifest->info;
+  info->kind = BACKUP_PLAIN;
+  info->pairs = 0;
+  info->shards = 0;
+  info->compressed = false;
+  bool found = false;
+  for (int kind = BACKUP_PLAIN; kind <= BACKUP_SNAPSHOT && !found; kind++) {
+    size_t len = strlen(kind_names[kind]);
+    if ((size_t)(end - pos) > len && memcmp(pos, kind_names[kind], len) == 0 && pos[len] == ' ') {
+      info->kind = (enum BackupKind)kind;
+      pos += len + 1;
+      found = true;
+    }
+  }
+  uint64_t generation, num_shards;
+  if (!found || parse_number(&pos, end, &generation) != 0 || pos == end || *pos++ != ' ' ||
+      parse_number(&pos, end, &num_shards) != 0 || pos == end || *pos++ != '\n' ||
+      num_shards == 0 || num_shards > MAX_BACKUP_SHARDS) {
+    return 1;
+  }
+  info->generation = (uint32_t)generation;
+
+  const char *slash = strrchr(path, '/');
+  size_t dir_len = slash != NULL ? (size_t)(slash - path) + 1 : 0;
+  for (size_t i = 0; i < num_shards; i++) {
+    const char *newline = memchr(pos, '\n', (size_t)(end - pos));
+    if (newline == NULL) {
+      manifest_free(manifest);
+      return 1;
+    }
+    // The numbers are the last two fields, the name is everything before
+    const char *name_end = newline;
+    for (int field = 0; field < 2 && name_end > pos; field++) {
+      do {
+        name_end--;
+      } while (name_end > pos && *name_end != ' ');
+    }
+    const char *numbers = name_end + 1;
+    uint64_t records, bytes;
+    size_t name_len = (size_t)(name_end - pos);
+    char *shard = name_len > 0 ? malloc(dir_len + name_len + 1) : NULL;
+    if (shard == NULL || memchr(pos, '/', name_len) != NULL ||
+        parse_number(&numbers, newline, &records) != 0 || *numbers++ != ' ' ||
+        parse_number(&numbers, newline, &bytes) != 0 || numbers != newline) {
+      free(shard);
+      manifest_free(manifest);
+      return 1;
+    }
+    memcpy(shard, path, dir_len);
+    memcpy(shard + dir_len, pos, name_len);
+    shard[dir_len + name_len] = '\0';
+    manifest->paths[i] = shard;
+    manifest->shards[i] = (BackupShard){(size_t)records, (size_t)bytes};
+    info->shards++;
+    if (info->kind != BACKUP_DELTA) {
+      info->pairs += (size_t)records;
+    }
+    pos = newline + 1;
+  }
+  return 0;
+}
+
+// Maps a whole file for reading.
+// @param size Set to the size of the file.
+// @return The contents, to be released with unmap_file, NULL on failure.
+static const char *map_file(const char *path, size_t *size) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return NULL;
+  }
+  *size = (size_t)st.st_size;
+  const char *data = "";
+  if (*size > 0) {
+    data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  return data != MAP_FAILED ? data : NULL;
+}
+
+static void unmap_file(const char *data, size_t size) {
+  if (size > 0) {
+    munmap((void *)data, size);
+  }
+}
+
+// Reads the manifest of a sharded backup.
+// @return 0 if successful, 1 if it could not be read or is malformed.
+static int read_manifest(const char *path, Manifest *manifest) {
+  size_t size;
+  const char *data = map_file(path, &size);
+  if (data == NULL) {
+    return 1;
+  }
+  int result = !is_manifest(data, size) || parse_manifest(path, data, size, manifest) != 0;
+  unmap_file(data, size);
+  return result;
+}
+
+int backup_info(const char *path, BackupInfo *info) {
+  char header[64];
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return 1;
+  }
+  ssize_t len = read(fd, header, sizeof(header));
+  close(fd);
+  if (len < 0) {
+    return 1;
+  }
+  if (is_manifest(header, (size_t)len)) {
+    Manifest manifest;
+    if (read_manifest(path, &manifest) != 0) {
+      return 1;
+    }
+    *info = manifest.info;
+    manifest_free(&manifest);
+    return 0;
+  }
+  bool compressed = is_compressed(header, (size_t)len);
+  if (compressed) {
+    // The header is in the first block
+    size_t size, raw_size;
+    const char *data = map_file(path, &size);
+    char *raw = data != NULL ? decompress(data, size, sizeof(header), &raw_size) : NULL;
+    if (data != NULL) {
+      unmap_file(data, size);
+    }
+    if (raw == NULL) {
+      return 1;
+    }
+    len = (ssize_t)(raw_size < sizeof(header) ? raw_size : sizeof(header));
+    memcpy(header, raw, (size_t)len);
+    free(raw);
+  }
+  uint32_t crc_table[256];
+  crc32_init(crc_table);
+  if (parse_snapshot_header(header, (size_t)len, crc_table, info) != 0) {
+    parse_header(header, (size_t)len, info);
+  }
+  info->shards = 0;
+  info->compressed = compressed;
+  return 0;
+}
+
+// Applies the pairs of a backup file that is not a manifest.
+// @return 0 if successful, 1 if the file is malformed.
+static int load_data(const char *data, size_t size, BackupInfo *info,
+                     void (*apply)(const Slice *key, const Slice *value, void *arg), void *arg) {
+  if (is_compressed(data, size)) {
+    size_t raw_size;
+    char *raw = decompress(data, size, SIZE_MAX, &raw_size);
+    // What was compressed is never compressed again
+    int result = raw == NULL || is_compressed(raw, raw_size) ||
+                 load_data(raw, raw_size, info, apply, arg) != 0;
+    free(raw);
+    info->compressed = true;
+    return result;
+  }
+
+  int result = 0;
+  info->shards = 0;
+  info->compressed = false;
+  size_t magic_len = strlen(SNAPSHOT_MAGIC);
+  if (size >= magic_len && memcmp(data, SNAPSHOT_MAGIC, magic_len) == 0) {
+    return load_snapshot(data, size, info, apply, arg);
+  }
+
+  size_t pos = parse_header(data, size, info);
+  while (pos < size) {
+    const char *newline = memchr(data + pos, '\n', size - pos);
+    size_t end = newline != NULL ? (size_t)(newline - data) : size;
+    if (end - pos < 3 || data[pos] != '(' || data[end - 1] != ')') {
+      result = 1; // Not a pair, most likely a truncated line
+      break;
+    }
+
+    Slice key = {data + pos + 1, end - pos - 2};
+    const char *comma = memchr(key.data, ',', key.len);
+    if (comma == NULL) {
+      apply(&key, NULL, arg);
+    } else {
+      // ", " separates the key from the value
+      size_t rest = (size_t)(key.data + key.len - comma);
+      if (rest < 2 || comma[1] != ' ') {
+        result = 1;
+        break;
+      }
+      Slice value = {comma + 2, rest - 2};
+      key.len = (size_t)(comma - key.data);
+      apply(&key, &value, arg);
+    }
+    pos = end + 1;
+  }
+  return result;
+}
+
+// Counts a record of a shard and applies it.
+// @param arg Pointer to the ShardLoad.
+static void count_record(const Slice *key, const Slice *value, void *arg) {
+  ShardLoad *load = arg;
+  load->records++;
+  load->apply(key, value, load->arg);
+}
+
+// Loads a shard of a manifest, checking its size before and the number of
+// records after it was applied. A shard is never a manifest itself.
+static void *load_shard(void *arg) {
+  ShardLoad *load = arg;
+  size_t size;
+  const char *data = map_file(load->path, &size);
+  if (data == NULL) {
+    load->result = 1;
+    return NULL;
+  }
+  // Left unfilled if the checks before load_data fail
+  BackupInfo info = {0};
+  load->result = size != load->expected.bytes || is_manifest(data, size) ||
+                 load_data(data, size, &info, count_record, load) != 0 ||
+                 load->records != load->expected.records || info.kind != load->manifest->kind ||
+                 (info.kind != BACKUP_PLAIN && info.generation != load->manifest->generation);
+  load->compressed = info.compressed;
+  unmap_file(data, size);
+  return NULL;
+}
+
+// Loads a backup file, or the shards of a manifest.
+// @param parallel Whether each shard is loaded by a thread of its own.
+static int load_backup(const char *path, BackupInfo *info,
+                       void (*apply)(const Slice *key, const Slice *value, void *arg), void *arg,
+                       bool parallel) {
+  size_t size;
+  const char *data = map_file(path, &size);
+  if (data == NULL) {
+    return 1;
+  }
+  if (!is_manifest(data, size)) {
+    int result = load_data(data, size, info, apply, arg);
+    unmap_file(data, size);
+    return result;
+  }
+
+  Manifest manifest;
+  int result = parse_manifest(path, data, size, &manifest);
+  unmap_file(data, size);
+  if (result != 0) {
+    return 1;
+  }
+  *info = manifest.info;
+  ShardLoad loads[MAX_BACKUP_SHARDS];
+  bool started[MAX_BACKUP_SHARDS];
+  for (size_t i = 0; i < info->shards; i++) {
+    loads[i] = (ShardLoad){0, manifest.paths[i], &manifest.info, manifest.shards[i], apply, arg,
+                           0, false, 0};
+    // A shard whose thread could not be started is loaded right away
+    started[i] = parallel && pthread_create(&loads[i].thread, NULL, load_shard, &loads[i]) == 0;
+    if (!started[i]) {
+      load_shard(&loads[i]);
+    }
+  }
+  for (size_t i = 0; i < info->shards; i++) {
+    if (started[i]) {
+      pthread_join(loads[i].thread, NULL);
+    }
+    result = result || loads[i].result;
+  }
+  info->compressed = loads[0].compressed;
+  manifest_free(&manifest);
+  return result;
+}
+
+int backup_load(const char *path, BackupInfo *info,
+                void (*apply)(const Slice *key, const Slice *value, void *arg), void *arg) {
+  return load_backup(path, info, apply, arg, false);
+}
+
+int backup_load_parallel(const char *path, BackupInfo *info,
+                         void (*apply)(const Slice *key, const Slice *value, void *arg),
+                         void *arg) {
+  return load_backup(path, info, apply, arg, true);
+}
+
+// A backup found by backup_chain.
+typedef struct ChainEntry {
+  char *path;
+  BackupInfo info;
+  struct timespec mtime;
+} ChainEntry;
+
+static int filter_backups(const struct dirent *entry) {
+  const char *dot = strrchr(entry->d_name, '.');
+  return dot != NULL && strcmp(dot, ".bck") == 0;
+}
+
+// Whether a backup is of a later generation than another, or of the same
+// generation and written after it.
+static bool newer(const ChainEntry *a, const ChainEntry *b) {
+  if (b == NULL || a->info.generation != b->info.generation) {
+    return b == NULL || a->info.generation > b->info.generation;
+  }
+  return a->mtime.tv_sec > b->mtime.tv_sec ||
+         (a->mtime.tv_sec == b->mtime.tv_sec && a->mtime.tv_nsec > b->mtime.tv_nsec);
+}
+
+char **backup_chain(const char *dir, size_t *count) {
+  struct dirent **entries;
+  int num_entries = scandir(dir, &entries, filter_backups, alphasort);
+  if (num_entries < 0) {
+    return NULL;
+  }
+
+  ChainEntry *found = calloc((size_t)num_entries + 1, sizeof(ChainEntry));
+  size_t num_found = 0;
+  ChainEntry *checkpoint = NULL;
+  for (int i = 0; i < num_entries; i++) {
+    ChainEntry *entry = &found[num_found];
+    size_t len = strlen(dir) + 1 + strlen(entries[i]->d_name) + 1;
+    struct stat st;
+    if (found != NULL && (entry->path = malloc(len)) != NULL) {
+      snprintf(entry->path, len, "%s/%s", dir, entries[i]->d_name);
+      if (stat(entry->path, &st) == 0 && backup_info(entry->path, &entry->info) == 0 &&
+          entry->info.kind != BACKUP_PLAIN) {
+        entry->mtime = st.st_mtim;
+        num_found++;
+      } else {
+        free(entry->path);
+      }
+    }
+    free(entries[i]);
+  }
+  free(entries);
+  if (found == NULL) {
+    return NULL;
+  }
+
+  // Backups of the same generation may be left by runs that did not restore
+  // the previous one, the last one written wins
+  for (size_t i = 0; i < num_found; i++) {
+    if (found[i].info.kind != BACKUP_DELTA && newer(&found[i], checkpoint)) {
+      checkpoint = &found[i];
+    }
+  }
+
+  char **paths = NULL;
+  *count = 0;
+  if (checkpoint != NULL && (paths = malloc((num_found + 1) * sizeof(char *))) != NULL) {
+    uint32_t generation = checkpoint->info.generation;
+    paths[(*count)++] = checkpoint->path;
+    checkpoint->path = NULL;
+    while (1) {
+      ChainEntry *delta = NULL;
+      for (size_t i = 0; i < num_found; i++) {
+        if (found[i].info.kind == BACKUP_DELTA && found[i].info.generation == generation + 1 &&
+            newer(&found[i], delta)) {
+          delta = &found[i];
+        }
+      }
+      if (delta == NULL) {
+        break;
+      }
+      paths[(*count)++] = delta->path;
+      delta->path = NULL;
+      generation++;
+    }
+  }
+
+  for (size_t i = 0; i < num_found; i++) {
+    free(found[i].path);
+  }
+  free(found);
+  return paths;
+}
+
+void backup_chain_free(char **paths, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    free(paths[i]);
+  }
+  free(paths);
+}
@@ -0,0 +1,225 @@
+#ifndef KVS_BACKUP_H
+#define KVS_BACKUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "io.h"
+#include "lz.h"
+#include "parser.h"
+
+// Backup files are text, one "(key, value)" line per pair. Backups of a
+// server running with delta backups start with a header line naming the
+// kind of backup and the generation of the table it was taken at:
+//
+//   #KVS-BACKUP full <generation>
+//   #KVS-BACKUP delta <generation>
+//
+// A full backup (checkpoint) holds every pair. A delta holds only the keys
+// changed since the backup of the previous generation, a "(key)" line for
+// each deleted key, so the state at a delta is rebuilt by applying, in
+// order, every delta after the newest checkpoint before it.
+//
+// A checkpoint may also be a binary snapshot, which is what the server
+// restores from on startup:
+//
+//   header:  magic "KVSSNAP1", u32 version, u32 generation, u64 pairs,
+//            u32 CRC-32 of the previous fields, u32 reserved
+//   blocks:  u32 length, u32 CRC-32 of the payload, then the payload, a
+//            sequence of records u8 key_len, u8 value_len, key, value
+//   end:     a block of length 0
+//
+// Integers are stored in the byte order of the host.
+//
+// A backup of any kind may also be split into shards, written in parallel,
+// each holding the pairs of a range of stripes of the table (see kvs.h).
+// Each shard is a backup file of its own, named after the backup with the
+// index of the shard appended ("job-1.bck.0", "job-1.bck.1", ...), and the
+// backup file itself is a text manifest listing them:
+//
+//   #KVS-MANIFEST <kind> <generation> <shards>
+//   <shard file name> <records> <bytes>
+//   ...
+//
+// where records is the number of lines (or snapshot records) of the shard
+// and bytes the size of its file, so missing or truncated shards are
+// detected before they are loaded.
+//
+// Any backup file but a manifest may also be compressed a block at a time
+// with the codec of lz.h:
+//
+//   header:  magic "KVSLZBK1", u32 version, u32 reserved
+//   blocks:  u32 length of the block decompressed, u32 length stored,
+//            u32 CRC-32 of the block decompressed, then the stored bytes,
+//            compressed unless both lengths are equal
+//   end:     a block of length 0
+
+#define BACKUP_HEADER "#KVS-BACKUP"
+#define MANIFEST_HEADER "#KVS-MANIFEST"
+#define SNAPSHOT_MAGIC "KVSSNAP1"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BLOCK_SIZE 65536 // Maximum payload of a block
+#define MAX_BACKUP_SHARDS 64      // At most one shard per stripe (LOCK_STRIPES)
+#define COMPRESSED_MAGIC "KVSLZBK1"
+#define COMPRESSED_VERSION 1
+#define COMPRESSED_BLOCK_SIZE 262144 // Bytes of a backup compressed together
+
+enum BackupKind {
+  BACKUP_PLAIN,  // Every pair, without header (and with long lines truncated)
+  BACKUP_FULL,
+  BACKUP_DELTA,
+  BACKUP_SNAPSHOT  // Every pair, binary
+};
+
+typedef struct BackupInfo {
+  enum BackupKind kind;
+  uint32_t generation;  // 0 for plain backups
+  size_t pairs;         // Number of pairs of a snapshot or sharded checkpoint, 0 if unknown
+  size_t shards;        // Shards listed by a manifest, 0 for a single file
+  bool compressed;      // Whether the file (or the shards) are compressed
+} BackupInfo;
+
+// Entry of a shard in a manifest.
+typedef struct BackupShard {
+  size_t records; // Pairs and deleted keys written to the shard
+  size_t bytes;   // Size of the shard file
+} BackupShard;
+
+// A backup file being compressed. Too large for the stack: forked children
+// use a static one.
+typedef struct Compressor {
+  uint32_t crc_table[256];
+  uint32_t positions[LZ_HASH_SIZE];
+  char raw[COMPRESSED_BLOCK_SIZE];    // Output of the backup, compressed once full
+  char packed[COMPRESSED_BLOCK_SIZE]; // Block being compressed
+} Compressor;
+
+struct HashTable;
+struct KeyNode;
+
+/// Fills the lookup table of the CRC-32 used by zlib and Ethernet.
+/// @param table The table.
+void crc32_init(uint32_t table[256]);
+
+/// CRC-32 of a sequence of bytes.
+/// @param table Table filled by crc32_init.
+/// @param data The bytes.
+/// @param len Number of bytes.
+/// @return The checksum.
+uint32_t crc32(const uint32_t table[256], const void *data, size_t len);
+
+/// Writes the header line of a full or delta backup. Only uses async signal safe functions.
+/// @param out Output buffer of the backup file.
+/// @param kind Kind of backup.
+/// @param generation Generation of the table the backup was taken at.
+void backup_header(OutputBuffer *out, enum BackupKind kind, uint32_t generation);
+
+/// Initializes an output buffer whose output is compressed into a backup
+/// file, and writes the header of the file. Only uses async signal safe
+/// functions.
+/// @param out The output buffer.
+/// @param fd File descriptor of the backup file.
+/// @param compressor Compressor, which must outlive the output buffer.
+/// @return 0 if successful, -1 if the header could not be written.
+int compressed_init(OutputBuffer *out, int fd, Compressor *compressor);
+
+/// Compresses the pending output of a compressed backup and ends the file.
+/// Only uses async signal safe functions.
+/// @param out Output buffer initialized by compressed_init.
+/// @return 0 if successful, -1 if the output could not be written.
+int compressed_finish(OutputBuffer *out);
+
+/// Writes a pair, or a deleted key if value is NULL, as a line of a backup.
+/// Unlike the lines of a backup without header, the pair is never
+/// truncated. Only uses async signal safe functions.
+/// @param out Output buffer of the backup file.
+/// @param key The key.
+/// @param key_len Length of the key.
+/// @param value The value, NULL for a deleted key.
+/// @param value_len Length of the value.
+void backup_record(OutputBuffer *out, const char *key, size_t key_len, const char *value,
+                   size_t value_len);
+
+/// Writes a binary snapshot of the pairs of a set of stripes of a table.
+/// Only uses async signal safe functions, if iterate does.
+/// @param out Output buffer of the backup file.
+/// @param ht The table.
+/// @param stripes Mask of the stripes written.
+/// @param generation Generation of the table.
+/// @param pairs Number of pairs iterate visits, 0 if unknown.
+/// @param iterate Visit of the pairs: iterate_pairs, with the stripes
+/// locked or in the copy of a forked child, or snapshot_pairs.
+/// @return Number of pairs written.
+size_t snapshot_write(OutputBuffer *out, struct HashTable *ht, uint64_t stripes,
+                      uint32_t generation, size_t pairs,
+                      void (*iterate)(struct HashTable *ht, uint64_t stripes,
+                                      void (*visit)(const struct KeyNode *node, void *arg),
+                                      void *arg));
+
+/// Path of a shard of a backup. Only uses async signal safe functions.
+/// @param path Set to the path of the shard.
+/// @param size Size of path.
+/// @param backup Path of the backup (its manifest).
+/// @param index Index of the shard.
+/// @return 0 if successful, 1 if the path doesn't fit.
+int shard_path(char *path, size_t size, const char *backup, size_t index);
+
+/// Writes the manifest of a sharded backup, once every shard was written.
+/// Only uses async signal safe functions.
+/// @param path Path of the backup (its manifest).
+/// @param kind Kind of backup of every shard.
+/// @param generation Generation of the table the backup was taken at.
+/// @param num_shards Number of shards, at most MAX_BACKUP_SHARDS.
+/// @param shards What was written to each shard.
+/// @return 0 if successful, 1 if the manifest could not be written.
+int manifest_write(const char *path, enum BackupKind kind, uint32_t generation,
+                   size_t num_shards, const BackupShard *shards);
+
+/// Reads the header of a backup file, or the whole manifest of a sharded one.
+/// @param path Path of the backup file.
+/// @param info Set to the kind and generation of the backup.
+/// @return 0 if successful, 1 if the file could not be read.
+int backup_info(const char *path, BackupInfo *info);
+
+/// Reads a backup file, calling apply for each of its pairs in order. The
+/// checksums of snapshots are verified before their pairs are applied. The
+/// shards of a sharded backup are read one after the other.
+/// @param path Path of the backup file.
+/// @param info Set to the kind and generation of the backup.
+/// @param apply Function called with each key, its value (NULL for a deleted
+/// key) and arg.
+/// @param arg Opaque argument forwarded to apply.
+/// @return 0 if successful, 1 if the file could not be read or is malformed,
+/// or a shard does not match its manifest.
+int backup_load(const char *path, BackupInfo *info,
+                void (*apply)(const Slice *key, const Slice *value, void *arg), void *arg);
+
+/// Reads a backup file like backup_load, but the shards of a sharded backup
+/// are read by a thread each. apply is then called concurrently, though the
+/// keys of a stripe all come from the same shard, and so the same thread.
+/// @param path Path of the backup file.
+/// @param info Set to the kind and generation of the backup.
+/// @param apply Function called with each key, its value (NULL for a deleted
+/// key) and arg.
+/// @param arg Opaque argument forwarded to apply.
+/// @return 0 if successful, 1 if a file could not be read or is malformed,
+/// or a shard does not match its manifest.
+int backup_load_parallel(const char *path, BackupInfo *info,
+                         void (*apply)(const Slice *key, const Slice *value, void *arg),
+                         void *arg);
+
+/// Finds the newest checkpoint of a directory (of the latest generation)
+/// and the deltas that follow it, in the order they have to be applied.
+/// @param dir Path of the directory.
+/// @param count Set to the number of backups found.
+/// @return Paths of the backups, checkpoint first, to be freed with
+/// backup_chain_free, NULL if there is no checkpoint.
+char **backup_chain(const char *dir, size_t *count);
+
+/// Frees the paths returned by backup_chain.
+/// @param paths The paths.
+/// @param count Number of paths.
+void backup_chain_free(char **paths, size_t count);
+
+#endif  // KVS_BACKUP_H
@@ -0,0 +1,214 @@
+#include "backup_manager.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "operations.h"
+
+// A forked backup child, queued or running.
+typedef struct Backup {
+    pid_t pid;
+    int gate;               // End of the socket pair the child waits on while queued
+    uint64_t submitted_ns;  // When its BACKUP was run
+    struct Backup* next;
+} Backup;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;  // A child started running, or stopping
+static pthread_cond_t dequeued = PTHREAD_COND_INITIALIZER; // A queued child started running
+static pthread_t reaper;
+static bool started = false;
+static bool stopping = false;
+static size_t max_running;
+static size_t running = 0;          // Children released and not yet reaped
+static size_t queued = 0;           // Children waiting for a slot, or being forked
+static Backup* queue_head = NULL;   // Oldest queued child
+static Backup* queue_tail = NULL;
+static Backup* running_list = NULL;
+static BackupStats stats;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Lets queued children write their backups while there are free slots,
+// oldest first. The mutex must be held.
+static void release_queued(void) {
+    while (running < max_running && queue_head != NULL) {
+        Backup* backup = queue_head;
+        queue_head = backup->next;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        queued--;
+
+        // Later children hold copies of the gate too, so the child is
+        // released by a byte rather than by the gate being closed.
+        // MSG_NOSIGNAL, so a child that already died can't raise SIGPIPE
+        send(backup->gate, "", 1, MSG_NOSIGNAL);
+        close(backup->gate);
+        backup->gate = -1;
+        stats.total_queued_ns += now_ns() - backup->submitted_ns;
+        backup->next = running_list;
+        running_list = backup;
+        running++;
+        pthread_cond_broadcast(&dequeued);
+    }
+}
+
+// Reaps a running child.
+// @param pid PID of the child.
+// @param failed Whether it failed to write its backup.
+static void reaped(pid_t pid, bool failed) {
+    Backup** link = &running_list;
+    while (*link != NULL && (*link)->pid != pid) {
+        link = &(*link)->next;
+    }
+    if (*link == NULL) {
+        return; // Not a backup child
+    }
+    Backup* backup = *link;
+    *link = backup->next;
+    running--;
+
+    uint64_t latency = now_ns() - backup->submitted_ns;
+    stats.completed++;
+    stats.failed += failed;
+    stats.total_latency_ns += latency;
+    if (latency > stats.max_latency_ns) {
+        stats.max_latency_ns = latency;
+    }
+    free(backup);
+}
+
+// Waits for the running children, so no other thread ever blocks on them,
+// and replaces each one that exits with the oldest queued one.
+static void* reap(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&mutex);
+    while (running > 0 || !stopping) {
+        if (running == 0) {
+            pthread_cond_wait(&changed, &mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&mutex);
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        int error = errno;
+        pthread_mutex_lock(&mutex);
+
+        if (pid > 0) {
+            reaped(pid, !WIFEXITED(status) || WEXITSTATUS(status) != 0);
+        } else if (error == ECHILD) {
+            // Reaped by someone else, their outcome is unknown
+            while (running_list != NULL) {
+                reaped(running_list->pid, true);
+            }
+        }
+        release_queued();
+    }
+    pthread_mutex_unlock(&mutex);
+    return NULL;
+}
+
+int manager_start(size_t _max_running) {
+    pthread_mutex_lock(&mutex);
+    max_running = _max_running;
+    if (!started) {
+        // A second reaper would take children from the first one
+        stopping = false;
+        started = pthread_create(&reaper, NULL, reap, NULL) == 0;
+    }
+    release_queued();
+    pthread_mutex_unlock(&mutex);
+    return !started;
+}
+
+int manager_submit(size_t num_backup, const char* job_filename, const char* directory) {
+    Backup* backup = malloc(sizeof(Backup));
+    int gate[2];
+    if (backup == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, gate) != 0) {
+        free(backup);
+        return 1;
+    }
+
+    // The place in the queue is taken before forking, so the fork itself
+    // happens without the mutex
+    pthread_mutex_lock(&mutex);
+    while (queued >= MAX_QUEUED_BACKUPS) {
+        pthread_cond_wait(&dequeued, &mutex);
+    }
+    queued++;
+    pthread_mutex_unlock(&mutex);
+
+    backup->submitted_ns = now_ns();
+    backup->pid = kvs_backup(num_backup, job_filename, directory, gate);
+    close(gate[0]);
+
+    pthread_mutex_lock(&mutex);
+    if (backup->pid <= 0) {
+        // Not forked, or written by a thread of the server (see
+        // kvs_fork_free_backups), which has nothing to throttle
+        int result = backup->pid < 0;
+        queued--;
+        pthread_cond_broadcast(&dequeued);
+        pthread_mutex_unlock(&mutex);
+        close(gate[1]);
+        free(backup);
+        return result;
+    }
+    backup->gate = gate[1];
+    backup->next = NULL;
+    if (queue_tail != NULL) {
+        queue_tail->next = backup;
+    } else {
+        queue_head = backup;
+    }
+    queue_tail = backup;
+
+    release_queued();
+    if (queued > stats.max_queued) {
+        stats.max_queued = queued;
+    }
+    pthread_cond_signal(&changed);
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+void manager_stats(BackupStats* _stats) {
+    pthread_mutex_lock(&mutex);
+    *_stats = stats;
+    pthread_mutex_unlock(&mutex);
+}
+
+void manager_stop(void) {
+    pthread_mutex_lock(&mutex);
+    if (!started) {
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+    stopping = true;
+    pthread_cond_signal(&changed);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(reaper, NULL);
+    started = false;
+
+    if (stats.completed > 0) {
+        printf("Backups: %zu done, %zu failed, up to %zu queued, "
+               "latency %.1f ms avg, %.1f ms max, queued %.1f ms avg\n",
+               stats.completed, stats.failed, stats.max_queued,
+               (double)stats.total_latency_ns / (double)stats.completed / 1e6,
+               (double)stats.max_latency_ns / 1e6,
+               (double)stats.total_queued_ns / (double)stats.completed / 1e6);
+    }
+}
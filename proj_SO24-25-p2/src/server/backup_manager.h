@@ -0,0 +1,48 @@
+#ifndef KVS_BACKUP_MANAGER_H
+#define KVS_BACKUP_MANAGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Throttles the backups of the jobs without blocking the threads running
+// them. A BACKUP forks right away, so the backup holds the state of the KVS
+// at that point of the job, but the child only writes it once one of the
+// max_running slots is free: until then it waits, queued, on a socket
+// pair (see kvs_backup). A reaper thread is the only one waiting for the
+// children, and releases the next queued one whenever a running one exits.
+
+#define MAX_QUEUED_BACKUPS 64 // Queued children before BACKUPs wait for a slot
+
+typedef struct BackupStats {
+    size_t completed;          // Children that exited
+    size_t failed;             // Children that exited with an error or were killed
+    size_t max_queued;         // Deepest the queue got
+    uint64_t total_latency_ns; // From each BACKUP to its child exiting
+    uint64_t max_latency_ns;
+    uint64_t total_queued_ns;  // From each BACKUP to its child being released
+} BackupStats;
+
+/// Starts the reaper thread, or only changes the number of slots if it is
+/// running already.
+/// @param max_running Maximum number of children writing backups at once.
+/// @return 0 if successful, 1 if the thread could not be started.
+int manager_start(size_t max_running);
+
+/// Forks a backup of the KVS (see kvs_backup) and queues it. Only waits if
+/// MAX_QUEUED_BACKUPS children are already queued. Backups written by a
+/// thread instead are not queued.
+/// @param num_backup Number of the backup in the job.
+/// @param job_filename Name of the job file.
+/// @param directory Directory the backup is written to.
+/// @return 0 if successful, 1 if the child could not be forked.
+int manager_submit(size_t num_backup, const char* job_filename, const char* directory);
+
+/// Reads the counters of the backups so far.
+/// @param stats Set to the counters.
+void manager_stats(BackupStats* stats);
+
+/// Waits for every backup submitted, stops the reaper thread and prints
+/// the counters.
+void manager_stop(void);
+
+#endif  // KVS_BACKUP_MANAGER_H
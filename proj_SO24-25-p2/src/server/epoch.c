@@ -0,0 +1,186 @@
+#include "epoch.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "slab.h"
+
+#define EPOCH_IDLE UINT64_MAX   // Epoch of a thread outside a critical section
+#define RECLAIM_INTERVAL 64     // Retirements between reclamation attempts
+
+// Per thread state, padded to its own cache line so entering and leaving
+// a critical section never invalidates the lines of other readers.
+typedef struct EpochRecord {
+    _Alignas(64) atomic_uint_fast64_t epoch; // Epoch observed on enter
+    atomic_bool in_use;                      // Whether a thread owns it
+    struct EpochRecord *next;
+} EpochRecord;
+
+typedef struct Retired {
+    void *ptr;
+    void (*destroy)(void *ptr);
+    uint_fast64_t epoch; // Global epoch when ptr was retired
+    struct Retired *next;
+} Retired;
+
+static atomic_uint_fast64_t global_epoch = 0;
+
+// Records are only ever added, and reused once their thread exits
+static _Atomic(EpochRecord *) records = NULL;
+static pthread_key_t record_key;
+static pthread_once_t record_key_once = PTHREAD_ONCE_INIT;
+static _Thread_local EpochRecord *local_record = NULL;
+
+// Retired pointers, ordered by epoch
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+static Retired *limbo_head = NULL;
+static Retired *limbo_tail = NULL;
+static unsigned retired_since_reclaim = 0;
+
+// Gives the record of an exiting thread back to the pool.
+static void release_record(void *arg) {
+    EpochRecord *record = arg;
+    atomic_store(&record->epoch, EPOCH_IDLE);
+    atomic_store(&record->in_use, false);
+}
+
+static void create_record_key(void) {
+    pthread_key_create(&record_key, release_record);
+}
+
+// Finds a free record or registers a new one for the calling thread.
+static EpochRecord *acquire_record(void) {
+    pthread_once(&record_key_once, create_record_key);
+
+    EpochRecord *record = atomic_load(&records);
+    for (; record != NULL; record = record->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&record->in_use, &expected, true)) {
+            break;
+        }
+    }
+
+    if (record == NULL) {
+        record = aligned_alloc(_Alignof(EpochRecord), sizeof(EpochRecord));
+        if (record == NULL) {
+            perror("Failed to allocate epoch record");
+            exit(EXIT_FAILURE);
+        }
+        atomic_init(&record->epoch, EPOCH_IDLE);
+        atomic_init(&record->in_use, true);
+        record->next = atomic_load(&records);
+        while (!atomic_compare_exchange_weak(&records, &record->next, record))
+            ;
+    }
+
+    pthread_setspecific(record_key, record);
+    return record;
+}
+
+void epoch_enter(void) {
+    if (local_record == NULL) {
+        local_record = acquire_record();
+    }
+    atomic_store_explicit(&local_record->epoch, atomic_load(&global_epoch),
+                          memory_order_relaxed);
+    // The announcement must be visible before any shared pointer is read
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void epoch_exit(void) {
+    atomic_store_explicit(&local_record->epoch, EPOCH_IDLE, memory_order_release);
+}
+
+// Advances the global epoch if every active reader has already observed it.
+static void try_advance(void) {
+    uint_fast64_t current = atomic_load(&global_epoch);
+    atomic_thread_fence(memory_order_seq_cst);
+    for (EpochRecord *record = atomic_load(&records); record != NULL; record = record->next) {
+        uint_fast64_t epoch = atomic_load(&record->epoch);
+        if (epoch != EPOCH_IDLE && epoch != current) {
+            return;
+        }
+    }
+    atomic_compare_exchange_strong(&global_epoch, &current, current + 1);
+}
+
+// Frees a detached list of retired pointers.
+static void destroy_list(Retired *entry) {
+    while (entry != NULL) {
+        Retired *next = entry->next;
+        entry->destroy(entry->ptr);
+        slab_free(entry, sizeof(Retired));
+        entry = next;
+    }
+}
+
+// Frees the pointers retired two or more epochs ago: every reader active
+// when they were unlinked has left its critical section since then.
+static void reclaim(void) {
+    try_advance();
+    uint_fast64_t current = atomic_load(&global_epoch);
+
+    pthread_mutex_lock(&limbo_lock);
+    Retired *head = limbo_head;
+    Retired *last = NULL;
+    for (Retired *entry = limbo_head; entry != NULL && entry->epoch + 2 <= current;
+         entry = entry->next) {
+        last = entry;
+    }
+    if (last == NULL) {
+        pthread_mutex_unlock(&limbo_lock);
+        return;
+    }
+    limbo_head = last->next;
+    if (limbo_head == NULL) {
+        limbo_tail = NULL;
+    }
+    last->next = NULL;
+    pthread_mutex_unlock(&limbo_lock);
+
+    destroy_list(head);
+}
+
+void epoch_retire(void *ptr, void (*destroy)(void *ptr)) {
+    Retired *entry = slab_alloc(sizeof(Retired));
+    if (entry == NULL) {
+        // Leaking is the only safe option, a reader may still use ptr
+        perror("Failed to retire pointer");
+        return;
+    }
+    entry->ptr = ptr;
+    entry->destroy = destroy;
+    entry->next = NULL;
+
+    pthread_mutex_lock(&limbo_lock);
+    entry->epoch = atomic_load(&global_epoch);
+    if (limbo_tail == NULL) {
+        limbo_head = entry;
+    } else {
+        limbo_tail->next = entry;
+    }
+    limbo_tail = entry;
+    bool should_reclaim = ++retired_since_reclaim >= RECLAIM_INTERVAL;
+    if (should_reclaim) {
+        retired_since_reclaim = 0;
+    }
+    pthread_mutex_unlock(&limbo_lock);
+
+    if (should_reclaim) {
+        reclaim();
+    }
+}
+
+void epoch_drain(void) {
+    pthread_mutex_lock(&limbo_lock);
+    Retired *head = limbo_head;
+    limbo_head = limbo_tail = NULL;
+    retired_since_reclaim = 0;
+    pthread_mutex_unlock(&limbo_lock);
+
+    destroy_list(head);
+}
@@ -0,0 +1,25 @@
+#ifndef KVS_EPOCH_H
+#define KVS_EPOCH_H
+
+// Epoch based memory reclamation. Readers traverse shared structures
+// between epoch_enter and epoch_exit without taking locks; writers unlink
+// memory and hand it to epoch_retire, which only frees it once every reader
+// that could still be holding a reference has left its critical section.
+
+/// Enters a read-side critical section. Memory retired from now on is not
+/// freed until the calling thread calls epoch_exit. Sections can't be nested.
+void epoch_enter(void);
+
+/// Leaves a read-side critical section.
+void epoch_exit(void);
+
+/// Schedules memory to be freed once no reader can reference it anymore.
+/// @param ptr Memory unlinked from a shared structure.
+/// @param destroy Function that frees ptr.
+void epoch_retire(void *ptr, void (*destroy)(void *ptr));
+
+/// Frees every retired pointer right away. Only safe when no thread is
+/// inside a read-side critical section.
+void epoch_drain(void);
+
+#endif  // KVS_EPOCH_H
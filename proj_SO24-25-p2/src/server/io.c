@@ -1,7 +1,11 @@
+#include "io.h"
+
+#include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <sys/uio.h>
 
 void write_str(int fd, const char *str) {
   size_t len = strlen(str);
@@ -27,6 +31,182 @@ void write_uint(int fd, int value) {
   }
 }
 
+void output_init(OutputBuffer *out, int fd) {
+  out->fd = fd;
+  out->len = 0;
+  out->syscalls = 0;
+  out->spill = NULL;
+  out->spill_len = 0;
+  out->spill_capacity = 0;
+  out->block = NULL;
+  out->capacity = OUTPUT_BUFFER_SIZE;
+  out->sink = NULL;
+  out->sink_arg = NULL;
+}
+
+void output_init_block(OutputBuffer *out, int fd, char *block, size_t size) {
+  output_init(out, fd);
+  out->block = block;
+  out->capacity = size;
+}
+
+void output_init_memory(OutputBuffer *out) {
+  output_init(out, -1);
+}
+
+// Where the pending output of an output buffer is gathered.
+static char *pending(OutputBuffer *out) {
+  return out->block != NULL ? out->block : out->data;
+}
+
+// Appends bytes to the spill of a memory output buffer.
+// @return 0 if successful, -1 if memory could not be allocated.
+static int spill_append(OutputBuffer *out, const char *data, size_t len) {
+  if (len == 0) {
+    return 0;
+  }
+  if (out->spill_len + len > out->spill_capacity) {
+    size_t capacity = out->spill_capacity == 0 ? 4 * OUTPUT_BUFFER_SIZE : out->spill_capacity;
+    while (capacity < out->spill_len + len) {
+      capacity *= 2;
+    }
+    char *spill = realloc(out->spill, capacity);
+    if (spill == NULL) {
+      return -1;
+    }
+    out->spill = spill;
+    out->spill_capacity = capacity;
+  }
+  memcpy(out->spill + out->spill_len, data, len);
+  out->spill_len += len;
+  return 0;
+}
+
+// Writes every byte of an I/O vector, resuming after partial writes.
+// @return 0 if successful, -1 on error.
+static int writev_all(OutputBuffer *out, struct iovec *iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t written = writev(out->fd, iov, iovcnt);
+    out->syscalls++;
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    size_t left = (size_t)written;
+    while (iovcnt > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *)iov->iov_base + left;
+      iov->iov_len -= left;
+    }
+  }
+  return 0;
+}
+
+int output_write(OutputBuffer *out, const char *data, size_t len) {
+  if (out->len + len <= out->capacity) {
+    memcpy(pending(out) + out->len, data, len);
+    out->len += len;
+    return 0;
+  }
+
+  if (out->sink != NULL) {
+    int result = out->len > 0 ? out->sink(out, pending(out), out->len) : 0;
+    out->len = 0;
+    if (result != 0 || len > out->capacity) {
+      return result != 0 ? result : out->sink(out, data, len);
+    }
+    memcpy(pending(out), data, len);
+    out->len = len;
+    return 0;
+  }
+
+  if (out->fd < 0) {
+    int result = spill_append(out, pending(out), out->len);
+    out->len = 0;
+    return result == 0 ? spill_append(out, data, len) : result;
+  }
+
+  struct iovec iov[2] = {{pending(out), out->len}, {(void *)data, len}};
+  int result = writev_all(out, iov[0].iov_len > 0 ? iov : iov + 1, iov[0].iov_len > 0 ? 2 : 1);
+  out->len = 0; // Output that could not be written is dropped
+  return result;
+}
+
+int output_str(OutputBuffer *out, const char *str) {
+  return output_write(out, str, strlen(str));
+}
+
+int output_flush(OutputBuffer *out) {
+  if (out->len == 0 || out->fd < 0) {
+    return 0;
+  }
+  int result;
+  if (out->sink != NULL) {
+    result = out->sink(out, pending(out), out->len);
+  } else {
+    struct iovec iov = {pending(out), out->len};
+    result = writev_all(out, &iov, 1);
+  }
+  out->len = 0;
+  return result;
+}
+
+int output_drain(OutputBuffer *out, int fd) {
+  struct iovec iov[2] = {{out->spill, out->spill_len}, {pending(out), out->len}};
+  out->fd = fd;
+  int result = writev_all(out, iov[0].iov_len > 0 ? iov : iov + 1, iov[0].iov_len > 0 ? 2 : 1);
+  out->fd = -1;
+  free(out->spill);
+  out->spill = NULL;
+  out->len = out->spill_len = out->spill_capacity = 0;
+  return result;
+}
+
+ssize_t output_send(OutputBuffer *out, int fd) {
+  if (out->spill_len + out->len == 0) {
+    return 0;
+  }
+  struct iovec iov[2] = {{out->spill, out->spill_len}, {pending(out), out->len}};
+  ssize_t written;
+  do {
+    written = writev(fd, iov[0].iov_len > 0 ? iov : iov + 1, iov[0].iov_len > 0 ? 2 : 1);
+    out->syscalls++;
+  } while (written < 0 && errno == EINTR);
+  if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    return -1;
+  }
+  size_t sent = written > 0 ? (size_t)written : 0;
+
+  // What is left is kept in spill, the unsent part of data after it
+  size_t from_spill = sent < out->spill_len ? sent : out->spill_len;
+  if (from_spill > 0) {
+    memmove(out->spill, out->spill + from_spill, out->spill_len - from_spill);
+    out->spill_len -= from_spill;
+  }
+  size_t from_data = sent - from_spill;
+  int result = spill_append(out, pending(out) + from_data, out->len - from_data);
+  out->len = 0;
+  if (result != 0) {
+    return -1;
+  }
+  if (out->spill_len == 0) {
+    output_discard(out);
+  }
+  return (ssize_t)out->spill_len;
+}
+
+void output_discard(OutputBuffer *out) {
+  free(out->spill);
+  out->spill = NULL;
+  out->len = out->spill_len = out->spill_capacity = 0;
+}
+
 size_t strn_memcpy(char* dest, const char* src, size_t n) {
     // strnlen is async signal safe in recent versions of POSIX
     size_t bytes_to_copy = strnlen(src, n);
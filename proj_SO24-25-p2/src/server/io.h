@@ -1,8 +1,37 @@
 #ifndef KVS_IO_H
 #define KVS_IO_H
 
+#include <stddef.h>
 #include <unistd.h>
 
+#define OUTPUT_BUFFER_SIZE 4096
+
+// Output of a job or session, gathered so that a command costs one write(2)
+// instead of one per pair. Owned by a single thread.
+//
+// An output buffer without a file descriptor keeps the whole output in
+// memory, moving it to spill whenever data fills up, until output_drain
+// writes it out. Segments of a split job use it so that their outputs can
+// be written in the order of the job (see jobs.c).
+//
+// Long sequential outputs, like backups, may gather their output in a
+// larger block provided by the caller instead of data, and have a sink
+// transform it (compress it, for instance) instead of writing it as is.
+typedef struct OutputBuffer {
+  int fd;                // Where the output goes, -1 to keep it in memory
+  size_t len;            // Bytes pending in data (or block)
+  size_t syscalls;       // write/writev calls made so far
+  char *spill;           // Older output of a memory output buffer
+  size_t spill_len;      // Bytes in spill
+  size_t spill_capacity; // Size of spill
+  char *block;           // Caller's buffer used instead of data, NULL if none
+  size_t capacity;       // Size of data, or of block
+  // Called with the pending output instead of writing it to fd, NULL if none
+  int (*sink)(struct OutputBuffer *out, const char *data, size_t len);
+  void *sink_arg;        // Opaque argument of sink
+  char data[OUTPUT_BUFFER_SIZE];
+} OutputBuffer;
+
 /// Writes a string to the given file descriptor.
 /// @param fd The file descriptor to write to.
 /// @param str The string to write.
@@ -13,6 +42,66 @@ void write_str(int fd, const char *str);
 /// @param value The value to write.
 void write_uint(int fd, int value);
 
+/// Initializes an empty output buffer.
+/// @param out The output buffer.
+/// @param fd The file descriptor the output is flushed to.
+void output_init(OutputBuffer *out, int fd);
+
+/// Initializes an empty output buffer that gathers its output in a block of
+/// the caller, so that fewer, larger writes are made. Only uses async
+/// signal safe functions.
+/// @param out The output buffer.
+/// @param fd The file descriptor the output is flushed to.
+/// @param block The block, which must outlive the output buffer.
+/// @param size Size of the block.
+void output_init_block(OutputBuffer *out, int fd, char *block, size_t size);
+
+/// Initializes an empty output buffer that keeps its output in memory.
+/// @param out The output buffer.
+void output_init_memory(OutputBuffer *out);
+
+/// Appends bytes to an output buffer. When they don't fit, the pending
+/// output and the new bytes are written together with a single writev.
+/// Only uses async signal safe functions, unless the output is kept in memory.
+/// @param out The output buffer.
+/// @param data The bytes to append.
+/// @param len Number of bytes.
+/// @return 0 if successful, -1 if the output could not be written.
+int output_write(OutputBuffer *out, const char *data, size_t len);
+
+/// Appends a string to an output buffer (see output_write).
+/// @param out The output buffer.
+/// @param str The string to append.
+/// @return 0 if successful, -1 if the output could not be written.
+int output_str(OutputBuffer *out, const char *str);
+
+/// Writes the pending output. Called at the end of every command. Output
+/// kept in memory stays there.
+/// @param out The output buffer.
+/// @return 0 if successful, -1 if the output could not be written.
+int output_flush(OutputBuffer *out);
+
+/// Writes all the output kept by a memory output buffer with a single
+/// writev and frees it, leaving the buffer empty.
+/// @param out The output buffer.
+/// @param fd The file descriptor to write to.
+/// @return 0 if successful, -1 if the output could not be written.
+int output_drain(OutputBuffer *out, int fd);
+
+/// Writes as much of the output kept by a memory output buffer as a file
+/// descriptor takes without blocking, with a single writev, and keeps the
+/// rest. Used with descriptors opened with O_NONBLOCK, which a full FIFO
+/// would otherwise make fail.
+/// @param out The output buffer.
+/// @param fd The file descriptor to write to.
+/// @return Bytes still kept, 0 once everything was written, or -1 if the
+/// output could not be written.
+ssize_t output_send(OutputBuffer *out, int fd);
+
+/// Drops the output kept by a memory output buffer, leaving it empty.
+/// @param out The output buffer.
+void output_discard(OutputBuffer *out);
+
 /// @brief Copies bytes from src to dest, not including the '\0'
 /// @param dest 
 /// @param src 
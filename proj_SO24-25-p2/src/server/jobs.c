@@ -0,0 +1,594 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "backup_manager.h"
+#include "constants.h"
+#include "io.h"
+#include "jobs.h"
+#include "kvs.h"
+#include "operations.h"
+#include "parser.h"
+#include "scheduler.h"
+
+#define SEGMENT_SIZE (1 << 20) // Mapped jobs larger than this are split in segments
+
+// ---------------------------------------------------
+// ESTRUTURAS DE DADOS
+// ---------------------------------------------------
+
+// Consecutive commands of a job, run as a single task. A job file is split
+// in segments at command boundaries, and consecutive segments are grouped in
+// phases: segments of the same phase touch disjoint keys and contain no
+// SHOW, BACKUP or WAIT, so they can run in any order and in parallel, while
+// phases run one after the other. The output of a segment is kept in memory
+// and written when its phase ends, in the order of the job.
+typedef struct Segment {
+    Task task;            // Must be the first member
+    struct Job* job;
+    size_t start;         // Offset of the first command in the job file
+    size_t end;           // Offset past the last command
+    size_t first_backup;  // BACKUPs of the job before the segment
+    OutputBuffer out;
+} Segment;
+
+typedef struct Job {
+    Task task;            // Opens the job and runs or splits it, must be the first member
+    char in_path[MAX_JOB_FILE_NAME_SIZE];
+    char out_path[MAX_JOB_FILE_NAME_SIZE];
+    char name[MAX_JOB_FILE_NAME_SIZE];
+    size_t size;          // Size of the job file when the directory was scanned
+    int out_fd;
+    InputBuffer* in;
+    Segment* segments;    // NULL unless the job was split
+    size_t num_segments;
+    size_t* phases;       // First segment of each phase, then num_segments
+    size_t num_phases;
+    size_t phase;         // Phase running
+    atomic_size_t running; // Segments of the phase still running
+} Job;
+
+// Open addressing set of key hashes. Two keys with the same hash are taken
+// as the same key, which can only make segments conflict more often.
+typedef struct KeySet {
+    uint64_t* slots;      // 0 marks an empty slot
+    size_t capacity;      // Power of two
+    size_t count;
+} KeySet;
+
+// State of split_job while scanning a job.
+typedef struct Scan {
+    KeySet segment_keys;  // Keys of the segment being scanned
+    KeySet phase_keys;    // Keys of the segments already in the last phase
+    size_t segments_capacity;
+    size_t phases_capacity;
+    bool barrier_phase;   // Whether the last phase is a SHOW, BACKUP or WAIT
+} Scan;
+
+// ---------------------------------------------------
+// VARIÁVEIS GLOBAIS
+// ---------------------------------------------------
+static char* jobs_directory = NULL;
+static Scheduler* scheduler = NULL;
+static CommandArgs* worker_args = NULL; // Reutilizados por todos os comandos de cada worker
+
+// ---------------------------------------------------
+// PROCESSAMENTO DOS .job FILES
+// ---------------------------------------------------
+
+int filter_job_files(const struct dirent* entry) {
+    const char* dot = strrchr(entry->d_name, '.');
+    if (dot != NULL && strcmp(dot, ".job") == 0) {
+        return 1;  // Keep this file (it has the .job extension)
+    }
+    return 0;
+}
+
+static int entry_files(const char* dir, struct dirent* entry, char* in_path, char* out_path) {
+    const char* dot = strrchr(entry->d_name, '.');
+    if (dot == NULL || dot == entry->d_name || strlen(dot) != 4 || strcmp(dot, ".job")) {
+        return 1;
+    }
+
+    if (strlen(entry->d_name) + strlen(dir) + 2 > MAX_JOB_FILE_NAME_SIZE) {
+        fprintf(stderr, "%s/%s\n", dir, entry->d_name);
+        return 1;
+    }
+
+    strcpy(in_path, dir);
+    strcat(in_path, "/");
+    strcat(in_path, entry->d_name);
+
+    strcpy(out_path, in_path);
+    strcpy(strrchr(out_path, '.'), ".out");
+
+    return 0;
+}
+
+static void run_job(InputBuffer* in, OutputBuffer* out, CommandArgs* args, const char* filename,
+                    size_t file_backups) {
+    while (1) {
+        // Output of the previous command is written before the next one starts
+        if (output_flush(out) != 0) {
+            write_str(STDERR_FILENO, "Failed to write output\n");
+        }
+
+        unsigned int delay;
+        size_t num_pairs;
+
+        switch (get_next(in)) {
+            case CMD_WRITE: {
+                num_pairs = parse_write(in, args, MAX_STRING_SIZE);
+                if (num_pairs == 0) {
+                    write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+                    continue;
+                }
+                if (kvs_write(num_pairs, args->keys, args->values)) {
+                    write_str(STDERR_FILENO, "Failed to write pair\n");
+                }
+                break;
+            }
+            case CMD_READ: {
+                num_pairs = parse_read_delete(in, args, MAX_STRING_SIZE);
+                if (num_pairs == 0) {
+                    write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+                    continue;
+                }
+                if (kvs_read(num_pairs, args->keys, out)) {
+                    write_str(STDERR_FILENO, "Failed to read pair\n");
+                }
+                break;
+            }
+            case CMD_DELETE: {
+                num_pairs = parse_read_delete(in, args, MAX_STRING_SIZE);
+                if (num_pairs == 0) {
+                    write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+                    continue;
+                }
+                if (kvs_delete(num_pairs, args->keys, out)) {
+                    write_str(STDERR_FILENO, "Failed to delete pair\n");
+                }
+                break;
+            }
+            case CMD_SHOW: {
+                kvs_show(out);
+                break;
+            }
+            case CMD_WAIT: {
+                if (parse_wait(in, &delay, NULL) == -1) {
+                    write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+                    continue;
+                }
+                if (delay > 0) {
+                    printf("Waiting %d seconds\n", delay / 1000);
+                    kvs_wait(delay);
+                }
+                break;
+            }
+            case CMD_BACKUP: {
+                // Only forks, the backup manager throttles the children
+                if (manager_submit(++file_backups, filename, jobs_directory) != 0) {
+                    write_str(STDERR_FILENO, "Failed to do backup\n");
+                }
+                break;
+            }
+            case CMD_INVALID: {
+                write_str(STDERR_FILENO, "Invalid command. See HELP for usage\n");
+                break;
+            }
+            case CMD_HELP: {
+                write_str(STDOUT_FILENO,
+                    "Available commands:\n"
+                    "  WRITE [(key,value)(key2,value2),...]\n"
+                    "  READ [key,key2,...]\n"
+                    "  DELETE [key,key2,...]\n"
+                    "  SHOW\n"
+                    "  WAIT <delay_ms>\n"
+                    "  BACKUP\n" // Not implemented
+                    "  HELP\n");
+                break;
+            }
+            case CMD_EMPTY: {
+                break;
+            }
+            case EOC: {
+                return;
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------
+// DIVISÃO DOS .job FILES EM SEGMENTOS
+// ---------------------------------------------------
+
+// Adds a hash to a key set.
+// @return 0 if successful, 1 if memory could not be allocated.
+static int keyset_insert(KeySet* set, uint64_t key_hash) {
+    key_hash = key_hash != 0 ? key_hash : 1;
+    if (2 * (set->count + 1) > set->capacity) {
+        size_t capacity = set->capacity == 0 ? 1024 : 2 * set->capacity;
+        uint64_t* slots = calloc(capacity, sizeof(uint64_t));
+        if (slots == NULL) {
+            return 1;
+        }
+        for (size_t i = 0; i < set->capacity; i++) {
+            if (set->slots[i] != 0) {
+                size_t j = set->slots[i] & (capacity - 1);
+                while (slots[j] != 0) {
+                    j = (j + 1) & (capacity - 1);
+                }
+                slots[j] = set->slots[i];
+            }
+        }
+        free(set->slots);
+        set->slots = slots;
+        set->capacity = capacity;
+    }
+
+    size_t i = key_hash & (set->capacity - 1);
+    while (set->slots[i] != 0) {
+        if (set->slots[i] == key_hash) {
+            return 0;
+        }
+        i = (i + 1) & (set->capacity - 1);
+    }
+    set->slots[i] = key_hash;
+    set->count++;
+    return 0;
+}
+
+// Whether a key set has a hash.
+static bool keyset_contains(const KeySet* set, uint64_t key_hash) {
+    key_hash = key_hash != 0 ? key_hash : 1;
+    for (size_t i = key_hash & (set->capacity - 1); set->count > 0 && set->slots[i] != 0;
+         i = (i + 1) & (set->capacity - 1)) {
+        if (set->slots[i] == key_hash) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Empties a key set, keeping its slots.
+static void keyset_clear(KeySet* set) {
+    if (set->count > 0) {
+        memset(set->slots, 0, set->capacity * sizeof(uint64_t));
+        set->count = 0;
+    }
+}
+
+// Adds the keys of a command to the segment being scanned.
+// @return 0 if successful, 1 if memory could not be allocated.
+static int scan_keys(Scan* scan, const Slice* keys, size_t num_keys) {
+    for (size_t i = 0; i < num_keys; i++) {
+        if (keyset_insert(&scan->segment_keys, hash(keys[i].data, keys[i].len)) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Ends the segment being scanned and adds it to the last phase of the job,
+// or to a new phase if it can't run alongside the segments already there.
+// @return 0 if successful, 1 if memory could not be allocated.
+static int close_segment(Job* job, Scan* scan, size_t start, size_t end, size_t first_backup,
+                         bool barrier) {
+    if (job->num_segments == scan->segments_capacity) {
+        size_t capacity = scan->segments_capacity == 0 ? 16 : 2 * scan->segments_capacity;
+        Segment* segments = realloc(job->segments, capacity * sizeof(Segment));
+        if (segments == NULL) {
+            return 1;
+        }
+        job->segments = segments;
+        scan->segments_capacity = capacity;
+    }
+    // The last slot of phases holds num_segments
+    if (job->num_phases + 1 >= scan->phases_capacity) {
+        size_t capacity = scan->phases_capacity == 0 ? 16 : 2 * scan->phases_capacity;
+        size_t* phases = realloc(job->phases, capacity * sizeof(size_t));
+        if (phases == NULL) {
+            return 1;
+        }
+        job->phases = phases;
+        scan->phases_capacity = capacity;
+    }
+
+    bool conflict = job->num_segments == 0 || barrier || scan->barrier_phase;
+    for (size_t i = 0; !conflict && i < scan->segment_keys.capacity; i++) {
+        uint64_t key_hash = scan->segment_keys.slots[i];
+        conflict = key_hash != 0 && keyset_contains(&scan->phase_keys, key_hash);
+    }
+    if (conflict) {
+        job->phases[job->num_phases++] = job->num_segments;
+        keyset_clear(&scan->phase_keys);
+        scan->barrier_phase = barrier;
+    }
+    for (size_t i = 0; i < scan->segment_keys.capacity; i++) {
+        uint64_t key_hash = scan->segment_keys.slots[i];
+        if (key_hash != 0 && keyset_insert(&scan->phase_keys, key_hash) != 0) {
+            return 1;
+        }
+    }
+    keyset_clear(&scan->segment_keys);
+
+    Segment* segment = &job->segments[job->num_segments++];
+    segment->job = job;
+    segment->start = start;
+    segment->end = end;
+    segment->first_backup = first_backup;
+    job->phases[job->num_phases] = job->num_segments;
+    return 0;
+}
+
+// Parses a mapped job once to split it in segments of about SEGMENT_SIZE
+// bytes, each SHOW, BACKUP and WAIT in a segment (and phase) of its own.
+// @return 0 if the job was split in more than one segment, 1 if it has to
+// run as a whole.
+static int split_job(Job* job, CommandArgs* args) {
+    InputBuffer* in = job->in;
+    Scan scan = {{NULL, 0, 0}, {NULL, 0, 0}, 0, 0, false};
+    size_t start = 0, backups = 0;
+    int result = 0;
+
+    while (result == 0) {
+        size_t command_start = in->pos;
+        enum Command command = get_next(in);
+        bool barrier = false;
+        unsigned int delay;
+
+        switch (command) {
+            case CMD_WRITE:
+                result = scan_keys(&scan, args->keys, parse_write(in, args, MAX_STRING_SIZE));
+                break;
+            case CMD_READ:
+            case CMD_DELETE:
+                result = scan_keys(&scan, args->keys, parse_read_delete(in, args, MAX_STRING_SIZE));
+                break;
+            case CMD_WAIT:
+                parse_wait(in, &delay, NULL);
+                barrier = true;
+                break;
+            case CMD_SHOW:
+            case CMD_BACKUP:
+                barrier = true;
+                break;
+            case CMD_HELP:
+            case CMD_EMPTY:
+            case CMD_INVALID:
+                break;
+            case EOC:
+                break;
+        }
+        if (command == EOC || result != 0) {
+            break;
+        }
+
+        if (barrier) {
+            if (command_start > start) {
+                result = close_segment(job, &scan, start, command_start, backups, false);
+            }
+            if (result == 0) {
+                result = close_segment(job, &scan, command_start, in->pos, backups, true);
+            }
+            backups += command == CMD_BACKUP;
+            start = in->pos;
+        } else if (in->pos - start >= SEGMENT_SIZE) {
+            result = close_segment(job, &scan, start, in->pos, backups, false);
+            start = in->pos;
+        }
+    }
+    if (result == 0 && in->len > start) {
+        result = close_segment(job, &scan, start, in->len, backups, false);
+    }
+
+    free(scan.segment_keys.slots);
+    free(scan.phase_keys.slots);
+    if (result != 0 || job->num_segments < 2) {
+        free(job->segments);
+        free(job->phases);
+        job->segments = NULL;
+        job->phases = NULL;
+        job->num_segments = job->num_phases = 0;
+        in->pos = 0;
+        return 1;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------
+// EXECUÇÃO DOS .job FILES
+// ---------------------------------------------------
+
+// Prints the end of a job and releases its files.
+static void finish_job(Job* job) {
+    printf("EOF\n");
+    close(job->in->fd);
+    input_release(job->in);
+    free(job->in);
+    close(job->out_fd);
+    free(job->segments);
+    free(job->phases);
+}
+
+static void run_segment(Task* task);
+
+// Submits the segments of the current phase of a split job.
+static void submit_phase(Job* job) {
+    size_t first = job->phases[job->phase], last = job->phases[job->phase + 1];
+    atomic_store(&job->running, last - first);
+    for (size_t i = first; i < last; i++) {
+        Segment* segment = &job->segments[i];
+        segment->task.run = run_segment;
+        output_init_memory(&segment->out);
+        if (scheduler_submit(scheduler, &segment->task) != 0) {
+            run_segment(&segment->task);
+        }
+    }
+}
+
+// Writes the output of a finished phase, in order, and starts the next one.
+static void finish_phase(Job* job) {
+    for (size_t i = job->phases[job->phase]; i < job->phases[job->phase + 1]; i++) {
+        if (output_drain(&job->segments[i].out, job->out_fd) != 0) {
+            write_str(STDERR_FILENO, "Failed to write output\n");
+        }
+    }
+    if (++job->phase < job->num_phases) {
+        submit_phase(job);
+    } else {
+        finish_job(job);
+    }
+}
+
+static void run_segment(Task* task) {
+    Segment* segment = (Segment*)task;
+    Job* job = segment->job;
+    InputBuffer view;
+    input_view(&view, job->in, segment->start, segment->end);
+    run_job(&view, &segment->out, &worker_args[scheduler_worker()], job->name,
+            segment->first_backup);
+    if (atomic_fetch_sub(&job->running, 1) == 1) {
+        finish_phase(job);
+    }
+}
+
+static void run_job_task(Task* task) {
+    Job* job = (Job*)task;
+
+    int in_fd = open(job->in_path, O_RDONLY);
+    if (in_fd == -1) {
+        write_str(STDERR_FILENO, "Failed to open input file: ");
+        write_str(STDERR_FILENO, job->in_path);
+        write_str(STDERR_FILENO, "\n");
+        return;
+    }
+
+    job->out_fd = open(job->out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (job->out_fd == -1) {
+        write_str(STDERR_FILENO, "Failed to open output file: ");
+        write_str(STDERR_FILENO, job->out_path);
+        write_str(STDERR_FILENO, "\n");
+        close(in_fd);
+        return;
+    }
+
+    job->in = malloc(sizeof(InputBuffer));
+    if (job->in == NULL) {
+        write_str(STDERR_FILENO, "Failed to allocate memory for job\n");
+        close(in_fd);
+        close(job->out_fd);
+        return;
+    }
+    input_init(job->in, in_fd);
+
+    // Streamed jobs can't be split, since segments are parsed from the mapping
+    CommandArgs* args = &worker_args[scheduler_worker()];
+    if (input_map(job->in) == 0 && job->in->len > SEGMENT_SIZE && split_job(job, args) == 0) {
+        job->phase = 0;
+        submit_phase(job);
+        return;
+    }
+
+    OutputBuffer out;
+    output_init(&out, job->out_fd);
+    run_job(job->in, &out, args, job->name, 0);
+    finish_job(job);
+}
+
+// Larger jobs first, so they don't start last and leave the other workers idle
+static int compare_jobs(const void* a, const void* b) {
+    const Job* job_a = a;
+    const Job* job_b = b;
+    return (job_a->size < job_b->size) - (job_a->size > job_b->size);
+}
+
+// Distribui os .job files pelos workers do scheduler
+static void dispatch_jobs(Job* jobs, size_t num_jobs, size_t max_threads) {
+    scheduler = scheduler_create(max_threads);
+    worker_args = malloc(max_threads * sizeof(CommandArgs));
+    if (scheduler == NULL || worker_args == NULL) {
+        fprintf(stderr, "Failed to allocate memory for threads\n");
+        if (scheduler != NULL) {
+            scheduler_destroy(scheduler);
+        }
+        free(worker_args);
+        return;
+    }
+    for (size_t i = 0; i < max_threads; i++) {
+        command_args_init(&worker_args[i]);
+    }
+
+    for (size_t i = 0; i < num_jobs; i++) {
+        jobs[i].task.run = run_job_task;
+        if (scheduler_submit(scheduler, &jobs[i].task) != 0) {
+            fprintf(stderr, "Failed to schedule %s\n", jobs[i].in_path);
+        }
+    }
+
+    if (scheduler_run(scheduler) == 0) {
+        scheduler_report(scheduler);
+    }
+
+    for (size_t i = 0; i < max_threads; i++) {
+        command_args_destroy(&worker_args[i]);
+    }
+    free(worker_args);
+    worker_args = NULL;
+    scheduler_destroy(scheduler);
+    scheduler = NULL;
+}
+
+int process_jobs(char* dir_name, size_t max_threads, size_t max_backups) {
+    jobs_directory = dir_name;
+    if (manager_start(max_backups) != 0) {
+        fprintf(stderr, "Failed to start backup manager\n");
+        return 1;
+    }
+
+    // Lê o diretório inteiro antes de distribuir os .job files
+    struct dirent** entries;
+    int num_entries = scandir(dir_name, &entries, filter_job_files, alphasort);
+    if (num_entries < 0) {
+        perror("Failed to open jobs directory");
+        return 1;
+    }
+
+    Job* jobs = calloc((size_t)num_entries + 1, sizeof(Job));
+    size_t num_jobs = 0;
+    for (int i = 0; i < num_entries; i++) {
+        Job* job = &jobs[num_jobs];
+        struct stat st;
+        if (jobs != NULL && entry_files(dir_name, entries[i], job->in_path, job->out_path) == 0 &&
+            stat(job->in_path, &st) == 0) {
+            strcpy(job->name, entries[i]->d_name);
+            job->size = (size_t)st.st_size;
+            num_jobs++;
+        }
+        free(entries[i]);
+    }
+    free(entries);
+    if (jobs == NULL) {
+        fprintf(stderr, "Failed to allocate memory for jobs\n");
+        return 1;
+    }
+
+    qsort(jobs, num_jobs, sizeof(Job), compare_jobs);
+    dispatch_jobs(jobs, num_jobs, max_threads);
+    free(jobs);
+    return 0;
+}
+
+void wait_backups() {
+    manager_stop();
+    kvs_wait_backup();
+}
@@ -0,0 +1,17 @@
+#ifndef KVS_JOBS_H
+#define KVS_JOBS_H
+
+#include <stddef.h>
+
+/// Processes every .job file of a directory, writing the output of each
+/// one to the correspondent .out file.
+/// @param dir_name Path of the jobs directory.
+/// @param max_threads Number of threads processing job files.
+/// @param max_backups Maximum number of simultaneous backups.
+/// @return 0 if the directory was processed, 1 if it couldn't be opened.
+int process_jobs(char* dir_name, size_t max_threads, size_t max_backups);
+
+/// Waits for the backups that are still running.
+void wait_backups();
+
+#endif  // KVS_JOBS_H
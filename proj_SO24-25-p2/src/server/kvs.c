@@ -1,119 +1,899 @@
 #include "kvs.h"
 #include "string.h"
-#include <ctype.h>
 
+#include <sched.h>
 #include <stdlib.h>
 
-// Hash function based on key initial.
-// @param key Lowercase alphabetical string.
-// @return hash.
-// NOTE: This is not an ideal hash function, but is useful for test purposes of the project
-int hash(const char *key) {
-    int firstLetter = tolower(key[0]);
-    if (firstLetter >= 'a' && firstLetter <= 'z') {
-        return firstLetter - 'a';
-    } else if (firstLetter >= '0' && firstLetter <= '9') {
-        return firstLetter - '0';
+#include "epoch.h"
+#include "slab.h"
+
+#define MAX_LOAD_FACTOR 1   // Grow when count > size * MAX_LOAD_FACTOR
+#define MIN_LOAD_DIVISOR 8  // Shrink when count < size / MIN_LOAD_DIVISOR
+#define REHASH_STEP 4       // Old buckets migrated by each resize_step
+
+_Static_assert(TABLE_SIZE >= LOCK_STRIPES, "buckets must not share a stripe across resizes");
+_Static_assert(LOCK_STRIPES == 64, "stripe masks are 64 bits wide");
+
+uint64_t hash(const char *key, size_t len) {
+    uint64_t h = 14695981039346656037ULL; // FNV-1a offset basis
+    const unsigned char *bytes = (const unsigned char *)key;
+    for (size_t i = 0; i < len; i++) {
+        h ^= bytes[i];
+        h *= 1099511628211ULL; // FNV-1a prime
     }
-    return -1; // Invalid index for non-alphabetic or number strings
+    // Final avalanche (fmix64 from MurmurHash3), so the low bits used as the
+    // bucket index depend on every byte of the key
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
 }
 
-struct HashTable* create_hash_table() {
-	HashTable *ht = malloc(sizeof(HashTable));
-	if (!ht) return NULL;
-	for (int i = 0; i < TABLE_SIZE; i++) {
-		ht->table[i] = NULL;
-	}
-	pthread_rwlock_init(&ht->tablelock, NULL);
-	return ht;
+// Allocates an empty bucket array.
+// @param size Number of buckets (power of two).
+// @return The bucket array, NULL on failure.
+static Buckets *create_buckets(size_t size) {
+    Buckets *buckets = malloc(sizeof(Buckets) + size * sizeof(_Atomic(KeyNode *)));
+    if (buckets == NULL) {
+        return NULL;
+    }
+    buckets->size = size;
+    for (size_t i = 0; i < size; i++) {
+        atomic_init(&buckets->heads[i], NULL);
+    }
+    return buckets;
 }
 
-int write_pair(HashTable *ht, const char *key, const char *value) {
-    int index = hash(key);
+// Bucket of a hash in a bucket array.
+// @param buckets Bucket array.
+// @param h Hash of the key.
+// @return Pointer to the head of the bucket list.
+static _Atomic(KeyNode *) *bucket_of(Buckets *buckets, uint64_t h) {
+    return &buckets->heads[h & (buckets->size - 1)];
+}
 
-    // Search for the key node
-	KeyNode *keyNode = ht->table[index];
-    KeyNode *previousNode;
+// Size of a node holding a key and a value of the given lengths.
+static size_t node_size(size_t key_len, size_t value_len) {
+    return sizeof(KeyNode) + key_len + 1 + value_len + 1;
+}
+
+// Allocates a node and copies the pair into it. The next pointer is left
+// for the caller to set.
+// @return The node, NULL on failure.
+static KeyNode *create_node(const char *key, size_t key_len, const char *value,
+                            size_t value_len, uint64_t h, uint32_t generation) {
+    KeyNode *keyNode = slab_alloc(node_size(key_len, value_len));
+    if (keyNode == NULL) {
+        return NULL;
+    }
+    keyNode->hash = h;
+    keyNode->generation = generation;
+    keyNode->key_len = (uint8_t)key_len;
+    keyNode->value_len = (uint8_t)value_len;
+    memcpy(keyNode->data, key, key_len);
+    keyNode->data[key_len] = '\0';
+    memcpy(keyNode->data + key_len + 1, value, value_len);
+    keyNode->data[key_len + 1 + value_len] = '\0';
+    return keyNode;
+}
+
+// Gives a node back to the slab.
+// @param ptr The node.
+static void destroy_node(void *ptr) {
+    KeyNode *keyNode = ptr;
+    slab_free(keyNode, node_size(keyNode->key_len, keyNode->value_len));
+}
+
+// Gives saved nodes back to the slab, and frees their array.
+// @param ptr The SavedNodes.
+static void destroy_saved(void *ptr) {
+    SavedNodes *saved = ptr;
+    for (size_t i = 0; i < saved->len; i++) {
+        destroy_node(saved->nodes[i]);
+    }
+    free(saved);
+}
 
+// Whether a node holds a key.
+static bool node_matches(const KeyNode *keyNode, const char *key, size_t len, uint64_t h) {
+    return keyNode->hash == h && keyNode->key_len == len && memcmp(keyNode->data, key, len) == 0;
+}
+
+// Searches a bucket list for a key.
+// @return Link pointing to the node holding the key, NULL if not found.
+static _Atomic(KeyNode *) *find_in_bucket(_Atomic(KeyNode *) *link, const char *key, size_t len,
+                                          uint64_t h) {
+    KeyNode *keyNode;
+    while ((keyNode = atomic_load_explicit(link, memory_order_relaxed)) != NULL) {
+        if (node_matches(keyNode, key, len, h)) {
+            return link;
+        }
+        link = &keyNode->next;
+    }
+    return NULL;
+}
+
+// Searches a bucket list for a key, without locks.
+// @return Node holding the key, NULL if not found.
+static KeyNode *find_node(_Atomic(KeyNode *) *head, const char *key, size_t len, uint64_t h) {
+    KeyNode *keyNode = atomic_load_explicit(head, memory_order_acquire);
     while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // overwrite value
-            free(keyNode->value);
-            keyNode->value = strdup(value);
-            return 0;
-        }
-        previousNode = keyNode;
-        keyNode = previousNode->next; // Move to the next node
-    }
-    // Key not found, create a new key node
-    keyNode = malloc(sizeof(KeyNode));
-    keyNode->key = strdup(key); // Allocate memory for the key
-    keyNode->value = strdup(value); // Allocate memory for the value
-    keyNode->next = ht->table[index]; // Link to existing nodes
-    ht->table[index] = keyNode; // Place new key node at the start of the list
+        if (node_matches(keyNode, key, len, h)) {
+            return keyNode;
+        }
+        keyNode = atomic_load_explicit(&keyNode->next, memory_order_acquire);
+    }
+    return NULL;
+}
+
+// Searches the table for a key, looking at the bucket array being drained
+// first (migrated buckets are left empty, so this is always correct).
+// The stripe of the key must be locked.
+// @return Link pointing to the node holding the key, NULL if not found.
+static _Atomic(KeyNode *) *find_link(HashTable *ht, const char *key, size_t len, uint64_t h) {
+    Buckets *old = atomic_load_explicit(&ht->old_table, memory_order_relaxed);
+    if (old != NULL) {
+        _Atomic(KeyNode *) *link = find_in_bucket(bucket_of(old, h), key, len, h);
+        if (link != NULL) {
+            return link;
+        }
+    }
+    Buckets *current = atomic_load_explicit(&ht->table, memory_order_relaxed);
+    return find_in_bucket(bucket_of(current, h), key, len, h);
+}
+
+// Searches the table for a key without locks. Must be called inside an
+// epoch. A miss is only trusted if no resize moved nodes of the stripe while
+// the buckets were being searched, as a moved node may have been skipped.
+// @return Node holding the key, NULL if not found.
+static KeyNode *lookup(HashTable *ht, const char *key, size_t len, uint64_t h) {
+    Stripe *stripe = &ht->stripes[h & (LOCK_STRIPES - 1)];
+    while (1) {
+        unsigned seq = atomic_load_explicit(&stripe->seq, memory_order_acquire);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        KeyNode *keyNode = NULL;
+        Buckets *old = atomic_load_explicit(&ht->old_table, memory_order_acquire);
+        if (old != NULL) {
+            keyNode = find_node(bucket_of(old, h), key, len, h);
+        }
+        if (keyNode == NULL) {
+            Buckets *current = atomic_load_explicit(&ht->table, memory_order_acquire);
+            keyNode = find_node(bucket_of(current, h), key, len, h);
+        }
+        if (keyNode != NULL) {
+            return keyNode;
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&stripe->seq, memory_order_relaxed) == seq) {
+            return NULL;
+        }
+    }
+}
+
+// Marks the start of a change that moves nodes of a stripe between bucket
+// arrays. The stripe must be locked exclusively.
+static void begin_move(Stripe *stripe) {
+    unsigned seq = atomic_load_explicit(&stripe->seq, memory_order_relaxed);
+    atomic_store_explicit(&stripe->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+// Marks the end of a change started with begin_move.
+static void end_move(Stripe *stripe) {
+    unsigned seq = atomic_load_explicit(&stripe->seq, memory_order_relaxed);
+    atomic_store_explicit(&stripe->seq, seq + 1, memory_order_release);
+}
+
+uint64_t stripe_of(const char *key, size_t len) {
+    return 1ULL << (hash(key, len) & (LOCK_STRIPES - 1));
+}
+
+void lock_stripes(HashTable *ht, uint64_t stripes, bool exclusive) {
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        if (stripes & (1ULL << i)) {
+            if (exclusive) {
+                pthread_rwlock_wrlock(&ht->stripes[i].lock);
+            } else {
+                pthread_rwlock_rdlock(&ht->stripes[i].lock);
+            }
+        }
+    }
+}
+
+void unlock_stripes(HashTable *ht, uint64_t stripes) {
+    for (int i = LOCK_STRIPES - 1; i >= 0; i--) {
+        if (stripes & (1ULL << i)) {
+            pthread_rwlock_unlock(&ht->stripes[i].lock);
+        }
+    }
+}
+
+// Migrates up to REHASH_STEP buckets of the old bucket array that belong to
+// a stripe. The stripe must be locked exclusively.
+// @param stripe Index of the stripe.
+// @return true if this was the last old bucket to be migrated.
+static bool migrate_stripe(HashTable *ht, size_t stripe) {
+    Buckets *old = atomic_load_explicit(&ht->old_table, memory_order_relaxed);
+    Buckets *current = atomic_load_explicit(&ht->table, memory_order_relaxed);
+    size_t n = 0;
+    size_t index = ht->rehash_next[stripe];
+    if (index >= old->size) {
+        return false;
+    }
+
+    begin_move(&ht->stripes[stripe]);
+    for (; n < REHASH_STEP && index < old->size; n++, index += LOCK_STRIPES) {
+        KeyNode *keyNode = atomic_load_explicit(&old->heads[index], memory_order_relaxed);
+        atomic_store_explicit(&old->heads[index], NULL, memory_order_release);
+        while (keyNode != NULL) {
+            KeyNode *next = atomic_load_explicit(&keyNode->next, memory_order_relaxed);
+            _Atomic(KeyNode *) *bucket = bucket_of(current, keyNode->hash);
+            atomic_store_explicit(&keyNode->next, atomic_load_explicit(bucket, memory_order_relaxed),
+                                  memory_order_release);
+            atomic_store_explicit(bucket, keyNode, memory_order_release);
+            keyNode = next;
+        }
+    }
+    end_move(&ht->stripes[stripe]);
+
+    ht->rehash_next[stripe] = index;
+    return atomic_fetch_add(&ht->migrated, n) + n == old->size;
+}
+
+// Retires the old bucket array once every bucket has been migrated.
+static void finish_resize(HashTable *ht) {
+    lock_stripes(ht, ALL_STRIPES, true);
+    Buckets *old = atomic_load_explicit(&ht->old_table, memory_order_relaxed);
+    if (old != NULL && atomic_load(&ht->migrated) == old->size) {
+        atomic_store_explicit(&ht->old_table, NULL, memory_order_release);
+        atomic_store(&ht->resizing, false);
+        epoch_retire(old, free); // Readers may still be looking at its empty buckets
+    }
+    unlock_stripes(ht, ALL_STRIPES);
+}
+
+// Replaces the bucket array by one with new_size buckets, leaving the
+// current one to be drained by resize_step. If the new array can't be
+// allocated the table simply keeps its current size.
+// @param size Number of buckets the table had when the resize was decided.
+// @param new_size Number of buckets of the new array.
+static void start_resize(HashTable *ht, size_t size, size_t new_size) {
+    Buckets *new_table = create_buckets(new_size);
+    if (new_table == NULL) {
+        return;
+    }
+
+    lock_stripes(ht, ALL_STRIPES, true);
+    Buckets *current = atomic_load_explicit(&ht->table, memory_order_relaxed);
+    if (atomic_load_explicit(&ht->old_table, memory_order_relaxed) != NULL ||
+        current->size != size) {
+        // Another thread resized the table in the meantime
+        unlock_stripes(ht, ALL_STRIPES);
+        free(new_table);
+        return;
+    }
+    for (size_t i = 0; i < LOCK_STRIPES; i++) {
+        begin_move(&ht->stripes[i]);
+        ht->rehash_next[i] = i;
+    }
+    atomic_store(&ht->migrated, 0);
+    atomic_store_explicit(&ht->old_table, current, memory_order_release);
+    atomic_store_explicit(&ht->table, new_table, memory_order_release);
+    for (size_t i = 0; i < LOCK_STRIPES; i++) {
+        end_move(&ht->stripes[i]);
+    }
+    atomic_store(&ht->capacity, new_size);
+    atomic_store(&ht->resizing, true);
+    unlock_stripes(ht, ALL_STRIPES);
+}
+
+int reserve_table(HashTable *ht, size_t count) {
+    size_t size = atomic_load(&ht->capacity);
+    size_t new_size = size;
+    while (new_size * MAX_LOAD_FACTOR < count) {
+        new_size *= 2;
+    }
+    if (new_size == size) {
+        return 0;
+    }
+    if (atomic_load(&ht->count) != 0 || atomic_load(&ht->resizing)) {
+        return 1;
+    }
+
+    Buckets *new_table = create_buckets(new_size);
+    if (new_table == NULL) {
+        return 1;
+    }
+    Buckets *old = atomic_load_explicit(&ht->table, memory_order_relaxed);
+    atomic_store_explicit(&ht->table, new_table, memory_order_release);
+    atomic_store(&ht->capacity, new_size);
+    free(old);
     return 0;
 }
 
-char* read_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
+void resize_step(HashTable *ht) {
+    if (atomic_load(&ht->resizing)) {
+        // Stripes are helped in turns, so every one of them gets drained
+        // even if writes only hit a few
+        size_t stripe = atomic_fetch_add(&ht->help_cursor, 1) % LOCK_STRIPES;
+        bool last = false;
+        pthread_rwlock_wrlock(&ht->stripes[stripe].lock);
+        if (atomic_load_explicit(&ht->old_table, memory_order_relaxed) != NULL) {
+            last = migrate_stripe(ht, stripe);
+        }
+        pthread_rwlock_unlock(&ht->stripes[stripe].lock);
+        if (last) {
+            finish_resize(ht);
+        }
+        return;
+    }
 
-	KeyNode *keyNode = ht->table[index];
-    KeyNode *previousNode;
-    char *value;
+    size_t count = atomic_load(&ht->count);
+    size_t size = atomic_load(&ht->capacity);
+    if (count > size * MAX_LOAD_FACTOR) {
+        start_resize(ht, size, size * 2);
+    } else if (size > TABLE_SIZE && count < size / MIN_LOAD_DIVISOR) {
+        start_resize(ht, size, size / 2);
+    }
+}
 
-    while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            value = strdup(keyNode->value);
-            return value; // Return the value if found
+// Logs a key changed in the current generation. The stripe of the key must
+// be locked exclusively.
+// @param old Node that held the key before the change, NULL if none.
+static void log_change(HashTable *ht, const KeyNode *old, const char *key, size_t len, uint64_t h) {
+    if (!ht->track_changes || (old != NULL && old->generation == ht->generation)) {
+        return; // Not tracked, or already logged when old was written
+    }
+    Stripe *stripe = &ht->stripes[h & (LOCK_STRIPES - 1)];
+    if (stripe->changes_len + 1 + len > stripe->changes_capacity) {
+        size_t capacity = stripe->changes_capacity == 0 ? 1024 : 2 * stripe->changes_capacity;
+        char *changes = realloc(stripe->changes, capacity);
+        if (changes == NULL) {
+            atomic_store(&ht->changes_lost, true);
+            return;
+        }
+        stripe->changes = changes;
+        stripe->changes_capacity = capacity;
+    }
+    stripe->changes[stripe->changes_len++] = (char)len;
+    memcpy(stripe->changes + stripe->changes_len, key, len);
+    stripe->changes_len += len;
+}
+
+// Retires a node that was replaced or deleted, unless a snapshot that
+// hasn't visited its stripe yet holds it, in which case it is saved for the
+// snapshot. The stripe of the node must be locked exclusively.
+static void retire_node(HashTable *ht, KeyNode *keyNode) {
+    Stripe *stripe = &ht->stripes[keyNode->hash & (LOCK_STRIPES - 1)];
+    if (stripe->snapshot_pending && keyNode->generation <= ht->snapshot_generation) {
+        SavedNodes *saved = stripe->saved;
+        if (saved == NULL || saved->len == saved->capacity) {
+            size_t capacity = saved == NULL ? 64 : 2 * saved->capacity;
+            saved = realloc(saved, sizeof(SavedNodes) + capacity * sizeof(KeyNode *));
+            if (saved == NULL) {
+                atomic_store(&ht->snapshot_lost, true);
+                epoch_retire(keyNode, destroy_node);
+                return;
+            }
+            if (stripe->saved == NULL) {
+                saved->len = 0;
+            }
+            saved->capacity = capacity;
+            stripe->saved = saved;
         }
-        previousNode = keyNode;
-        keyNode = previousNode->next; // Move to the next node
+        saved->nodes[saved->len++] = keyNode;
+        return;
     }
+    epoch_retire(keyNode, destroy_node);
+}
 
-    return NULL; // Key not found
+void resize_now(HashTable *ht) {
+    do {
+        resize_step(ht);
+    } while (atomic_load(&ht->resizing));
 }
 
-int delete_pair(HashTable *ht, const char *key) {
-    int index = hash(key);
+struct HashTable* create_hash_table() {
+    HashTable *ht = aligned_alloc(_Alignof(HashTable), sizeof(HashTable));
+    if (!ht) return NULL;
+    Buckets *table = create_buckets(TABLE_SIZE);
+    if (!table) {
+        free(ht);
+        return NULL;
+    }
+    atomic_init(&ht->table, table);
+    atomic_init(&ht->old_table, NULL);
+    atomic_init(&ht->migrated, 0);
+    atomic_init(&ht->count, 0);
+    atomic_init(&ht->capacity, TABLE_SIZE);
+    atomic_init(&ht->resizing, false);
+    atomic_init(&ht->help_cursor, 0);
+    ht->generation = 0;
+    ht->track_changes = false;
+    atomic_init(&ht->changes_lost, false);
+    ht->snapshot_generation = 0;
+    atomic_init(&ht->snapshot_active, false);
+    atomic_init(&ht->snapshot_lost, false);
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        Stripe *stripe = &ht->stripes[i];
+        pthread_rwlock_init(&stripe->lock, NULL);
+        atomic_init(&stripe->seq, 0);
+        stripe->changes = NULL;
+        stripe->changes_len = 0;
+        stripe->changes_capacity = 0;
+        stripe->snapshot_pending = false;
+        stripe->saved = NULL;
+        stripe->snapshot_changes = NULL;
+        stripe->snapshot_changes_len = 0;
+        stripe->snapshot_changes_capacity = 0;
+    }
+    return ht;
+}
+
+int write_pair(HashTable *ht, const char *key, size_t key_len, const char *value,
+               size_t value_len) {
+    if (key_len > UINT8_MAX || value_len > UINT8_MAX) {
+        return 1;
+    }
+    uint64_t h = hash(key, key_len);
+
+    KeyNode *keyNode = create_node(key, key_len, value, value_len, h, ht->generation);
+    if (keyNode == NULL) {
+        return 1;
+    }
 
     // Search for the key node
-    KeyNode *keyNode = ht->table[index];
-    KeyNode *prevNode = NULL;
+    _Atomic(KeyNode *) *link = find_link(ht, key, key_len, h);
+    if (link != NULL) {
+        // Replace the node in place, readers already on the old one still
+        // see its value and can follow its next pointer until it is freed
+        KeyNode *old = atomic_load_explicit(link, memory_order_relaxed);
+        log_change(ht, old, key, key_len, h);
+        atomic_init(&keyNode->next, atomic_load_explicit(&old->next, memory_order_relaxed));
+        atomic_store_explicit(link, keyNode, memory_order_release);
+        retire_node(ht, old);
+        return 0;
+    }
+
+    // Key not found, link to existing nodes, then publish the fully built
+    // node at the start of the list
+    log_change(ht, NULL, key, key_len, h);
+    _Atomic(KeyNode *) *bucket = bucket_of(atomic_load_explicit(&ht->table, memory_order_relaxed), h);
+    atomic_init(&keyNode->next, atomic_load_explicit(bucket, memory_order_relaxed));
+    atomic_store_explicit(bucket, keyNode, memory_order_release);
+    atomic_fetch_add(&ht->count, 1);
+    return 0;
+}
 
+const char* read_pair(HashTable *ht, const char *key, size_t key_len, size_t *len) {
+    KeyNode *keyNode = lookup(ht, key, key_len, hash(key, key_len));
+    if (keyNode == NULL) {
+        return NULL; // Key not found
+    }
+    // Return the value if found, the node is only freed after the caller's epoch
+    if (len != NULL) {
+        *len = keyNode->value_len;
+    }
+    return node_value(keyNode);
+}
+
+int delete_pair(HashTable *ht, const char *key, size_t key_len) {
+    uint64_t h = hash(key, key_len);
+    _Atomic(KeyNode *) *link = find_link(ht, key, key_len, h);
+    if (link == NULL) {
+        return 1;
+    }
+
+    // Key found; bypass the node, readers already on it can still follow
+    // its next pointer until it is freed
+    KeyNode *keyNode = atomic_load_explicit(link, memory_order_relaxed);
+    log_change(ht, keyNode, key, key_len, h);
+    atomic_store_explicit(link, atomic_load_explicit(&keyNode->next, memory_order_relaxed),
+                          memory_order_release);
+    retire_node(ht, keyNode);
+    atomic_fetch_sub(&ht->count, 1);
+    return 0;
+}
+
+// Calls visit for every node of a bucket list.
+static void visit_bucket(_Atomic(KeyNode *) *head,
+                         void (*visit)(const KeyNode *node, void *arg), void *arg) {
+    KeyNode *keyNode = atomic_load_explicit(head, memory_order_acquire);
     while (keyNode != NULL) {
-        if (strcmp(keyNode->key, key) == 0) {
-            // Key found; delete this node
-            if (prevNode == NULL) {
-                // Node to delete is the first node in the list
-                ht->table[index] = keyNode->next; // Update the table to point to the next node
+        visit(keyNode, arg);
+        keyNode = atomic_load_explicit(&keyNode->next, memory_order_acquire);
+    }
+}
+
+void iterate_pairs(HashTable *ht, uint64_t stripes,
+                   void (*visit)(const KeyNode *node, void *arg), void *arg) {
+    Buckets *old = atomic_load_explicit(&ht->old_table, memory_order_relaxed);
+    if (old != NULL) {
+        for (size_t i = 0; i < old->size; i++) {
+            if (stripes & (1ULL << (i % LOCK_STRIPES))) {
+                visit_bucket(&old->heads[i], visit, arg);
+            }
+        }
+    }
+    Buckets *current = atomic_load_explicit(&ht->table, memory_order_relaxed);
+    for (size_t i = 0; i < current->size; i++) {
+        if (stripes & (1ULL << (i % LOCK_STRIPES))) {
+            visit_bucket(&current->heads[i], visit, arg);
+        }
+    }
+}
+
+int iterate_stripe(HashTable *ht, size_t stripe,
+                   void (*visit)(const KeyNode *node, void *arg), void *arg) {
+    unsigned seq = atomic_load_explicit(&ht->stripes[stripe].seq, memory_order_acquire);
+    if (seq & 1) {
+        sched_yield();
+        return 1;
+    }
+
+    Buckets *old = atomic_load_explicit(&ht->old_table, memory_order_acquire);
+    if (old != NULL) {
+        for (size_t i = stripe; i < old->size; i += LOCK_STRIPES) {
+            visit_bucket(&old->heads[i], visit, arg);
+        }
+    }
+    Buckets *current = atomic_load_explicit(&ht->table, memory_order_acquire);
+    for (size_t i = stripe; i < current->size; i += LOCK_STRIPES) {
+        visit_bucket(&current->heads[i], visit, arg);
+    }
+
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&ht->stripes[stripe].seq, memory_order_relaxed) != seq;
+}
+
+void track_changes(HashTable *ht) {
+    ht->track_changes = true;
+}
+
+int visit_changes(HashTable *ht, uint64_t stripes,
+                  void (*visit)(const char *key, size_t len, const KeyNode *node, void *arg),
+                  void *arg) {
+    for (size_t i = 0; i < LOCK_STRIPES; i++) {
+        if (!(stripes & (1ULL << i))) {
+            continue;
+        }
+        const Stripe *stripe = &ht->stripes[i];
+        size_t pos = 0;
+        while (pos < stripe->changes_len) {
+            size_t len = (unsigned char)stripe->changes[pos++];
+            const char *key = stripe->changes + pos;
+            pos += len;
+            _Atomic(KeyNode *) *link = find_link(ht, key, len, hash(key, len));
+            visit(key, len, link != NULL ? atomic_load_explicit(link, memory_order_relaxed) : NULL,
+                  arg);
+        }
+    }
+    return atomic_load(&ht->changes_lost);
+}
+
+uint32_t next_generation(HashTable *ht) {
+    for (size_t i = 0; i < LOCK_STRIPES; i++) {
+        ht->stripes[i].changes_len = 0;
+    }
+    atomic_store(&ht->changes_lost, false);
+    return ht->generation++;
+}
+
+uint32_t snapshot_begin(HashTable *ht) {
+    ht->snapshot_generation = ht->generation;
+    atomic_store(&ht->snapshot_lost, false);
+    atomic_store(&ht->snapshot_active, true);
+    for (size_t i = 0; i < LOCK_STRIPES; i++) {
+        Stripe *stripe = &ht->stripes[i];
+        stripe->snapshot_pending = true;
+        // The snapshot takes the keys changed in the generation that ends,
+        // and the new one is logged in the buffer of the previous snapshot
+        char *changes = stripe->snapshot_changes;
+        size_t capacity = stripe->snapshot_changes_capacity;
+        stripe->snapshot_changes = stripe->changes;
+        stripe->snapshot_changes_len = stripe->changes_len;
+        stripe->snapshot_changes_capacity = stripe->changes_capacity;
+        stripe->changes = changes;
+        stripe->changes_len = 0;
+        stripe->changes_capacity = capacity;
+    }
+    atomic_store(&ht->changes_lost, false);
+    return ht->generation++;
+}
+
+// Stops saving nodes of the snapshot in a stripe and hands over the ones
+// saved so far. From now on its nodes are retired as usual, so the caller
+// must have found them already, inside the epoch it is still in. The stripe
+// must be locked exclusively.
+// @return The saved nodes, to be passed to retire_saved, NULL if none.
+static SavedNodes *take_saved(Stripe *stripe) {
+    SavedNodes *saved = stripe->saved;
+    stripe->saved = NULL;
+    stripe->snapshot_pending = false;
+    return saved;
+}
+
+// Retires the nodes handed over by take_saved. They are retired as a
+// single pointer: thousands of them retired one by one would make the
+// writers reclaiming them stall.
+static void retire_saved(SavedNodes *saved) {
+    if (saved != NULL) {
+        epoch_retire(saved, destroy_saved);
+    }
+}
+
+// Nodes of a snapshot found in a stripe without locks.
+typedef struct NodeList {
+    const KeyNode **nodes;
+    size_t len;
+    size_t capacity;
+    uint32_t generation; // Generation of the snapshot, newer nodes are skipped
+    bool failed;         // Whether the list couldn't grow
+} NodeList;
+
+// Adds a node to a NodeList if it belongs to the snapshot.
+// @param arg Pointer to the NodeList.
+static void collect_node(const KeyNode *keyNode, void *arg) {
+    NodeList *list = arg;
+    if (keyNode->generation > list->generation || list->failed) {
+        return;
+    }
+    if (list->len == list->capacity) {
+        size_t capacity = list->capacity == 0 ? 1024 : 2 * list->capacity;
+        const KeyNode **nodes = realloc(list->nodes, capacity * sizeof(KeyNode *));
+        if (nodes == NULL) {
+            list->failed = true;
+            return;
+        }
+        list->nodes = nodes;
+        list->capacity = capacity;
+    }
+    list->nodes[list->len++] = keyNode;
+}
+
+// Visit of the nodes of a snapshot, skipping newer ones.
+typedef struct SnapshotVisit {
+    void (*visit)(const KeyNode *node, void *arg);
+    void *arg;
+    uint32_t generation;
+} SnapshotVisit;
+
+static void visit_snapshot_node(const KeyNode *keyNode, void *arg) {
+    SnapshotVisit *snapshot = arg;
+    if (keyNode->generation <= snapshot->generation) {
+        snapshot->visit(keyNode, snapshot->arg);
+    }
+}
+
+static int compare_addresses(const void *a, const void *b) {
+    uintptr_t x = (uintptr_t)*(const KeyNode *const *)a;
+    uintptr_t y = (uintptr_t)*(const KeyNode *const *)b;
+    return (x > y) - (x < y);
+}
+
+static int compare_hashes(const void *a, const void *b) {
+    uint64_t x = (*(const KeyNode *const *)a)->hash;
+    uint64_t y = (*(const KeyNode *const *)b)->hash;
+    return (x > y) - (x < y);
+}
+
+void snapshot_pairs(HashTable *ht, uint64_t stripes,
+                    void (*visit)(const KeyNode *node, void *arg), void *arg) {
+    NodeList list = {NULL, 0, 0, ht->snapshot_generation, false};
+    for (size_t i = 0; i < LOCK_STRIPES; i++) {
+        if (!(stripes & (1ULL << i))) {
+            continue;
+        }
+        Stripe *stripe = &ht->stripes[i];
+        SavedNodes *saved;
+        epoch_enter();
+        int retry;
+        do {
+            list.len = 0;
+            retry = iterate_stripe(ht, i, collect_node, &list);
+        } while (retry && !list.failed);
+
+        if (list.failed) {
+            // Out of memory, visit the stripe while holding its lock
+            list.failed = false;
+            SnapshotVisit snapshot = {visit, arg, ht->snapshot_generation};
+            lock_stripes(ht, 1ULL << i, true);
+            iterate_stripe(ht, i, visit_snapshot_node, &snapshot);
+            saved = take_saved(stripe);
+            for (size_t j = 0; saved != NULL && j < saved->len; j++) {
+                visit(saved->nodes[j], arg);
+            }
+            unlock_stripes(ht, 1ULL << i);
+            epoch_exit();
+            retire_saved(saved);
+            continue;
+        }
+
+        lock_stripes(ht, 1ULL << i, true);
+        saved = take_saved(stripe);
+        unlock_stripes(ht, 1ULL << i);
+
+        for (size_t j = 0; j < list.len; j++) {
+            visit(list.nodes[j], arg);
+        }
+        // A node unlinked after it was collected is saved as well
+        if (saved != NULL) {
+            if (list.len > 1) {
+                qsort(list.nodes, list.len, sizeof(KeyNode *), compare_addresses);
+            }
+            for (size_t j = 0; j < saved->len; j++) {
+                if (list.len == 0 || bsearch(&saved->nodes[j], list.nodes, list.len,
+                                             sizeof(KeyNode *), compare_addresses) == NULL) {
+                    visit(saved->nodes[j], arg);
+                }
+            }
+        }
+        epoch_exit();
+        retire_saved(saved);
+    }
+    free(list.nodes);
+}
+
+// Node of a key in a snapshot.
+// @param current Node holding the key in the table, NULL if none.
+// @param saved Nodes saved for the snapshot in the stripe of the key,
+// sorted by hash, NULL if none.
+// @return The node, NULL if the key wasn't in the snapshot.
+static const KeyNode *snapshot_node(HashTable *ht, const KeyNode *current,
+                                    const SavedNodes *saved, const char *key, size_t len,
+                                    uint64_t h) {
+    if (current != NULL && current->generation <= ht->snapshot_generation) {
+        return current;
+    }
+    if (saved == NULL) {
+        return NULL;
+    }
+    // Otherwise the node of the snapshot, if any, was unlinked and saved
+    size_t count = saved->len;
+    size_t low = 0, high = count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (saved->nodes[mid]->hash < h) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    for (; low < count && saved->nodes[low]->hash == h; low++) {
+        if (node_matches(saved->nodes[low], key, len, h)) {
+            return saved->nodes[low];
+        }
+    }
+    return NULL;
+}
+
+void snapshot_changes(HashTable *ht, uint64_t stripes,
+                      void (*visit)(const char *key, size_t len, const KeyNode *node, void *arg),
+                      void *arg) {
+    const KeyNode **found = NULL;
+    size_t found_capacity = 0;
+    for (size_t i = 0; i < LOCK_STRIPES; i++) {
+        if (!(stripes & (1ULL << i))) {
+            continue;
+        }
+        Stripe *stripe = &ht->stripes[i];
+        const char *changes = stripe->snapshot_changes;
+        size_t changes_len = stripe->snapshot_changes_len;
+        size_t num_keys = 0;
+        for (size_t pos = 0; pos < changes_len; pos += 1 + (unsigned char)changes[pos]) {
+            num_keys++;
+        }
+        if (num_keys > found_capacity) {
+            free(found);
+            found_capacity = num_keys;
+            found = malloc(found_capacity * sizeof(KeyNode *));
+            if (found == NULL) {
+                found_capacity = 0;
+            }
+        }
+
+        epoch_enter();
+        bool locked = found == NULL && num_keys > 0;
+        if (locked) {
+            // Out of memory, look the keys up while holding the lock
+            lock_stripes(ht, 1ULL << i, true);
+        } else {
+            // Nodes found before the saved ones are taken are still the
+            // snapshot's, or were saved
+            size_t j = 0;
+            for (size_t pos = 0; pos < changes_len; j++) {
+                size_t len = (unsigned char)changes[pos++];
+                found[j] = lookup(ht, changes + pos, len, hash(changes + pos, len));
+                pos += len;
+            }
+            lock_stripes(ht, 1ULL << i, true);
+        }
+        SavedNodes *saved = take_saved(stripe);
+        if (!locked) {
+            unlock_stripes(ht, 1ULL << i);
+        }
+
+        if (saved != NULL) {
+            qsort(saved->nodes, saved->len, sizeof(KeyNode *), compare_hashes);
+        }
+        size_t j = 0;
+        for (size_t pos = 0; pos < changes_len; j++) {
+            size_t len = (unsigned char)changes[pos++];
+            const char *key = changes + pos;
+            pos += len;
+            uint64_t h = hash(key, len);
+            const KeyNode *current;
+            if (locked) {
+                _Atomic(KeyNode *) *link = find_link(ht, key, len, h);
+                current = link != NULL ? atomic_load_explicit(link, memory_order_relaxed) : NULL;
             } else {
-                // Node to delete is not the first; bypass it
-                prevNode->next = keyNode->next; // Link the previous node to the next node
+                current = found[j];
             }
-            // Free the memory allocated for the key and value
-            free(keyNode->key);
-            free(keyNode->value);
-            free(keyNode); // Free the key node itself
-            return 0; // Exit the function
+            visit(key, len, snapshot_node(ht, current, saved, key, len, h), arg);
+        }
+        if (locked) {
+            unlock_stripes(ht, 1ULL << i);
         }
-        prevNode = keyNode; // Move prevNode to current node
-        keyNode = keyNode->next; // Move to the next node
+        epoch_exit();
+        retire_saved(saved);
     }
+    free(found);
+}
 
-    return 1;
+int snapshot_end(HashTable *ht) {
+    // Stripes the snapshot didn't visit stop saving nodes for it
+    for (size_t i = 0; i < LOCK_STRIPES; i++) {
+        Stripe *stripe = &ht->stripes[i];
+        if (stripe->snapshot_pending) {
+            lock_stripes(ht, 1ULL << i, true);
+            SavedNodes *saved = take_saved(stripe);
+            unlock_stripes(ht, 1ULL << i);
+            retire_saved(saved);
+        }
+    }
+    int lost = atomic_load(&ht->snapshot_lost);
+    atomic_store(&ht->snapshot_active, false);
+    return lost;
 }
 
-void free_table(HashTable *ht) {
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        KeyNode *keyNode = ht->table[i];
+// Frees every node of a bucket array and the array itself.
+static void free_buckets(Buckets *buckets) {
+    for (size_t i = 0; i < buckets->size; i++) {
+        KeyNode *keyNode = atomic_load_explicit(&buckets->heads[i], memory_order_relaxed);
         while (keyNode != NULL) {
             KeyNode *temp = keyNode;
-            keyNode = keyNode->next;
-            free(temp->key);
-            free(temp->value);
-            free(temp);
+            keyNode = atomic_load_explicit(&keyNode->next, memory_order_relaxed);
+            destroy_node(temp);
+        }
+    }
+    free(buckets);
+}
+
+void free_table(HashTable *ht) {
+    // Nodes and values replaced while the table was in use
+    epoch_drain();
+
+    Buckets *old = atomic_load_explicit(&ht->old_table, memory_order_relaxed);
+    if (old != NULL) {
+        free_buckets(old);
+    }
+    free_buckets(atomic_load_explicit(&ht->table, memory_order_relaxed));
+    for (int i = 0; i < LOCK_STRIPES; i++) {
+        Stripe *stripe = &ht->stripes[i];
+        pthread_rwlock_destroy(&stripe->lock);
+        free(stripe->changes);
+        free(stripe->snapshot_changes);
+        // Saved nodes are no longer in the buckets
+        if (stripe->saved != NULL) {
+            destroy_saved(stripe->saved);
         }
     }
-    pthread_rwlock_destroy(&ht->tablelock);
     free(ht);
 }
@@ -1,47 +1,274 @@
 #ifndef KEY_VALUE_STORE_H
 #define KEY_VALUE_STORE_H
-#define TABLE_SIZE 26
+#define TABLE_SIZE 64   // Initial (and minimum) number of buckets, power of two
+#define LOCK_STRIPES 64 // Number of bucket locks, one bit each in a stripe mask
+#define ALL_STRIPES UINT64_MAX
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <pthread.h>
 
+// Nodes are read without locks (see epoch.h). A node is immutable once
+// published: overwriting a value links a new node in its place and retires
+// the old one, and unlinked nodes are retired instead of freed.
+//
+// The key and the value are stored inline after the header, each followed
+// by '\0', so a pair is a single slab block (see slab.h).
 typedef struct KeyNode {
-    char *key;
-    char *value;
-    struct KeyNode *next;
+    _Atomic(struct KeyNode *) next;
+    uint64_t hash;       // Cached hash of the key, so resizing never rehashes strings
+    uint32_t generation; // Generation of the table when the pair was written
+    uint8_t key_len;   // Length of the key, without the '\0'
+    uint8_t value_len; // Length of the value, without the '\0'
+    char data[];       // Key, then value
 } KeyNode;
 
+// Key of a node.
+static inline const char *node_key(const KeyNode *keyNode) {
+    return keyNode->data;
+}
+
+// Value of a node.
+static inline const char *node_value(const KeyNode *keyNode) {
+    return keyNode->data + keyNode->key_len + 1;
+}
+
+// Bucket array, published as a whole so readers always see a size that
+// matches the heads they index.
+typedef struct Buckets {
+    size_t size; // Number of buckets, power of two
+    _Atomic(KeyNode *) heads[];
+} Buckets;
+
+// Nodes of a snapshot unlinked from a stripe before the snapshot visited
+// it, retired together once it did.
+typedef struct SavedNodes {
+    size_t len;
+    size_t capacity;
+    KeyNode *nodes[];
+} SavedNodes;
+
+// Lock of a stripe, padded to its own cache line so stripes taken by
+// different threads don't share one. Writers of the stripe serialize on the
+// lock; lock-free readers use seq to detect that nodes were moved between
+// bucket arrays while they were looking, and retry.
+//
+// When changes are tracked, the stripe also logs the keys written or
+// deleted in it during the current generation, each as a length byte
+// followed by the key, guarded by the lock like the buckets.
+//
+// While a snapshot hasn't visited the stripe yet, nodes of the snapshot
+// that writers replace or delete are kept in saved instead of retired, so
+// the snapshot still finds them (see snapshot_begin).
+typedef struct Stripe {
+    _Alignas(64) pthread_rwlock_t lock;
+    atomic_uint seq;       // Odd while nodes of the stripe are being moved
+    char *changes;         // Keys changed in the current generation
+    size_t changes_len;    // Bytes used in changes
+    size_t changes_capacity;
+    bool snapshot_pending; // Whether the snapshot being taken still has to visit the stripe
+    SavedNodes *saved;     // NULL if no node was saved
+    char *snapshot_changes; // Keys changed in the generation of the snapshot
+    size_t snapshot_changes_len;
+    size_t snapshot_changes_capacity;
+} Stripe;
+
+// Chained hash table that resizes incrementally: when the load factor
+// crosses a threshold a new bucket array is allocated and the buckets of
+// the old one are migrated a few at a time by subsequent writes.
+//
+// Bucket i is protected by stripe i % LOCK_STRIPES. Since both bucket arrays
+// always have at least LOCK_STRIPES buckets, a key keeps its stripe across
+// resizes, so migrating a bucket only needs the lock of its stripe. Swapping
+// bucket arrays takes every stripe.
 typedef struct HashTable {
-    KeyNode *table[TABLE_SIZE];
-    pthread_rwlock_t tablelock;
+    _Atomic(Buckets *) table;     // Current bucket array
+    _Atomic(Buckets *) old_table; // Bucket array being drained, NULL if not resizing
+    size_t rehash_next[LOCK_STRIPES]; // Next old bucket to migrate, per stripe
+    atomic_size_t migrated;   // Old buckets already migrated
+    atomic_size_t count;      // Number of pairs stored
+    atomic_size_t capacity;   // Number of buckets of table
+    atomic_bool resizing;     // Whether old_table is set, readable without locks
+    atomic_uint help_cursor;  // Stripe the next resize_step will migrate
+    uint32_t generation;      // Incremented by next_generation, every stripe locked
+    bool track_changes;       // Whether stripes log the keys changed in a generation
+    atomic_bool changes_lost; // A change could not be logged in this generation
+    uint32_t snapshot_generation; // Generation of the snapshot being taken
+    atomic_bool snapshot_active;  // Whether a snapshot is being taken
+    atomic_bool snapshot_lost;    // A node of the snapshot could not be saved
+    Stripe stripes[LOCK_STRIPES];
 } HashTable;
 
 /// Creates a new KVS hash table.
 /// @return Newly created hash table, NULL on failure
 struct HashTable *create_hash_table();
 
-int hash(const char *key); 
+// 64-bit hash of a key (FNV-1a followed by a final avalanche step).
+// @param key The key, not necessarily '\0' terminated.
+// @param len Length of the key.
+// @return hash.
+uint64_t hash(const char *key, size_t len);
+
+// Stripe protecting a key.
+// @param key The key, not necessarily '\0' terminated.
+// @param len Length of the key.
+// @return Mask with the bit of the stripe of key set.
+uint64_t stripe_of(const char *key, size_t len);
+
+/// Locks a set of stripes, always in ascending order, so operations that
+/// lock several stripes can never deadlock with each other.
+/// @param ht The hash table.
+/// @param stripes Mask of the stripes to lock.
+/// @param exclusive Whether stripes are locked for writing.
+void lock_stripes(HashTable *ht, uint64_t stripes, bool exclusive);
+
+/// Unlocks a set of stripes locked by lock_stripes.
+/// @param ht The hash table.
+/// @param stripes Mask of the stripes to unlock.
+void unlock_stripes(HashTable *ht, uint64_t stripes);
+
+/// Resizes the table right away if its load factor is out of bounds, or
+/// finishes an ongoing resize, migrating every bucket. Must be called
+/// without holding any stripe.
+/// @param ht The hash table.
+void resize_now(HashTable *ht);
+
+/// Grows the bucket array of an empty table to hold count pairs, so that
+/// filling it (when restoring a backup, for instance) never resizes it.
+/// @param ht The hash table, empty and not in use by other threads.
+/// @param count Number of pairs the table will hold.
+/// @return 0 if successful, 1 if the table is not empty or memory could not
+/// be allocated.
+int reserve_table(HashTable *ht, size_t count);
 
-// Writes a key value pair in the hash table.
+/// Advances an ongoing resize, or starts one if the load factor is out of
+/// bounds. Must be called without holding any stripe.
+/// @param ht The hash table.
+void resize_step(HashTable *ht);
+
+// Writes a key value pair in the hash table. The stripe of the key must be
+// locked exclusively. The key and value are copied, so they may point into
+// a larger buffer (a mapped job file, for instance).
 // @param ht The hash table.
-// @param key The key.
-// @param value The value.
-// @return 0 if successful.
-int write_pair(HashTable *ht, const char *key, const char *value);
+// @param key The key, not necessarily '\0' terminated.
+// @param key_len Length of the key.
+// @param value The value, not necessarily '\0' terminated.
+// @param value_len Length of the value.
+// @return 0 if successful, 1 if the key or value is longer than UINT8_MAX
+// or memory could not be allocated.
+int write_pair(HashTable *ht, const char *key, size_t key_len, const char *value,
+               size_t value_len);
 
-// Reads the value of a given key.
+// Reads the value of a given key without taking any lock or copying it.
+// Must be called between epoch_enter and epoch_exit: the value is borrowed
+// from the table and stays valid only until epoch_exit.
 // @param ht The hash table.
-// @param key The key.
+// @param key The key, not necessarily '\0' terminated.
+// @param key_len Length of the key.
+// @param len If not NULL, set to the length of the value.
 // return the value if found, NULL otherwise.
-char* read_pair(HashTable *ht, const char *key);
+const char* read_pair(HashTable *ht, const char *key, size_t key_len, size_t *len);
 
-/// Deletes a pair from the table.
+/// Deletes a pair from the table. The stripe of the key must be locked
+/// exclusively.
 /// @param ht Hash table to read from.
-/// @param key Key of the pair to be deleted.
+/// @param key Key of the pair to be deleted, not necessarily '\0' terminated.
+/// @param key_len Length of the key.
 /// @return 0 if the node was deleted successfully, 1 otherwise.
-int delete_pair(HashTable *ht, const char *key);
+int delete_pair(HashTable *ht, const char *key, size_t key_len);
+
+/// Calls visit for every pair stored in a set of stripes of the table,
+/// including the ones still waiting to be migrated during a resize. Every
+/// stripe of the set must be locked.
+/// @param ht Hash table to iterate.
+/// @param stripes Mask of the stripes visited, ALL_STRIPES for the whole table.
+/// @param visit Function called with each node and arg.
+/// @param arg Opaque argument forwarded to visit.
+void iterate_pairs(HashTable *ht, uint64_t stripes,
+                   void (*visit)(const KeyNode *node, void *arg), void *arg);
+
+/// Calls visit for every pair of a stripe without taking any lock. Must be
+/// called between epoch_enter and epoch_exit. If a resize moved nodes of the
+/// stripe meanwhile, pairs may have been visited twice or skipped, and the
+/// stripe has to be visited again.
+/// @param ht Hash table to iterate.
+/// @param stripe Index of the stripe.
+/// @param visit Function called with each node and arg.
+/// @param arg Opaque argument forwarded to visit.
+/// @return 0 if the visited pairs are a consistent view of the stripe, 1 otherwise.
+int iterate_stripe(HashTable *ht, size_t stripe,
+                   void (*visit)(const KeyNode *node, void *arg), void *arg);
+
+/// Starts logging the keys written and deleted in each generation, for
+/// visit_changes. Must be called before the table is used.
+/// @param ht The hash table.
+void track_changes(HashTable *ht);
+
+/// Calls visit for every key of a set of stripes changed in the current
+/// generation, with the node holding the key, or NULL if it was deleted. A
+/// key may be visited more than once. Every stripe of the set must be locked.
+/// @param ht Hash table to iterate.
+/// @param stripes Mask of the stripes visited.
+/// @param visit Function called with each key, its length, its node and arg.
+/// @param arg Opaque argument forwarded to visit.
+/// @return 0 if every change was logged, 1 if some could not be (out of
+/// memory), in which case only a visit of every pair is complete.
+int visit_changes(HashTable *ht, uint64_t stripes,
+                  void (*visit)(const char *key, size_t len, const KeyNode *node, void *arg),
+                  void *arg);
+
+/// Starts a new generation, forgetting the keys changed in the current one.
+/// Every stripe must be locked exclusively.
+/// @param ht The hash table.
+/// @return The generation that ended.
+uint32_t next_generation(HashTable *ht);
+
+/// Starts a snapshot of the table as it is now, to be visited by
+/// snapshot_pairs or snapshot_changes while writers carry on. Like
+/// next_generation, it starts a new generation: nodes written from now on
+/// belong to it, so the snapshot is every node of an older generation, and
+/// those replaced or deleted before the snapshot visits their stripe are
+/// saved for it instead of retired. The keys changed in the generation that
+/// ended are kept for snapshot_changes. Every stripe must be locked
+/// exclusively, and no other snapshot may be active.
+/// @param ht The hash table.
+/// @return The generation of the snapshot.
+uint32_t snapshot_begin(HashTable *ht);
+
+/// Calls visit for every pair of a set of stripes of the snapshot. Stripes
+/// are visited without locks, each one only held for as long as it takes to
+/// hand over its saved nodes. Must be called once for each stripe, without
+/// holding any stripe and outside an epoch. Threads may visit disjoint sets
+/// of stripes concurrently.
+/// @param ht Hash table of an active snapshot.
+/// @param stripes Mask of the stripes visited.
+/// @param visit Function called with each node and arg.
+/// @param arg Opaque argument forwarded to visit.
+void snapshot_pairs(HashTable *ht, uint64_t stripes,
+                    void (*visit)(const KeyNode *node, void *arg), void *arg);
+
+/// Calls visit for every key of a set of stripes changed in the generation
+/// of the snapshot, with its node in the snapshot, or NULL if it was
+/// deleted, like visit_changes. Must be called instead of snapshot_pairs,
+/// with the same rules.
+/// @param ht Hash table of an active snapshot.
+/// @param stripes Mask of the stripes visited.
+/// @param visit Function called with each key, its length, its node and arg.
+/// @param arg Opaque argument forwarded to visit.
+void snapshot_changes(HashTable *ht, uint64_t stripes,
+                      void (*visit)(const char *key, size_t len, const KeyNode *node, void *arg),
+                      void *arg);
+
+/// Ends a snapshot, so another one can begin. Must be called without
+/// holding any stripe.
+/// @param ht Hash table of an active snapshot.
+/// @return 0 if the pairs visited were the snapshot, 1 if a node of it could
+/// not be saved (out of memory) and the visit is not to be trusted.
+int snapshot_end(HashTable *ht);
 
-/// Frees the hashtable.
+/// Frees the hashtable. No thread may be using it anymore.
 /// @param ht Hash table to be deleted.
 void free_table(HashTable *ht);
 
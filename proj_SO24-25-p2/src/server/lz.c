@@ -0,0 +1,159 @@
+#include "lz.h"
+
+#include <string.h>
+
+#define MIN_MATCH 4
+#define LAST_LITERALS 5   // Bytes at the end of a block always left as literals
+#define MATCH_LIMIT 12    // No match starts in the last bytes of a block
+#define MAX_OFFSET 65535
+
+static uint32_t read32(const char *data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+// Multiplicative hash of a 4-byte sequence.
+static uint32_t hash_sequence(uint32_t sequence) {
+  return (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the extra bytes of a length that didn't fit in its nibble.
+// @param len The length minus 15.
+static char *write_length(char *out, size_t len) {
+  for (; len >= 255; len -= 255) {
+    *out++ = (char)255;
+  }
+  *out++ = (char)len;
+  return out;
+}
+
+// Writes a sequence: literals, then a match unless it is the last one.
+// @param match_len Length of the match, 0 for the last sequence.
+// @return End of the sequence, NULL if it doesn't fit before end.
+static char *write_sequence(char *out, const char *end, const char *literals, size_t num_literals,
+                            size_t offset, size_t match_len) {
+  size_t extra_match = match_len > 0 ? match_len - MIN_MATCH : 0;
+  size_t size = 1 + (num_literals >= 15 ? 1 + (num_literals - 15) / 255 : 0) + num_literals +
+                (match_len > 0 ? 2 + (extra_match >= 15 ? 1 + (extra_match - 15) / 255 : 0) : 0);
+  if (size > (size_t)(end - out)) {
+    return NULL;
+  }
+
+  *out++ = (char)(((num_literals < 15 ? num_literals : 15) << 4) |
+                  (extra_match < 15 ? extra_match : 15));
+  if (num_literals >= 15) {
+    out = write_length(out, num_literals - 15);
+  }
+  memcpy(out, literals, num_literals);
+  out += num_literals;
+  if (match_len > 0) {
+    *out++ = (char)(offset & 0xFF);
+    *out++ = (char)(offset >> 8);
+    if (extra_match >= 15) {
+      out = write_length(out, extra_match - 15);
+    }
+  }
+  return out;
+}
+
+size_t lz_compress(const char *src, size_t len, char *dst, size_t capacity, uint32_t *table) {
+  char *out = dst;
+  const char *end = dst + capacity;
+  size_t anchor = 0; // Start of the literals not yet written
+  if (len > MATCH_LIMIT && len <= LZ_MAX_BLOCK_SIZE) {
+    memset(table, 0, LZ_HASH_SIZE * sizeof(uint32_t));
+    size_t limit = len - MATCH_LIMIT;
+    size_t match_limit = len - LAST_LITERALS;
+    size_t pos = 0;
+    while (pos < limit) {
+      uint32_t sequence = read32(src + pos);
+      uint32_t h = hash_sequence(sequence);
+      size_t candidate = table[h];
+      table[h] = (uint32_t)pos;
+      if (candidate >= pos || pos - candidate > MAX_OFFSET || read32(src + candidate) != sequence) {
+        // The longer nothing matched, the faster data is skipped
+        pos += 1 + ((pos - anchor) >> 6);
+        continue;
+      }
+
+      while (pos > anchor && candidate > 0 && src[pos - 1] == src[candidate - 1]) {
+        pos--;
+        candidate--;
+      }
+      size_t match_len = MIN_MATCH;
+      while (pos + match_len < match_limit && src[pos + match_len] == src[candidate + match_len]) {
+        match_len++;
+      }
+      out = write_sequence(out, end, src + anchor, pos - anchor, pos - candidate, match_len);
+      if (out == NULL) {
+        return 0;
+      }
+      pos += match_len;
+      anchor = pos;
+      // So that a match right after this one can be found
+      table[hash_sequence(read32(src + pos - 2))] = (uint32_t)(pos - 2);
+    }
+  }
+
+  out = write_sequence(out, end, src + anchor, len - anchor, 0, 0);
+  return out != NULL ? (size_t)(out - dst) : 0;
+}
+
+// Reads the extra bytes of a length that didn't fit in its nibble.
+// @return 0 if successful, 1 if the block ends first.
+static int read_length(const unsigned char **in, const unsigned char *end, size_t *len) {
+  unsigned char byte;
+  do {
+    if (*in == end) {
+      return 1;
+    }
+    byte = *(*in)++;
+    *len += byte;
+  } while (byte == 255);
+  return 0;
+}
+
+int lz_decompress(const char *src, size_t len, char *dst, size_t size) {
+  const unsigned char *in = (const unsigned char *)src;
+  const unsigned char *end = in + len;
+  size_t out = 0;
+  while (in < end) {
+    unsigned token = *in++;
+    size_t num_literals = token >> 4;
+    if ((num_literals == 15 && read_length(&in, end, &num_literals) != 0) ||
+        (size_t)(end - in) < num_literals || size - out < num_literals) {
+      return 1;
+    }
+    memcpy(dst + out, in, num_literals);
+    in += num_literals;
+    out += num_literals;
+    if (in == end) {
+      break; // The last sequence has no match
+    }
+
+    if (end - in < 2) {
+      return 1;
+    }
+    size_t offset = (size_t)in[0] | (size_t)in[1] << 8;
+    in += 2;
+    size_t match_len = token & 15;
+    if ((match_len == 15 && read_length(&in, end, &match_len) != 0)) {
+      return 1;
+    }
+    match_len += MIN_MATCH;
+    if (offset == 0 || offset > out || size - out < match_len) {
+      return 1;
+    }
+    if (offset >= match_len) {
+      memcpy(dst + out, dst + out - offset, match_len);
+    } else {
+      // Overlapping matches repeat the last offset bytes
+      for (size_t i = 0; i < match_len; i++) {
+        dst[out + i] = dst[out + i - offset];
+      }
+    }
+    out += match_len;
+  }
+  return out != size;
+}
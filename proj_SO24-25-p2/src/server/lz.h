@@ -0,0 +1,46 @@
+#ifndef KVS_LZ_H
+#define KVS_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Small LZ77 block codec in the spirit of LZ4, used to compress backups.
+// A block is a sequence of:
+//
+//   token:     u8, literal length in the high nibble, match length - 4 in
+//              the low one, 15 meaning more length bytes follow
+//   literals:  extra literal length bytes (each 255 means another follows),
+//              then the literal bytes
+//   match:     u16 offset back from the current position (little endian),
+//              then extra match length bytes like the literal ones
+//
+// The last sequence has no match and ends the block. Matches are found with
+// a hash table of the positions of 4-byte sequences, so compressing favors
+// speed over ratio and decompressing is a plain copy loop.
+//
+// Both functions only use async signal safe functions.
+
+#define LZ_HASH_BITS 14
+#define LZ_HASH_SIZE (1U << LZ_HASH_BITS) // Entries of the table of positions
+#define LZ_MAX_BLOCK_SIZE (1U << 30)      // Positions are stored in 32 bits
+
+/// Compresses a block.
+/// @param src Bytes to compress, at most LZ_MAX_BLOCK_SIZE.
+/// @param len Number of bytes.
+/// @param dst Where the compressed block is written.
+/// @param capacity Size of dst.
+/// @param table Table of positions, LZ_HASH_SIZE entries the caller needs
+/// not initialize.
+/// @return Size of the compressed block, 0 if it doesn't fit in capacity.
+size_t lz_compress(const char *src, size_t len, char *dst, size_t capacity, uint32_t *table);
+
+/// Decompresses a block. Malformed blocks are detected, never read or
+/// written out of bounds.
+/// @param src The compressed block.
+/// @param len Size of the compressed block.
+/// @param dst Where the bytes are written.
+/// @param size Number of bytes the block decompresses to.
+/// @return 0 if successful, 1 if the block is malformed or not of that size.
+int lz_decompress(const char *src, size_t len, char *dst, size_t size);
+
+#endif  // KVS_LZ_H
@@ -0,0 +1,491 @@
+#include "notifications.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+struct Outbox {
+    pthread_mutex_t lock;
+    pthread_cond_t room;     // Signaled when notifications leave the queue
+    int fd;                  // FIFO of the session, without blocking
+    int evicted_fd;          // Eventfd readable once evicted
+    atomic_size_t refs;      // The session, the notifier and publishers
+    Notification** queue;    // Ring of capacity notifications
+    size_t capacity;
+    size_t head;
+    size_t len;
+    enum OverflowPolicy policy;
+    unsigned int timeout_ms;
+    size_t batch_size;
+    unsigned int deadline_us;
+    bool armed;              // Waiting in the notifier for the FIFO to be writable
+    bool waiting;            // Waiting for its batch to fill, in waiting_outboxes
+    bool closed;             // The session ended
+    atomic_bool evicted;     // Disconnected by OVERFLOW_DISCONNECT
+    uint64_t due_ns;         // When it stops waiting for its batch to fill
+    struct Outbox* next_waiting;
+    struct Outbox* next_closed;
+};
+
+static size_t outbox_capacity = OUTBOX_CAPACITY;
+static enum OverflowPolicy overflow_policy = OVERFLOW_DROP_OLDEST;
+static unsigned int overflow_timeout_ms = 100;
+static size_t notify_batch = NOTIFY_BATCH;
+static unsigned int batch_deadline_us = 0;
+
+static atomic_size_t queued = 0;
+static atomic_size_t sent = 0;
+static atomic_size_t batches = 0;
+static atomic_size_t dropped = 0;
+static atomic_size_t evicted = 0;
+
+static pthread_once_t notifier_once = PTHREAD_ONCE_INIT;
+static int notifier_fd = -1; // epoll of the notifier, -1 if it could not start
+static int wake_pipe[2];     // Written when outboxes are closed
+static int timer_fd = -1;    // Expires when the first waiting outbox is due
+
+// Outboxes closed since the notifier last looked, freed by it once no
+// event it took can point to them anymore.
+static pthread_mutex_t closed_lock = PTHREAD_MUTEX_INITIALIZER;
+static Outbox* closed_outboxes = NULL;
+
+// Outboxes waiting for their batch to fill, each with a reference, in the
+// order they are due.
+static pthread_mutex_t waiting_lock = PTHREAD_MUTEX_INITIALIZER;
+static Outbox* waiting_head = NULL;
+static Outbox* waiting_tail = NULL;
+
+void notifications_configure(size_t capacity, enum OverflowPolicy policy,
+                             unsigned int timeout_ms) {
+    outbox_capacity = capacity > 0 ? capacity : 1;
+    overflow_policy = policy;
+    overflow_timeout_ms = timeout_ms;
+}
+
+void notifications_batching(size_t batch_size, unsigned int deadline_us) {
+    notify_batch = batch_size > 0 ? batch_size : 1;
+    if (notify_batch > NOTIFY_BATCH_MAX) {
+        notify_batch = NOTIFY_BATCH_MAX;
+    }
+    batch_deadline_us = deadline_us;
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+Notification* notification_create(const char* frame, size_t len) {
+    Notification* notification = malloc(sizeof(Notification) + len);
+    if (notification == NULL) {
+        return NULL;
+    }
+    atomic_init(&notification->refs, 1);
+    notification->len = len;
+    memcpy(notification->frame, frame, len);
+    return notification;
+}
+
+void notification_release(Notification* notification) {
+    if (atomic_fetch_sub(&notification->refs, 1) == 1) {
+        free(notification);
+    }
+}
+
+// Drops every queued notification. Called with the lock held.
+// @return How many there were.
+static size_t outbox_clear(Outbox* outbox) {
+    size_t len = outbox->len;
+    for (size_t i = 0; i < len; i++) {
+        notification_release(outbox->queue[(outbox->head + i) % outbox->capacity]);
+    }
+    outbox->head = 0;
+    outbox->len = 0;
+    pthread_cond_broadcast(&outbox->room);
+    return len;
+}
+
+// Has the notifier wait for the FIFO of an outbox to be writable. Called
+// with the lock held.
+static void outbox_arm(Outbox* outbox) {
+    struct epoll_event event = {.events = EPOLLOUT | EPOLLONESHOT, .data.ptr = outbox};
+    if (epoll_ctl(notifier_fd, EPOLL_CTL_MOD, outbox->fd, &event) != 0) {
+        perror("Erro ao esperar pelo FIFO de notificações");
+        outbox->armed = false;
+        return;
+    }
+    outbox->armed = true;
+}
+
+// Sets the timer to when an outbox is due. Called with waiting_lock held.
+static void set_timer(uint64_t due_ns) {
+    struct itimerspec timer = {
+        .it_value = {(time_t)(due_ns / 1000000000), (long)(due_ns % 1000000000)}};
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &timer, NULL) != 0) {
+        perror("Erro ao esperar pelo lote de notificações");
+    }
+}
+
+// Has an outbox wait for its batch to fill until its deadline. Called with
+// the lock held.
+static void outbox_wait(Outbox* outbox) {
+    outbox->waiting = true;
+    outbox->due_ns = monotonic_ns() + (uint64_t)outbox->deadline_us * 1000;
+    outbox->next_waiting = NULL;
+    outbox_ref(outbox);
+    pthread_mutex_lock(&waiting_lock);
+    if (waiting_tail != NULL) {
+        waiting_tail->next_waiting = outbox;
+    } else {
+        waiting_head = outbox;
+        set_timer(outbox->due_ns);
+    }
+    waiting_tail = outbox;
+    pthread_mutex_unlock(&waiting_lock);
+}
+
+// Arms the outboxes whose deadline expired, that are still not armed.
+static void flush_due(void) {
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        perror("Erro ao esperar pelo lote de notificações");
+    }
+    uint64_t now = monotonic_ns();
+    pthread_mutex_lock(&waiting_lock);
+    Outbox* due = NULL;
+    if (waiting_head != NULL && waiting_head->due_ns <= now) {
+        due = waiting_head;
+        Outbox* last = due;
+        while (last->next_waiting != NULL && last->next_waiting->due_ns <= now) {
+            last = last->next_waiting;
+        }
+        waiting_head = last->next_waiting;
+        last->next_waiting = NULL;
+        if (waiting_head == NULL) {
+            waiting_tail = NULL;
+        }
+    }
+    if (waiting_head != NULL) {
+        set_timer(waiting_head->due_ns);
+    }
+    pthread_mutex_unlock(&waiting_lock);
+
+    while (due != NULL) {
+        Outbox* next = due->next_waiting;
+        pthread_mutex_lock(&due->lock);
+        due->waiting = false;
+        if (due->len > 0 && !due->armed && !due->closed) {
+            outbox_arm(due);
+        }
+        pthread_mutex_unlock(&due->lock);
+        outbox_release(due);
+        due = next;
+    }
+}
+
+// Writes the queued notifications of an outbox until it is empty or its
+// FIFO is full, a batch at a time. A batch is no larger than PIPE_BUF, so
+// each write is all or nothing and frames are never split.
+static void outbox_flush(Outbox* outbox) {
+    pthread_mutex_lock(&outbox->lock);
+    size_t written = 0;
+    while (outbox->len > 0 && !outbox->closed) {
+        struct iovec batch[NOTIFY_BATCH_MAX];
+        size_t count = 0, bytes = 0;
+        while (count < outbox->batch_size && count < outbox->len) {
+            Notification* notification =
+                outbox->queue[(outbox->head + count) % outbox->capacity];
+            if (bytes + notification->len > PIPE_BUF) {
+                break;
+            }
+            batch[count++] = (struct iovec){notification->frame, notification->len};
+            bytes += notification->len;
+        }
+        ssize_t result = writev(outbox->fd, batch, (int)count);
+        if (result == (ssize_t)bytes) {
+            for (size_t i = 0; i < count; i++) {
+                notification_release(outbox->queue[outbox->head]);
+                outbox->head = (outbox->head + 1) % outbox->capacity;
+            }
+            outbox->len -= count;
+            written += count;
+            atomic_fetch_add(&batches, 1);
+        } else if (result < 0 && errno == EINTR) {
+            continue;
+        } else if (result < 0 && errno == EAGAIN) {
+            break;
+        } else {
+            perror("Erro ao enviar notificação");
+            atomic_fetch_add(&dropped, outbox_clear(outbox));
+        }
+    }
+    atomic_fetch_add(&sent, written);
+    if (written > 0) {
+        pthread_cond_broadcast(&outbox->room);
+    }
+    if (outbox->len > 0 && !outbox->closed) {
+        outbox_arm(outbox);
+    } else {
+        outbox->armed = false;
+    }
+    pthread_mutex_unlock(&outbox->lock);
+}
+
+static void* notifier_thread(void* arg) {
+    (void)arg;
+    struct epoll_event events[NOTIFIER_EVENTS];
+    while (1) {
+        int count = epoll_wait(notifier_fd, events, NOTIFIER_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Erro ao esperar pelos FIFOs de notificações");
+            return NULL;
+        }
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                char buffer[64];
+                while (read(wake_pipe[0], buffer, sizeof(buffer)) > 0) {
+                }
+            } else if (events[i].data.ptr == &timer_fd) {
+                flush_due();
+            } else {
+                outbox_flush(events[i].data.ptr);
+            }
+        }
+
+        // Closed outboxes were removed from the epoll before being listed,
+        // so no later batch of events can point to them
+        pthread_mutex_lock(&closed_lock);
+        Outbox* outbox = closed_outboxes;
+        closed_outboxes = NULL;
+        pthread_mutex_unlock(&closed_lock);
+        while (outbox != NULL) {
+            Outbox* next = outbox->next_closed;
+            outbox_release(outbox);
+            outbox = next;
+        }
+    }
+}
+
+static void notifier_start(void) {
+    int fd = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd == -1 || timer_fd == -1 || pipe(wake_pipe) != 0) {
+        perror("Erro ao iniciar o envio de notificações");
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+    fcntl(wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, O_NONBLOCK);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    struct epoll_event timer = {.events = EPOLLIN, .data.ptr = &timer_fd};
+    pthread_t thread;
+    if (epoll_ctl(fd, EPOLL_CTL_ADD, wake_pipe[0], &event) != 0 ||
+        epoll_ctl(fd, EPOLL_CTL_ADD, timer_fd, &timer) != 0) {
+        perror("Erro ao iniciar o envio de notificações");
+        close(fd);
+        return;
+    }
+    notifier_fd = fd;
+    if (pthread_create(&thread, NULL, notifier_thread, NULL) != 0) {
+        perror("Erro ao iniciar o envio de notificações");
+        notifier_fd = -1;
+        close(fd);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+Outbox* outbox_open(const char* path) {
+    pthread_once(&notifier_once, notifier_start);
+    if (notifier_fd == -1) {
+        return NULL;
+    }
+    Outbox* outbox = calloc(1, sizeof(Outbox));
+    if (outbox == NULL) {
+        return NULL;
+    }
+    outbox->capacity = outbox_capacity;
+    outbox->policy = overflow_policy;
+    outbox->timeout_ms = overflow_timeout_ms;
+    outbox->batch_size = notify_batch;
+    outbox->deadline_us = batch_deadline_us;
+    outbox->queue = malloc(outbox->capacity * sizeof(Notification*));
+    // O_RDWR evita EOF prematuro, e um FIFO cheio nunca bloqueia o servidor
+    outbox->fd = open(path, O_RDWR | O_NONBLOCK);
+    outbox->evicted_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (outbox->queue == NULL || outbox->fd == -1 || outbox->evicted_fd == -1) {
+        if (outbox->fd != -1) {
+            close(outbox->fd);
+        }
+        if (outbox->evicted_fd != -1) {
+            close(outbox->evicted_fd);
+        }
+        free(outbox->queue);
+        free(outbox);
+        return NULL;
+    }
+
+    // Deadlines of OVERFLOW_BLOCK are measured on the monotonic clock
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&outbox->lock, NULL);
+    pthread_cond_init(&outbox->room, &attr);
+    pthread_condattr_destroy(&attr);
+    atomic_init(&outbox->refs, 2);
+    atomic_init(&outbox->evicted, false);
+
+    // Registered armed: the FIFO is writable, so the notifier disarms it
+    outbox->armed = true;
+    struct epoll_event event = {.events = EPOLLOUT | EPOLLONESHOT, .data.ptr = outbox};
+    if (epoll_ctl(notifier_fd, EPOLL_CTL_ADD, outbox->fd, &event) != 0) {
+        pthread_cond_destroy(&outbox->room);
+        pthread_mutex_destroy(&outbox->lock);
+        close(outbox->fd);
+        close(outbox->evicted_fd);
+        free(outbox->queue);
+        free(outbox);
+        return NULL;
+    }
+    return outbox;
+}
+
+int outbox_fd(const Outbox* outbox) {
+    return outbox->fd;
+}
+
+int outbox_evicted_fd(const Outbox* outbox) {
+    return outbox->evicted_fd;
+}
+
+void outbox_ref(Outbox* outbox) {
+    atomic_fetch_add(&outbox->refs, 1);
+}
+
+void outbox_release(Outbox* outbox) {
+    if (atomic_fetch_sub(&outbox->refs, 1) != 1) {
+        return;
+    }
+    close(outbox->fd);
+    close(outbox->evicted_fd);
+    pthread_cond_destroy(&outbox->room);
+    pthread_mutex_destroy(&outbox->lock);
+    free(outbox->queue);
+    free(outbox);
+}
+
+int outbox_push(Outbox* outbox, Notification* notification) {
+    pthread_mutex_lock(&outbox->lock);
+    if (outbox->closed || atomic_load(&outbox->evicted)) {
+        pthread_mutex_unlock(&outbox->lock);
+        return 1;
+    }
+
+    if (outbox->len == outbox->capacity) {
+        switch (outbox->policy) {
+            case OVERFLOW_DROP_OLDEST:
+                notification_release(outbox->queue[outbox->head]);
+                outbox->head = (outbox->head + 1) % outbox->capacity;
+                outbox->len--;
+                atomic_fetch_add(&dropped, 1);
+                break;
+
+            case OVERFLOW_DISCONNECT: {
+                // Wakes the session, even one that sends no requests, to end
+                // it (see outbox_evicted_fd)
+                atomic_store(&outbox->evicted, true);
+                atomic_fetch_add(&dropped, outbox_clear(outbox) + 1);
+                atomic_fetch_add(&evicted, 1);
+                uint64_t one = 1;
+                if (write(outbox->evicted_fd, &one, sizeof(one)) != sizeof(one)) {
+                    perror("Erro ao terminar a sessão");
+                }
+                pthread_mutex_unlock(&outbox->lock);
+                return 1;
+            }
+
+            case OVERFLOW_BLOCK: {
+                struct timespec deadline;
+                clock_gettime(CLOCK_MONOTONIC, &deadline);
+                deadline.tv_sec += outbox->timeout_ms / 1000;
+                deadline.tv_nsec += (long)(outbox->timeout_ms % 1000) * 1000000;
+                if (deadline.tv_nsec >= 1000000000) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000;
+                }
+                while (outbox->len == outbox->capacity && !outbox->closed &&
+                       pthread_cond_timedwait(&outbox->room, &outbox->lock, &deadline) !=
+                           ETIMEDOUT) {
+                }
+                if (outbox->len == outbox->capacity || outbox->closed) {
+                    if (!outbox->closed) {
+                        atomic_fetch_add(&dropped, 1);
+                    }
+                    pthread_mutex_unlock(&outbox->lock);
+                    return 1;
+                }
+                break;
+            }
+        }
+    }
+
+    atomic_fetch_add(&notification->refs, 1);
+    outbox->queue[(outbox->head + outbox->len) % outbox->capacity] = notification;
+    outbox->len++;
+    atomic_fetch_add(&queued, 1);
+    if (!outbox->armed) {
+        if (outbox->deadline_us == 0 || outbox->len >= outbox->batch_size) {
+            outbox_arm(outbox);
+        } else if (!outbox->waiting) {
+            outbox_wait(outbox);
+        }
+    }
+    pthread_mutex_unlock(&outbox->lock);
+    return 0;
+}
+
+bool outbox_evicted(Outbox* outbox) {
+    return atomic_load(&outbox->evicted);
+}
+
+void outbox_close(Outbox* outbox) {
+    pthread_mutex_lock(&outbox->lock);
+    outbox->closed = true;
+    outbox_clear(outbox);
+    pthread_mutex_unlock(&outbox->lock);
+
+    // The notifier drops its reference once it can't be writing to it
+    epoll_ctl(notifier_fd, EPOLL_CTL_DEL, outbox->fd, NULL);
+    pthread_mutex_lock(&closed_lock);
+    outbox->next_closed = closed_outboxes;
+    closed_outboxes = outbox;
+    pthread_mutex_unlock(&closed_lock);
+    if (write(wake_pipe[1], "", 1) < 0 && errno != EAGAIN) {
+        perror("Erro ao acordar o envio de notificações");
+    }
+    outbox_release(outbox);
+}
+
+void notifications_stats(NotificationStats* stats) {
+    stats->queued = atomic_load(&queued);
+    stats->sent = atomic_load(&sent);
+    stats->batches = atomic_load(&batches);
+    stats->dropped = atomic_load(&dropped);
+    stats->evicted = atomic_load(&evicted);
+}
@@ -0,0 +1,125 @@
+#ifndef KVS_NOTIFICATIONS_H
+#define KVS_NOTIFICATIONS_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define OUTBOX_CAPACITY 64 // Default notifications queued per session
+#define NOTIFIER_EVENTS 16 // Writable FIFOs the notifier takes at once
+#define NOTIFY_BATCH 32      // Default notifications written to a FIFO at once
+#define NOTIFY_BATCH_MAX 128 // Largest batch that can be configured
+
+// Notifications are not written by the thread that publishes them. Each
+// session has an Outbox, a bounded queue of notifications, whose FIFO is
+// opened without blocking. Publishers only append to outboxes, and a
+// notifier thread waits with epoll for the FIFOs of non-empty outboxes to
+// be writable and drains them. A client that doesn't read its FIFO only
+// fills its own outbox, and what happens then is the overflow policy.
+//
+// The notifier drains an outbox in batches: the queued frames are written
+// with a single writev, up to a batch size and to PIPE_BUF bytes, so the
+// batch still reaches the FIFO whole. With a batch deadline, an outbox
+// isn't drained until its batch fills or the deadline of its oldest
+// notification expires, trading that much latency for fewer writes.
+
+enum OverflowPolicy {
+    OVERFLOW_DROP_OLDEST, // Drop the oldest queued notification
+    OVERFLOW_DISCONNECT,  // Drop every notification and end the session
+    OVERFLOW_BLOCK,       // Wait for room, then drop the new notification
+};
+
+// An encoded notification frame, shared by every outbox it is queued in.
+typedef struct Notification {
+    atomic_size_t refs;
+    size_t len;
+    char frame[];
+} Notification;
+
+typedef struct Outbox Outbox;
+
+typedef struct NotificationStats {
+    size_t queued;  // Notifications added to an outbox
+    size_t sent;    // Notifications written to a FIFO
+    size_t batches; // Writes to a FIFO, each of one or more notifications
+    size_t dropped; // Notifications dropped by the overflow policy
+    size_t evicted; // Sessions ended by OVERFLOW_DISCONNECT
+} NotificationStats;
+
+/// Sets how outboxes opened from now on behave.
+/// @param capacity Notifications each outbox holds.
+/// @param policy What to do when a notification finds its outbox full.
+/// @param timeout_ms How long OVERFLOW_BLOCK waits for room.
+void notifications_configure(size_t capacity, enum OverflowPolicy policy,
+                             unsigned int timeout_ms);
+
+/// Sets how outboxes opened from now on batch their notifications.
+/// @param batch_size Most notifications written at once, up to
+/// NOTIFY_BATCH_MAX. 1 writes each notification on its own.
+/// @param deadline_us How long the oldest notification of an outbox waits
+/// for batch_size notifications to be queued, 0 to write them as soon as
+/// the FIFO is writable. Should only be set once, before the first
+/// session, so deadlines expire in the order they were set.
+void notifications_batching(size_t batch_size, unsigned int deadline_us);
+
+/// Creates a notification holding a copy of a frame, with one reference.
+/// @param frame The frame.
+/// @param len Size of the frame, at most PIPE_BUF.
+/// @return The notification, NULL if it could not be allocated.
+Notification* notification_create(const char* frame, size_t len);
+
+/// Drops a reference to a notification, freeing it with the last one.
+/// @param notification The notification.
+void notification_release(Notification* notification);
+
+/// Opens the FIFO notifications of a session are written to, starting the
+/// notifier thread the first time.
+/// @param path Path of the FIFO.
+/// @return The outbox, with a reference for the session, NULL on error.
+Outbox* outbox_open(const char* path);
+
+/// Descriptor of the FIFO of an outbox, for logging and for telling
+/// sessions apart. It stays open until the outbox is freed.
+/// @param outbox The outbox.
+/// @return The descriptor.
+int outbox_fd(const Outbox* outbox);
+
+/// Descriptor that becomes readable, and stays so, once the session of an
+/// outbox is disconnected by OVERFLOW_DISCONNECT, for the session to wait
+/// on along with its requests. It stays open until the outbox is freed.
+/// @param outbox The outbox.
+/// @return The descriptor.
+int outbox_evicted_fd(const Outbox* outbox);
+
+/// Takes a reference to an outbox, so it outlives its session.
+/// @param outbox The outbox.
+void outbox_ref(Outbox* outbox);
+
+/// Drops a reference to an outbox, freeing it with the last one.
+/// @param outbox The outbox.
+void outbox_release(Outbox* outbox);
+
+/// Queues a notification to be written to the FIFO of an outbox, applying
+/// the overflow policy if it is full. With OVERFLOW_BLOCK it may wait, so
+/// it must not be called with locks held.
+/// @param outbox The outbox.
+/// @param notification The notification, which gains a reference if queued.
+/// @return 0 if queued, 1 if dropped.
+int outbox_push(Outbox* outbox, Notification* notification);
+
+/// Tells whether the session of an outbox was disconnected by
+/// OVERFLOW_DISCONNECT.
+/// @param outbox The outbox.
+/// @return true if the session must end.
+bool outbox_evicted(Outbox* outbox);
+
+/// Drops the notifications still queued and the reference of the session.
+/// The FIFO is closed once no publisher and no write uses it anymore.
+/// @param outbox The outbox.
+void outbox_close(Outbox* outbox);
+
+/// Reads the counters of the notifications so far.
+/// @param stats Set to the counters.
+void notifications_stats(NotificationStats* stats);
+
+#endif // KVS_NOTIFICATIONS_H
@@ -1,4 +1,6 @@
+#include <errno.h>
 #include <fcntl.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,15 +9,67 @@
 #include <unistd.h>
 #include <pthread.h> // Certifique-se de incluir a biblioteca pthread
 
+#include "backup.h"
 #include "constants.h"
+#include "epoch.h"
 #include "io.h"
 #include "kvs.h"
 #include "operations.h"
+#include "wal.h"
 
 static struct HashTable *kvs_table = NULL;
+static size_t checkpoint_interval = 0; // 0 if backups are not deltas
+static size_t backups_taken = 0;       // Backups forked since kvs_init
+static bool binary_snapshots = false;  // Whether full backups are snapshots
+static WriteAheadLog *kvs_log = NULL;  // NULL if WRITEs and DELETEs aren't logged
+static char *restored_backup = NULL;   // Name of the last backup restored
+static bool fork_free = false;         // Whether backups are written by a thread
+static pthread_mutex_t backup_thread_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t backup_thread;        // Thread writing the last snapshot backup
+static bool backup_thread_started = false; // Whether backup_thread has to be joined
+static atomic_bool backup_thread_done = false; // Whether backup_thread is only exiting
+static size_t backup_shards = 1;       // Files each backup is split into
+static bool compressed_backups = false; // Whether backup files are compressed
+
+#define RESTORE_RESIZE_INTERVAL 4096 // Pairs restored between two resizes
+#define BACKUP_BUFFER_SIZE (1 << 20) // Output a backup file gathers between writes
+
+// Memory a backup file is written with: a large output block, or the
+// compressor of a compressed backup.
+typedef union BackupBuffer {
+  char block[BACKUP_BUFFER_SIZE];
+  Compressor compressor;
+} BackupBuffer;
+
+// Buffer of forked backups, which can't allocate one. Each child writes
+// with its own copy.
+static BackupBuffer backup_buffer;
 
 pthread_mutex_t subscriptions_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/// Records that a key was written or deleted, for its subscribers to be
+/// notified (see kvs_change_window). Called after the stripe of the key was
+/// released, so the value recorded is the one the key holds by then: a
+/// writer that records after a later one can't leave an older value to be
+/// notified.
+/// @param key The key.
+static void record_change(const Slice *key);
+
+/// Checks whether changes are being recorded, anyone having subscribed.
+/// @return true if they are.
+static bool recording_changes(void);
+
+/// Allocates the flags of the keys a batch changes, if anyone subscribed.
+/// @param num_pairs Number of keys of the batch.
+/// @return Array of num_pairs flags, all false, or NULL if the changes of the
+/// batch are not recorded.
+static bool *changes_of(size_t num_pairs);
+
+/// Records the changes of a batch once its stripes were released.
+/// @param num_pairs Number of keys of the batch.
+/// @param keys Array of keys.
+/// @param applied Whether each key changed, NULL to record none.
+static void record_changes(size_t num_pairs, const Slice *keys, const bool *applied);
 
 /// Calculates a timespec from a delay in milliseconds.
 /// @param delay_ms Delay in milliseconds.
@@ -31,150 +85,795 @@ int kvs_init() {
   }
 
   kvs_table = create_hash_table();
+  if (kvs_table != NULL && checkpoint_interval > 0) {
+    track_changes(kvs_table);
+  }
+  backups_taken = 0;
   return kvs_table == NULL;
 }
 
+void kvs_delta_backups(size_t interval) {
+  checkpoint_interval = interval;
+}
+
+void kvs_binary_snapshots(bool enabled) {
+  binary_snapshots = enabled;
+}
+
+void kvs_fork_free_backups(bool enabled) {
+  fork_free = enabled;
+}
+
+void kvs_compressed_backups(bool enabled) {
+  compressed_backups = enabled;
+}
+
+void kvs_backup_shards(size_t shards) {
+  backup_shards = shards < 1 ? 1 : shards > MAX_BACKUP_SHARDS ? MAX_BACKUP_SHARDS : shards;
+}
+
+// Applies a pair of a backup being restored. Every stripe is locked.
+// @param arg Pointer to the number of pairs applied so far.
+static void restore_pair(const Slice *key, const Slice *value, void *arg) {
+  size_t *applied = arg;
+  if (value != NULL) {
+    write_pair(kvs_table, key->data, key->len, value->data, value->len);
+  } else {
+    delete_pair(kvs_table, key->data, key->len);
+  }
+
+  // Text backups don't say how many pairs they hold, so the table is grown
+  // as it is filled
+  if (++*applied % RESTORE_RESIZE_INTERVAL == 0) {
+    unlock_stripes(kvs_table, ALL_STRIPES);
+    resize_now(kvs_table);
+    lock_stripes(kvs_table, ALL_STRIPES, true);
+  }
+}
+
+// Applies a pair of a shard being restored, concurrently with the other
+// shards, which hold the pairs of other stripes.
+static void restore_shard_pair(const Slice *key, const Slice *value, void *arg) {
+  (void)arg;
+  uint64_t stripe = stripe_of(key->data, key->len);
+  lock_stripes(kvs_table, stripe, true);
+  if (value != NULL) {
+    write_pair(kvs_table, key->data, key->len, value->data, value->len);
+  } else {
+    delete_pair(kvs_table, key->data, key->len);
+  }
+  unlock_stripes(kvs_table, stripe);
+}
+
+int kvs_restore(const char *directory) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  size_t count;
+  char **paths = backup_chain(directory, &count);
+  if (paths == NULL) {
+    return 0;
+  }
+
+  BackupInfo info;
+  bool sharded = false;
+  if (backup_info(paths[0], &info) == 0) {
+    if (info.pairs > 0) {
+      reserve_table(kvs_table, info.pairs);
+    }
+    sharded = info.shards > 0;
+  }
+  int result = 0;
+  size_t applied = 0;
+  size_t first = 0;
+  if (sharded) {
+    // The shards of a checkpoint are loaded in parallel into a table that
+    // already holds them all, so it isn't resized meanwhile
+    first = 1;
+    if (backup_load_parallel(paths[0], &info, restore_shard_pair, NULL) != 0) {
+      fprintf(stderr, "Failed to restore %s\n", paths[0]);
+      result = 1;
+    }
+  }
+  lock_stripes(kvs_table, ALL_STRIPES, true);
+  for (size_t i = first; i < count && result == 0; i++) {
+    if (backup_load(paths[i], &info, restore_pair, &applied) != 0) {
+      fprintf(stderr, "Failed to restore %s\n", paths[i]);
+      result = 1;
+    }
+  }
+  // Backups taken from now on continue the generations of the restored ones
+  kvs_table->generation = info.generation + 1;
+  unlock_stripes(kvs_table, ALL_STRIPES);
+  resize_now(kvs_table);
+  if (result == 0) {
+    // The log is replayed from the point this backup was taken
+    const char *slash = strrchr(paths[count - 1], '/');
+    free(restored_backup);
+    restored_backup = strdup(slash != NULL ? slash + 1 : paths[count - 1]);
+  }
+  backup_chain_free(paths, count);
+
+  if (result != 0) {
+    kvs_terminate();
+    kvs_init();
+  }
+  return result;
+}
+
+int kvs_open_log(const char *directory, enum WalSync sync, unsigned int interval_ms,
+                 bool replay) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return 1;
+  }
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%s", directory, WAL_FILE_NAME);
+  if (replay) {
+    size_t applied = 0;
+    lock_stripes(kvs_table, ALL_STRIPES, true);
+    int result = wal_replay(path, restored_backup, restore_pair, &applied);
+    unlock_stripes(kvs_table, ALL_STRIPES);
+    resize_now(kvs_table);
+    if (result != 0) {
+      fprintf(stderr, "Failed to replay %s\n", path);
+      return 1;
+    }
+  }
+
+  kvs_log = wal_open(path, sync, interval_ms, !replay);
+  return kvs_log == NULL;
+}
+
 int kvs_terminate() {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
+  kvs_wait_backup();
+  if (kvs_log != NULL) {
+    if (wal_close(kvs_log) != 0) {
+      fprintf(stderr, "Failed to write the log\n");
+    }
+    kvs_log = NULL;
+  }
+  free(restored_backup);
+  restored_backup = NULL;
   free_table(kvs_table);
   kvs_table = NULL;
   return 0;
 }
 
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE],
-              char values[][MAX_STRING_SIZE]) {
+/// Stripes protecting a set of keys.
+/// @param num_pairs Number of keys.
+/// @param keys Array of keys.
+/// @return Mask of the stripes of every key.
+static uint64_t stripes_of(size_t num_pairs, const Slice *keys) {
+  uint64_t stripes = 0;
+  for (size_t i = 0; i < num_pairs; i++) {
+    stripes |= stripe_of(keys[i].data, keys[i].len);
+  }
+  return stripes;
+}
+
+int kvs_write(size_t num_pairs, const Slice *keys, const Slice *values) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
 
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  // Every stripe touched by the batch is held until the end, so the batch
+  // is applied atomically
+  uint64_t stripes = stripes_of(num_pairs, keys);
+  // Keys written, whose subscribers are notified once the stripes are released
+  bool *applied = changes_of(num_pairs);
+  lock_stripes(kvs_table, stripes, true);
 
+  // Logged while the stripes are held, so the log has the changes of a key
+  // in the order they were applied
+  uint64_t lsn = kvs_log != NULL ? wal_append(kvs_log, WAL_WRITE, num_pairs, keys, values) : 0;
   for (size_t i = 0; i < num_pairs; i++) {
-    if (write_pair(kvs_table, keys[i], values[i]) != 0) {
-      fprintf(stderr, "Failed to write key pair (%s,%s)\n", keys[i], values[i]);
+    if (write_pair(kvs_table, keys[i].data, keys[i].len, values[i].data, values[i].len) != 0) {
+      fprintf(stderr, "Failed to write key pair (%.*s,%.*s)\n", (int)keys[i].len, keys[i].data,
+              (int)values[i].len, values[i].data);
+    } else if (applied != NULL) {
+      applied[i] = true;
     }
   }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  unlock_stripes(kvs_table, stripes);
+  record_changes(num_pairs, keys, applied);
+  free(applied);
+
+  for (size_t i = 0; i < num_pairs; i++) {
+    resize_step(kvs_table);
+  }
+  // Waits for the log only after releasing the stripes, so other writers
+  // can join the same sync
+  if (kvs_log != NULL && wal_commit(kvs_log, lsn) != 0) {
+    fprintf(stderr, "Failed to log WRITE\n");
+  }
   return 0;
 }
 
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+int kvs_read(size_t num_pairs, const Slice *keys, OutputBuffer *out) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
   
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-
-  write_str(fd, "[");
+  // Reads take no locks, so each key is read atomically but a concurrent
+  // WRITE batch may be seen partially applied
+  output_write(out, "[", 1);
   for (size_t i = 0; i < num_pairs; i++) {
-    char *result = read_pair(kvs_table, keys[i]);
     char aux[MAX_STRING_SIZE];
+    // The value is formatted straight from the table, while it can't be freed
+    epoch_enter();
+    const char *result = read_pair(kvs_table, keys[i].data, keys[i].len, NULL);
+    int len;
     if (result == NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,KVSERROR)", keys[i]);
+      len = snprintf(aux, MAX_STRING_SIZE, "(%.*s,KVSERROR)", (int)keys[i].len, keys[i].data);
     } else {
-      snprintf(aux, MAX_STRING_SIZE, "(%s,%s)", keys[i], result);
+      len = snprintf(aux, MAX_STRING_SIZE, "(%.*s,%s)", (int)keys[i].len, keys[i].data, result);
     }
-    write_str(fd, aux);
-    free(result);
+    epoch_exit();
+    output_write(out, aux, len < MAX_STRING_SIZE ? (size_t)len : MAX_STRING_SIZE - 1);
   }
-  write_str(fd, "]\n");
-  
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  output_write(out, "]\n", 2);
   return 0;
 }
 
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd) {
+ssize_t kvs_get(const Slice *key, char *value, size_t size) {
+  if (kvs_table == NULL) {
+    fprintf(stderr, "KVS state must be initialized\n");
+    return -1;
+  }
+
+  size_t len = 0;
+  epoch_enter();
+  const char *result = read_pair(kvs_table, key->data, key->len, &len);
+  if (result != NULL) {
+    len = len < size ? len : size;
+    memcpy(value, result, len);
+  }
+  epoch_exit();
+  return result != NULL ? (ssize_t)len : -1;
+}
+
+int kvs_delete(size_t num_pairs, const Slice *keys, OutputBuffer *out) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return 1;
   }
   
-  pthread_rwlock_wrlock(&kvs_table->tablelock);
+  uint64_t stripes = stripes_of(num_pairs, keys);
+  bool *applied = changes_of(num_pairs);
+  lock_stripes(kvs_table, stripes, true);
 
+  uint64_t lsn = kvs_log != NULL ? wal_append(kvs_log, WAL_DELETE, num_pairs, keys, NULL) : 0;
   int aux = 0;
   for (size_t i = 0; i < num_pairs; i++) {
+    if (delete_pair(kvs_table, keys[i].data, keys[i].len) != 0) {
       if (!aux) {
-        write_str(fd, "[");
+        output_write(out, "[", 1);
         aux = 1;
       }
       char str[MAX_STRING_SIZE];
-      snprintf(str, MAX_STRING_SIZE, "(%s,KVSMISSING)", keys[i]);
-      write_str(fd, str);
+      snprintf(str, MAX_STRING_SIZE, "(%.*s,KVSMISSING)", (int)keys[i].len, keys[i].data);
+      output_str(out, str);
+    } else if (applied != NULL) {
+      applied[i] = true;
+    }
   }
   if (aux) {
-    write_str(fd, "]\n");
+    output_write(out, "]\n", 2);
   }
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+  unlock_stripes(kvs_table, stripes);
+  record_changes(num_pairs, keys, applied);
+  free(applied);
+
+  for (size_t i = 0; i < num_pairs; i++) {
+    resize_step(kvs_table);
+  }
+  if (kvs_log != NULL && wal_commit(kvs_log, lsn) != 0) {
+    fprintf(stderr, "Failed to log DELETE\n");
+  }
   return 0;
 }
 
-void kvs_show(int fd) {
+// Output of SHOW for a stripe, kept until the stripe was visited
+// consistently.
+typedef struct ShowBuffer {
+  char *data;  // Formatted pairs
+  size_t len;
+  size_t capacity;
+  int failed;  // Whether the buffer couldn't grow
+} ShowBuffer;
+
+// Appends a pair in the SHOW format to a ShowBuffer.
+// @param keyNode Node to be written.
+// @param arg Pointer to the ShowBuffer.
+static void buffer_pair(const KeyNode *keyNode, void *arg) {
+  ShowBuffer *buffer = arg;
+  if (buffer->len + MAX_STRING_SIZE > buffer->capacity) {
+    size_t capacity = buffer->capacity == 0 ? 4096 : buffer->capacity * 2;
+    char *data = realloc(buffer->data, capacity);
+    if (data == NULL) {
+      buffer->failed = 1;
+      return;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+  }
+  // snprintf never writes more than MAX_STRING_SIZE bytes, the '\0' included
+  int len = snprintf(buffer->data + buffer->len, MAX_STRING_SIZE, "(%s, %s)\n",
+                     node_key(keyNode), node_value(keyNode));
+  buffer->len += len < MAX_STRING_SIZE ? (size_t)len : MAX_STRING_SIZE - 1;
+}
+
+// Writes a pair in the SHOW format.
+// @param keyNode Node to be written.
+// @param arg Pointer to the OutputBuffer.
+static void show_pair(const KeyNode *keyNode, void *arg) {
+  char aux[MAX_STRING_SIZE];
+  snprintf(aux, MAX_STRING_SIZE, "(%s, %s)\n", node_key(keyNode), node_value(keyNode));
+  output_str(arg, aux);
+}
+
+void kvs_show(OutputBuffer *out) {
   if (kvs_table == NULL) {
     fprintf(stderr, "KVS state must be initialized\n");
     return;
   }
   
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  char aux[MAX_STRING_SIZE];
-  
-  for (int i = 0; i < TABLE_SIZE; i++) {
-    KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-    while (keyNode != NULL) {
-      snprintf(aux, MAX_STRING_SIZE, "(%s, %s)\n", keyNode->key, keyNode->value);
-      write_str(fd, aux);
-      keyNode = keyNode->next; // Move to the next node of the list
+  // Stripes are visited without locks and buffered, since a stripe whose
+  // nodes were moved by a resize meanwhile has to be visited again
+  ShowBuffer buffer = {NULL, 0, 0, 0};
+  for (size_t i = 0; i < LOCK_STRIPES; i++) {
+    int retry;
+    do {
+      buffer.len = 0;
+      epoch_enter();
+      retry = iterate_stripe(kvs_table, i, buffer_pair, &buffer);
+      epoch_exit();
+    } while (retry && !buffer.failed);
+
+    if (buffer.failed) {
+      // Out of memory, write the stripe directly while holding its lock
+      buffer.failed = 0;
+      lock_stripes(kvs_table, 1ULL << i, false);
+      iterate_stripe(kvs_table, i, show_pair, out);
+      unlock_stripes(kvs_table, 1ULL << i);
+    } else if (buffer.len > 0) {
+      output_write(out, buffer.data, buffer.len);
     }
   }
+  free(buffer.data);
+}
 
-  pthread_rwlock_unlock(&kvs_table->tablelock);
+// Output of a backup file, counting the records written to it.
+typedef struct BackupWriter {
+  OutputBuffer out;
+  size_t records;
+} BackupWriter;
+
+// Writes a pair in the backup format. May run in the forked backup child,
+// so only async signal safe functions may be used.
+// @param keyNode Node to be written.
+// @param arg Pointer to the BackupWriter of the backup file.
+static void backup_pair(const KeyNode *keyNode, void *arg) {
+  BackupWriter *writer = arg;
+  char aux[MAX_STRING_SIZE];
+  aux[0] = '(';
+  size_t num_bytes_copied = 1; // the "("
+  // the - 1 are all to leave space for the '/0'
+  num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
+                                  node_key(keyNode), MAX_STRING_SIZE - num_bytes_copied - 1);
+  num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
+                                  ", ", MAX_STRING_SIZE - num_bytes_copied - 1);
+  num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
+                                  node_value(keyNode), MAX_STRING_SIZE - num_bytes_copied - 1);
+  num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
+                                  ")\n", MAX_STRING_SIZE - num_bytes_copied - 1);
+  output_write(&writer->out, aux, num_bytes_copied);
+  writer->records++;
 }
 
-int kvs_backup(size_t num_backup,char* job_filename , char* directory) {
-  pid_t pid;
+// Writes a pair of a checkpoint. May run in the forked backup child.
+// @param keyNode Node to be written.
+// @param arg Pointer to the BackupWriter of the backup file.
+static void backup_node(const KeyNode *keyNode, void *arg) {
+  BackupWriter *writer = arg;
+  backup_record(&writer->out, node_key(keyNode), keyNode->key_len, node_value(keyNode),
+                keyNode->value_len);
+  writer->records++;
+}
+
+// Writes a changed key of a delta. May run in the forked backup child.
+// @param key The key.
+// @param len Length of the key.
+// @param keyNode Node holding the key, NULL if it was deleted.
+// @param arg Pointer to the BackupWriter of the backup file.
+static void backup_change(const char *key, size_t len, const KeyNode *keyNode, void *arg) {
+  BackupWriter *writer = arg;
+  if (keyNode != NULL) {
+    backup_node(keyNode, arg);
+  } else {
+    backup_record(&writer->out, key, len, NULL, 0);
+    writer->records++;
+  }
+}
+
+// A backup to be written, by a forked child or from a snapshot.
+typedef struct BackupRequest {
   char bck_name[50];
-  snprintf(bck_name, sizeof(bck_name), "%s/%s-%ld.bck", directory, strtok(job_filename, "."),
-           num_backup);
+  enum BackupKind kind;
+  uint32_t generation;
+  size_t pairs;     // Pairs of the table
+  bool in_process;  // Whether the pairs are visited in a snapshot of the
+                    // table (see snapshot_begin) rather than in the copy of a
+                    // forked child
+} BackupRequest;
+
+// Writes the pairs of a set of stripes of a backup.
+// @param writer Output of the backup file.
+// @param backup The backup.
+// @param stripes Mask of the stripes written.
+// @param pairs Number of pairs written, 0 if unknown.
+static void write_backup(BackupWriter *writer, const BackupRequest *backup, uint64_t stripes,
+                         size_t pairs) {
+  void (*iterate)(HashTable *, uint64_t, void (*)(const KeyNode *, void *), void *) =
+      backup->in_process ? snapshot_pairs : iterate_pairs;
+  switch (backup->kind) {
+    case BACKUP_PLAIN:
+      iterate(kvs_table, stripes, backup_pair, writer);
+      break;
+    case BACKUP_FULL:
+      backup_header(&writer->out, backup->kind, backup->generation);
+      iterate(kvs_table, stripes, backup_node, writer);
+      break;
+    case BACKUP_DELTA:
+      backup_header(&writer->out, backup->kind, backup->generation);
+      if (backup->in_process) {
+        snapshot_changes(kvs_table, stripes, backup_change, writer);
+      } else {
+        visit_changes(kvs_table, stripes, backup_change, writer);
+      }
+      break;
+    case BACKUP_SNAPSHOT:
+      writer->records = snapshot_write(&writer->out, kvs_table, stripes, backup->generation,
+                                       pairs, iterate);
+      break;
+  }
+}
+
+// Stripes of a shard of a backup: the shards split the stripes in
+// contiguous ranges.
+static uint64_t shard_stripes(size_t index) {
+  uint64_t stripes = 0;
+  for (size_t i = index * LOCK_STRIPES / backup_shards;
+       i < (index + 1) * LOCK_STRIPES / backup_shards; i++) {
+    stripes |= 1ULL << i;
+  }
+  return stripes;
+}
+
+// Writes a shard of a backup, or the whole backup file if backups aren't
+// sharded. Only uses async signal safe functions, unless the backup is
+// written from a snapshot.
+// @param backup The backup.
+// @param index Index of the shard.
+// @param buffer Memory the file is written with, NULL to write it
+// uncompressed through a small buffer.
+// @param shard Set to what was written.
+// @return 0 if successful, 1 otherwise.
+static int write_shard(const BackupRequest *backup, size_t index, BackupBuffer *buffer,
+                       BackupShard *shard) {
+  char shard_name[PATH_MAX];
+  const char *path = backup->bck_name;
+  bool sharded = backup_shards > 1;
+  if (sharded) {
+    if (shard_path(shard_name, sizeof(shard_name), backup->bck_name, index) != 0) {
+      return 1;
+    }
+    path = shard_name;
+  }
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) {
+    return 1;
+  }
+
+  BackupWriter writer;
+  writer.records = 0;
+  bool compressed = compressed_backups && buffer != NULL;
+  int failed = 0;
+  if (compressed) {
+    failed = compressed_init(&writer.out, fd, &buffer->compressor) != 0;
+  } else if (buffer != NULL) {
+    output_init_block(&writer.out, fd, buffer->block, BACKUP_BUFFER_SIZE);
+  } else {
+    output_init(&writer.out, fd);
+  }
+  write_backup(&writer, backup, sharded ? shard_stripes(index) : ALL_STRIPES,
+               sharded ? 0 : backup->pairs);
+  failed = (compressed ? compressed_finish(&writer.out) : output_flush(&writer.out)) != 0 ||
+           failed;
+  off_t bytes = lseek(fd, 0, SEEK_CUR);
+  failed = close(fd) != 0 || bytes < 0 || failed;
+  shard->records = writer.records;
+  shard->bytes = (size_t)bytes;
+  return failed;
+}
+
+// Shard written by a process of a forked backup, reported through a pipe.
+typedef struct ShardReport {
+  size_t index;
+  BackupShard shard;
+} ShardReport;
+
+// Writes the shards of a forked backup, each by a process of its own, then
+// its manifest. Runs in the forked child, which only has one thread, so it
+// may fork again, but still only uses async signal safe functions.
+// @param backup The backup.
+// @return 0 if successful, 1 otherwise.
+static int fork_shards(const BackupRequest *backup) {
+  BackupShard shards[MAX_BACKUP_SHARDS];
+  int reports[2];
+  if (pipe(reports) != 0) {
+    return 1;
+  }
+  int failed = 0;
+  size_t forked = 0;
+  for (size_t i = 1; i < backup_shards; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(reports[0]);
+      ShardReport report = {i, {0, 0}};
+      int result = write_shard(backup, i, &backup_buffer, &report.shard);
+      // Smaller than PIPE_BUF, so reports never interleave
+      ssize_t written = write(reports[1], &report, sizeof(report));
+      _exit(result != 0 || written != (ssize_t)sizeof(report));
+    }
+    if (pid > 0) {
+      forked++;
+    } else {
+      failed = 1;
+    }
+  }
+  close(reports[1]);
+  failed = write_shard(backup, 0, &backup_buffer, &shards[0]) != 0 || failed;
+
+  // Read until every process exited and closed its end
+  size_t reported = 0;
+  ShardReport report;
+  ssize_t len;
+  while ((len = read(reports[0], &report, sizeof(report))) != 0) {
+    if (len == (ssize_t)sizeof(report) && report.index < backup_shards) {
+      shards[report.index] = report.shard;
+      reported++;
+    } else if (len != -1 || errno != EINTR) {
+      failed = 1;
+      break;
+    }
+  }
+  close(reports[0]);
+  for (size_t i = 0; i < forked; i++) {
+    int status;
+    pid_t pid;
+    while ((pid = wait(&status)) == -1 && errno == EINTR) {
+    }
+    failed = failed || pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+  }
+
+  if (!failed && reported == forked && forked == backup_shards - 1) {
+    failed = manifest_write(backup->bck_name, backup->kind, backup->generation,
+                            backup_shards, shards) != 0;
+  } else {
+    failed = 1;
+  }
+  if (failed) {
+    // Otherwise the manifest of an older backup would list the new shards
+    unlink(backup->bck_name);
+  }
+  return failed;
+}
+
+// Shard written by a thread from a snapshot.
+typedef struct ShardThread {
+  pthread_t thread;
+  const BackupRequest *backup;
+  size_t index;
+  BackupShard shard;
+  int result;
+} ShardThread;
+
+static void *write_snapshot_shard(void *arg) {
+  ShardThread *shard = arg;
+  // Without a buffer the shard is written in smaller pieces, uncompressed
+  BackupBuffer *buffer = malloc(sizeof(BackupBuffer));
+  shard->result = write_shard(shard->backup, shard->index, buffer, &shard->shard);
+  free(buffer);
+  return NULL;
+}
+
+static void *write_snapshot_backup(void *arg) {
+  BackupRequest *backup = arg;
+  // The snapshot begins once the thread exists (see start_backup_thread)
+  pthread_mutex_lock(&backup_thread_mutex);
+  pthread_mutex_unlock(&backup_thread_mutex);
+
+  // Shards are written by a thread each, the first one by this thread
+  ShardThread shards[MAX_BACKUP_SHARDS];
+  bool started[MAX_BACKUP_SHARDS];
+  for (size_t i = backup_shards; i-- > 0;) {
+    shards[i] = (ShardThread){0, backup, i, {0, 0}, 0};
+    started[i] = i > 0 &&
+                 pthread_create(&shards[i].thread, NULL, write_snapshot_shard, &shards[i]) == 0;
+    if (!started[i]) {
+      write_snapshot_shard(&shards[i]);
+    }
+  }
+  int failed = 0;
+  BackupShard written[MAX_BACKUP_SHARDS];
+  for (size_t i = 0; i < backup_shards; i++) {
+    if (started[i]) {
+      pthread_join(shards[i].thread, NULL);
+    }
+    failed = failed || shards[i].result;
+    written[i] = shards[i].shard;
+  }
+
+  // Without the nodes that couldn't be saved the files aren't the snapshot
+  failed = snapshot_end(kvs_table) != 0 || failed;
+  if (!failed && backup_shards > 1) {
+    failed = manifest_write(backup->bck_name, backup->kind, backup->generation, backup_shards,
+                            written) != 0;
+  }
+  if (failed) {
+    fprintf(stderr, "Failed to write backup %s\n", backup->bck_name);
+    unlink(backup->bck_name);
+  }
+  free(backup);
+  atomic_store(&backup_thread_done, true);
+  return NULL;
+}
+
+// Joins the thread of the last snapshot backup if it is done writing, so
+// the next one can start. Called without the stripes, so writers never wait
+// for the join.
+static void join_done_backup_thread(void) {
+  pthread_mutex_lock(&backup_thread_mutex);
+  if (backup_thread_started && atomic_load(&backup_thread_done)) {
+    pthread_join(backup_thread, NULL);
+    backup_thread_started = false;
+  }
+  pthread_mutex_unlock(&backup_thread_mutex);
+}
+
+// Begins a snapshot of the table and starts a thread writing it as a
+// backup. Every stripe must be locked exclusively, and no snapshot be active.
+// @param request The backup, copied by the thread.
+// @return 0 if successful, 1 if the thread could not be started or the
+// previous one is still writing its files (see join_done_backup_thread).
+static int start_backup_thread(const BackupRequest *request) {
+  BackupRequest *backup = malloc(sizeof(BackupRequest));
+  if (backup == NULL) {
+    return 1;
+  }
+  *backup = *request;
+  backup->in_process = true;
+
+  pthread_mutex_lock(&backup_thread_mutex);
+  if (backup_thread_started) {
+    // Its snapshot ended, but it may still be writing the manifest: joining
+    // it here would hold every stripe meanwhile
+    pthread_mutex_unlock(&backup_thread_mutex);
+    free(backup);
+    return 1;
+  }
+  atomic_store(&backup_thread_done, false);
+  backup_thread_started =
+      pthread_create(&backup_thread, NULL, write_snapshot_backup, backup) == 0;
+  if (backup_thread_started) {
+    // The thread waits for the mutex, so it only looks at the snapshot once
+    // it began
+    backup->generation = snapshot_begin(kvs_table);
+  }
+  pthread_mutex_unlock(&backup_thread_mutex);
+  if (!backup_thread_started) {
+    free(backup);
+    return 1;
+  }
+  return 0;
+}
 
-  pthread_rwlock_rdlock(&kvs_table->tablelock);
-  pid = fork();
-  pthread_rwlock_unlock(&kvs_table->tablelock);
-  if (pid == 0) {
+pid_t kvs_backup(size_t num_backup, const char* job_filename, const char* directory,
+                 const int *gate) {
+  pid_t pid;
+  BackupRequest backup;
+  char *bck_name = backup.bck_name;
+  // The name is shared by every segment of the job, so it is not modified
+  snprintf(bck_name, sizeof(backup.bck_name), "%s/%.*s-%ld.bck", directory,
+           (int)strcspn(job_filename, "."), job_filename, num_backup);
+
+  // Holding every stripe while forking gives the child a consistent table.
+  // Delta backups also end the generation of the table, and snapshots begin
+  // one, which needs them exclusively.
+  bool delta_backups = checkpoint_interval > 0;
+  if (fork_free) {
+    join_done_backup_thread();
+  }
+  lock_stripes(kvs_table, ALL_STRIPES, delta_backups || fork_free);
+  enum BackupKind kind = BACKUP_PLAIN;
+  if (delta_backups && backups_taken % checkpoint_interval != 0 &&
+      !atomic_load(&kvs_table->changes_lost)) {
+    kind = BACKUP_DELTA;
+  } else if (binary_snapshots) {
+    kind = BACKUP_SNAPSHOT;
+  } else if (delta_backups) {
+    kind = BACKUP_FULL;
+  }
+  backup.kind = kind;
+  backup.generation = kvs_table->generation;
+  backup.pairs = atomic_load(&kvs_table->count);
+  backup.in_process = false;
+  // Only one snapshot is taken at a time, backups asked for meanwhile, or
+  // while its thread finishes, are forked
+  bool in_process = fork_free && !atomic_load(&kvs_table->snapshot_active) &&
+                    start_backup_thread(&backup) == 0;
+  pid = in_process ? 0 : fork();
+  bool parent = in_process || pid > 0;
+  if (parent && delta_backups) {
+    backups_taken++;
+    if (!in_process) {
+      next_generation(kvs_table);
+    }
+  }
+  if (parent && kvs_log != NULL) {
+    // Marks the point of the log the backup holds every change up to
+    const char *slash = strrchr(bck_name, '/');
+    Slice name = {slash != NULL ? slash + 1 : bck_name, 0};
+    name.len = strlen(name.data);
+    wal_append(kvs_log, WAL_BACKUP, 1, &name, NULL);
+  }
+  unlock_stripes(kvs_table, ALL_STRIPES);
+  if (!in_process && pid == 0) {
     // functions used here have to be async signal safe, since this
     // fork happens in a multi thread context (see man fork)
-    int fd = open(bck_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
-    for (int i = 0; i < TABLE_SIZE; i++) {
-      KeyNode *keyNode = kvs_table->table[i]; // Get the next list head
-      while (keyNode != NULL) {
-        char aux[MAX_STRING_SIZE];
-        aux[0] = '(';
-        size_t num_bytes_copied = 1; // the "("
-        // the - 1 are all to leave space for the '/0'
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
-                                        keyNode->key, MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
-                                        ", ", MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
-                                        keyNode->value, MAX_STRING_SIZE - num_bytes_copied - 1);
-        num_bytes_copied += strn_memcpy(aux + num_bytes_copied,
-                                        ")\n", MAX_STRING_SIZE - num_bytes_copied - 1);
-        aux[num_bytes_copied] = '\0';
-        write_str(fd, aux);
-        keyNode = keyNode->next; // Move to the next node of the list
+    if (gate != NULL) {
+      // Released by a byte from the parent, or by its death
+      char token;
+      close(gate[1]);
+      while (read(gate[0], &token, 1) == -1 && errno == EINTR) {
       }
+      close(gate[0]);
     }
-    exit(1);
-  } else if (pid < 0) {
-    return -1;
+    // The buffers live in the child's copy of the memory, nothing is shared
+    BackupShard shard;
+    int failed = backup_shards > 1 ? fork_shards(&backup)
+                                   : write_shard(&backup, 0, &backup_buffer, &shard);
+    // _exit, so the child neither runs atexit handlers nor flushes stdio
+    // buffers it shares with the parent
+    _exit(failed);
+  }
+  return pid;
+}
+
+void kvs_wait_backup() {
+  // Joined without the mutex, which the thread takes when it starts
+  pthread_mutex_lock(&backup_thread_mutex);
+  bool started = backup_thread_started;
+  pthread_t thread = backup_thread;
+  backup_thread_started = false;
+  pthread_mutex_unlock(&backup_thread_mutex);
+  if (started) {
+    pthread_join(thread, NULL);
   }
-  return 0;
 }
 
 void kvs_wait(unsigned int delay_ms) {
@@ -188,87 +887,255 @@ void kvs_wait(unsigned int delay_ms) {
 #include <stdlib.h>
 #include <string.h>
 
-// Definição das funções auxiliares (exemplo para subscribe_client, publish_message, etc.)
-typedef struct Subscription {
-    char key[MAX_KEY_LENGTH];
-    int fd; // FIFO de respostas do cliente
-    struct Subscription* next;
-} Subscription;
+// Inscrições de todas as sessões, criadas com a primeira
+static SubscriptionTable* subscription_table = NULL;
 
-static Subscription* subscriptions = NULL;
+// Número de inscrições, lido sem o mutex por quem altera chaves, para não
+// o tomar enquanto ninguém estiver inscrito
+static atomic_size_t num_subscriptions = 0;
 
-// Inscreve um cliente em uma chave
-void subscribe_client(Session* s, const char* key) {
-    pthread_mutex_lock(&subscriptions_mutex);
+// Alterações das chaves inscritas, enviadas pela thread de changes_thread
+static unsigned int change_window_ms = CHANGE_WINDOW_MS;
+static pthread_once_t changes_once = PTHREAD_ONCE_INIT;
+static pthread_cond_t changes_cond; // Sinalizada quando há uma alteração nova
+
+void kvs_change_window(unsigned int window_ms) {
+    change_window_ms = window_ms;
+}
 
-    // Verifica se o cliente já está inscrito na chave
-    Subscription* current = subscriptions;
-    while (current) {
-        if (strcmp(current->key, key) == 0 && current->fd == s->fd_responses) {
-            printf("Cliente já inscrito na chave %s\n", key);
-            pthread_mutex_unlock(&subscriptions_mutex);
-            return;
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// Filas recolhidas para uma notificação
+typedef struct OutboxList {
+    Outbox** outboxes;
+    size_t count;
+    size_t capacity;
+    int sender_fd; // Quem enviou não recebe a notificação
+} OutboxList;
+
+// Junta a fila de um inscrito à lista, com uma referência
+static void collect_outbox(Subscription* s, void* arg) {
+    OutboxList* list = arg;
+    if (s->session->fd_notifications == list->sender_fd) {
+        return;
+    }
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity > 0 ? list->capacity * 2 : 16;
+        Outbox** outboxes = realloc(list->outboxes, capacity * sizeof(Outbox*));
+        if (outboxes == NULL) {
+            return; // Este inscrito fica sem a notificação
         }
-        current = current->next;
+        list->outboxes = outboxes;
+        list->capacity = capacity;
     }
+    outbox_ref(s->session->outbox);
+    list->outboxes[list->count++] = s->session->outbox;
+}
 
-    // Adiciona nova inscrição
-    Subscription* new_subscription = malloc(sizeof(Subscription));
-    if (!new_subscription) {
-        perror("Erro ao alocar nova inscrição");
-        pthread_mutex_unlock(&subscriptions_mutex);
-        return;
+static int compare_outboxes(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)*(Outbox* const*)a, y = (uintptr_t)*(Outbox* const*)b;
+    return (x > y) - (x < y);
+}
+
+// Recolhe, com uma referência, as filas dos inscritos numa chave e nos
+// padrões que lhe correspondem, menos a de quem enviou. Chamada com
+// subscriptions_mutex e a tabela criada.
+// Devolve as filas, ou NULL se não há nenhuma ou faltou memória
+static Outbox** subscriber_outboxes(const char* key, size_t len, int sender_fd, size_t* count) {
+    // Sem padrões, os inscritos são só os da chave, e cabem de uma vez
+    Topic* topic = table_find(subscription_table, key, len);
+    OutboxList list = {NULL, 0, topic != NULL ? topic->num_subscribers : 0, sender_fd};
+    if (list.capacity > 0 && (list.outboxes = malloc(list.capacity * sizeof(Outbox*))) == NULL) {
+        list.capacity = 0;
     }
-    strncpy(new_subscription->key, key, MAX_KEY_LENGTH);
-    new_subscription->fd = s->fd_responses;
-    new_subscription->next = subscriptions;
-    subscriptions = new_subscription;
+    if (table_match(subscription_table, key, len, collect_outbox, &list) > 1) {
+        // Uma sessão inscrita em mais de um dos tópicos só recebe uma vez
+        qsort(list.outboxes, list.count, sizeof(Outbox*), compare_outboxes);
+        size_t unique = 0;
+        for (size_t i = 0; i < list.count; i++) {
+            if (unique > 0 && list.outboxes[unique - 1] == list.outboxes[i]) {
+                outbox_release(list.outboxes[i]);
+            } else {
+                list.outboxes[unique++] = list.outboxes[i];
+            }
+        }
+        list.count = unique;
+    }
+    *count = list.count;
+    return list.outboxes;
+}
 
-    printf("Cliente inscrito na chave %s com fd=%d\n", key, s->fd_responses);
-    pthread_mutex_unlock(&subscriptions_mutex);
+// Põe uma notificação nas filas e larga as referências a elas. Chamada sem
+// subscriptions_mutex, pois pode ter de esperar por espaço
+// Devolve quantas filas ficaram com a notificação
+static size_t deliver(Notification* notification, Outbox** outboxes, size_t count) {
+    size_t queued = 0;
+    for (size_t i = 0; i < count; i++) {
+        queued += outbox_push(outboxes[i], notification) == 0;
+        outbox_release(outboxes[i]);
+    }
+    free(outboxes);
+    return queued;
 }
 
+// Envia as alterações das chaves inscritas, cada uma change_window_ms
+// depois da primeira que ainda não foi notificada. As que chegam entretanto
+// só mudam o valor a enviar, por isso uma chave alterada muitas vezes na
+// janela gera uma notificação por inscrito
+static void* changes_thread(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&subscriptions_mutex);
+    while (1) {
+        Topic* topic = subscription_table != NULL ? subscription_table->changed_head : NULL;
+        if (topic == NULL) {
+            pthread_cond_wait(&changes_cond, &subscriptions_mutex);
+            continue;
+        }
+        uint64_t deadline = topic->changed_ns + (uint64_t)change_window_ms * 1000000;
+        if (monotonic_ns() < deadline) {
+            struct timespec ts = {(time_t)(deadline / 1000000000), (long)(deadline % 1000000000)};
+            pthread_cond_timedwait(&changes_cond, &subscriptions_mutex, &ts);
+            continue;
+        }
+        table_take_change(subscription_table);
+
+        // Uma chave apagada vai sem valor (FIELD_MISSING)
+        char frame[MAX_FRAME_SIZE];
+        Field fields[2] = {{topic->key, topic->key_len},
+                           {topic->deleted ? NULL : topic->value, topic->value_len}};
+        size_t len = frame_encode(frame, sizeof(frame), OP_CODE_NOTIFICATION, STATUS_OK, 2, fields);
+        Notification* notification = notification_create(frame, len);
+        if (notification == NULL) {
+            perror("Erro ao enviar notificação");
+            table_release_topic(subscription_table, topic);
+            continue;
+        }
+        size_t count;
+        Outbox** outboxes = subscriber_outboxes(topic->key, topic->key_len, -1, &count);
+        table_release_topic(subscription_table, topic);
+        pthread_mutex_unlock(&subscriptions_mutex);
+        deliver(notification, outboxes, count);
+        notification_release(notification);
+        pthread_mutex_lock(&subscriptions_mutex);
+    }
+    return NULL;
+}
 
+static void start_changes_thread(void) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&changes_cond, &attr);
+    pthread_condattr_destroy(&attr);
 
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, changes_thread, NULL) != 0) {
+        perror("Erro ao criar a thread de alterações");
+        return;
+    }
+    pthread_detach(thread);
+}
 
+static bool recording_changes(void) {
+    return atomic_load_explicit(&num_subscriptions, memory_order_acquire) > 0;
+}
 
-// Cancela a inscrição de um cliente em uma chave
-void unsubscribe_client(Session* s, const char* key) {
+static void record_change(const Slice* key) {
+    // A tabela existe antes de haver inscrições, e nunca é libertada. Só as
+    // chaves que podem ter inscritos tomam o mutex
+    if (!recording_changes() || !table_may_change(subscription_table, key->data, key->len)) {
+        return;
+    }
+    uint64_t now = monotonic_ns();
     pthread_mutex_lock(&subscriptions_mutex);
+    // Lido com o mutex, para que o último a registar deixe o valor mais recente
+    char value[MAX_STRING_SIZE];
+    ssize_t len = kvs_get(key, value, sizeof(value));
+    // Só a primeira alteração de uma lista vazia acorda a thread: as outras
+    // esperam pela que está à frente
+    if (table_change(subscription_table, key->data, key->len, len >= 0 ? value : NULL,
+                     len >= 0 ? (size_t)len : 0, now) &&
+        subscription_table->changed_head == subscription_table->changed_tail) {
+        pthread_cond_signal(&changes_cond);
+    }
+    pthread_mutex_unlock(&subscriptions_mutex);
+}
 
-    Subscription** current = &subscriptions;
-    while (*current) {
-        if (strcmp((*current)->key, key) == 0 && (*current)->fd == s->fd_responses) {
-            Subscription* to_remove = *current;
-            *current = (*current)->next;
-            free(to_remove);
-            printf("Cliente removido da inscrição na chave %s\n", key);
-            pthread_mutex_unlock(&subscriptions_mutex);
-            return;
-        }
-        current = &((*current)->next);
+static bool* changes_of(size_t num_pairs) {
+    if (!recording_changes()) {
+        return NULL;
     }
+    bool* applied = calloc(num_pairs, sizeof(bool));
+    if (applied == NULL && num_pairs > 0) {
+        perror("Erro ao registar as alterações");
+    }
+    return applied;
+}
 
-    printf("Cliente não encontrado na chave %s para cancelamento\n", key);
-    pthread_mutex_unlock(&subscriptions_mutex);
+static void record_changes(size_t num_pairs, const Slice* keys, const bool* applied) {
+    // Sem a lista, por falta de memória ou por ninguém estar inscrito antes
+    // da escrita, nenhuma chave é registada: não se sabe quais mudaram
+    if (applied == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < num_pairs; i++) {
+        if (applied[i]) {
+            record_change(&keys[i]);
+        }
+    }
 }
 
+// Inscreve um cliente em uma chave
+void subscribe_client(Session* s, const char* key) {
+    pthread_once(&changes_once, start_changes_thread);
+    pthread_mutex_lock(&subscriptions_mutex);
 
+    if (subscription_table == NULL && (subscription_table = create_subscription_table()) == NULL) {
+        perror("Erro ao alocar nova inscrição");
+        pthread_mutex_unlock(&subscriptions_mutex);
+        return;
+    }
+    int result = table_subscribe(subscription_table, &s->subscriptions, s, key);
+    if (result == 1) {
+        printf("Cliente já inscrito na chave %s\n", key);
+    } else if (result < 0) {
+        perror("Erro ao alocar nova inscrição");
+    } else {
+        printf("Cliente inscrito na chave %s com fd=%d\n", key, s->fd_notifications);
+    }
+    atomic_store(&num_subscriptions, subscription_table->num_subscriptions);
+    pthread_mutex_unlock(&subscriptions_mutex);
+}
 
+// Cancela a inscrição de um cliente em uma chave
+// Devolve 1 se o cliente não estava inscrito na chave
+int unsubscribe_client(Session* s, const char* key) {
+    pthread_mutex_lock(&subscriptions_mutex);
 
+    int result = 1;
+    if (subscription_table != NULL) {
+        result = table_unsubscribe(subscription_table, &s->subscriptions, s, key);
+        atomic_store(&num_subscriptions, subscription_table->num_subscriptions);
+    }
+    if (result == 0) {
+        printf("Cliente removido da inscrição na chave %s\n", key);
+    } else {
+        printf("Cliente não encontrado na chave %s para cancelamento\n", key);
+    }
+    pthread_mutex_unlock(&subscriptions_mutex);
+    return result;
+}
 
 // Cancela todas as inscrições de um cliente
 void unsubscribe_all(Session* s) {
     pthread_mutex_lock(&subscriptions_mutex);
-    Subscription** current = &subscriptions;
-    while (*current) {
-        if ((*current)->fd == s->fd_responses) {
-            Subscription* to_remove = *current;
-            *current = (*current)->next;
-            free(to_remove);
-        } else {
-            current = &((*current)->next);
-        }
+    if (subscription_table != NULL) {
+        table_unsubscribe_all(subscription_table, &s->subscriptions);
+        atomic_store(&num_subscriptions, subscription_table->num_subscriptions);
     }
     pthread_mutex_unlock(&subscriptions_mutex);
 }
@@ -276,19 +1143,29 @@ void unsubscribe_all(Session* s) {
 
 // Publica uma mensagem para todos os inscritos em uma chave
 void publish_message(const char* key, const char* message, int sender_fd) {
-    pthread_mutex_lock(&subscriptions_mutex);
-
     printf("Publicando mensagem na chave %s: %s\n", key, message);
-    Subscription* current = subscriptions;
-    while (current) {
-        if (strcmp(current->key, key) == 0 && current->fd != sender_fd) {
-            dprintf(current->fd, "%s\n", message); // Envia a mensagem
-            printf("Mensagem enviada para fd=%d\n", current->fd); // Log único
-        }
-        current = current->next;
+    // A notificação é a mesma para todos os inscritos
+    char frame[MAX_FRAME_SIZE];
+    Field fields[2] = {{key, strlen(key)}, {message, strlen(message)}};
+    size_t len = frame_encode(frame, sizeof(frame), OP_CODE_NOTIFICATION, STATUS_OK, 2, fields);
+    Notification* notification = notification_create(frame, len);
+    if (notification == NULL) {
+        perror("Erro ao enviar notificação");
+        return;
     }
 
+    // Só as filas dos inscritos são recolhidas com o mutex, e as
+    // notificações entram nelas já sem ele, pois podem ter de esperar
+    pthread_mutex_lock(&subscriptions_mutex);
+    size_t count = 0;
+    Outbox** outboxes = subscription_table != NULL
+                            ? subscriber_outboxes(key, strlen(key), sender_fd, &count)
+                            : NULL;
     pthread_mutex_unlock(&subscriptions_mutex);
+
+    size_t queued = deliver(notification, outboxes, count);
+    printf("Mensagem na fila de %zu inscritos\n", queued);
+    notification_release(notification);
 }
 
 
@@ -1,8 +1,16 @@
 #ifndef KVS_OPERATIONS_H
 #define KVS_OPERATIONS_H
 
+#include <stdbool.h>
 #include <stddef.h>
+#include <sys/types.h>
 #include "constants.h"
+#include "io.h"
+#include "parser.h"
+#include "../common/protocol.h"
+#include "notifications.h"
+#include "subscriptions.h"
+#include "wal.h"
 
 
 #ifndef OPERATIONS_H
@@ -27,15 +35,24 @@ extern pthread_mutex_t subscriptions_mutex; // Declaração do mutex
 typedef struct Session {
     int fd_requests;    // FIFO de pedidos
     int fd_responses;   // FIFO de respostas
+    int fd_notifications; // FIFO de notificações, ou o de respostas se o cliente não tiver
+    Outbox* outbox;       // Notificações por enviar para fd_notifications
+    int fd_events;        // epoll dos FIFOs da sessão, com as threads do epoll, ou -1
+    OutputBuffer* unsent; // Respostas que não couberam no FIFO, com as threads do epoll
     pthread_t tid;      // Thread associada ao cliente
     pid_t client_pid;   // PID do cliente
     char fifo_requests[PATH_MAX];  // Caminho do FIFO de pedidos
     char fifo_responses[PATH_MAX]; // Caminho do FIFO de respostas
+    char frames[MAX_FRAME_SIZE];   // Pedidos lidos, o último possivelmente incompleto
+    size_t frames_len;
+    Subscription* subscriptions;   // Inscrições da sessão (ver subscriptions.h)
 } Session;
 
+#define CHANGE_WINDOW_MS 5 // Tempo por omissão em que as alterações de uma chave são juntadas
+
 // Declarações das funções auxiliares
 void subscribe_client(Session* s, const char* key);
-void unsubscribe_client(Session* s, const char* key);
+int unsubscribe_client(Session* s, const char* key);
 void publish_message(const char* key, const char* message, int sender_fd);
 void unsubscribe_all(Session* s);
 
@@ -49,40 +66,122 @@ void unsubscribe_all(Session* s);
 /// @return 0 if the KVS state was initialized successfully, 1 otherwise.
 int kvs_init();
 
+/// Makes each backup hold only the changes since the previous one (see
+/// backup.h), with a full backup every checkpoint_interval backups. Must be
+/// called before kvs_init.
+/// @param checkpoint_interval Backups from one full backup to the next, 0
+/// for every backup to be full and without header (the default).
+void kvs_delta_backups(size_t checkpoint_interval);
+
+/// Makes full backups binary snapshots (see backup.h), which are smaller and
+/// much faster to restore. Must be called before kvs_init.
+/// @param enabled Whether full backups are snapshots.
+void kvs_binary_snapshots(bool enabled);
+
+/// Makes backups be written by a thread of the server from an in-process
+/// snapshot of the table (see snapshot_begin in kvs.h), instead of by a
+/// forked child, so writers never pay for copying the pages of the table.
+/// Backups asked for while a snapshot is being written are still forked.
+/// Must be called before kvs_init.
+/// @param enabled Whether backups are written by a thread.
+void kvs_fork_free_backups(bool enabled);
+
+/// Makes backup files (and the shards of sharded ones) be compressed a
+/// block at a time (see backup.h), trading CPU time for disk bandwidth.
+/// Restores read compressed and uncompressed backups alike. Must be called
+/// before kvs_init.
+/// @param enabled Whether backup files are compressed.
+void kvs_compressed_backups(bool enabled);
+
+/// Splits each backup into shards written in parallel, each holding the
+/// pairs of a range of stripes of the table, listed by a manifest written
+/// in place of the backup file (see backup.h). Forked backups fork a process
+/// per shard, fork free ones start a thread per shard. Must be called before
+/// kvs_init.
+/// @param shards Number of shards, 1 (the default) for a single file.
+void kvs_backup_shards(size_t shards);
+
+/// Loads the newest checkpoint of a directory, and the deltas that follow
+/// it, into the freshly initialized KVS. The table is sized for the pairs
+/// of a snapshot or sharded checkpoint before it is filled, and the shards
+/// of a checkpoint are loaded in parallel.
+/// @param directory Directory the backups were written to.
+/// @return 0 if the backups were restored or there were none, 1 if a backup
+/// is corrupted or could not be read, leaving the KVS empty.
+int kvs_restore(const char *directory);
+
+/// Starts logging every WRITE and DELETE to the write-ahead log of a
+/// directory (see wal.h). Must be called after kvs_restore, if it is.
+/// @param directory Directory the backups are written to.
+/// @param sync When the log is synced.
+/// @param interval_ms Time between syncs of WAL_SYNC_PERIODIC.
+/// @param replay Whether the records of the log written after the restored
+/// backup are applied first. Otherwise the log is emptied.
+/// @return 0 if successful, 1 if the log could not be replayed or opened.
+int kvs_open_log(const char *directory, enum WalSync sync, unsigned int interval_ms,
+                 bool replay);
+
 /// Destroys the KVS state.
 /// @return 0 if the KVS state was terminated successfully, 1 otherwise.
 int kvs_terminate();
 
 /// Writes a key value pair to the KVS. If key already exists it is updated.
+/// The pairs may be slices of a mapped job file, they are only copied into
+/// the KVS itself.
 /// @param num_pairs Number of pairs being written.
-/// @param keys Array of keys' strings.
-/// @param values Array of values' strings.
+/// @param keys Array of keys.
+/// @param values Array of values.
 /// @return 0 if the pairs were written successfully, 1 otherwise.
-int kvs_write(size_t num_pairs, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE]);
+int kvs_write(size_t num_pairs, const Slice *keys, const Slice *values);
+
+/// Reads the value of a single key, for the READ requests of clients.
+/// @param key The key.
+/// @param value Set to a copy of the value, if the key exists.
+/// @param size Size of value. Longer values are cut.
+/// @return Length of the value copied, -1 if the key doesn't exist.
+ssize_t kvs_get(const Slice *key, char *value, size_t size);
 
 /// Reads values from the KVS.
 /// @param num_pairs Number of pairs to read.
-/// @param keys Array of keys' strings.
-/// @param fd File descriptor to write the (successful) output.
+/// @param keys Array of keys.
+/// @param out Output buffer of the job, flushed by the caller.
 /// @return 0 if the key reading, 1 otherwise.
-int kvs_read(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_read(size_t num_pairs, const Slice *keys, OutputBuffer *out);
 
 /// Deletes key value pairs from the KVS.
 /// @param num_pairs Number of pairs to read.
-/// @param keys Array of keys' strings.
+/// @param keys Array of keys.
+/// @param out Output buffer of the job, flushed by the caller.
 /// @return 0 if the pairs were deleted successfully, 1 otherwise.
-int kvs_delete(size_t num_pairs, char keys[][MAX_STRING_SIZE], int fd);
+int kvs_delete(size_t num_pairs, const Slice *keys, OutputBuffer *out);
+
+/// Sets how long the changes of a key are gathered before its subscribers
+/// are notified. WRITEs and DELETEs of subscribed keys are notified, as
+/// NOTIFICATION frames with the new value or with FIELD_MISSING for a
+/// delete, by a thread started with the first subscription. A key changed
+/// again within the window is notified once, with its latest value.
+/// @param window_ms Time from the first change not notified yet of a key
+/// until it is notified, 0 to notify every change as soon as possible.
+void kvs_change_window(unsigned int window_ms);
 
 /// Writes the state of the KVS.
-/// @param fd File descriptor to write the output.
-void kvs_show(int fd);
+/// @param out Output buffer of the job, flushed by the caller.
+void kvs_show(OutputBuffer *out);
 
 /// Creates a backup of the KVS state and stores it in the correspondent
-/// backup file
-/// @return 0 if the backup was successful, 1 otherwise.
-int kvs_backup(size_t num_backup,char* job_filename , char* directory);
-
-/// Waits for the last backup to be called.
+/// backup file, from a forked child or, with fork free backups, from a
+/// thread. With delta backups the backup only holds the changes since the
+/// previous one, unless it is a checkpoint.
+/// @param gate Pipe or socket pair the child waits on, holding the state of
+/// the fork, until a byte is written to gate[1] or every copy of it is
+/// closed. NULL to write the backup right away. Both ends stay open in the
+/// parent. Not used by threads, which never wait to write their backup.
+/// @return PID of the child writing the backup, which exits with status 1
+/// if it fails, 0 if a thread writes it instead, -1 if it could not be forked.
+pid_t kvs_backup(size_t num_backup, const char* job_filename, const char* directory,
+                 const int *gate);
+
+/// Waits for the thread writing the last fork free backup, if any.
 void kvs_wait_backup();
 
 /// Waits for a given amount of time.
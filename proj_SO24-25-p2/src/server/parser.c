@@ -1,80 +1,235 @@
 #include "parser.h"
 
+#include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "constants.h"
 #include "io.h"
 
-// Reads a string and indicates the position from where it was
-// extracted, based on the KVS specification.
-// @param fd File to read from.
-// @param buffer To write the string in.
-// @param max Maximum string size.
-static int read_string(int fd, char *buffer, size_t max) {
+#define ARENA_BLOCK_SIZE 4096
+
+// Block of strings copied from a streamed job file.
+typedef struct ArenaBlock {
+  struct ArenaBlock *next;
+  size_t used;
+  char data[ARENA_BLOCK_SIZE];
+} ArenaBlock;
+
+void input_init(InputBuffer *in, int fd) {
+  in->fd = fd;
+  in->data = in->block;
+  in->pos = 0;
+  in->len = 0;
+  in->syscalls = 0;
+  in->mapped = false;
+}
+
+int input_map(InputBuffer *in) {
+  struct stat st;
+  if (fstat(in->fd, &st) == -1 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+    return 1;
+  }
+
+  void *mapping = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+  if (mapping == MAP_FAILED) {
+    return 1;
+  }
+  // The file is parsed once, front to back
+  posix_madvise(mapping, (size_t)st.st_size, POSIX_MADV_SEQUENTIAL);
+
+  in->data = mapping;
+  in->pos = 0;
+  in->len = (size_t)st.st_size;
+  in->mapped = true;
+  return 0;
+}
+
+void input_view(InputBuffer *view, const InputBuffer *in, size_t start, size_t end) {
+  view->fd = in->fd;
+  view->data = in->data;
+  view->pos = start;
+  view->len = end;
+  view->syscalls = 0;
+  view->mapped = true;
+}
+
+void input_release(InputBuffer *in) {
+  if (in->mapped) {
+    munmap((void *)in->data, in->len);
+    in->data = in->block;
+    in->pos = in->len = 0;
+    in->mapped = false;
+  }
+}
+
+// Reads the next block of the file into an exhausted input buffer.
+// @param in Input buffer.
+// @return 1 if bytes were read, 0 at the end of the file or on error.
+static int refill(InputBuffer *in) {
+  if (in->mapped) {
+    return 0; // The whole file is already there
+  }
+
   ssize_t bytes_read;
-  char ch;
-  size_t i = 0;
-  int value = -1;
+  do {
+    bytes_read = read(in->fd, in->block, INPUT_BUFFER_SIZE);
+    in->syscalls++;
+  } while (bytes_read < 0 && errno == EINTR);
+
+  in->pos = 0;
+  in->len = bytes_read > 0 ? (size_t)bytes_read : 0;
+  return bytes_read > 0;
+}
 
-  while (i < max) {
-    bytes_read = read(fd, &ch, 1);
+// Reads a character, like read(fd, ch, 1) on the file.
+// @param in Input buffer.
+// @param ch To store the character in.
+// @return 1 if a character was read, 0 otherwise.
+static int read_char(InputBuffer *in, char *ch) {
+  if (in->pos == in->len && !refill(in)) {
+    return 0;
+  }
+  *ch = in->data[in->pos++];
+  return 1;
+}
 
-    if (bytes_read <= 0) {
-        return -1;
+// Reads up to n characters, like a read(fd, buf, n) on the file that
+// only comes up short at its end.
+// @param in Input buffer.
+// @param buf To store the characters in.
+// @param n Number of characters.
+// @return Number of characters read.
+static size_t read_chars(InputBuffer *in, char *buf, size_t n) {
+  size_t done = 0;
+  while (done < n) {
+    if (in->pos == in->len && !refill(in)) {
+      break;
     }
+    size_t chunk = in->len - in->pos < n - done ? in->len - in->pos : n - done;
+    memcpy(buf + done, in->data + in->pos, chunk);
+    in->pos += chunk;
+    done += chunk;
+  }
+  return done;
+}
 
-    if (ch == ' ') {
+// Reads a string and indicates the position from where it was
+// extracted, based on the KVS specification.
+// @param in Input buffer to read from.
+// @param buffer To write the string in.
+// @param max Size of buffer, strings must leave space for the '\0'.
+static int read_string(InputBuffer *in, char *buffer, size_t max) {
+  size_t i = 0;
+
+  while (1) {
+    if (in->pos == in->len && !refill(in)) {
       return -1;
     }
 
-    if (ch == ',') {
-      value = 0;
-      break;
-    }
-    else if (ch == ')') {
-      value = 1;
-      break;
-    }
-    else if (ch == ']') {
-      value = 2;
-      break;
+    // Scans the buffered bytes directly, most strings end inside the block
+    const char *data = in->data + in->pos;
+    size_t available = in->len - in->pos;
+    for (size_t j = 0; j < available; j++) {
+      char ch = data[j];
+      int value;
+      switch (ch) {
+        case ' ':
+          in->pos += j + 1;
+          return -1;
+        case ',':
+          value = 0;
+          break;
+        case ')':
+          value = 1;
+          break;
+        case ']':
+          value = 2;
+          break;
+        default:
+          if (i == max - 1) {
+            in->pos += j + 1;
+            return -1; // Too long
+          }
+          buffer[i++] = ch;
+          continue;
+      }
+      in->pos += j + 1;
+      buffer[i] = '\0';
+      return value;
     }
-
-    buffer[i++] = ch;
+    in->pos += available;
   }
+}
 
-  buffer[i] = '\0';
+// Reads a string of a mapped input buffer, based on the KVS
+// specification, without copying it.
+// @param in Mapped input buffer to read from.
+// @param slice To point to the string in the mapping.
+// @param max Maximum string size, the '\0' included.
+// @return Same as read_string.
+static int read_slice(InputBuffer *in, Slice *slice, size_t max) {
+  const char *start = in->data + in->pos;
+  size_t available = in->len - in->pos;
+  size_t limit = available < max ? available : max;
+
+  for (size_t i = 0; i < limit; i++) {
+    int value;
+    switch (start[i]) {
+      case ' ':
+        in->pos += i + 1;
+        return -1;
+      case ',':
+        value = 0;
+        break;
+      case ')':
+        value = 1;
+        break;
+      case ']':
+        value = 2;
+        break;
+      default:
+        continue;
+    }
+    in->pos += i + 1;
+    slice->data = start;
+    slice->len = i;
+    return value;
+  }
 
-  return value;
+  in->pos += limit; // Too long, or the file ended
+  return -1;
 }
 
 // Reads a number and stores it in an unsigned integer
 // variable.
-// @param fd File to read from.
+// @param in Input buffer to read from.
 // @param value To store the number in.
 // @param next Will point to the character succeding the number.
-static int read_uint(int fd, unsigned int *value, char *next) {
+static int read_uint(InputBuffer *in, unsigned int *value, char *next) {
   char buf[16];
 
-  int i = 0;
+  size_t i = 0;
   while (1) {
-    if (read(fd, buf + i, 1) == 0) {
+    if (!read_char(in, next)) {
       *next = '\0';
       break;
     }
 
-    *next = buf[i];
-
-    if (buf[i] > '9' || buf[i] < '0') {
-      buf[i] = '\0';
+    if (*next > '9' || *next < '0') {
       break;
     }
 
-    i++;
+    if (i == sizeof(buf) - 1) {
+      return 1; // Too many digits for an unsigned int anyway
+    }
+    buf[i++] = *next;
   }
+  buf[i] = '\0';
 
   unsigned long ul = strtoul(buf, NULL, 10);
 
@@ -87,25 +242,30 @@ static int read_uint(int fd, unsigned int *value, char *next) {
   return 0;
 }
 
-// Jumps file descriptor to next line.
-// @param fd File descriptor.
-static void cleanup(int fd) {
-  char ch;
-  while (read(fd, &ch, 1) == 1 && ch != '\n')
-    ;
+// Jumps input buffer to next line.
+// @param in Input buffer.
+static void cleanup(InputBuffer *in) {
+  while (in->pos < in->len || refill(in)) {
+    const char *newline = memchr(in->data + in->pos, '\n', in->len - in->pos);
+    if (newline != NULL) {
+      in->pos = (size_t)(newline - in->data) + 1;
+      return;
+    }
+    in->pos = in->len;
+  }
 }
 
-enum Command get_next(int fd) {
+enum Command get_next(InputBuffer *in) {
   char buf[16];
-  if (read(fd, buf, 1) != 1) {
+  if (read_char(in, buf) != 1) {
     return EOC;
   }
 
   switch (buf[0]) {
     case 'W':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
-        if (read(fd, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
-          cleanup(fd);
+      if (read_chars(in, buf + 1, 4) != 4 || strncmp(buf, "WAIT ", 5) != 0) {
+        if (read_chars(in, buf + 5, 1) != 1 || strncmp(buf, "WRITE ", 6) != 0) {
+          cleanup(in);
           return CMD_INVALID;
         }
         return CMD_WRITE;
@@ -114,119 +274,201 @@ enum Command get_next(int fd) {
       return CMD_WAIT;
 
     case 'R':
-      if (read(fd, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 4) != 4 || strncmp(buf, "READ ", 5) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_READ;
 
     case 'D':
-      if (read(fd, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 6) != 6 || strncmp(buf, "DELETE ", 7) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_DELETE;
 
     case 'S':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 3) != 3 || strncmp(buf, "SHOW", 4) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-        cleanup(fd);
+      if (read_char(in, buf + 4) != 0 && buf[4] != '\n') {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_SHOW;
 
     case 'B':
-      if (read(fd, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 5) != 5 || strncmp(buf, "BACKUP", 6) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 6, 1) != 0 && buf[6] != '\n') {
-        cleanup(fd);
+      if (read_char(in, buf + 6) != 0 && buf[6] != '\n') {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_BACKUP;
 
     case 'H':
-      if (read(fd, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
-        cleanup(fd);
+      if (read_chars(in, buf + 1, 3) != 3 || strncmp(buf, "HELP", 4) != 0) {
+        cleanup(in);
         return CMD_INVALID;
       }
 
-      if (read(fd, buf + 4, 1) != 0 && buf[4] != '\n') {
-        cleanup(fd);
+      if (read_char(in, buf + 4) != 0 && buf[4] != '\n') {
+        cleanup(in);
         return CMD_INVALID;
       }
 
       return CMD_HELP;
 
     case '#':
-      cleanup(fd);
+      cleanup(in);
       return CMD_EMPTY;
 
     case '\n':
       return CMD_EMPTY;
 
     default:
-      cleanup(fd);
+      cleanup(in);
       return CMD_INVALID;
   }
 }
 
-// Parses a key value pair.
-// @param fd File decriptor to read from.
-// @param key Pointer where the key will be stored
-// @param value Pointer where the value will be stored
-// @return 1 if successful, 0 otherwise.
-int parse_pair(int fd, char *key, char *value) {
-  if (read_string(fd, key, MAX_STRING_SIZE) != 0) {
-    cleanup(fd);
+// Makes room for one more pair in command arguments.
+// @return 0 if successful, 1 if memory could not be allocated.
+static int reserve_pair(CommandArgs *args) {
+  if (args->num_pairs < args->capacity) {
     return 0;
   }
+  size_t capacity = args->capacity == 0 ? 16 : args->capacity * 2;
+  Slice *keys = realloc(args->keys, capacity * sizeof(Slice));
+  if (keys == NULL) {
+    return 1;
+  }
+  args->keys = keys;
+  Slice *values = realloc(args->values, capacity * sizeof(Slice));
+  if (values == NULL) {
+    return 1;
+  }
+  args->values = values;
+  args->capacity = capacity;
+  return 0;
+}
 
-  if (read_string(fd, value, MAX_STRING_SIZE) != 1) {
-    cleanup(fd);
-    return 0;
+// Gets space for a string in the arena of command arguments. Blocks are
+// never moved, so strings already copied stay where they are.
+// @param size Maximum size of the string, the '\0' included.
+// @return Pointer to the space, NULL if memory could not be allocated.
+static char *arena_reserve(CommandArgs *args, size_t size) {
+  ArenaBlock *block = args->current;
+  if (block != NULL && block->used + size <= ARENA_BLOCK_SIZE) {
+    return block->data + block->used;
   }
 
-  return 1;
+  ArenaBlock *next = block == NULL ? args->arena : block->next;
+  if (next == NULL) {
+    next = malloc(sizeof(ArenaBlock));
+    if (next == NULL) {
+      return NULL;
+    }
+    next->next = NULL;
+    if (block == NULL) {
+      args->arena = next;
+    } else {
+      block->next = next;
+    }
+  }
+  next->used = 0;
+  args->current = next;
+  return next->data;
+}
+
+// Forgets the arguments of the previous command, keeping their memory.
+static void reset_args(CommandArgs *args) {
+  args->num_pairs = 0;
+  args->current = args->arena;
+  if (args->current != NULL) {
+    args->current->used = 0;
+  }
 }
 
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size) {
+// Reads a key or value, based on the KVS specification: from the mapping
+// of a mapped input buffer, or copied into the arena otherwise.
+// @param in Input buffer to read from.
+// @param args Command arguments owning the arena.
+// @param slice To point to the string.
+// @param max Maximum string size, the '\0' included.
+// @return Same as read_string.
+static int read_arg(InputBuffer *in, CommandArgs *args, Slice *slice, size_t max) {
+  if (in->mapped) {
+    return read_slice(in, slice, max);
+  }
+
+  char *buffer = arena_reserve(args, max);
+  if (buffer == NULL) {
+    return -1;
+  }
+  int value = read_string(in, buffer, max);
+  if (value >= 0) {
+    slice->data = buffer;
+    slice->len = strlen(buffer);
+    args->current->used += slice->len + 1;
+  }
+  return value;
+}
+
+void command_args_init(CommandArgs *args) {
+  args->keys = NULL;
+  args->values = NULL;
+  args->num_pairs = 0;
+  args->capacity = 0;
+  args->arena = NULL;
+  args->current = NULL;
+}
+
+void command_args_destroy(CommandArgs *args) {
+  free(args->keys);
+  free(args->values);
+  while (args->arena != NULL) {
+    ArenaBlock *next = args->arena->next;
+    free(args->arena);
+    args->arena = next;
+  }
+  command_args_init(args);
+}
+
+size_t parse_write(InputBuffer *in, CommandArgs *args, size_t max_string_size) {
   char ch;
+  reset_args(args);
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  if (read_char(in, &ch) != 1 || ch != '[') {
+    cleanup(in);
     return 0;
   }
 
-  if (read(fd, &ch, 1) != 1 || ch != '(') {
-    cleanup(fd);
+  if (read_char(in, &ch) != 1 || ch != '(') {
+    cleanup(in);
     return 0;
   }
 
-  size_t num_pairs = 0;
-  char key[max_string_size];
-  char value[max_string_size];
-  while (num_pairs < max_pairs) {
-    if(parse_pair(fd, key, value) == 0) {
-      cleanup(fd);
+  while (1) {
+    if (reserve_pair(args) != 0 ||
+        read_arg(in, args, &args->keys[args->num_pairs], max_string_size) != 0 ||
+        read_arg(in, args, &args->values[args->num_pairs], max_string_size) != 1) {
+      cleanup(in);
       return 0;
     }
+    args->num_pairs++;
 
-    strcpy(keys[num_pairs], key);
-    strcpy(values[num_pairs++], value);
-
-    if (read(fd, &ch, 1) != 1 || (ch != '(' && ch != ']')) {
-      cleanup(fd);
+    if (read_char(in, &ch) != 1 || (ch != '(' && ch != ']')) {
+      cleanup(in);
       return 0;
     }
 
@@ -235,72 +477,64 @@ size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRIN
     }
   }
 
-  if (num_pairs == max_pairs) {
-    cleanup(fd);
-    return 0;
-  }
-
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (read_char(in, &ch) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(in);
     return 0;
   }
 
-  return num_pairs;
+  return args->num_pairs;
 }
 
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size) {
+size_t parse_read_delete(InputBuffer *in, CommandArgs *args, size_t max_string_size) {
   char ch;
+  reset_args(args);
 
-  if (read(fd, &ch, 1) != 1 || ch != '[') {
-    cleanup(fd);
+  if (read_char(in, &ch) != 1 || ch != '[') {
+    cleanup(in);
     return 0;
   }
 
-  size_t num_keys = 0;
-  char key[max_string_size];
-  while (num_keys < max_keys) {
-    int output = read_string(fd, key, max_string_size);
+  while (1) {
+    int output = -1;
+    if (reserve_pair(args) == 0) {
+      output = read_arg(in, args, &args->keys[args->num_pairs], max_string_size);
+    }
     if(output < 0 || output == 1) {
-      cleanup(fd);
+      cleanup(in);
       return 0;
     }
 
-    strcpy(keys[num_keys++], key);
+    args->num_pairs++;
 
     if (output == 2){
       break;
     }
   }
 
-  if (num_keys == max_keys) {
-    cleanup(fd);
-    return 0;
-  }
-
-  if (read(fd, &ch, 1) != 1 || (ch != '\n' && ch != '\0')) {
-    cleanup(fd);
+  if (read_char(in, &ch) != 1 || (ch != '\n' && ch != '\0')) {
+    cleanup(in);
     return 0;
   }
 
-  return num_keys;
+  return args->num_pairs;
 }
 
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
+int parse_wait(InputBuffer *in, unsigned int *delay, unsigned int *thread_id) {
   char ch;
 
-  if (read_uint(fd, delay, &ch) != 0) {
-    cleanup(fd);
+  if (read_uint(in, delay, &ch) != 0) {
+    cleanup(in);
     return -1;
   }
 
   if (ch == ' ') {
     if (thread_id == NULL) {
-      cleanup(fd);
+      cleanup(in);
       return 0;
     }
 
-    if (read_uint(fd, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
-      cleanup(fd);
+    if (read_uint(in, thread_id, &ch) != 0 || (ch != '\n' && ch != '\0')) {
+      cleanup(in);
       return -1;
     }
 
@@ -308,7 +542,7 @@ int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id) {
   } else if (ch == '\n' || ch == '\0') {
     return 0;
   } else {
-    cleanup(fd);
+    cleanup(in);
     return -1;
   }
 }
@@ -1,9 +1,31 @@
 #ifndef KVS_PARSER_H
 #define KVS_PARSER_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include "constants.h"
 
+#define INPUT_BUFFER_SIZE 65536
+
+// Input of a job. Regular files are mapped whole (see input_map), anything
+// else is read a block at a time. Owned by a single thread.
+typedef struct InputBuffer {
+  int fd;            // Where the input comes from
+  const char *data;  // block, or the mapping of the whole file
+  size_t pos;        // Next byte of data to be parsed
+  size_t len;        // Bytes available in data
+  size_t syscalls;   // read calls made so far
+  bool mapped;       // Whether data is a mapping of the file
+  char block[INPUT_BUFFER_SIZE];
+} InputBuffer;
+
+// Bytes of a string that is not '\0' terminated, such as a key inside a
+// mapped job file.
+typedef struct Slice {
+  const char *data;
+  size_t len;
+} Slice;
+
 enum Command {
   CMD_WRITE,
   CMD_READ,
@@ -17,36 +39,81 @@ enum Command {
   EOC  // End of commands
 };
 
-// Parses input from the given file descriptor, according to
+// Arguments of the command being run, reused by every command of a thread so
+// that parsing one costs no allocation once the arrays and arena have grown
+// to the size of the largest command.
+typedef struct CommandArgs {
+  Slice *keys;
+  Slice *values;               // Only set by WRITE
+  size_t num_pairs;            // Keys (and values) of the command
+  size_t capacity;             // Slots of keys and values
+  struct ArenaBlock *arena;    // Blocks holding strings copied from a streamed file
+  struct ArenaBlock *current;  // Block strings are being copied to
+} CommandArgs;
+
+/// Initializes empty command arguments.
+/// @param args The command arguments.
+void command_args_init(CommandArgs *args);
+
+/// Frees the memory of command arguments.
+/// @param args The command arguments.
+void command_args_destroy(CommandArgs *args);
+
+/// Initializes an empty input buffer that streams the file.
+/// @param in The input buffer.
+/// @param fd The file descriptor the input is read from.
+void input_init(InputBuffer *in, int fd);
+
+/// Maps the whole file of a freshly initialized input buffer, so it is
+/// parsed without copies. Pipes and other files that can't be mapped keep
+/// being streamed.
+/// @param in The input buffer.
+/// @return 0 if the file was mapped, 1 if it is streamed.
+int input_map(InputBuffer *in);
+
+/// Initializes an input buffer that parses part of a mapped input buffer,
+/// sharing its mapping. Must not be released, and is only valid while in is
+/// mapped.
+/// @param view The input buffer to initialize.
+/// @param in A mapped input buffer.
+/// @param start Offset of the first byte of the part.
+/// @param end Offset past the last byte of the part.
+void input_view(InputBuffer *view, const InputBuffer *in, size_t start, size_t end);
+
+/// Releases the mapping of an input buffer, if any. Slices parsed from it
+/// are no longer valid.
+/// @param in The input buffer.
+void input_release(InputBuffer *in);
+
+// Parses input from the given input buffer, according to
 // KVS specification.
-// @param fd File descriptor of input.
+// @param in Input buffer.
 // @return enum Command Command code.
-enum Command get_next(int fd);
-
-/// Parses a WRITE command.
-/// @param fd File descriptor to read from.
-/// @param keys Array to store the keys
-/// @param values Array to store the values
-/// @param max_pairs Maximum number of pairs it will write.
-/// @param max_string_size Maximum string size allowed.
+enum Command get_next(InputBuffer *in);
+
+/// Parses a WRITE command of any number of pairs. Keys and values of a
+/// mapped input buffer point into the mapping, the ones of a streamed input
+/// buffer are copied into the arena of args.
+/// @param in Input buffer to read from.
+/// @param args To store the pairs in, replacing the ones of the previous command.
+/// @param max_string_size Maximum string size allowed, the '\0' included.
 /// @return 0 if the command was not parsed successfully, otherwise return the
 //          of pairs parsed.
-size_t parse_write(int fd, char keys[][MAX_STRING_SIZE], char values[][MAX_STRING_SIZE], size_t max_pairs, size_t max_string_size);
+size_t parse_write(InputBuffer *in, CommandArgs *args, size_t max_string_size);
 
-// Parses a READ or a DELETE command.
-// @param fd File descriptor to read from.
-// @param keys Array to store the keys
-// @param max_pairs Maximum number of pairs it will write.
-// @param max_string_size Maximum string size allowed.
+// Parses a READ or a DELETE command of any number of keys, like parse_write.
+// @param in Input buffer to read from.
+// @param args To store the keys in, replacing the ones of the previous command.
+// @param max_string_size Maximum string size allowed, the '\0' included.
 // @return 0 if the command was not parsed successfully, otherwise return the
 //          of keys parsed
-size_t parse_read_delete(int fd, char keys[][MAX_STRING_SIZE], size_t max_keys, size_t max_string_size);
+size_t parse_read_delete(InputBuffer *in, CommandArgs *args, size_t max_string_size);
 
 /// Parses a WAIT command.
-/// @param fd File descriptor to read from.
+/// @param in Input buffer to read from.
 /// @param delay Pointer to the variable to store the wait delay in.
 /// @param thread_id Pointer to the variable to store the thread ID in. May not be set.
 /// @return 0 if no thread was specified, 1 if a thread was specified, -1 on error.
-int parse_wait(int fd, unsigned int *delay, unsigned int *thread_id);
+int parse_wait(InputBuffer *in, unsigned int *delay, unsigned int *thread_id);
 
 #endif  // KVS_PARSER_H
@@ -0,0 +1,253 @@
+#include "scheduler.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEQUE_INITIAL_CAPACITY 64
+
+// Double ended queue of a worker, as a growable ring buffer. Only the owner
+// uses the back, but thieves take from the front, so it is locked.
+typedef struct Deque {
+    pthread_mutex_t lock;
+    Task **tasks;
+    size_t capacity; // Power of two
+    size_t head;     // Index of the front task
+    size_t count;
+} Deque;
+
+typedef struct Worker {
+    _Alignas(64) Deque deque;
+    Scheduler *scheduler;
+    size_t index;
+    pthread_t thread;
+    uint64_t busy_ns; // Time spent running tasks
+    size_t tasks_run;
+    size_t tasks_stolen;
+} Worker;
+
+struct Scheduler {
+    Worker *workers;
+    size_t num_workers;
+    atomic_size_t pending;     // Tasks submitted and not finished yet
+    atomic_size_t queued;      // Tasks waiting in some deque
+    atomic_size_t next_worker; // Deque of the next task submitted from outside
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;  // Signaled when a task is queued or none is pending
+    uint64_t run_ns;           // Duration of the last scheduler_run
+};
+
+static _Thread_local Worker *current_worker = NULL;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+// Adds a task at the back of a deque.
+// @return 0 if successful, 1 if memory could not be allocated.
+static int deque_push(Deque *deque, Task *task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        size_t capacity = deque->capacity == 0 ? DEQUE_INITIAL_CAPACITY : deque->capacity * 2;
+        Task **tasks = malloc(capacity * sizeof(Task *));
+        if (tasks == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            return 1;
+        }
+        for (size_t i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) & (deque->capacity - 1)];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+        deque->head = 0;
+    }
+    deque->tasks[(deque->head + deque->count) & (deque->capacity - 1)] = task;
+    deque->count++;
+    pthread_mutex_unlock(&deque->lock);
+    return 0;
+}
+
+// Takes a task from the back (owner) or the front (thief) of a deque.
+// @return The task, NULL if the deque is empty.
+static Task *deque_take(Deque *deque, int front) {
+    pthread_mutex_lock(&deque->lock);
+    Task *task = NULL;
+    if (deque->count > 0) {
+        deque->count--;
+        if (front) {
+            task = deque->tasks[deque->head];
+            deque->head = (deque->head + 1) & (deque->capacity - 1);
+        } else {
+            task = deque->tasks[(deque->head + deque->count) & (deque->capacity - 1)];
+        }
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+// Wakes a worker waiting for tasks.
+static void wake_workers(Scheduler *scheduler) {
+    pthread_mutex_lock(&scheduler->idle_lock);
+    pthread_cond_broadcast(&scheduler->idle_cond);
+    pthread_mutex_unlock(&scheduler->idle_lock);
+}
+
+int scheduler_submit(Scheduler *scheduler, Task *task) {
+    Worker *worker = current_worker;
+    if (worker == NULL || worker->scheduler != scheduler) {
+        size_t index = atomic_fetch_add(&scheduler->next_worker, 1) % scheduler->num_workers;
+        worker = &scheduler->workers[index];
+    }
+
+    // Counted before the push publishes the task, so a thief taking it
+    // right away never decrements below zero
+    atomic_fetch_add(&scheduler->pending, 1);
+    atomic_fetch_add(&scheduler->queued, 1);
+    if (deque_push(&worker->deque, task) != 0) {
+        atomic_fetch_sub(&scheduler->queued, 1);
+        atomic_fetch_sub(&scheduler->pending, 1);
+        return 1;
+    }
+    wake_workers(scheduler);
+    return 0;
+}
+
+size_t scheduler_worker(void) {
+    return current_worker != NULL ? current_worker->index : 0;
+}
+
+// Finds the next task of a worker: its own newest task, or else the oldest
+// task of another worker.
+// @return The task, NULL if every deque is empty.
+static Task *find_task(Worker *worker) {
+    Scheduler *scheduler = worker->scheduler;
+    Task *task = deque_take(&worker->deque, 0);
+    for (size_t i = 1; task == NULL && i < scheduler->num_workers; i++) {
+        Worker *victim = &scheduler->workers[(worker->index + i) % scheduler->num_workers];
+        task = deque_take(&victim->deque, 1);
+        if (task != NULL) {
+            worker->tasks_stolen++;
+        }
+    }
+    if (task != NULL) {
+        atomic_fetch_sub(&scheduler->queued, 1);
+    }
+    return task;
+}
+
+static void *worker_main(void *arg) {
+    Worker *worker = arg;
+    Scheduler *scheduler = worker->scheduler;
+    current_worker = worker;
+
+    while (1) {
+        Task *task = find_task(worker);
+        if (task == NULL) {
+            pthread_mutex_lock(&scheduler->idle_lock);
+            while (atomic_load(&scheduler->queued) == 0 && atomic_load(&scheduler->pending) > 0) {
+                pthread_cond_wait(&scheduler->idle_cond, &scheduler->idle_lock);
+            }
+            int finished = atomic_load(&scheduler->pending) == 0;
+            pthread_mutex_unlock(&scheduler->idle_lock);
+            if (finished) {
+                break;
+            }
+            continue;
+        }
+
+        uint64_t start = now_ns();
+        task->run(task);
+        worker->busy_ns += now_ns() - start;
+        worker->tasks_run++;
+
+        if (atomic_fetch_sub(&scheduler->pending, 1) == 1) {
+            wake_workers(scheduler); // Every task has run
+        }
+    }
+
+    current_worker = NULL;
+    return NULL;
+}
+
+Scheduler *scheduler_create(size_t num_workers) {
+    Scheduler *scheduler = malloc(sizeof(Scheduler));
+    if (scheduler == NULL) {
+        return NULL;
+    }
+    scheduler->workers = aligned_alloc(_Alignof(Worker), num_workers * sizeof(Worker));
+    if (scheduler->workers == NULL) {
+        free(scheduler);
+        return NULL;
+    }
+    scheduler->num_workers = num_workers;
+    atomic_init(&scheduler->pending, 0);
+    atomic_init(&scheduler->queued, 0);
+    atomic_init(&scheduler->next_worker, 0);
+    pthread_mutex_init(&scheduler->idle_lock, NULL);
+    pthread_cond_init(&scheduler->idle_cond, NULL);
+    scheduler->run_ns = 0;
+
+    for (size_t i = 0; i < num_workers; i++) {
+        Worker *worker = &scheduler->workers[i];
+        pthread_mutex_init(&worker->deque.lock, NULL);
+        worker->deque.tasks = NULL;
+        worker->deque.capacity = 0;
+        worker->deque.head = 0;
+        worker->deque.count = 0;
+        worker->scheduler = scheduler;
+        worker->index = i;
+        worker->busy_ns = 0;
+        worker->tasks_run = 0;
+        worker->tasks_stolen = 0;
+    }
+    return scheduler;
+}
+
+int scheduler_run(Scheduler *scheduler) {
+    uint64_t start = now_ns();
+    size_t started = 0;
+    for (; started < scheduler->num_workers; started++) {
+        Worker *worker = &scheduler->workers[started];
+        if (pthread_create(&worker->thread, NULL, worker_main, worker) != 0) {
+            fprintf(stderr, "Failed to create thread %zu\n", started);
+            break;
+        }
+    }
+
+    // With no worker at all nothing would ever run the tasks
+    int result = started == 0;
+    for (size_t i = 0; i < started; i++) {
+        if (pthread_join(scheduler->workers[i].thread, NULL) != 0) {
+            fprintf(stderr, "Failed to join thread %zu\n", i);
+            result = 1;
+        }
+    }
+    scheduler->run_ns = now_ns() - start;
+    return result;
+}
+
+void scheduler_report(Scheduler *scheduler) {
+    double run_ns = scheduler->run_ns > 0 ? (double)scheduler->run_ns : 1;
+    for (size_t i = 0; i < scheduler->num_workers; i++) {
+        Worker *worker = &scheduler->workers[i];
+        printf("Worker %zu: %5.1f%% busy, %zu tasks, %zu stolen\n", i,
+               100.0 * (double)worker->busy_ns / run_ns, worker->tasks_run, worker->tasks_stolen);
+    }
+}
+
+void scheduler_destroy(Scheduler *scheduler) {
+    for (size_t i = 0; i < scheduler->num_workers; i++) {
+        pthread_mutex_destroy(&scheduler->workers[i].deque.lock);
+        free(scheduler->workers[i].deque.tasks);
+    }
+    pthread_mutex_destroy(&scheduler->idle_lock);
+    pthread_cond_destroy(&scheduler->idle_cond);
+    free(scheduler->workers);
+    free(scheduler);
+}
@@ -0,0 +1,48 @@
+#ifndef KVS_SCHEDULER_H
+#define KVS_SCHEDULER_H
+
+#include <stddef.h>
+
+// Work-stealing thread pool. Every worker owns a deque of tasks: it pushes
+// and pops its own tasks at the back, and when it runs out it steals from
+// the front of the deques of the other workers, so the oldest (usually
+// largest) pending work moves to idle workers first.
+
+typedef struct Task {
+    void (*run)(struct Task *task); // Called by the worker that takes the task
+} Task;
+
+typedef struct Scheduler Scheduler;
+
+/// Creates a scheduler, without starting its workers.
+/// @param num_workers Number of worker threads.
+/// @return The scheduler, NULL on failure.
+Scheduler *scheduler_create(size_t num_workers);
+
+/// Adds a task. From inside a task it goes to the deque of the calling
+/// worker; from any other thread the deques are filled in turns.
+/// @param scheduler The scheduler.
+/// @param task The task, must stay valid until it has run.
+/// @return 0 if successful, 1 if memory could not be allocated.
+int scheduler_submit(Scheduler *scheduler, Task *task);
+
+/// Index of the worker running the calling task, so tasks can keep state
+/// per worker in an array indexed by it.
+/// @return Index of the worker, from 0 to num_workers - 1.
+size_t scheduler_worker(void);
+
+/// Starts the workers and waits until every task, including the ones
+/// submitted by other tasks, has run.
+/// @param scheduler The scheduler.
+/// @return 0 if successful, 1 if the workers could not be started.
+int scheduler_run(Scheduler *scheduler);
+
+/// Prints how busy each worker was during scheduler_run.
+/// @param scheduler The scheduler.
+void scheduler_report(Scheduler *scheduler);
+
+/// Frees a scheduler that is not running.
+/// @param scheduler The scheduler.
+void scheduler_destroy(Scheduler *scheduler);
+
+#endif  // KVS_SCHEDULER_H
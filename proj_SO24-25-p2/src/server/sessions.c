@@ -0,0 +1,630 @@
+#include "sessions.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "../common/protocol.h"
+#include "io.h"
+#include "operations.h"
+
+static atomic_size_t opened = 0;
+static atomic_size_t active = 0;
+static atomic_size_t requests = 0;
+
+static int epoll_fd = -1;         // Set while the pool of sessions_multiplex runs
+static int stop_pipe[2];          // Written to stop the pool
+static pthread_t* loop_threads;
+static size_t num_loop_threads = 0;
+
+// Appends a response frame to the output of a session.
+static void session_respond(OutputBuffer* out, uint8_t op_code, uint8_t status, size_t count,
+                            const Field* fields) {
+    char frame[MAX_FRAME_SIZE];
+    size_t len = frame_encode(frame, sizeof(frame), op_code, status, count, fields);
+    if (len == 0) {
+        // Values too large for a frame are only possible in READ responses
+        len = frame_encode(frame, sizeof(frame), op_code, STATUS_ERROR, 0, NULL);
+    }
+    output_write(out, frame, len);
+}
+
+// Copies a field into a string.
+// @return 0 if successful, 1 if it is missing or doesn't fit in size.
+static int field_string(const Field* field, char* str, size_t size) {
+    if (field->data == NULL || field->len == 0 || field->len >= size ||
+        memchr(field->data, '\0', field->len) != NULL) {
+        return 1;
+    }
+    memcpy(str, field->data, field->len);
+    str[field->len] = '\0';
+    return 0;
+}
+
+// Runs a READ request: replies with the value of each key.
+static uint8_t session_read(const Field* fields, size_t count, OutputBuffer* out) {
+    char values[MAX_FRAME_FIELDS][MAX_STRING_SIZE];
+    Field results[MAX_FRAME_FIELDS];
+    for (size_t i = 0; i < count; i++) {
+        Slice key = {fields[i].data, fields[i].len};
+        ssize_t len = fields[i].data != NULL ? kvs_get(&key, values[i], MAX_STRING_SIZE) : -1;
+        results[i] = (Field){len >= 0 ? values[i] : NULL, len >= 0 ? (size_t)len : 0};
+    }
+    session_respond(out, OP_CODE_READ, STATUS_OK, count, results);
+    return STATUS_OK;
+}
+
+// Runs a WRITE request of key, value fields.
+static uint8_t session_write(const Field* fields, size_t count) {
+    Slice keys[MAX_FRAME_FIELDS / 2], values[MAX_FRAME_FIELDS / 2];
+    if (count == 0 || count % 2 != 0) {
+        return STATUS_MALFORMED;
+    }
+    for (size_t i = 0; i < count / 2; i++) {
+        const Field* key = &fields[2 * i];
+        const Field* value = &fields[2 * i + 1];
+        // Como nos .job, chaves e valores têm menos de MAX_STRING_SIZE caracteres
+        if (key->data == NULL || value->data == NULL || key->len == 0 ||
+            key->len >= MAX_STRING_SIZE || value->len >= MAX_STRING_SIZE) {
+            return STATUS_MALFORMED;
+        }
+        keys[i] = (Slice){key->data, key->len};
+        values[i] = (Slice){value->data, value->len};
+    }
+    return kvs_write(count / 2, keys, values) == 0 ? STATUS_OK : STATUS_ERROR;
+}
+
+// Runs a request of a client.
+// @param s The session.
+// @param header Header of the request.
+// @param payload Its payload.
+// @param out Where the responses go.
+// @return 1 if the client disconnected, 0 otherwise.
+static int session_request(Session* s, const FrameHeader* header, const char* payload,
+                           OutputBuffer* out) {
+    atomic_fetch_add(&requests, 1);
+    printf("Received request: opcode %u, %u fields\n", header->op_code, header->count);
+
+    Field fields[MAX_FRAME_FIELDS];
+    if (frame_decode(header, payload, fields, MAX_FRAME_FIELDS) != 0) {
+        session_respond(out, header->op_code, STATUS_MALFORMED, 0, NULL);
+        return 0;
+    }
+    char key[MAX_KEY_LENGTH], message[MAX_MESSAGE_LENGTH];
+    uint8_t status;
+    switch (header->op_code) {
+        // Processa o comando DISCONNECT
+        case OP_CODE_DISCONNECT:
+            printf("Client requested disconnect\n");
+            session_respond(out, OP_CODE_DISCONNECT, STATUS_OK, 0, NULL);
+            return 1;
+
+        // Processa o comando SUBSCRIBE
+        case OP_CODE_SUBSCRIBE:
+            status = STATUS_MALFORMED;
+            if (header->count == 1 && field_string(&fields[0], key, sizeof(key)) == 0) {
+                printf("Inscrevendo cliente na chave %s\n", key);
+                subscribe_client(s, key); // Função para inscrever o cliente
+                status = STATUS_OK;
+            }
+            break;
+
+        // Processa o comando UNSUBSCRIBE
+        case OP_CODE_UNSUBSCRIBE:
+            status = STATUS_MALFORMED;
+            if (header->count == 1 && field_string(&fields[0], key, sizeof(key)) == 0) {
+                printf("Cancelando inscrição do cliente na chave %s\n", key);
+                // Função para remover inscrição
+                status = unsubscribe_client(s, key) == 0 ? STATUS_OK : STATUS_NOT_FOUND;
+            }
+            break;
+
+        // Processa o comando PUBLISH
+        case OP_CODE_PUBLISH:
+            status = STATUS_MALFORMED;
+            if (header->count == 2 && field_string(&fields[0], key, sizeof(key)) == 0 &&
+                field_string(&fields[1], message, sizeof(message)) == 0) {
+                printf("Publicando mensagem na chave %s: %s\n", key, message);
+                // Passa o descritor do cliente que publicou
+                publish_message(key, message, s->fd_notifications);
+                status = STATUS_OK;
+            }
+            break;
+
+        case OP_CODE_READ:
+            if (header->count > 0) {
+                session_read(fields, header->count, out);
+                return 0;
+            }
+            status = STATUS_MALFORMED;
+            break;
+
+        case OP_CODE_WRITE:
+            status = session_write(fields, header->count);
+            break;
+
+        // Comando desconhecido
+        default:
+            status = STATUS_UNKNOWN_OP;
+            break;
+    }
+    session_respond(out, header->op_code, status, 0, NULL);
+    return 0;
+}
+
+// Runs every complete request frame read into a session so far. An
+// incomplete frame at the end is kept for later reads.
+// @param s The session.
+// @param out Where the responses go, sent by the caller.
+// @return 1 if the client disconnected, sent a frame larger than
+// MAX_FRAME_SIZE or was disconnected for not reading its notifications,
+// 0 otherwise.
+static int session_frames(Session* s, OutputBuffer* out) {
+    if (outbox_evicted(s->outbox)) {
+        fprintf(stderr, "Cliente não lê as notificações, a terminar a sessão\n");
+        return 1;
+    }
+    int disconnected = 0;
+    size_t start = 0;
+    while (!disconnected && s->frames_len - start >= sizeof(FrameHeader)) {
+        FrameHeader header;
+        memcpy(&header, s->frames + start, sizeof(header));
+        if (header.len > MAX_FRAME_PAYLOAD) {
+            // Não há forma de encontrar o início do pedido seguinte
+            fprintf(stderr, "Pedido demasiado grande, a terminar a sessão\n");
+            disconnected = 1;
+            break;
+        }
+        if (s->frames_len - start < sizeof(header) + header.len) {
+            break;
+        }
+        disconnected = session_request(s, &header, s->frames + start + sizeof(header), out);
+        start += sizeof(header) + header.len;
+    }
+    s->frames_len -= start;
+    memmove(s->frames, s->frames + start, s->frames_len);
+    return disconnected;
+}
+
+// Reads more of the request FIFO of a session, after what it holds already.
+static ssize_t session_fill(Session* s) {
+    return read(s->fd_requests, s->frames + s->frames_len, sizeof(s->frames) - s->frames_len);
+}
+
+// Closes the FIFOs of a session, removes them and its subscriptions, and
+// frees it.
+static void session_end(Session* s) {
+    // Limpeza da sessão
+    printf("Limpando sessão do cliente...\n");
+    close(s->fd_requests);
+    close(s->fd_responses);
+    if (s->fd_events != -1) {
+        close(s->fd_events);
+    }
+    if (s->unsent != NULL) {
+        output_discard(s->unsent);
+        free(s->unsent);
+    }
+
+    // Remove os FIFOs do cliente, verificando antes se eles ainda existem
+    if (access(s->fifo_requests, F_OK) == 0) {
+        if (unlink(s->fifo_requests) == 0) {
+            printf("FIFO de pedidos removido: %s\n", s->fifo_requests);
+        } else {
+            perror("Erro ao remover FIFO de pedidos");
+        }
+    } else {
+        printf("FIFO de pedidos já removido: %s\n", s->fifo_requests);
+    }
+
+    if (access(s->fifo_responses, F_OK) == 0) {
+        if (unlink(s->fifo_responses) == 0) {
+            printf("FIFO de respostas removido: %s\n", s->fifo_responses);
+        } else {
+            perror("Erro ao remover FIFO de respostas");
+        }
+    } else {
+        printf("FIFO de respostas já removido: %s\n", s->fifo_responses);
+    }
+
+    // Remove inscrições ativas do cliente, e só depois a fila de
+    // notificações, que quem publica já não encontra
+    unsubscribe_all(s);
+    outbox_close(s->outbox);
+
+    free(s);
+    atomic_fetch_sub(&active, 1);
+}
+
+static void* session_thread_func(void* arg) {
+    Session* s = (Session*)arg;
+    OutputBuffer out; // Respostas do pedido atual, enviadas de uma vez
+    output_init(&out, s->fd_responses);
+    // Um cliente que só recebe notificações não envia pedidos que acordem a
+    // thread quando é desligado por não as ler
+    struct pollfd fds[2] = {{s->fd_requests, POLLIN, 0},
+                            {outbox_evicted_fd(s->outbox), POLLIN, 0}};
+
+    while (1) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Erro ao esperar pelos pedidos");
+            break;
+        }
+        if (fds[1].revents != 0) {
+            fprintf(stderr, "Cliente não lê as notificações, a terminar a sessão\n");
+            break;
+        }
+        ssize_t bytes_read = session_fill(s);
+        if (bytes_read > 0) {
+            s->frames_len += (size_t)bytes_read;
+            int disconnected = session_frames(s, &out);
+            if (output_flush(&out) != 0) {
+                perror("Erro ao enviar resposta");
+            }
+            if (disconnected) {
+                break;  // Sai do loop ao receber DISCONNECT
+            }
+        } else if (bytes_read == 0) {
+            // FIFO fechado pelo cliente (EOF)
+            printf("FIFO fechado pelo cliente. Finalizando sessão.\n");
+            break;  // Sai do loop ao detectar EOF
+        } else {
+            perror("Erro ao ler pedido do cliente");
+            break;  // Sai do loop em caso de erro
+        }
+    }
+
+    session_end(s);
+    return NULL;
+}
+
+// Has the epoll of a session wait for its requests or, while it has
+// responses left unsent, only for room in its response FIFO, so a client
+// that doesn't read its responses stops being served.
+// @return 0 if successful, 1 otherwise.
+static int session_watch(Session* s, bool unsent) {
+    struct epoll_event ready = {.events = unsent ? 0 : EPOLLIN, .data.ptr = NULL};
+    struct epoll_event room = {.events = EPOLLOUT, .data.ptr = NULL};
+    return epoll_ctl(s->fd_events, EPOLL_CTL_MOD, s->fd_requests, &ready) != 0 ||
+           epoll_ctl(s->fd_events, unsent ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, s->fd_responses,
+                     &room) != 0;
+}
+
+// Sends responses without blocking, keeping in the session what doesn't
+// fit in its response FIFO.
+// @return 1 if some were left unsent, 0 if all were sent, -1 on error.
+static int session_send(Session* s, OutputBuffer* out) {
+    ssize_t left = output_send(out, s->fd_responses);
+    if (left <= 0) {
+        if (left < 0) {
+            perror("Erro ao enviar resposta");
+            output_discard(out);
+        }
+        return left < 0 ? -1 : 0;
+    }
+    if (s->unsent == NULL && (s->unsent = malloc(sizeof(OutputBuffer))) == NULL) {
+        output_discard(out);
+        return -1;
+    }
+    if (s->unsent != out) {
+        *s->unsent = *out; // Fica com o que ficou por enviar
+    }
+    return 1;
+}
+
+// Sends the responses left unsent, if any, and then reads everything the
+// request FIFO of a session has, without blocking, and runs the requests.
+// The response FIFO is written without blocking too, so a client that
+// doesn't read its responses never holds one of the threads.
+// @return 1 if the session is over, 0 if it waits for more requests or for
+// room for its responses.
+static int session_readable(Session* s) {
+    if (outbox_evicted(s->outbox)) {
+        fprintf(stderr, "Cliente não lê as notificações, a terminar a sessão\n");
+        return 1;
+    }
+    if (s->unsent != NULL) {
+        int sent = session_send(s, s->unsent);
+        if (sent != 0) {
+            return sent < 0;
+        }
+        free(s->unsent);
+        s->unsent = NULL;
+        if (session_watch(s, false) != 0) {
+            perror("Erro ao esperar pelos pedidos");
+            return 1;
+        }
+    }
+
+    OutputBuffer out;
+    output_init_memory(&out);
+    int over = 0;
+    while (!over) {
+        ssize_t bytes_read = session_fill(s);
+        if (bytes_read > 0) {
+            s->frames_len += (size_t)bytes_read;
+            over = session_frames(s, &out);
+        } else if (bytes_read < 0 && errno == EAGAIN) {
+            break;
+        } else if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        } else {
+            if (bytes_read < 0) {
+                perror("Erro ao ler pedido do cliente");
+            }
+            over = 1;
+        }
+    }
+
+    int sent = session_send(s, &out);
+    if (sent > 0 && over) {
+        // A sessão acaba sem esperar que o cliente leia o resto
+        output_discard(s->unsent);
+    } else if (sent > 0 && session_watch(s, true) != 0) {
+        perror("Erro ao esperar pelo FIFO de respostas");
+        return 1;
+    }
+    return over || sent < 0;
+}
+
+// Thread of the pool: takes ready sessions and handles them. Sessions are
+// registered with EPOLLONESHOT, so no other thread gets one until it is
+// armed again, after its requests ran. What is registered is the epoll of
+// each session, ready with its requests or once it was evicted.
+static void* loop_thread(void* arg) {
+    (void)arg;
+    struct epoll_event events[SESSION_EVENTS];
+    while (1) {
+        int count = epoll_wait(epoll_fd, events, SESSION_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Erro ao esperar pelos pedidos");
+            return NULL;
+        }
+        for (int i = 0; i < count; i++) {
+            Session* s = events[i].data.ptr;
+            if (s == NULL) {
+                return NULL; // The stop pipe, which stays readable
+            }
+            if (session_readable(s)) {
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->fd_events, NULL);
+                session_end(s);
+                continue;
+            }
+            struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = s};
+            if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->fd_events, &event) != 0) {
+                perror("Erro ao esperar pelos pedidos");
+                session_end(s);
+            }
+        }
+    }
+}
+
+int sessions_multiplex(size_t num_threads) {
+    if (epoll_fd != -1 || num_threads == 0) {
+        return 1;
+    }
+    loop_threads = malloc(num_threads * sizeof(pthread_t));
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop_threads == NULL || epoll_fd == -1 || pipe(stop_pipe) != 0) {
+        free(loop_threads);
+        if (epoll_fd != -1) {
+            close(epoll_fd);
+            epoll_fd = -1;
+        }
+        return 1;
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stop_pipe[0], &event);
+
+    for (num_loop_threads = 0; num_loop_threads < num_threads; num_loop_threads++) {
+        if (pthread_create(&loop_threads[num_loop_threads], NULL, loop_thread, NULL) != 0) {
+            sessions_stop();
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int session_open(const char* fifo_requests, const char* fifo_responses,
+                 const char* fifo_notifications) {
+    // Só a sessão escreve no FIFO de respostas: notificações que também lá
+    // fossem escritas, pela thread de notificações, partiriam as respostas
+    if (fifo_notifications == NULL) {
+        fprintf(stderr, "FIFO de notificações em falta\n");
+        return 1;
+    }
+
+    // Cria sessão
+    Session* s = calloc(1, sizeof(Session));
+    if (!s) {
+        perror("Erro ao alocar sessão");
+        return 1;
+    }
+
+    s->client_pid = getpid();
+    s->fd_events = -1;
+    s->unsent = NULL;
+    strncpy(s->fifo_requests, fifo_requests, PATH_MAX - 1);
+    strncpy(s->fifo_responses, fifo_responses, PATH_MAX - 1);
+
+    s->fd_requests = open(fifo_requests, O_RDWR); // O_RDWR evita EOF prematuro
+    s->fd_responses = open(fifo_responses, O_RDWR); // O_RDWR evita EOF prematuro
+    s->outbox = outbox_open(fifo_notifications);
+    s->fd_notifications = s->outbox != NULL ? outbox_fd(s->outbox) : -1;
+
+    // O cliente só envia pedidos depois de saber que a sessão foi aberta
+    char frame[sizeof(FrameHeader)];
+    size_t len = frame_encode(frame, sizeof(frame), OP_CODE_CONNECT, STATUS_OK, 0, NULL);
+    if (s->fd_requests == -1 || s->fd_responses == -1 || s->fd_notifications == -1 ||
+        write(s->fd_responses, frame, len) != (ssize_t)len) {
+        perror("Erro ao abrir FIFOs do cliente");
+        if (s->fd_requests != -1) close(s->fd_requests);
+        if (s->fd_responses != -1) close(s->fd_responses);
+        if (s->outbox != NULL) outbox_close(s->outbox);
+        free(s);
+        return 1;
+    }
+
+    atomic_fetch_add(&opened, 1);
+    atomic_fetch_add(&active, 1);
+    if (epoll_fd != -1) {
+        // Os pedidos passam a ser lidos pelas threads do epoll, sem bloquear.
+        // O epoll da sessão junta-os ao aviso de que foi desligada, e é ele
+        // que as threads esperam, para a sessão só ter uma de cada vez
+        struct epoll_event ready = {.events = EPOLLIN, .data.ptr = NULL};
+        struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.ptr = s};
+        s->fd_events = epoll_create1(EPOLL_CLOEXEC);
+        if (s->fd_events != -1 && fcntl(s->fd_requests, F_SETFL, O_NONBLOCK) == 0 &&
+            fcntl(s->fd_responses, F_SETFL, O_NONBLOCK) == 0 &&
+            epoll_ctl(s->fd_events, EPOLL_CTL_ADD, s->fd_requests, &ready) == 0 &&
+            epoll_ctl(s->fd_events, EPOLL_CTL_ADD, outbox_evicted_fd(s->outbox), &ready) == 0 &&
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, s->fd_events, &event) == 0) {
+            return 0;
+        }
+        perror("Erro ao registar sessão");
+    } else if (pthread_create(&s->tid, NULL, session_thread_func, s) == 0) {
+        pthread_detach(s->tid);
+        return 0;
+    } else {
+        perror("Erro ao criar thread");
+    }
+
+    close(s->fd_requests);
+    close(s->fd_responses);
+    if (s->fd_events != -1) {
+        close(s->fd_events);
+    }
+    outbox_close(s->outbox);
+    free(s);
+    atomic_fetch_sub(&active, 1);
+    return 1;
+}
+
+// Opens the session of a CONNECT frame.
+static void session_register(const FrameHeader* header, const char* payload) {
+    printf("Mensagem recebida: opcode %u, %u campos\n", header->op_code, header->count);
+
+    Field fields[3];
+    char fifo_req[PATH_MAX];
+    char fifo_res[PATH_MAX];
+    char fifo_notif[PATH_MAX];
+
+    // Os campos são o FIFO de pedidos, o de respostas e o de notificações,
+    // que não pode ser o de respostas, escrito por outra thread
+    if (header->op_code == OP_CODE_CONNECT && frame_decode(header, payload, fields, 3) == 0 &&
+        header->count == 3 && field_string(&fields[0], fifo_req, PATH_MAX) == 0 &&
+        field_string(&fields[1], fifo_res, PATH_MAX) == 0 &&
+        field_string(&fields[2], fifo_notif, PATH_MAX) == 0 && strcmp(fifo_res, fifo_notif) != 0 &&
+        strcmp(fifo_req, fifo_notif) != 0 && strcmp(fifo_req, fifo_res) != 0) {
+        printf("FIFO de pedidos: %s, FIFO de respostas: %s\n", fifo_req, fifo_res);
+        printf("Verificando existência dos FIFOs...\n");
+
+        // Verifica se os FIFOs existem
+        if (access(fifo_req, F_OK) == -1 || access(fifo_res, F_OK) == -1 ||
+            access(fifo_notif, F_OK) == -1) {
+            fprintf(stderr, "FIFO de cliente não encontrado.\n");
+            return;
+        }
+
+        // Cria a sessão, servida por uma thread própria ou pelas threads do epoll
+        session_open(fifo_req, fifo_res, fifo_notif);
+    } else {
+        fprintf(stderr, "Mensagem malformada\n");
+    }
+}
+
+int sessions_accept(int fifo_fd, int stop_fd) {
+    char buffer[MAX_FRAME_SIZE];
+    size_t len = 0; // Bytes of frames not yet complete
+    struct pollfd fds[2] = {{fifo_fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+
+    while (1) {
+        // Sleeps until a client registers, instead of polling the FIFO
+        if (poll(fds, stop_fd != -1 ? 2 : 1, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Erro ao esperar pelo FIFO de registo");
+            return 1;
+        }
+        if (stop_fd != -1 && fds[1].revents != 0) {
+            return 0;
+        }
+
+        ssize_t count = read(fifo_fd, buffer + len, sizeof(buffer) - len);
+        if (count == 0) {
+            // Only without a writer of its own, which would make poll spin
+            fprintf(stderr, "FIFO de registo fechado\n");
+            return 1;
+        } else if (count < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                continue;
+            }
+            perror("Erro ao ler FIFO de registo");
+            return 1;
+        }
+        len += (size_t)count;
+
+        // Frames are written at once and no larger than PIPE_BUF, so those of
+        // different clients never mix, and a frame cut by the end of a read
+        // is completed by the next one
+        size_t start = 0;
+        while (len - start >= sizeof(FrameHeader)) {
+            FrameHeader header;
+            memcpy(&header, buffer + start, sizeof(header));
+            if (header.len > MAX_FRAME_PAYLOAD) {
+                // Lost track of where frames start: drop what was read
+                fprintf(stderr, "Mensagem malformada\n");
+                start = len;
+                break;
+            }
+            if (len - start < sizeof(header) + header.len) {
+                break;
+            }
+            session_register(&header, buffer + start + sizeof(header));
+            start += sizeof(header) + header.len;
+        }
+        len -= start;
+        memmove(buffer, buffer + start, len);
+    }
+}
+
+void sessions_stats(SessionStats* stats) {
+    stats->opened = atomic_load(&opened);
+    stats->active = atomic_load(&active);
+    stats->requests = atomic_load(&requests);
+}
+
+void sessions_stop(void) {
+    if (epoll_fd == -1) {
+        return;
+    }
+    // Every thread sees the stop pipe readable, and leaves
+    if (write(stop_pipe[1], "", 1) != 1) {
+        perror("Erro ao parar as sessões");
+    }
+    for (size_t i = 0; i < num_loop_threads; i++) {
+        pthread_join(loop_threads[i], NULL);
+    }
+    free(loop_threads);
+    num_loop_threads = 0;
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    close(epoll_fd);
+    epoll_fd = -1;
+}
@@ -0,0 +1,59 @@
+#ifndef KVS_SESSIONS_H
+#define KVS_SESSIONS_H
+
+#include <stddef.h>
+
+// Sessions of the clients that connect through the register FIFO. By
+// default every session gets a detached thread of its own, blocked reading
+// its request FIFO. With sessions_multiplex, a small fixed pool of threads
+// waits on the request FIFOs of every session at once with epoll instead,
+// reads whatever a FIFO has without blocking and runs the requests it
+// holds. Responses are written without blocking as well: those that don't
+// fit in the response FIFO are kept in the session, which waits for room
+// for them before its next requests are read. A session is only ever
+// handled by one of those threads at a time.
+// Either way, a session evicted by OVERFLOW_DISCONNECT (see
+// notifications.h) ends right away, even if its client sends no requests.
+
+#define SESSION_EVENTS 8         // Ready sessions a loop thread takes at once
+
+typedef struct SessionStats {
+    size_t opened;   // Sessions opened so far
+    size_t active;   // Sessions opened and not ended yet
+    size_t requests; // Requests handled
+} SessionStats;
+
+/// Makes the sessions opened from now on be handled by a pool of threads
+/// waiting on all of them, rather than by a thread each.
+/// @param num_threads Number of threads of the pool.
+/// @return 0 if successful, 1 if the pool could not be started.
+int sessions_multiplex(size_t num_threads);
+
+/// Opens the FIFOs of a client, answers its CONNECT and starts handling its
+/// requests (see protocol.h).
+/// @param fifo_requests Path of the FIFO the client writes requests to.
+/// @param fifo_responses Path of the FIFO the responses are written to.
+/// @param fifo_notifications Path of the FIFO notifications are written to,
+/// which must not be the response FIFO: each FIFO has a single writer, so
+/// frames never interleave.
+/// @return 0 if successful, 1 otherwise, or if fifo_notifications is NULL.
+int session_open(const char* fifo_requests, const char* fifo_responses,
+                 const char* fifo_notifications);
+
+/// Opens a session for every client that registers through the register
+/// FIFO with a CONNECT frame, sleeping in poll while no client does.
+/// @param fifo_fd The register FIFO, opened for reading and writing and
+/// without blocking, so that it never reads as closed between clients.
+/// @param stop_fd Descriptor that stops the loop once readable, -1 if none.
+/// @return 0 if stopped, 1 if the FIFO could not be read.
+int sessions_accept(int fifo_fd, int stop_fd);
+
+/// Reads the counters of the sessions so far.
+/// @param stats Set to the counters.
+void sessions_stats(SessionStats* stats);
+
+/// Stops the pool of sessions_multiplex, if it was started. Sessions still
+/// open are left as they are.
+void sessions_stop(void);
+
+#endif  // KVS_SESSIONS_H
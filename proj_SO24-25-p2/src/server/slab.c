@@ -0,0 +1,149 @@
+#include "slab.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_GRANULARITY)
+#define SLAB_CHUNK_SIZE (64 * 1024) // Memory requested from malloc at once
+#define SLAB_BATCH 64               // Blocks moved to or from the shared pool at once
+
+typedef struct FreeBlock {
+    struct FreeBlock *next;
+} FreeBlock;
+
+typedef struct ThreadCache {
+    FreeBlock *blocks[SLAB_CLASSES];
+    size_t count[SLAB_CLASSES];
+    bool registered;
+} ThreadCache;
+
+typedef struct SharedPool {
+    pthread_mutex_t lock;
+    FreeBlock *blocks;
+} SharedPool;
+
+static _Thread_local ThreadCache cache;
+static SharedPool pools[SLAB_CLASSES];
+static pthread_once_t pools_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+
+// Size class of an object.
+static size_t class_of(size_t size) {
+    return size == 0 ? 0 : (size - 1) / SLAB_GRANULARITY;
+}
+
+// Moves up to SLAB_BATCH blocks of a class from the thread cache to the
+// shared pool.
+static void flush_class(size_t class) {
+    FreeBlock *first = cache.blocks[class];
+    if (first == NULL) {
+        return;
+    }
+    FreeBlock *last = first;
+    size_t n = 1;
+    for (; n < SLAB_BATCH && last->next != NULL; n++) {
+        last = last->next;
+    }
+    cache.blocks[class] = last->next;
+    cache.count[class] -= n;
+
+    pthread_mutex_lock(&pools[class].lock);
+    last->next = pools[class].blocks;
+    pools[class].blocks = first;
+    pthread_mutex_unlock(&pools[class].lock);
+}
+
+// Hands the cache of an exiting thread over to the shared pool.
+// @param arg Unused, only set so that the destructor runs.
+static void release_cache(void *arg) {
+    (void)arg;
+    for (size_t class = 0; class < SLAB_CLASSES; class++) {
+        while (cache.blocks[class] != NULL) {
+            flush_class(class);
+        }
+    }
+}
+
+static void init_pools(void) {
+    for (size_t class = 0; class < SLAB_CLASSES; class++) {
+        pthread_mutex_init(&pools[class].lock, NULL);
+        pools[class].blocks = NULL;
+    }
+    pthread_key_create(&cache_key, release_cache);
+}
+
+// Fills the thread cache of a class, from the shared pool if it has blocks
+// or from a new chunk otherwise.
+// @return 0 if the cache has blocks, 1 otherwise.
+static int refill_class(size_t class) {
+    if (!cache.registered) {
+        pthread_once(&pools_once, init_pools);
+        pthread_setspecific(cache_key, &cache);
+        cache.registered = true;
+    }
+
+    pthread_mutex_lock(&pools[class].lock);
+    FreeBlock *first = pools[class].blocks;
+    if (first != NULL) {
+        FreeBlock *last = first;
+        size_t n = 1;
+        for (; n < SLAB_BATCH && last->next != NULL; n++) {
+            last = last->next;
+        }
+        pools[class].blocks = last->next;
+        pthread_mutex_unlock(&pools[class].lock);
+        last->next = NULL;
+        cache.blocks[class] = first;
+        cache.count[class] = n;
+        return 0;
+    }
+    pthread_mutex_unlock(&pools[class].lock);
+
+    char *chunk = malloc(SLAB_CHUNK_SIZE);
+    if (chunk == NULL) {
+        return 1;
+    }
+    size_t block_size = (class + 1) * SLAB_GRANULARITY;
+    size_t n = SLAB_CHUNK_SIZE / block_size;
+    for (size_t i = 0; i < n; i++) {
+        FreeBlock *block = (FreeBlock *)(void *)(chunk + i * block_size);
+        block->next = cache.blocks[class];
+        cache.blocks[class] = block;
+    }
+    cache.count[class] = n;
+    return 0;
+}
+
+void *slab_alloc(size_t size) {
+    if (size > SLAB_MAX_SIZE) {
+        return malloc(size);
+    }
+    size_t class = class_of(size);
+    if (cache.blocks[class] == NULL && refill_class(class) != 0) {
+        return NULL;
+    }
+    FreeBlock *block = cache.blocks[class];
+    cache.blocks[class] = block->next;
+    cache.count[class]--;
+    return block;
+}
+
+void slab_free(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (size > SLAB_MAX_SIZE) {
+        free(ptr);
+        return;
+    }
+    size_t class = class_of(size);
+    FreeBlock *block = ptr;
+    block->next = cache.blocks[class];
+    cache.blocks[class] = block;
+    // Threads that mostly free (e.g. the one reclaiming retired nodes) give
+    // blocks back, so the ones that allocate can reuse them
+    if (++cache.count[class] > 2 * SLAB_BATCH) {
+        flush_class(class);
+    }
+}
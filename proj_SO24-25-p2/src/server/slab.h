@@ -0,0 +1,24 @@
+#ifndef KVS_SLAB_H
+#define KVS_SLAB_H
+
+#include <stddef.h>
+
+// Size-class allocator for small, fixed size objects such as the KVS nodes.
+// Each thread allocates from and frees to its own cache of blocks, and only
+// goes to the shared pool (under a lock) in batches. Memory taken from the
+// system is kept for reuse for the lifetime of the process.
+
+#define SLAB_GRANULARITY 16 // Block sizes are multiples of this
+#define SLAB_MAX_SIZE 544   // Larger requests go straight to malloc
+
+/// Allocates a block from the calling thread's cache.
+/// @param size Size of the object.
+/// @return Block with at least size bytes, NULL on failure.
+void *slab_alloc(size_t size);
+
+/// Gives a block back to the calling thread's cache.
+/// @param ptr Block returned by slab_alloc, may be allocated by another thread.
+/// @param size Size passed to slab_alloc.
+void slab_free(void *ptr, size_t size);
+
+#endif  // KVS_SLAB_H
@@ -0,0 +1,539 @@
+#include "subscriptions.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "kvs.h"
+
+// Bucket of a hash.
+static Topic **bucket_of(const SubscriptionTable *table, uint64_t h) {
+    return &table->buckets[h & (table->size - 1)];
+}
+
+// Finds the topic of a key.
+// @return The link pointing to the topic, or to the NULL ending its bucket
+// if the key has none.
+static Topic **find_topic(const SubscriptionTable *table, const char *key, size_t len,
+                          uint64_t h) {
+    Topic **link = bucket_of(table, h);
+    while (*link != NULL &&
+           ((*link)->hash != h || (*link)->key_len != len || memcmp((*link)->key, key, len) != 0)) {
+        link = &(*link)->next;
+    }
+    return link;
+}
+
+// Doubles the buckets of a table. Topics keep their hash, so moving them
+// never rehashes a key. On allocation failure the table stays as it was,
+// only with longer chains.
+static void grow(SubscriptionTable *table) {
+    size_t size = table->size * 2;
+    Topic **buckets = calloc(size, sizeof(Topic *));
+    if (buckets == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < table->size; i++) {
+        Topic *topic = table->buckets[i];
+        while (topic != NULL) {
+            Topic *next = topic->next;
+            Topic **bucket = &buckets[topic->hash & (size - 1)];
+            topic->next = *bucket;
+            *bucket = topic;
+            topic = next;
+        }
+    }
+    free(table->buckets);
+    table->buckets = buckets;
+    table->size = size;
+}
+
+// Creates a topic, without subscribers, for a key or pattern.
+static Topic *new_topic(const char *key, size_t len) {
+    Topic *topic = calloc(1, sizeof(Topic) + len + 1);
+    if (topic == NULL) {
+        return NULL;
+    }
+    topic->prefix_len = strcspn(key, "*?");
+    topic->pattern = topic->prefix_len < len;
+    topic->key_len = len;
+    memcpy(topic->key, key, len);
+    topic->key[len] = '\0';
+    return topic;
+}
+
+// Adds a topic to the buckets, growing them if needed.
+static void insert_topic(SubscriptionTable *table, Topic **link, Topic *topic) {
+    *link = topic;
+    if (++table->num_topics > table->size) {
+        grow(table);
+    }
+}
+
+// Counter of the filter for the subscriptions to a topic.
+static atomic_uint *filter_of(SubscriptionTable *table, const Topic *topic) {
+    if (!topic->pattern) {
+        return &table->key_filter[topic->hash & (TOPIC_FILTER_SIZE - 1)];
+    }
+    return &table->pattern_filter[topic->prefix_len > 0 ? (unsigned char)topic->key[0]
+                                                        : UCHAR_MAX + 1];
+}
+
+// Removes a topic without subscribers from the buckets and frees it.
+static void free_topic(SubscriptionTable *table, Topic *topic) {
+    Topic **link = find_topic(table, topic->key, topic->key_len, topic->hash);
+    *link = topic->next;
+    free(topic);
+    table->num_topics--;
+}
+
+// Child of a trie node reached by a byte.
+// @return The child, NULL if there is none.
+static PatternNode *child_of(const PatternNode *node, unsigned char byte) {
+    size_t low = 0, high = node->num_children;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (node->children[middle]->byte < byte) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low < node->num_children && node->children[low]->byte == byte ? node->children[low]
+                                                                          : NULL;
+}
+
+// Child of a trie node reached by a byte, added if missing.
+// @return The child, NULL if out of memory.
+static PatternNode *add_child(PatternNode *node, unsigned char byte) {
+    PatternNode *child = child_of(node, byte);
+    if (child != NULL) {
+        return child;
+    }
+    if (node->num_children == node->capacity) {
+        size_t capacity = node->capacity > 0 ? node->capacity * 2 : 2;
+        PatternNode **children = realloc(node->children, capacity * sizeof(PatternNode *));
+        if (children == NULL) {
+            return NULL;
+        }
+        node->children = children;
+        node->capacity = capacity;
+    }
+    child = calloc(1, sizeof(PatternNode));
+    if (child == NULL) {
+        return NULL;
+    }
+    child->byte = byte;
+    size_t i = node->num_children;
+    while (i > 0 && node->children[i - 1]->byte > byte) {
+        node->children[i] = node->children[i - 1];
+        i--;
+    }
+    node->children[i] = child;
+    node->num_children++;
+    return child;
+}
+
+// Finds the topic of a pattern in the trie.
+// @param node Set to the node the pattern belongs to, NULL if it isn't in
+// the trie.
+// @return The topic, NULL if the pattern has no subscribers.
+static Topic *find_pattern(const SubscriptionTable *table, const char *key, size_t len,
+                           size_t prefix_len, PatternNode **node) {
+    PatternNode *current = table->patterns;
+    for (size_t i = 0; i < prefix_len && current != NULL; i++) {
+        current = child_of(current, (unsigned char)key[i]);
+    }
+    *node = current;
+    Topic *topic = current != NULL ? current->patterns : NULL;
+    while (topic != NULL && (topic->key_len != len || memcmp(topic->key, key, len) != 0)) {
+        topic = topic->next;
+    }
+    return topic;
+}
+
+// Removes a pattern from the trie, freeing the nodes left empty below
+// [node], which is at [depth].
+// @return Whether [node] was left empty.
+static bool unlink_pattern(PatternNode *node, Topic *topic, size_t depth) {
+    if (depth == topic->prefix_len) {
+        Topic **link = &node->patterns;
+        while (*link != topic) {
+            link = &(*link)->next;
+        }
+        *link = topic->next;
+    } else {
+        PatternNode *child = child_of(node, (unsigned char)topic->key[depth]);
+        if (unlink_pattern(child, topic, depth + 1)) {
+            size_t i = 0;
+            while (node->children[i] != child) {
+                i++;
+            }
+            memmove(&node->children[i], &node->children[i + 1],
+                    (node->num_children - i - 1) * sizeof(PatternNode *));
+            node->num_children--;
+            free(child->children);
+            free(child);
+        }
+    }
+    return node->patterns == NULL && node->num_children == 0;
+}
+
+// Frees a trie node, its children and their patterns with their
+// subscriptions.
+static void free_pattern_node(PatternNode *node) {
+    for (size_t i = 0; i < node->num_children; i++) {
+        free_pattern_node(node->children[i]);
+    }
+    Topic *topic = node->patterns;
+    while (topic != NULL) {
+        Topic *next = topic->next;
+        Subscription *s = topic->subscribers;
+        while (s != NULL) {
+            Subscription *next_subscriber = s->next_subscriber;
+            free(s);
+            s = next_subscriber;
+        }
+        free(topic);
+        topic = next;
+    }
+    free(node->children);
+    free(node);
+}
+
+// Matches a key against a simple glob, '*' matching any sequence of
+// characters and '?' any single one. A '*' only backtracks to the latest
+// one, which is enough for a glob without character classes.
+static bool glob_match(const char *pattern, size_t pattern_len, const char *key, size_t len) {
+    size_t p = 0, k = 0, star = SIZE_MAX, star_k = 0;
+    while (k < len) {
+        if (p < pattern_len && pattern[p] == '*') {
+            star = p++;
+            star_k = k;
+        } else if (p < pattern_len && (pattern[p] == '?' || pattern[p] == key[k])) {
+            p++;
+            k++;
+        } else if (star != SIZE_MAX) {
+            p = star + 1;
+            k = ++star_k;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern_len && pattern[p] == '*') {
+        p++;
+    }
+    return p == pattern_len;
+}
+
+// Visits the subscribers of the patterns matching a key, walking the trie
+// along the key: only patterns whose literal prefix the key starts with
+// are matched, the rest of each against the rest of the key.
+// @param visit Called for each subscription, NULL to only count patterns.
+// @return Number of patterns matched.
+static size_t match_patterns(const SubscriptionTable *table, const char *key, size_t len,
+                             SubscriptionVisitor visit, void *arg) {
+    size_t matched = 0;
+    const PatternNode *node = table->patterns;
+    for (size_t depth = 0; node != NULL; depth++) {
+        for (Topic *topic = node->patterns; topic != NULL; topic = topic->next) {
+            // A prefix ending in '*' matches every key that reached it
+            bool prefix = topic->key_len == depth + 1 && topic->key[depth] == '*';
+            if (prefix ||
+                glob_match(topic->key + depth, topic->key_len - depth, key + depth, len - depth)) {
+                matched++;
+                for (Subscription *s = topic->subscribers; s != NULL && visit != NULL;
+                     s = s->next_subscriber) {
+                    visit(s, arg);
+                }
+            }
+        }
+        node = depth < len ? child_of(node, (unsigned char)key[depth]) : NULL;
+    }
+    return matched;
+}
+
+// Removes a topic from the list of changed topics.
+static void unlink_changed(SubscriptionTable *table, Topic *topic) {
+    if (topic->prev_changed != NULL) {
+        topic->prev_changed->next_changed = topic->next_changed;
+    } else {
+        table->changed_head = topic->next_changed;
+    }
+    if (topic->next_changed != NULL) {
+        topic->next_changed->prev_changed = topic->prev_changed;
+    } else {
+        table->changed_tail = topic->prev_changed;
+    }
+    topic->changed = false;
+}
+
+// Unlinks a subscription from its topic and its session and frees it, with
+// the topic if it was its last subscriber.
+static void remove_subscription(SubscriptionTable *table, Subscription **subscriptions,
+                                Subscription *subscription) {
+    Topic *topic = subscription->topic;
+    if (subscription->prev_subscriber != NULL) {
+        subscription->prev_subscriber->next_subscriber = subscription->next_subscriber;
+    } else {
+        topic->subscribers = subscription->next_subscriber;
+    }
+    if (subscription->next_subscriber != NULL) {
+        subscription->next_subscriber->prev_subscriber = subscription->prev_subscriber;
+    }
+    if (subscription->prev_of_session != NULL) {
+        subscription->prev_of_session->next_of_session = subscription->next_of_session;
+    } else {
+        *subscriptions = subscription->next_of_session;
+    }
+    if (subscription->next_of_session != NULL) {
+        subscription->next_of_session->prev_of_session = subscription->prev_of_session;
+    }
+    free(subscription);
+    table->num_subscriptions--;
+    atomic_fetch_sub_explicit(filter_of(table, topic), 1, memory_order_relaxed);
+
+    // A key whose change wasn't notified yet keeps its topic for it
+    if (--topic->num_subscribers == 0 && topic->pattern) {
+        unlink_pattern(table->patterns, topic, 0); // The root stays even if left empty
+        free(topic);
+        table->num_patterns--;
+    } else if (topic->num_subscribers == 0 && !topic->changed) {
+        free_topic(table, topic);
+    }
+}
+
+SubscriptionTable *create_subscription_table(void) {
+    SubscriptionTable *table = malloc(sizeof(SubscriptionTable));
+    if (table == NULL) {
+        return NULL;
+    }
+    table->buckets = calloc(TOPIC_TABLE_SIZE, sizeof(Topic *));
+    if (table->buckets == NULL) {
+        free(table);
+        return NULL;
+    }
+    table->patterns = calloc(1, sizeof(PatternNode));
+    if (table->patterns == NULL) {
+        free(table->buckets);
+        free(table);
+        return NULL;
+    }
+    table->size = TOPIC_TABLE_SIZE;
+    table->num_topics = 0;
+    table->num_patterns = 0;
+    table->num_subscriptions = 0;
+    table->changed_head = NULL;
+    table->changed_tail = NULL;
+    for (size_t i = 0; i < TOPIC_FILTER_SIZE; i++) {
+        atomic_init(&table->key_filter[i], 0);
+    }
+    for (size_t i = 0; i < UCHAR_MAX + 2; i++) {
+        atomic_init(&table->pattern_filter[i], 0);
+    }
+    return table;
+}
+
+int table_subscribe(SubscriptionTable *table, Subscription **subscriptions,
+                    struct Session *session, const char *key) {
+    size_t len = strlen(key);
+    size_t prefix_len = strcspn(key, "*?");
+    uint64_t h = 0;
+    Topic **link = NULL;
+    PatternNode *node = NULL;
+    Topic *topic;
+    if (prefix_len < len) {
+        topic = find_pattern(table, key, len, prefix_len, &node);
+    } else {
+        h = hash(key, len);
+        link = find_topic(table, key, len, h);
+        topic = *link;
+    }
+    if (topic != NULL) {
+        for (Subscription *s = topic->subscribers; s != NULL; s = s->next_subscriber) {
+            if (s->session == session) {
+                return 1;
+            }
+        }
+    }
+
+    Subscription *subscription = malloc(sizeof(Subscription));
+    if (subscription == NULL) {
+        return -1;
+    }
+    if (topic == NULL) {
+        topic = new_topic(key, len);
+        if (topic == NULL) {
+            free(subscription);
+            return -1;
+        }
+        if (topic->pattern) {
+            // The nodes of the prefix are added one by one, and left empty
+            // if one can't be
+            node = table->patterns;
+            for (size_t i = 0; i < prefix_len && node != NULL; i++) {
+                node = add_child(node, (unsigned char)key[i]);
+            }
+            if (node == NULL) {
+                free(topic);
+                free(subscription);
+                return -1;
+            }
+            topic->next = node->patterns;
+            node->patterns = topic;
+            table->num_patterns++;
+        } else {
+            topic->hash = h;
+            insert_topic(table, link, topic);
+        }
+    }
+
+    subscription->topic = topic;
+    subscription->session = session;
+    subscription->prev_subscriber = NULL;
+    subscription->next_subscriber = topic->subscribers;
+    if (topic->subscribers != NULL) {
+        topic->subscribers->prev_subscriber = subscription;
+    }
+    topic->subscribers = subscription;
+    topic->num_subscribers++;
+
+    subscription->prev_of_session = NULL;
+    subscription->next_of_session = *subscriptions;
+    if (*subscriptions != NULL) {
+        (*subscriptions)->prev_of_session = subscription;
+    }
+    *subscriptions = subscription;
+    table->num_subscriptions++;
+    atomic_fetch_add_explicit(filter_of(table, topic), 1, memory_order_relaxed);
+    return 0;
+}
+
+int table_unsubscribe(SubscriptionTable *table, Subscription **subscriptions,
+                      struct Session *session, const char *key) {
+    size_t len = strlen(key);
+    size_t prefix_len = strcspn(key, "*?");
+    PatternNode *node;
+    Topic *topic = prefix_len < len ? find_pattern(table, key, len, prefix_len, &node)
+                                    : *find_topic(table, key, len, hash(key, len));
+    for (Subscription *s = topic != NULL ? topic->subscribers : NULL; s != NULL;
+         s = s->next_subscriber) {
+        if (s->session == session) {
+            remove_subscription(table, subscriptions, s);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void table_unsubscribe_all(SubscriptionTable *table, Subscription **subscriptions) {
+    while (*subscriptions != NULL) {
+        remove_subscription(table, subscriptions, *subscriptions);
+    }
+}
+
+Topic *table_find(const SubscriptionTable *table, const char *key, size_t len) {
+    return *find_topic(table, key, len, hash(key, len));
+}
+
+size_t table_match(const SubscriptionTable *table, const char *key, size_t len,
+                   SubscriptionVisitor visit, void *arg) {
+    size_t matched = 0;
+    Topic *topic = table_find(table, key, len);
+    if (topic != NULL && topic->num_subscribers > 0) {
+        matched++;
+        for (Subscription *s = topic->subscribers; s != NULL; s = s->next_subscriber) {
+            visit(s, arg);
+        }
+    }
+    if (table->num_patterns > 0) {
+        matched += match_patterns(table, key, len, visit, arg);
+    }
+    return matched;
+}
+
+bool table_may_change(const SubscriptionTable *table, const char *key, size_t len) {
+    if (atomic_load_explicit(&table->pattern_filter[UCHAR_MAX + 1], memory_order_relaxed) > 0 ||
+        (len > 0 && atomic_load_explicit(&table->pattern_filter[(unsigned char)key[0]],
+                                         memory_order_relaxed) > 0)) {
+        return true;
+    }
+    uint64_t h = hash(key, len);
+    return atomic_load_explicit(&table->key_filter[h & (TOPIC_FILTER_SIZE - 1)],
+                                memory_order_relaxed) > 0;
+}
+
+bool table_change(SubscriptionTable *table, const char *key, size_t len, const char *value,
+                  size_t value_len, uint64_t now_ns) {
+    uint64_t h = hash(key, len);
+    Topic **link = find_topic(table, key, len, h);
+    Topic *topic = *link;
+    if (topic == NULL) {
+        // Only subscribed through patterns: the change gets a topic of its own
+        if (table->num_patterns == 0 || match_patterns(table, key, len, NULL, NULL) == 0 ||
+            (topic = new_topic(key, len)) == NULL) {
+            return false;
+        }
+        topic->pattern = false; // A key that happens to have wildcards
+        topic->hash = h;
+        insert_topic(table, link, topic);
+    }
+    topic->deleted = value == NULL;
+    topic->value_len = 0;
+    if (value != NULL) {
+        topic->value_len = value_len < MAX_STRING_SIZE ? value_len : MAX_STRING_SIZE;
+        memcpy(topic->value, value, topic->value_len);
+    }
+    if (topic->changed) {
+        return false;
+    }
+    topic->changed = true;
+    topic->changed_ns = now_ns;
+    topic->next_changed = NULL;
+    topic->prev_changed = table->changed_tail;
+    if (table->changed_tail != NULL) {
+        table->changed_tail->next_changed = topic;
+    } else {
+        table->changed_head = topic;
+    }
+    table->changed_tail = topic;
+    return true;
+}
+
+Topic *table_take_change(SubscriptionTable *table) {
+    Topic *topic = table->changed_head;
+    if (topic != NULL) {
+        unlink_changed(table, topic);
+    }
+    return topic;
+}
+
+void table_release_topic(SubscriptionTable *table, Topic *topic) {
+    if (topic->num_subscribers == 0 && !topic->changed) {
+        free_topic(table, topic);
+    }
+}
+
+Subscription *table_subscribers(const SubscriptionTable *table, const char *key) {
+    Topic *topic = table_find(table, key, strlen(key));
+    return topic != NULL ? topic->subscribers : NULL;
+}
+
+void free_subscription_table(SubscriptionTable *table) {
+    for (size_t i = 0; i < table->size; i++) {
+        Topic *topic = table->buckets[i];
+        while (topic != NULL) {
+            Topic *next = topic->next;
+            Subscription *s = topic->subscribers;
+            while (s != NULL) {
+                Subscription *next_subscriber = s->next_subscriber;
+                free(s);
+                s = next_subscriber;
+            }
+            free(topic);
+            topic = next;
+        }
+    }
+    free_pattern_node(table->patterns);
+    free(table->buckets);
+    free(table);
+}
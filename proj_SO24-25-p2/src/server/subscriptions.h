@@ -0,0 +1,195 @@
+#ifndef KVS_SUBSCRIPTIONS_H
+#define KVS_SUBSCRIPTIONS_H
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "constants.h"
+
+#define TOPIC_TABLE_SIZE 64    // Initial number of buckets, power of two
+#define TOPIC_FILTER_SIZE 4096 // Slots of the filter of subscribed keys, power of two
+
+// Registry of the subscriptions of client sessions. Every subscribed key
+// has a Topic, found by hash, holding the set of its subscribers, so a
+// publication only visits the sessions subscribed to its key. Every
+// subscription is also linked in the list of its session, so a session
+// that ends drops its subscriptions without looking at anyone else's.
+//
+// A key with '*' or '?' is a pattern, a simple glob where '*' matches any
+// sequence of characters and '?' any single one. Patterns are kept apart
+// from keys, in a trie of the literal prefix before their first wildcard,
+// so a key finds the patterns that may match it by walking its own
+// characters, and keys that start like no pattern stop at the root. Exact
+// keys are still found by hash, with no cost while there are no patterns.
+//
+// Changes of subscribed keys, or of keys matched by a pattern, are
+// recorded on their topics until notified, a topic without subscribers
+// being kept for them meanwhile. A topic changed again before that only
+// keeps the latest value, so a key updated many times in a short window is
+// notified once.
+//
+// The registry is not synchronized: callers hold a lock around it. Only
+// table_may_change may be called without it, so that writers of keys
+// nobody subscribed to never take the lock: it reads a filter of counters,
+// one per slot of the hashes of subscribed keys and one per first byte of
+// the prefixes of patterns.
+
+struct Session;
+struct Topic;
+struct PatternNode;
+
+// A session subscribed to a key, linked both in the subscribers of the key
+// and in the subscriptions of the session.
+typedef struct Subscription {
+    struct Topic *topic;
+    struct Session *session;
+    struct Subscription *next_subscriber; // Next session subscribed to the key
+    struct Subscription *prev_subscriber;
+    struct Subscription *next_of_session; // Next key the session is subscribed to
+    struct Subscription *prev_of_session;
+} Subscription;
+
+// A key or pattern with at least one subscriber. Topics are freed with
+// their last subscription, unless they hold a change not notified yet.
+typedef struct Topic {
+    struct Topic *next; // Next topic of the bucket, or of the trie node of a pattern
+    uint64_t hash;
+    Subscription *subscribers;
+    size_t num_subscribers;
+    struct Topic *next_changed; // Next topic with a change not notified yet
+    struct Topic *prev_changed;
+    bool changed;               // Whether it is in the list of changed topics
+    bool deleted;               // Whether the latest change was a delete
+    uint64_t changed_ns;        // When the oldest change not notified yet was made
+    size_t value_len;
+    char value[MAX_STRING_SIZE]; // Value of the latest change
+    bool pattern;                // Whether the key is a pattern, kept in the trie
+    size_t prefix_len;           // Characters of a pattern before its first wildcard
+    size_t key_len;
+    char key[]; // Followed by '\0'
+} Topic;
+
+// Node of the trie of patterns, reached by the bytes of a literal prefix.
+typedef struct PatternNode {
+    struct PatternNode **children; // Sorted by byte
+    size_t num_children;
+    size_t capacity;
+    Topic *patterns; // Patterns whose literal prefix ends here
+    unsigned char byte;
+} PatternNode;
+
+typedef struct SubscriptionTable {
+    Topic **buckets;
+    size_t size;       // Number of buckets, power of two
+    size_t num_topics; // The table grows when it exceeds size
+    PatternNode *patterns;
+    size_t num_patterns;
+    size_t num_subscriptions;
+    Topic *changed_head; // Changed topics, oldest change first
+    Topic *changed_tail;
+    atomic_uint key_filter[TOPIC_FILTER_SIZE]; // Subscriptions to the keys of each slot
+    atomic_uint pattern_filter[UCHAR_MAX + 2]; // Subscriptions to the patterns starting
+                                               // with each byte, the last with a wildcard
+} SubscriptionTable;
+
+/// Creates an empty subscription table.
+/// @return The table, or NULL if it could not be allocated.
+SubscriptionTable *create_subscription_table(void);
+
+/// Called for each subscription matched by table_match.
+typedef void (*SubscriptionVisitor)(Subscription *subscription, void *arg);
+
+/// Subscribes a session to a key or pattern.
+/// @param table The table.
+/// @param subscriptions Head of the subscriptions of the session.
+/// @param session The session.
+/// @param key The key or pattern, '\0' terminated.
+/// @return 0 if subscribed, 1 if it already was, -1 if out of memory.
+int table_subscribe(SubscriptionTable *table, Subscription **subscriptions,
+                    struct Session *session, const char *key);
+
+/// Removes the subscription of a session to a key or pattern.
+/// @param table The table.
+/// @param subscriptions Head of the subscriptions of the session.
+/// @param session The session.
+/// @param key The key or pattern, '\0' terminated.
+/// @return 0 if removed, 1 if the session wasn't subscribed to the key.
+int table_unsubscribe(SubscriptionTable *table, Subscription **subscriptions,
+                      struct Session *session, const char *key);
+
+/// Removes every subscription of a session.
+/// @param table The table.
+/// @param subscriptions Head of the subscriptions of the session, set to
+/// NULL.
+void table_unsubscribe_all(SubscriptionTable *table, Subscription **subscriptions);
+
+/// Finds the topic of a key, not of the patterns matching it.
+/// @param table The table.
+/// @param key The key.
+/// @param len Length of the key.
+/// @return The topic, NULL if the key has no subscribers.
+Topic *table_find(const SubscriptionTable *table, const char *key, size_t len);
+
+/// Visits the subscriptions to a key and to every pattern matching it. A
+/// session subscribed to more than one of them is visited once for each.
+/// @param table The table.
+/// @param key The key.
+/// @param len Length of the key.
+/// @param visit Called for each subscription.
+/// @param arg Passed to visit.
+/// @return Number of topics matched: the key's own and patterns.
+size_t table_match(const SubscriptionTable *table, const char *key, size_t len,
+                   SubscriptionVisitor visit, void *arg);
+
+/// Checks, without the lock of the table, whether a key may have
+/// subscribers, itself or through a pattern. Different keys may share a
+/// slot of the filter, so it can answer true for a key without any.
+/// @param table The table.
+/// @param key The key.
+/// @param len Length of the key.
+/// @return false if the key has no subscribers, true if it may have.
+bool table_may_change(const SubscriptionTable *table, const char *key, size_t len);
+
+/// Records a change of a key, if it or a pattern matching it has
+/// subscribers.
+/// @param table The table.
+/// @param key The key.
+/// @param len Length of the key.
+/// @param value The new value, NULL if the key was deleted.
+/// @param value_len Length of the value, cut to MAX_STRING_SIZE.
+/// @param now_ns Time of the change.
+/// @return true if it was the first change of the key since it was last
+/// taken with table_take_change, false if it had one already, has no
+/// subscribers or is out of memory.
+bool table_change(SubscriptionTable *table, const char *key, size_t len, const char *value,
+                  size_t value_len, uint64_t now_ns);
+
+/// Takes the topic with the oldest change not notified yet, removing it
+/// from the list of changed topics. The change stays in the topic until
+/// the next one, and the topic must be given back with table_release_topic
+/// once its subscribers were found.
+/// @param table The table.
+/// @return The topic, NULL if no topic changed.
+Topic *table_take_change(SubscriptionTable *table);
+
+/// Frees a topic taken with table_take_change if it has no subscribers,
+/// having only been kept for its change.
+/// @param table The table.
+/// @param topic The topic.
+void table_release_topic(SubscriptionTable *table, Topic *topic);
+
+/// Finds the subscribers of a key, to be walked through next_subscriber.
+/// @param table The table.
+/// @param key The key, '\0' terminated.
+/// @return The first subscription to the key, NULL if it has none.
+Subscription *table_subscribers(const SubscriptionTable *table, const char *key);
+
+/// Frees a subscription table and every subscription in it. The lists of
+/// the sessions are left dangling.
+/// @param table The table.
+void free_subscription_table(SubscriptionTable *table);
+
+#endif // KVS_SUBSCRIPTIONS_H
@@ -1,90 +1,196 @@
 #!/bin/bash
 
-echo "Iniciando testes do servidor para o exercício 2..."
+# Testa o servidor falando o protocolo de frames (ver src/common/protocol.h):
+# cada mensagem é um cabeçalho de 8 bytes (opcode, status, número de campos
+# em u16 e tamanho do payload em u32, na ordem de bytes da máquina, aqui
+# little-endian) seguido dos campos, cada um um u16 de tamanho e os bytes.
+
+OP_CONNECT=1
+OP_DISCONNECT=2
+OP_SUBSCRIBE=3
+OP_UNSUBSCRIBE=4
+OP_PUBLISH=5
+OP_NOTIFICATION=8
+STATUS_OK=0
+STATUS_NOT_FOUND=4
+
+# Escreve um inteiro de $2 bytes em little-endian
+le() {
+    local value=$1
+    for ((b = 0; b < $2; b++)); do
+        printf "\\x$(printf %02x $((value & 255)))"
+        value=$((value >> 8))
+    done
+}
+
+# Escreve os campos de um payload
+fields() {
+    for field in "$@"; do
+        le ${#field} 2
+        printf %s "$field"
+    done
+}
+
+# Envia uma frame de uma só vez para o descritor $1: opcode $2 e campos $3...
+send_frame() {
+    local fd=$1 op=$2
+    shift 2
+    local len=0
+    for field in "$@"; do
+        len=$((len + 2 + ${#field}))
+    done
+    { le $op 1; le 0 1; le $# 2; le $len 4; fields "$@"; } > "$TMP_DIR/frame"
+    cat "$TMP_DIR/frame" >&$fd
+}
+
+# Lê o cabeçalho de uma frame do descritor $1, como "opcode status tamanho"
+read_header() {
+    local bytes
+    bytes=($(timeout 2 dd bs=1 count=8 status=none <&$1 | od -An -tu1))
+    if [ ${#bytes[@]} -ne 8 ]; then
+        echo "- - -"
+        return
+    fi
+    echo "${bytes[0]} ${bytes[1]} $((bytes[4] | bytes[5] << 8 | bytes[6] << 16 | bytes[7] << 24))"
+}
+
+# Envia um pedido sem campos de resposta e verifica o opcode e o status
+# devolvidos: descritores $1 e $2, status esperado $3, opcode $4, campos $5...
+check_request() {
+    local req=$1 resp=$2 expected=$3 op=$4
+    shift 4
+    send_frame $req $op "$@"
+    read -r r_op r_status r_len <<< "$(read_header $resp)"
+    [ "$r_op" == "$op" ] && [ "$r_status" == "$expected" ] && [ "$r_len" == 0 ]
+}
 
-# Limpa FIFOs antigos
-echo "Limpando FIFOs antigos..."
-rm -f /tmp/register_fifo /tmp/client_req* /tmp/client_resp*
+echo "Iniciando testes do servidor..."
+
+TMP_DIR=$(mktemp -d)
+REGISTER_FIFO="$TMP_DIR/register_fifo"
+mkdir "$TMP_DIR/jobs"
 
 # Inicia o servidor em background
 echo "Iniciando servidor..."
-./server ./jobs_dir 1 1 /tmp/register_fifo &
+./server "$TMP_DIR/jobs" 1 1 "$REGISTER_FIFO" > "$TMP_DIR/server.log" 2>&1 &
 SERVER_PID=$!
 sleep 1
 
 # Verifica se o FIFO de registo foi criado
 echo "Verificando FIFO de registo..."
-if [ -p /tmp/register_fifo ]; then
+if [ -p "$REGISTER_FIFO" ]; then
     echo "PASS: FIFO de registo criado"
 else
     echo "FAIL: FIFO de registo não foi criado"
     kill $SERVER_PID 2>/dev/null
+    rm -rf "$TMP_DIR"
     exit 1
 fi
 
+FAILED=0
+
+# Um CONNECT sem FIFO de notificações é recusado, sem resposta
+echo "Conectando cliente sem FIFO de notificações..."
+mkfifo "$TMP_DIR/req0" "$TMP_DIR/resp0"
+exec {REGISTER_FD}>"$REGISTER_FIFO"
+send_frame $REGISTER_FD $OP_CONNECT "$TMP_DIR/req0" "$TMP_DIR/resp0"
+exec {REGISTER_FD}>&-
+exec {fd}<>"$TMP_DIR/resp0"
+read -r r_op r_status r_len <<< "$(read_header $fd)"
+exec {fd}>&-
+if [ "$r_op" == "-" ]; then
+    echo "PASS: Cliente sem FIFO de notificações recusado"
+else
+    echo "FAIL: Cliente sem FIFO de notificações foi conectado"
+    FAILED=1
+fi
+
 # Define número de clientes
 NUM_CLIENTS=4
+declare -a REQ_FD RESP_FD NOTIF_FD
 
-# Cria FIFOs para os clientes
+# Conecta os clientes e inscreve-os na chave key1
 for i in $(seq 1 $NUM_CLIENTS); do
-    if [ -p "/tmp/client_req$i" ] || [ -p "/tmp/client_resp$i" ]; then
-        echo "FIFOs do cliente $i já existem. Removendo..."
-        rm -f "/tmp/client_req$i" "/tmp/client_resp$i"
-    fi
-    echo "Criando FIFOs do cliente $i..."
-    mkfifo "/tmp/client_req$i" "/tmp/client_resp$i"
-
     echo "Conectando cliente $i ao servidor..."
-    echo "/tmp/client_req$i;/tmp/client_resp$i" > /tmp/register_fifo
-    sleep 0.2
-done
-
-# Testa o cliente
-for i in $(seq 1 $NUM_CLIENTS); do
-    echo "Iniciando sessão para cliente $i..."
-
-    exec {REQ_FD}>"/tmp/client_req$i"
-    exec {RESP_FD}<"/tmp/client_resp$i"
+    mkfifo "$TMP_DIR/req$i" "$TMP_DIR/resp$i" "$TMP_DIR/notif$i"
+    exec {REGISTER_FD}>"$REGISTER_FIFO"
+    send_frame $REGISTER_FD $OP_CONNECT "$TMP_DIR/req$i" "$TMP_DIR/resp$i" "$TMP_DIR/notif$i"
+    exec {REGISTER_FD}>&-
+
+    # O servidor abre os FIFOs para leitura e escrita, por isso abri-los não bloqueia
+    exec {fd}>"$TMP_DIR/req$i"
+    REQ_FD[$i]=$fd
+    exec {fd}<"$TMP_DIR/resp$i"
+    RESP_FD[$i]=$fd
+    exec {fd}<"$TMP_DIR/notif$i"
+    NOTIF_FD[$i]=$fd
+
+    read -r r_op r_status r_len <<< "$(read_header ${RESP_FD[$i]})"
+    if [ "$r_op" == "$OP_CONNECT" ] && [ "$r_status" == "$STATUS_OK" ]; then
+        echo "PASS: Cliente $i conectado"
+    else
+        echo "FAIL: Cliente $i não foi conectado. Resposta: $r_op $r_status"
+        FAILED=1
+        continue
+    fi
 
-    # SUBSCRIBE
-    echo "SUBSCRIBE key1" >&$REQ_FD
-    read RESPONSE <&$RESP_FD
-    if [ "$RESPONSE" == "SUBSCRIBED" ]; then
+    if check_request ${REQ_FD[$i]} ${RESP_FD[$i]} $STATUS_OK $OP_SUBSCRIBE key1; then
         echo "PASS: Cliente $i inscrito corretamente na chave key1"
     else
-        echo "FAIL: Cliente $i não foi inscrito corretamente. Resposta: $RESPONSE"
+        echo "FAIL: Cliente $i não foi inscrito corretamente"
+        FAILED=1
     fi
+done
+
+# O cliente 1 publica, e os restantes recebem a notificação
+if check_request ${REQ_FD[1]} ${RESP_FD[1]} $STATUS_OK $OP_PUBLISH key1 "Mensagem de teste"; then
+    echo "PASS: Cliente 1 publicou mensagem na chave key1"
+else
+    echo "FAIL: Cliente 1 não conseguiu publicar mensagem"
+    FAILED=1
+fi
 
-    # PUBLISH
-    echo "PUBLISH key1 Mensagem de teste" >&$REQ_FD
-    read RESPONSE <&$RESP_FD
-    if [ "$RESPONSE" == "MESSAGE PUBLISHED" ]; then
-        echo "PASS: Cliente $i publicou mensagem na chave key1"
+fields key1 "Mensagem de teste" > "$TMP_DIR/expected"
+for i in $(seq 2 $NUM_CLIENTS); do
+    read -r r_op r_status r_len <<< "$(read_header ${NOTIF_FD[$i]})"
+    if [ "$r_op" == "$OP_NOTIFICATION" ] &&
+        timeout 2 dd bs=1 count="$r_len" status=none <&${NOTIF_FD[$i]} |
+        cmp -s - "$TMP_DIR/expected"; then
+        echo "PASS: Cliente $i recebeu a notificação"
     else
-        echo "FAIL: Cliente $i não conseguiu publicar mensagem. Resposta: $RESPONSE"
+        echo "FAIL: Cliente $i não recebeu a notificação"
+        FAILED=1
     fi
+done
 
-    # UNSUBSCRIBE
-    echo "UNSUBSCRIBE key1" >&$REQ_FD
-    read RESPONSE <&$RESP_FD
-    if [ "$RESPONSE" == "UNSUBSCRIBED" ]; then
+# Cancela as inscrições e desconecta os clientes
+for i in $(seq 1 $NUM_CLIENTS); do
+    if check_request ${REQ_FD[$i]} ${RESP_FD[$i]} $STATUS_OK $OP_UNSUBSCRIBE key1 &&
+        check_request ${REQ_FD[$i]} ${RESP_FD[$i]} $STATUS_NOT_FOUND $OP_UNSUBSCRIBE key1; then
         echo "PASS: Cliente $i cancelou inscrição corretamente"
     else
-        echo "FAIL: Cliente $i não cancelou inscrição. Resposta: $RESPONSE"
+        echo "FAIL: Cliente $i não cancelou inscrição"
+        FAILED=1
     fi
 
-    # DISCONNECT
-    echo "DISCONNECT" >&$REQ_FD
-    sleep 1
+    if check_request ${REQ_FD[$i]} ${RESP_FD[$i]} $STATUS_OK $OP_DISCONNECT; then
+        echo "PASS: Cliente $i desconectado"
+    else
+        echo "FAIL: Cliente $i não foi desconectado"
+        FAILED=1
+    fi
+    sleep 0.2
 
-    exec {REQ_FD}>&-
-    exec {RESP_FD}<&-
+    for fd in ${REQ_FD[$i]} ${RESP_FD[$i]} ${NOTIF_FD[$i]}; do
+        exec {fd}>&-
+    done
 
-    echo "Verificando desconexão do cliente $i..."
-    if [ -p "/tmp/client_req$i" ] || [ -p "/tmp/client_resp$i" ]; then
+    echo "Verificando remoção dos FIFOs do cliente $i..."
+    if [ -p "$TMP_DIR/req$i" ] || [ -p "$TMP_DIR/resp$i" ]; then
         echo "FAIL: FIFOs do cliente $i ainda existem"
+        FAILED=1
     else
-        echo "PASS: Cliente $i desconectado corretamente"
+        echo "PASS: FIFOs do cliente $i removidos"
     fi
 done
 
@@ -94,6 +200,10 @@ kill $SERVER_PID 2>/dev/null
 sleep 1
 if ps -p $SERVER_PID > /dev/null; then
     echo "FAIL: Não foi possível finalizar o servidor"
+    FAILED=1
 else
     echo "PASS: Servidor finalizado com sucesso"
 fi
+
+rm -rf "$TMP_DIR"
+exit $FAILED
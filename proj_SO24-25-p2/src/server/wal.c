@@ -0,0 +1,347 @@
+#include "wal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "backup.h"
+
+typedef struct RecordHeader {
+  uint32_t len; // Bytes of the payload
+  uint32_t crc; // Of the payload
+} RecordHeader;
+
+struct WriteAheadLog {
+  int fd;
+  enum WalSync sync;
+  unsigned int interval_ms;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t appended; // Records were appended to an empty buffer, or the log is closing
+  pthread_cond_t synced;   // durable advanced
+  char *buffer;            // Records appended and not yet taken by the log thread
+  size_t len;              // Bytes used in buffer
+  size_t capacity;
+  char *spare;             // Buffer being written by the log thread
+  size_t spare_capacity;
+  uint64_t end;            // Bytes appended since the log was opened
+  uint64_t durable;        // Bytes written (and synced, if the policy says so)
+  bool closing;
+  bool failed;             // A write or sync failed, records may have been lost
+  WalStats stats;
+  uint32_t crc_table[256];
+};
+
+// Writes a whole buffer, retrying after short writes and interruptions.
+// @return 0 if successful, -1 otherwise.
+static int write_all(int fd, const char *data, size_t len) {
+  while (len > 0) {
+    ssize_t written = write(fd, data, len);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    data += written;
+    len -= (size_t)written;
+  }
+  return 0;
+}
+
+static void *log_thread(void *arg) {
+  WriteAheadLog *wal = arg;
+  pthread_mutex_lock(&wal->mutex);
+  while (!wal->closing || wal->len > 0) {
+    if (wal->len == 0) {
+      pthread_cond_wait(&wal->appended, &wal->mutex);
+      continue;
+    }
+    if (wal->sync == WAL_SYNC_PERIODIC) {
+      // Records appended during the interval are all covered by one sync
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_sec += wal->interval_ms / 1000;
+      deadline.tv_nsec += (long)(wal->interval_ms % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      while (!wal->closing &&
+             pthread_cond_timedwait(&wal->appended, &wal->mutex, &deadline) != ETIMEDOUT) {
+      }
+    }
+
+    // Writers keep appending to the other buffer while this one is written
+    char *data = wal->buffer;
+    size_t len = wal->len;
+    size_t capacity = wal->capacity;
+    uint64_t end = wal->end;
+    wal->buffer = wal->spare;
+    wal->capacity = wal->spare_capacity;
+    wal->len = 0;
+    pthread_mutex_unlock(&wal->mutex);
+
+    bool sync = wal->sync != WAL_SYNC_NEVER;
+    bool failed = write_all(wal->fd, data, len) != 0 || (sync && fdatasync(wal->fd) != 0);
+
+    pthread_mutex_lock(&wal->mutex);
+    wal->spare = data;
+    wal->spare_capacity = capacity;
+    wal->stats.writes++;
+    wal->stats.syncs += sync;
+    wal->failed = wal->failed || failed;
+    wal->durable = end;
+    pthread_cond_broadcast(&wal->synced);
+  }
+  pthread_mutex_unlock(&wal->mutex);
+  return NULL;
+}
+
+WriteAheadLog *wal_open(const char *path, enum WalSync sync, unsigned int interval_ms,
+                        bool truncate) {
+  WriteAheadLog *wal = calloc(1, sizeof(WriteAheadLog));
+  if (wal == NULL) {
+    return NULL;
+  }
+  wal->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | (truncate ? O_TRUNC : 0), 0666);
+  if (wal->fd == -1) {
+    free(wal);
+    return NULL;
+  }
+  wal->sync = sync;
+  wal->interval_ms = interval_ms;
+  crc32_init(wal->crc_table);
+
+  // Deadlines of periodic syncs are measured on the monotonic clock
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_mutex_init(&wal->mutex, NULL);
+  pthread_cond_init(&wal->appended, &attr);
+  pthread_cond_init(&wal->synced, NULL);
+  pthread_condattr_destroy(&attr);
+
+  if (pthread_create(&wal->thread, NULL, log_thread, wal) != 0) {
+    pthread_cond_destroy(&wal->synced);
+    pthread_cond_destroy(&wal->appended);
+    pthread_mutex_destroy(&wal->mutex);
+    close(wal->fd);
+    free(wal);
+    return NULL;
+  }
+  return wal;
+}
+
+uint64_t wal_append(WriteAheadLog *wal, enum WalRecord type, size_t count, const Slice *keys,
+                    const Slice *values) {
+  // Pairs too long for a node are never applied, so they aren't logged
+  size_t payload = 1;
+  for (size_t i = 0; i < count; i++) {
+    if (type == WAL_BACKUP) {
+      payload += keys[i].len;
+    } else if (keys[i].len <= UINT8_MAX && (values == NULL || values[i].len <= UINT8_MAX)) {
+      payload += 1 + keys[i].len + (values != NULL ? 1 + values[i].len : 0);
+    }
+  }
+  size_t size = sizeof(RecordHeader) + payload;
+
+  pthread_mutex_lock(&wal->mutex);
+  if (wal->len + size > wal->capacity) {
+    size_t capacity = wal->capacity == 0 ? 65536 : wal->capacity;
+    while (capacity < wal->len + size) {
+      capacity *= 2;
+    }
+    char *buffer = realloc(wal->buffer, capacity);
+    if (buffer == NULL) {
+      pthread_mutex_unlock(&wal->mutex);
+      return 0;
+    }
+    wal->buffer = buffer;
+    wal->capacity = capacity;
+  }
+
+  char *record = wal->buffer + wal->len;
+  char *pos = record + sizeof(RecordHeader);
+  *pos++ = (char)type;
+  for (size_t i = 0; i < count; i++) {
+    if (type == WAL_BACKUP) {
+      memcpy(pos, keys[i].data, keys[i].len);
+      pos += keys[i].len;
+    } else if (keys[i].len <= UINT8_MAX && (values == NULL || values[i].len <= UINT8_MAX)) {
+      *pos++ = (char)keys[i].len;
+      if (values != NULL) {
+        *pos++ = (char)values[i].len;
+      }
+      memcpy(pos, keys[i].data, keys[i].len);
+      pos += keys[i].len;
+      if (values != NULL) {
+        memcpy(pos, values[i].data, values[i].len);
+        pos += values[i].len;
+      }
+    }
+  }
+  RecordHeader header = {(uint32_t)payload,
+                         crc32(wal->crc_table, record + sizeof(RecordHeader), payload)};
+  memcpy(record, &header, sizeof(header));
+
+  // The log thread only waits for appends while the buffer is empty
+  if (wal->len == 0) {
+    pthread_cond_signal(&wal->appended);
+  }
+  wal->len += size;
+  wal->end += size;
+  wal->stats.records++;
+  uint64_t end = wal->end;
+  pthread_mutex_unlock(&wal->mutex);
+  return end;
+}
+
+int wal_commit(WriteAheadLog *wal, uint64_t lsn) {
+  pthread_mutex_lock(&wal->mutex);
+  if (wal->sync == WAL_SYNC_ALWAYS) {
+    while (wal->durable < lsn && !wal->failed) {
+      pthread_cond_wait(&wal->synced, &wal->mutex);
+    }
+  }
+  int result = lsn == 0 || wal->failed;
+  pthread_mutex_unlock(&wal->mutex);
+  return result;
+}
+
+void wal_stats(WriteAheadLog *wal, WalStats *stats) {
+  pthread_mutex_lock(&wal->mutex);
+  *stats = wal->stats;
+  pthread_mutex_unlock(&wal->mutex);
+}
+
+int wal_close(WriteAheadLog *wal) {
+  pthread_mutex_lock(&wal->mutex);
+  wal->closing = true;
+  pthread_cond_signal(&wal->appended);
+  pthread_mutex_unlock(&wal->mutex);
+  pthread_join(wal->thread, NULL);
+
+  int result = wal->failed;
+  if (close(wal->fd) != 0) {
+    result = 1;
+  }
+  pthread_cond_destroy(&wal->synced);
+  pthread_cond_destroy(&wal->appended);
+  pthread_mutex_destroy(&wal->mutex);
+  free(wal->buffer);
+  free(wal->spare);
+  free(wal);
+  return result;
+}
+
+// Size of the record at pos, if it is complete and its checksum matches.
+// @return Bytes of the record, header included, 0 if it is torn.
+static size_t record_size(const char *data, size_t size, size_t pos,
+                          const uint32_t crc_table[256]) {
+  RecordHeader header;
+  if (size - pos < sizeof(header)) {
+    return 0;
+  }
+  memcpy(&header, data + pos, sizeof(header));
+  if (header.len == 0 || size - pos - sizeof(header) < header.len ||
+      crc32(crc_table, data + pos + sizeof(header), header.len) != header.crc) {
+    return 0;
+  }
+  return sizeof(header) + header.len;
+}
+
+// Applies the keys of a WAL_WRITE or WAL_DELETE payload.
+// @return 0 if successful, 1 if the payload is malformed.
+static int apply_record(const char *payload, size_t len,
+                        void (*apply)(const Slice *key, const Slice *value, void *arg),
+                        void *arg) {
+  bool write = payload[0] == WAL_WRITE;
+  size_t pos = 1;
+  while (pos < len) {
+    size_t lengths = write ? 2 : 1;
+    if (len - pos < lengths) {
+      return 1;
+    }
+    Slice key = {NULL, (unsigned char)payload[pos]};
+    Slice value = {NULL, write ? (unsigned char)payload[pos + 1] : 0};
+    pos += lengths;
+    if (len - pos < key.len + value.len) {
+      return 1;
+    }
+    key.data = payload + pos;
+    value.data = payload + pos + key.len;
+    pos += key.len + value.len;
+    apply(&key, write ? &value : NULL, arg);
+  }
+  return 0;
+}
+
+int wal_replay(const char *path, const char *backup,
+               void (*apply)(const Slice *key, const Slice *value, void *arg), void *arg) {
+  int fd = open(path, O_RDWR);
+  if (fd == -1) {
+    return errno != ENOENT;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return 1;
+  }
+  size_t size = (size_t)st.st_size;
+  if (size == 0) {
+    close(fd);
+    return 0;
+  }
+  const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    close(fd);
+    return 1;
+  }
+  uint32_t crc_table[256];
+  crc32_init(crc_table);
+
+  // First pass: where the valid records end, and where the ones after the
+  // restored backup start
+  size_t start = 0;
+  size_t end = 0;
+  bool found = backup == NULL;
+  size_t backup_len = backup != NULL ? strlen(backup) : 0;
+  for (size_t len; (len = record_size(data, size, end, crc_table)) != 0; end += len) {
+    const char *payload = data + end + sizeof(RecordHeader);
+    size_t payload_len = len - sizeof(RecordHeader);
+    if (backup != NULL && payload[0] == WAL_BACKUP && payload_len - 1 == backup_len &&
+        memcmp(payload + 1, backup, backup_len) == 0) {
+      start = end + len;
+      found = true;
+    }
+  }
+  if (!found) {
+    fprintf(stderr, "%s predates the restored backup, discarding it\n", path);
+    start = end = 0;
+  }
+
+  int result = 0;
+  for (size_t pos = start, len; pos < end && result == 0; pos += len) {
+    len = record_size(data, size, pos, crc_table);
+    const char *payload = data + pos + sizeof(RecordHeader);
+    if (payload[0] == WAL_WRITE || payload[0] == WAL_DELETE) {
+      result = apply_record(payload, len - sizeof(RecordHeader), apply, arg);
+    }
+  }
+  munmap((void *)data, size);
+
+  // New records are appended right after the last valid one
+  if (result == 0 && end < size && ftruncate(fd, (off_t)end) != 0) {
+    result = 1;
+  }
+  close(fd);
+  return result;
+}
@@ -0,0 +1,103 @@
+#ifndef KVS_WAL_H
+#define KVS_WAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "parser.h"
+
+// Write-ahead log of the WRITE and DELETE commands applied to the KVS, so
+// the changes made since the last backup survive a crash. The log is a
+// sequence of records:
+//
+//   u32 length of the payload, u32 CRC-32 of the payload (see backup.h)
+//   payload: u8 type, then
+//     WAL_WRITE:   pairs u8 key_len, u8 value_len, key, value
+//     WAL_DELETE:  keys u8 key_len, key
+//     WAL_BACKUP:  name of a backup file forked at that point of the log
+//
+// Writers only append records to a buffer in memory. A log thread writes
+// everything appended since its previous write with one write(2) and, if
+// the sync policy asks for it, one fdatasync, so concurrent writers waiting
+// for the same sync share it (group commit).
+//
+// Integers are stored in the byte order of the host.
+
+#define WAL_FILE_NAME "kvs.wal" // Name of the log in the backups directory
+
+enum WalSync {
+  WAL_SYNC_ALWAYS,   // A commit waits until its record is on disk
+  WAL_SYNC_PERIODIC, // Records are synced every interval, a crash loses at most one
+  WAL_SYNC_NEVER     // Records are written without fdatasync, the OS decides
+};
+
+enum WalRecord {
+  WAL_WRITE = 1,
+  WAL_DELETE,
+  WAL_BACKUP
+};
+
+typedef struct WalStats {
+  size_t records; // Records appended
+  size_t writes;  // write(2) calls of the log thread
+  size_t syncs;   // fdatasync calls of the log thread
+} WalStats;
+
+typedef struct WriteAheadLog WriteAheadLog;
+
+/// Opens a log for appending and starts its log thread.
+/// @param path Path of the log file.
+/// @param sync When records are synced.
+/// @param interval_ms Time between syncs of WAL_SYNC_PERIODIC.
+/// @param truncate Whether the records already in the file are discarded.
+/// @return The log, NULL on failure.
+WriteAheadLog *wal_open(const char *path, enum WalSync sync, unsigned int interval_ms,
+                        bool truncate);
+
+/// Appends a record. Called while the stripes of the keys are locked, so
+/// the records of a key are in the order they were applied.
+/// @param wal The log.
+/// @param type Type of the record.
+/// @param count Number of keys (or names of WAL_BACKUP).
+/// @param keys Array of keys.
+/// @param values Array of values of WAL_WRITE, NULL otherwise.
+/// @return Position of the end of the record in the log, to be passed to
+/// wal_commit, 0 if memory could not be allocated.
+uint64_t wal_append(WriteAheadLog *wal, enum WalRecord type, size_t count, const Slice *keys,
+                    const Slice *values);
+
+/// Waits until a record is as durable as the sync policy promises: on disk
+/// with WAL_SYNC_ALWAYS, appended with the other policies.
+/// @param wal The log.
+/// @param lsn Value returned by wal_append.
+/// @return 0 if successful, 1 if the record was not appended or the log
+/// could not be written.
+int wal_commit(WriteAheadLog *wal, uint64_t lsn);
+
+/// Reads the counters of a log.
+/// @param wal The log.
+/// @param stats Set to the counters.
+void wal_stats(WriteAheadLog *wal, WalStats *stats);
+
+/// Writes and syncs every record appended, stops the log thread and frees
+/// the log. No thread may be appending anymore.
+/// @param wal The log.
+/// @return 0 if successful, 1 if the log could not be written.
+int wal_close(WriteAheadLog *wal);
+
+/// Applies the records of a log written after a backup, in order. A torn
+/// record at the end (from a crash during a write) and whatever follows it
+/// is cut from the file.
+/// @param path Path of the log file.
+/// @param backup Name of the last backup restored, NULL if none was. Only
+/// the records after the last WAL_BACKUP naming it are applied. If the log
+/// doesn't name it, it predates the backup and is emptied.
+/// @param apply Function called with each key, its value (NULL for a
+/// deleted key) and arg.
+/// @param arg Opaque argument forwarded to apply.
+/// @return 0 if successful or there is no log, 1 if it could not be read.
+int wal_replay(const char *path, const char *backup,
+               void (*apply)(const Slice *key, const Slice *value, void *arg), void *arg);
+
+#endif  // KVS_WAL_H
@@ -0,0 +1,153 @@
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/server/backup.h"
+#include "src/server/constants.h"
+#include "src/server/kvs.h"
+
+// Offline tools for the backup files written by the server. Each tool is
+// selected by name, like the benchmarks.
+
+struct Tool {
+  const char *name;
+  const char *usage;
+  int (*run)(int argc, char **argv);
+};
+
+// Applies a line of a backup to a table.
+static void apply_record(const Slice *key, const Slice *value, void *arg) {
+  HashTable *ht = arg;
+  uint64_t stripe = stripe_of(key->data, key->len);
+  lock_stripes(ht, stripe, true);
+  if (value != NULL) {
+    write_pair(ht, key->data, key->len, value->data, value->len);
+  } else {
+    delete_pair(ht, key->data, key->len);
+  }
+  unlock_stripes(ht, stripe);
+}
+
+static void write_node(const KeyNode *keyNode, void *arg) {
+  backup_record(arg, node_key(keyNode), keyNode->key_len, node_value(keyNode), keyNode->value_len);
+}
+
+// Merges the newest checkpoint of a directory with the deltas that follow
+// it into a single checkpoint, a snapshot if the newest checkpoint is one.
+static int compact(int argc, char **argv) {
+  if (argc < 2) {
+    return 2;
+  }
+  size_t count;
+  char **paths = backup_chain(argv[0], &count);
+  if (paths == NULL) {
+    fprintf(stderr, "No checkpoint in %s\n", argv[0]);
+    return 1;
+  }
+
+  BackupInfo checkpoint, info;
+  HashTable *ht = create_hash_table();
+  if (ht == NULL || backup_info(paths[0], &checkpoint) != 0) {
+    fprintf(stderr, "Failed to read %s\n", paths[0]);
+    backup_chain_free(paths, count);
+    return 1;
+  }
+  reserve_table(ht, checkpoint.pairs);
+  for (size_t i = 0; i < count; i++) {
+    // The shards of a sharded checkpoint are loaded in parallel
+    int result = i == 0 ? backup_load_parallel(paths[i], &info, apply_record, ht)
+                        : backup_load(paths[i], &info, apply_record, ht);
+    if (result != 0) {
+      fprintf(stderr, "Failed to load %s\n", paths[i]);
+      backup_chain_free(paths, count);
+      free_table(ht);
+      return 1;
+    }
+  }
+  backup_chain_free(paths, count);
+
+  int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd == -1) {
+    perror("Failed to create checkpoint");
+    free_table(ht);
+    return 1;
+  }
+  OutputBuffer out;
+  output_init(&out, fd);
+  if (checkpoint.kind == BACKUP_SNAPSHOT) {
+    snapshot_write(&out, ht, ALL_STRIPES, info.generation, atomic_load(&ht->count), iterate_pairs);
+  } else {
+    backup_header(&out, BACKUP_FULL, info.generation);
+    iterate_pairs(ht, ALL_STRIPES, write_node, &out);
+  }
+  int result = output_flush(&out);
+  close(fd);
+  printf("Merged %zu backups up to generation %u, %zu pairs\n", count, info.generation,
+         atomic_load(&ht->count));
+  free_table(ht);
+  return result != 0;
+}
+
+// Counts a record of a backup, from any of the threads loading its shards.
+static void count_record(const Slice *key, const Slice *value, void *arg) {
+  (void)key;
+  (void)value;
+  atomic_fetch_add_explicit((atomic_size_t *)arg, 1, memory_order_relaxed);
+}
+
+// Reads a backup, the shards of a sharded one in parallel, verifying the
+// checksums of snapshots and compressed blocks and that every shard matches
+// its manifest.
+static int verify(int argc, char **argv) {
+  if (argc < 1) {
+    return 2;
+  }
+  static const char *const kinds[] = {"plain", "full", "delta", "snapshot"};
+  atomic_size_t records = 0;
+  BackupInfo info;
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int result = backup_load_parallel(argv[0], &info, count_record, &records);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (result != 0) {
+    fprintf(stderr, "%s is corrupted or could not be read\n", argv[0]);
+    return 1;
+  }
+  double ms = (double)(end.tv_sec - start.tv_sec) * 1e3 +
+              (double)(end.tv_nsec - start.tv_nsec) / 1e6;
+  printf("%s: %s%s backup of generation %u, %zu shards, %zu records, read in %.1f ms\n",
+         argv[0], info.compressed ? "compressed " : "", kinds[info.kind], info.generation,
+         info.shards, atomic_load(&records), ms);
+  return 0;
+}
+
+static const struct Tool tools[] = {
+    {"compact", "<backup_dir> <checkpoint>", compact},
+    {"verify", "<backup>", verify},
+};
+
+int main(int argc, char **argv) {
+  size_t count = sizeof(tools) / sizeof(tools[0]);
+  if (argc >= 2) {
+    for (size_t i = 0; i < count; i++) {
+      if (strcmp(argv[1], tools[i].name) == 0) {
+        int result = tools[i].run(argc - 2, argv + 2);
+        if (result != 2) {
+          return result;
+        }
+        fprintf(stderr, "Usage: %s %s %s\n", argv[0], tools[i].name, tools[i].usage);
+        return 1;
+      }
+    }
+  }
+
+  fprintf(stderr, "Usage: %s <tool> [args]\n", argv[0]);
+  for (size_t i = 0; i < count; i++) {
+    fprintf(stderr, "  %s %s\n", tools[i].name, tools[i].usage);
+  }
+  return 1;
+}